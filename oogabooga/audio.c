@@ -1169,6 +1169,10 @@ typedef struct Audio_Player {
 	// fairly quick and low contention, hence a spinlock.
 	Spinlock sample_lock; 
 	
+	// Players which are allocated, owned by audio_players_lock
+	struct Audio_Player *next_active;
+	struct Audio_Player *prev_active;
+	
 	// #Cleanup
 	DEPRECATED(Vector3 position, "Use player->config.position_ndc instead"); // ndc space -1 to 1
 	DEPRECATED(bool disable_spacialization, "Use player->config.enable_spacialization instead");
@@ -1179,58 +1183,38 @@ typedef struct Audio_Player {
 	Audio_Playback_Config config;
 	
 } Audio_Player;
-#define AUDIO_PLAYERS_PER_BLOCK 128
-typedef struct Audio_Player_Block {
-	Audio_Player players[AUDIO_PLAYERS_PER_BLOCK]; // Players need to be persistent in memory
-	
-	struct Audio_Player_Block *next;
-} Audio_Player_Block;
+// Players need to be persistent in memory, so they come from a pool.
+// The audio thread walks the active list and is the only one that releases players.
 
 // #Global
-ogb_instance Audio_Player_Block audio_player_block;
+ogb_instance Pool audio_player_pool;
+ogb_instance Audio_Player *audio_players;
+ogb_instance Spinlock audio_players_lock;
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
-Audio_Player_Block audio_player_block = {0};
+Pool audio_player_pool = POOL_INITIALIZER(sizeof(Audio_Player), false);
+Audio_Player *audio_players = 0;
+Spinlock audio_players_lock = {0};
 #endif
 
 Audio_Player *
 audio_player_get_one() {
 
-	Audio_Player_Block *block = &audio_player_block;
-	Audio_Player_Block *last = 0;
+	Audio_Player *p = pool_alloc(&audio_player_pool);
 	
-	while (block) {
-		
-		for (u64 i = 0; i < AUDIO_PLAYERS_PER_BLOCK; i++) {
-			if (!block->players[i].allocated) {
-			
-				memset(&block->players[i], 0, sizeof(block->players[i]));
-				block->players[i].allocated = true;
-				block->players[i].config.volume = 1.0;
-				block->players[i].config.playback_speed = 1.0;
-				
-				return &block->players[i];
-			}
-		}
-		
-		last = block;
-		block = block->next;
-	}
+	memset(p, 0, sizeof(*p));
+	p->allocated = true;
+	p->config.volume = 1.0;
+	p->config.playback_speed = 1.0;
+	spinlock_set_name(&p->sample_lock, STR("sample_lock"));
 	
-	// No free player found, make another block
-	// #Volatile can't assign to last->next before this is zero initialized
-	Audio_Player_Block *new_block = alloc(get_heap_allocator(), sizeof(Audio_Player_Block));
+	spinlock_acquire_or_wait(&audio_players_lock);
+	p->next_active = audio_players;
+	if (audio_players) audio_players->prev_active = p;
+	audio_players = p;
+	spinlock_release(&audio_players_lock);
 	
-#if !DO_ZERO_INITIALIATION
-	memset(new_block, 0, sizeof(*new_block));
-#endif
-
-	last->next = new_block;
-
-	new_block->players[0].allocated = true;
-	new_block->players[0].config.volume = 1.0;
-	block->players[0].config.playback_speed = 1.0;
-	return &new_block->players[0];
+	return p;
 }
 
 void 
@@ -1660,6 +1644,8 @@ void
 do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format, 
 							 void *output) {
 							 
+	u64 start_cycles = rdtsc();
+	
 	reset_temporary_storage();
 							 
 	u64 out_comp_size  = get_audio_bit_width_byte_size(out_format.bit_width);
@@ -1668,8 +1654,6 @@ do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format,
     
 	memset(output, 0, output_size);
 	
-	Audio_Player_Block *block = &audio_player_block;
-	
 	// #Cleanup #Memory refactor intermediate buffers
 	thread_local local_persist void *mix_buffer = 0;
 	thread_local local_persist u64 mix_buffer_size;
@@ -1681,209 +1665,225 @@ do_program_audio_sample(u64 number_of_output_frames, Audio_Format out_format,
 	u64 *started_this_frame;
 	growing_array_init((void**)&started_this_frame, sizeof(u64), get_temporary_allocator());
 	
-	while (block) {
+	// Release what should be released and take a snapshot of the rest so we don't hold the lock
+	// while mixing.
+	Audio_Player **players;
+	growing_array_init((void**)&players, sizeof(Audio_Player*), get_temporary_allocator());
+	
+	spinlock_acquire_or_wait(&audio_players_lock);
+	Audio_Player *next = audio_players;
+	while (next) {
+		Audio_Player *p = next;
+		next = p->next_active;
 		
-		for (u64 i = 0; i < AUDIO_PLAYERS_PER_BLOCK; i++) {
-			Audio_Player *p = &block->players[i];
-			if (p->release_when_done && (p->frame_index >= p->source.number_of_frames
-										  || !p->has_source)) {
-				p->allocated = false;
-			}
-			if (!p->allocated) {
-				continue;
-			}
-			
-			if (p->marked_for_release) {
-				p->marked_for_release = false;
-				p->allocated = false;
-				continue;
-			}
-			
-			if (p->state != AUDIO_PLAYER_STATE_PLAYING) {
-				if (p->fade_frames == 0) continue;
-			}
-			
-			// #Incomplete Reverse playback ?
-			if (p->config.playback_speed <= 0.0) continue;
-			
-			if (p->frame_index >= p->source.number_of_frames && !p->looping) continue;
-			
-			spinlock_acquire_or_wait(&p->sample_lock);
-			
-			Audio_Source src = p->source;
-			
-			mutex_acquire_or_wait(&src.mutex_for_destroy);
+		bool release = p->marked_for_release;
+		if (p->release_when_done && (p->frame_index >= p->source.number_of_frames
+									  || !p->has_source)) {
+			release = true;
+		}
+		
+		if (release) {
+			if (p->prev_active) p->prev_active->next_active = p->next_active;
+			else audio_players = p->next_active;
+			if (p->next_active) p->next_active->prev_active = p->prev_active;
+			p->allocated = false;
+			pool_dealloc(&audio_player_pool, p);
+			continue;
+		}
+		
+		growing_array_add((void**)&players, &p);
+	}
+	spinlock_release(&audio_players_lock);
+	
+	tm_counter("Active audio players", growing_array_get_valid_count(players));
+	
+	for (u64 player_index = 0; player_index < growing_array_get_valid_count(players); player_index++) {
+		Audio_Player *p = players[player_index];
+		
+		if (p->state != AUDIO_PLAYER_STATE_PLAYING) {
+			if (p->fade_frames == 0) continue;
+		}
+		
+		// #Incomplete Reverse playback ?
+		if (p->config.playback_speed <= 0.0) continue;
+		
+		if (p->frame_index >= p->source.number_of_frames && !p->looping) continue;
+		
+		spinlock_acquire_or_wait(&p->sample_lock);
+		
+		Audio_Source src = p->source;
+		
+		mutex_acquire_or_wait(&src.mutex_for_destroy);
 
-			Audio_Format sample_format = src.format;
-			sample_format.sample_rate = sample_format.sample_rate*p->config.playback_speed;
-			
-			bool need_convert = !bytes_match(
-				&out_format, 
-				&sample_format, 
-				sizeof(Audio_Format)
-			);
-			
-			u64 in_comp_size 
-				= get_audio_bit_width_byte_size(sample_format.bit_width);
-			
-			u64 in_frame_size = in_comp_size * sample_format.channels;
-			u64 input_size = number_of_output_frames * in_frame_size;
+		Audio_Format sample_format = src.format;
+		sample_format.sample_rate = sample_format.sample_rate*p->config.playback_speed;
+		
+		bool need_convert = !bytes_match(
+			&out_format, 
+			&sample_format, 
+			sizeof(Audio_Format)
+		);
+		
+		u64 in_comp_size 
+			= get_audio_bit_width_byte_size(sample_format.bit_width);
+		
+		u64 in_frame_size = in_comp_size * sample_format.channels;
+		u64 input_size = number_of_output_frames * in_frame_size;
+		
+		// #Copypaste #Cleanup
+		u64 biggest_size = max(input_size, output_size);
+		if (!mix_buffer || mix_buffer_size < biggest_size) {
+			u64 new_size = get_next_power_of_two(biggest_size);
+			if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
+			mix_buffer = alloc_aligned(get_heap_allocator(), new_size, CACHE_LINE_SIZE);
+			mix_buffer_size = new_size;
+			memset(mix_buffer, 0, new_size);
+		}
+		
+		void *target_buffer = mix_buffer;
+		u64 number_of_sample_frames = number_of_output_frames;
+		
+		if (need_convert) {
+			if (sample_format.sample_rate != out_format.sample_rate) {
+				f64 src_ratio 
+					= (f64)sample_format.sample_rate 
+					  / (f64)out_format.sample_rate;
+					
+				number_of_sample_frames = round(number_of_output_frames * src_ratio);
+				input_size = number_of_sample_frames * in_frame_size;
+
+				// #Copypaste #Cleanup  we need to potentially grow the mix buffer again after we change input_size
+				u64 biggest_size = max(input_size, output_size);
+				if (!mix_buffer || mix_buffer_size < biggest_size) {
+					u64 new_size = get_next_power_of_two(biggest_size);
+					if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
+					mix_buffer = alloc_aligned(get_heap_allocator(), new_size, CACHE_LINE_SIZE);
+					mix_buffer_size = new_size;
+					memset(mix_buffer, 0, new_size);
+				}
+			}
 			
-			// #Copypaste #Cleanup
 			u64 biggest_size = max(input_size, output_size);
-			if (!mix_buffer || mix_buffer_size < biggest_size) {
+			if (!convert_buffer || convert_buffer_size < biggest_size) {
 				u64 new_size = get_next_power_of_two(biggest_size);
-				if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
-				mix_buffer = alloc(get_heap_allocator(), new_size);
-				mix_buffer_size = new_size;
-				memset(mix_buffer, 0, new_size);
+				if (convert_buffer) dealloc(get_heap_allocator(), convert_buffer);
+				convert_buffer = alloc_aligned(get_heap_allocator(), new_size, CACHE_LINE_SIZE);
+				convert_buffer_size = new_size;
+				memset(convert_buffer, 0, new_size);
 			}
+			target_buffer = convert_buffer;
 			
-			void *target_buffer = mix_buffer;
-			u64 number_of_sample_frames = number_of_output_frames;
+		}
+
+		// :PhaseCancellation
+		if (p->frame_index == 0) { // The players' source just started playing
+		
+			s64 existing_index = growing_array_find_index_from_left_by_value((void**)&started_this_frame, &src.uid);
 			
-			if (need_convert) {
-				if (sample_format.sample_rate != out_format.sample_rate) {
-					f64 src_ratio 
-						= (f64)sample_format.sample_rate 
-						  / (f64)out_format.sample_rate;
-						
-					number_of_sample_frames = round(number_of_output_frames * src_ratio);
-					input_size = number_of_sample_frames * in_frame_size;
-
-					// #Copypaste #Cleanup  we need to potentially grow the mix buffer again after we change input_size
-					u64 biggest_size = max(input_size, output_size);
-					if (!mix_buffer || mix_buffer_size < biggest_size) {
-						u64 new_size = get_next_power_of_two(biggest_size);
-						if (mix_buffer) dealloc(get_heap_allocator(), mix_buffer);
-						mix_buffer = alloc(get_heap_allocator(), new_size);
-						mix_buffer_size = new_size;
-						memset(mix_buffer, 0, new_size);
-					}
-				}
-				
-				u64 biggest_size = max(input_size, output_size);
-				if (!convert_buffer || convert_buffer_size < biggest_size) {
-					u64 new_size = get_next_power_of_two(biggest_size);
-					if (convert_buffer) dealloc(get_heap_allocator(), convert_buffer);
-					convert_buffer = alloc(get_heap_allocator(), new_size);
-					convert_buffer_size = new_size;
-					memset(convert_buffer, 0, new_size);
-				}
-				target_buffer = convert_buffer;
-				
+			if (existing_index != -1) {
+				// If this source already started playing this round from another player, then we pretend that
+				// we're already done playing by skipping to the last frame.
+				// For non-looping players, this means we don't play this instance at all.
+				// For looping players, this means we have a slight offset between the players that start
+				// playing at the exact same time. I'm not sure how else to deal with phase cancellation
+				// in looping players.
+				// #Incomplete player->is_muted_for_phase_cancellation ? 
+				p->frame_index = src.number_of_frames;
+				continue;
 			}
-	
-			// :PhaseCancellation
-			if (p->frame_index == 0) { // The players' source just started playing
+			growing_array_add((void**)&started_this_frame, &src.uid);
+		}
+
+		u64 last_frame_index = p->frame_index;
+		p->frame_index = audio_source_sample_next_frames(
+			&src,
+			p->frame_index, 
+			number_of_sample_frames,
+			target_buffer,
+			p->looping
+		);
+		if (p->frame_index > last_frame_index && (p->looping || p->frame_index != src.number_of_frames)) {
+			assert(p->frame_index - last_frame_index == number_of_sample_frames);
+		}
+		
+		if (p->fade_frames > 0) {
+			u64 frames_to_fade = min(p->fade_frames, number_of_sample_frames);
 			
-				s64 existing_index = growing_array_find_index_from_left_by_value((void**)&started_this_frame, &src.uid);
-				
-				if (existing_index != -1) {
-					// If this source already started playing this round from another player, then we pretend that
-					// we're already done playing by skipping to the last frame.
-					// For non-looping players, this means we don't play this instance at all.
-					// For looping players, this means we have a slight offset between the players that start
-					// playing at the exact same time. I'm not sure how else to deal with phase cancellation
-					// in looping players.
-					// #Incomplete player->is_muted_for_phase_cancellation ? 
-					p->frame_index = src.number_of_frames;
-					continue;
-				}
-				growing_array_add((void**)&started_this_frame, &src.uid);
-			}
-	
-			u64 last_frame_index = p->frame_index;
-			p->frame_index = audio_source_sample_next_frames(
-				&src,
-				p->frame_index, 
-				number_of_sample_frames,
-				target_buffer,
-				p->looping
-			);
-			if (p->frame_index > last_frame_index && (p->looping || p->frame_index != src.number_of_frames)) {
-				assert(p->frame_index - last_frame_index == number_of_sample_frames);
-			}
+			u64 frames_faded_so_far = (p->fade_frames_total-p->fade_frames);
 			
-			if (p->fade_frames > 0) {
-				u64 frames_to_fade = min(p->fade_frames, number_of_sample_frames);
-				
-				u64 frames_faded_so_far = (p->fade_frames_total-p->fade_frames);
-				
-				switch (p->state) {
-					case AUDIO_PLAYER_STATE_PLAYING: {
-						// We need to fade in
-						float64 fade_from 
-							= (f64)frames_faded_so_far / (f64)p->fade_frames_total;
-							
-						float64 fade_to 
-							= (f64)(frames_faded_so_far + frames_to_fade) / (f64)p->fade_frames_total;
-						audio_apply_fade_in(
-							target_buffer, 
-							frames_to_fade, 
-							p->source.format, 
-							fade_from,
-							fade_to
-						);
-						break;
-					}
-					case AUDIO_PLAYER_STATE_PAUSED: {
-						// We need to fade out
-						// #Bug #Incomplete
-						// I can't get this to fade out without noise.
-						// I tried dithering but that didn't help.
-						float64 fade_from 
-							= 1.0 - (f64)frames_faded_so_far / (f64)p->fade_frames_total;
-							
-						float64 fade_to 
-							= 1.0 - (f64)(frames_faded_so_far + frames_to_fade) / (f64)p->fade_frames_total;
-						audio_apply_fade_out(
-							target_buffer, 
-							frames_to_fade, 
-							p->source.format, 
-							fade_from,
-							fade_to
-						);
-						break;
-					}
+			switch (p->state) {
+				case AUDIO_PLAYER_STATE_PLAYING: {
+					// We need to fade in
+					float64 fade_from 
+						= (f64)frames_faded_so_far / (f64)p->fade_frames_total;
+						
+					float64 fade_to 
+						= (f64)(frames_faded_so_far + frames_to_fade) / (f64)p->fade_frames_total;
+					audio_apply_fade_in(
+						target_buffer, 
+						frames_to_fade, 
+						p->source.format, 
+						fade_from,
+						fade_to
+					);
+					break;
 				}
-				
-				p->fade_frames -= frames_to_fade;
-				
-				if (frames_to_fade < number_of_sample_frames) {
-					memset(
-						(u8*)target_buffer+frames_to_fade, 
-						0, 
-						number_of_sample_frames-frames_to_fade
+				case AUDIO_PLAYER_STATE_PAUSED: {
+					// We need to fade out
+					// #Bug #Incomplete
+					// I can't get this to fade out without noise.
+					// I tried dithering but that didn't help.
+					float64 fade_from 
+						= 1.0 - (f64)frames_faded_so_far / (f64)p->fade_frames_total;
+						
+					float64 fade_to 
+						= 1.0 - (f64)(frames_faded_so_far + frames_to_fade) / (f64)p->fade_frames_total;
+					audio_apply_fade_out(
+						target_buffer, 
+						frames_to_fade, 
+						p->source.format, 
+						fade_from,
+						fade_to
 					);
+					break;
 				}
 			}
 			
-			spinlock_release(&p->sample_lock);
-						
-			if (need_convert) {
-				int converted = convert_frames(
-					mix_buffer, 
-					out_format, 
-					convert_buffer, 
-					sample_format,
-					number_of_output_frames
+			p->fade_frames -= frames_to_fade;
+			
+			if (frames_to_fade < number_of_sample_frames) {
+				memset(
+					(u8*)target_buffer+frames_to_fade, 
+					0, 
+					number_of_sample_frames-frames_to_fade
 				);
-				assert(converted == number_of_output_frames);
 			}
+		}
+		
+		spinlock_release(&p->sample_lock);
+					
+		if (need_convert) {
+			int converted = convert_frames(
+				mix_buffer, 
+				out_format, 
+				convert_buffer, 
+				sample_format,
+				number_of_output_frames
+			);
+			assert(converted == number_of_output_frames);
+		}
 
-			if (p->config.enable_spacialization) {
-				apply_audio_spacialization(mix_buffer, out_format, number_of_output_frames, p->config.position_ndc);
-			}
-			if (p->config.volume != 0.0) {
-				apply_audio_volume(mix_buffer, out_format, number_of_output_frames, p->config.volume);
-			}
-			
-			mix_frames(output, mix_buffer, number_of_output_frames, out_format);
-			
-			mutex_release(&src.mutex_for_destroy);
+		if (p->config.enable_spacialization) {
+			apply_audio_spacialization(mix_buffer, out_format, number_of_output_frames, p->config.position_ndc);
 		}
+		if (p->config.volume != 0.0) {
+			apply_audio_volume(mix_buffer, out_format, number_of_output_frames, p->config.volume);
+		}
+		
+		mix_frames(output, mix_buffer, number_of_output_frames, out_format);
 		
-		block = block->next;
+		mutex_release(&src.mutex_for_destroy);
 	}
+	
+	frame_stats_record(FRAME_STATS_AUDIO_CALLBACK, rdtsc_to_seconds(rdtsc()-start_cycles));
 }
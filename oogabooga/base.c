@@ -54,6 +54,8 @@ dump_stack_trace();
 
 typedef struct Nothing {int nothing;} Nothing;
 
+#define CACHE_LINE_SIZE 64
+
 #ifndef CONTEXT_EXTRA
 	#define CONTEXT_EXTRA Nothing
 #endif
@@ -62,6 +64,16 @@ typedef enum Allocator_Message {
 	ALLOCATOR_ALLOCATE,
 	ALLOCATOR_DEALLOCATE,
 	ALLOCATOR_REALLOCATE,
+	// Same as ALLOCATOR_ALLOCATE but the memory must be zero. Allocators that know parts of their
+	// memory are already zero (like fresh pages from the OS) can skip zeroing those.
+	// Optional: return 0 and alloc() will ALLOCATOR_ALLOCATE and zero it instead.
+	ALLOCATOR_ALLOCATE_ZEROED,
+	// p is the alignment (a power of two) instead of a pointer. The result must be deallocatable
+	// with ALLOCATOR_DEALLOCATE like any other allocation. Return 0 if not supported.
+	ALLOCATOR_ALLOCATE_ALIGNED,
+	// ALLOCATOR_ALLOCATE_ALIGNED, but the memory must be zero like ALLOCATOR_ALLOCATE_ZEROED.
+	// Optional: return 0 and alloc_aligned() will ALLOCATOR_ALLOCATE_ALIGNED and zero it instead.
+	ALLOCATOR_ALLOCATE_ALIGNED_ZEROED,
 } Allocator_Message;
 typedef void*(*Allocator_Proc)(u64, void*, Allocator_Message, void*);
 
@@ -111,9 +123,20 @@ alloc(Allocator allocator, u64 size);
 ogb_instance void* 
 alloc_uninitialized(Allocator allocator, u64 size);
 
+// alignment must be a power of two. CACHE_LINE_SIZE keeps things on different threads from
+// sharing cache lines. Dealloc with dealloc() as usual.
+// Note that reallocate() only keeps the alignment when it resizes in place.
+ogb_instance void* 
+alloc_aligned(Allocator allocator, u64 size, u64 alignment);
+
 ogb_instance void 
 dealloc(Allocator allocator, void *p);
 
+// Resizes p, possibly in place. Anything past old_size is zero initialized like in alloc().
+// p may be 0, then it's the same as alloc().
+ogb_instance void* 
+reallocate(Allocator allocator, void *p, u64 old_size, u64 new_size);
+
 ogb_instance void 
 push_context(Context c);
 
@@ -132,11 +155,15 @@ thread_local u64 num_contexts = 0;
 void* 
 alloc(Allocator allocator, u64 size) {
 	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
-	void *p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
 #if DO_ZERO_INITIALIZATION
+	void *p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE_ZEROED, allocator.data);
+	if (p) return p;
+	p = allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
 	memset(p, 0, size);
-#endif
 	return p;
+#else
+	return allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);
+#endif
 }
 
 void* 
@@ -145,12 +172,42 @@ alloc_uninitialized(Allocator allocator, u64 size) {
 	return allocator.proc(size, 0, ALLOCATOR_ALLOCATE, allocator.data);	
 }
 
+void* 
+alloc_aligned(Allocator allocator, u64 size, u64 alignment) {
+	assert(size > 0, "You requested an allocation of zero bytes. I'm not sure what you want with that.");
+	assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Alignment must be a power of two, got %llu", alignment);
+#if DO_ZERO_INITIALIZATION
+	void *p = allocator.proc(size, (void*)alignment, ALLOCATOR_ALLOCATE_ALIGNED_ZEROED, allocator.data);
+	if (!p) {
+		p = allocator.proc(size, (void*)alignment, ALLOCATOR_ALLOCATE_ALIGNED, allocator.data);
+		if (p) memset(p, 0, size);
+	}
+#else
+	void *p = allocator.proc(size, (void*)alignment, ALLOCATOR_ALLOCATE_ALIGNED, allocator.data);
+#endif
+	assert(p, "Allocator does not support aligned allocations (alignment %llu)", alignment);
+	assert((u64)p % alignment == 0, "Allocator returned a pointer which is not aligned to %llu", alignment);
+	return p;
+}
+
 void 
 dealloc(Allocator allocator, void *p) {
 	assert(p != 0, "You tried to deallocate a pointer at adress 0. That doesn't make sense!");
 	allocator.proc(0, p, ALLOCATOR_DEALLOCATE, allocator.data);
 }
 
+void* 
+reallocate(Allocator allocator, void *p, u64 old_size, u64 new_size) {
+	assert(new_size > 0, "You requested a reallocation to zero bytes. Use dealloc() if you want to free it.");
+	if (!p) return alloc(allocator, new_size);
+	p = allocator.proc(new_size, p, ALLOCATOR_REALLOCATE, allocator.data);
+	assert(p, "Allocator does not support reallocate");
+#if DO_ZERO_INITIALIZATION
+	if (new_size > old_size) memset((u8*)p+old_size, 0, new_size-old_size);
+#endif
+	return p;
+}
+
 void 
 push_context(Context c) {
 	assert(num_contexts < CONTEXT_STACK_MAX, "Context stack overflow");
@@ -173,6 +230,14 @@ Context get_context() {
 
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
 
+#if HEAP_TRACK_CALLSITES
+// Defined in memory.c. Everything after this point records where heap allocations come from.
+ogb_instance void*
+alloc_tracked(Allocator allocator, u64 size, bool initialize, const char *file, u64 line);
+#define alloc(allocator, size) alloc_tracked(allocator, size, true, __FILE__, __LINE__)
+#define alloc_uninitialized(allocator, size) alloc_tracked(allocator, size, false, __FILE__, __LINE__)
+#endif
+
 u64 
 get_next_power_of_two(u64 x) {
     if (x == 0) {
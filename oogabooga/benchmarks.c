@@ -0,0 +1,1026 @@
+/*
+	Micro benchmarks
+
+	tests.c checks that things work, this measures how fast they are. It's an entry point like
+	the examples, so in build.c:
+
+		#define OOGABOOGA_HEADLESS 1
+		#define CONFIGURATION RELEASE
+		#include "oogabooga/oogabooga.c"
+		#include "oogabooga/benchmarks.c"
+
+	Arguments:
+		--save              Write the results as the new baseline
+		--baseline <path>   Baseline file, default benchmarks_baseline.json
+		--threshold <pct>   A median which is more than this much slower than the baseline is a
+		                    regression, default 10
+		--filter <text>     Only run benchmarks with text in their name
+
+	Each benchmark prints min, median & p99 per iteration in ns and cycles, and how the median
+	compares to the baseline. The exit code is 1 if anything regressed, so it can run after a
+	build. Baselines only mean something on the machine they were saved on.
+
+	Writing a benchmark:
+
+		Matrix4 m = m4_scalar(1.0);
+		BENCH("m4_inverse") {
+			m.m[0][3] += 1.0; // So it can't be moved out of the loop
+			bench_keep(m4_inverse(m).m[0][0]);
+		}
+
+	The block is one iteration. It's run in batches long enough that reading the clock doesn't
+	matter (BENCH_MIN_BATCH_SECONDS). First it warms up for BENCH_WARMUP_SECONDS, then it takes
+	one sample per batch until the median moves less than BENCH_STABLE_PERCENT over a round of
+	BENCH_SAMPLES_PER_ROUND samples, or BENCH_MAX_SECONDS have passed ("unstable" in the output).
+	Pass results to bench_keep() so the compiler can't throw the work away.
+
+	Benchmarks with "(incl. thread start & join)" in their name start their threads in every
+	iteration, so they're only comparable to each other.
+	The image & audio benchmarks need gfx & audio.c, so they only run without OOGABOOGA_HEADLESS.
+*/
+
+#define BENCH_WARMUP_SECONDS 0.05
+#define BENCH_MIN_BATCH_SECONDS 0.00002
+#define BENCH_SAMPLES_PER_ROUND 64
+#define BENCH_MIN_SAMPLES 16
+#define BENCH_MAX_SAMPLES 4096
+#define BENCH_STABLE_PERCENT 1.0
+#define BENCH_MAX_SECONDS 2.0
+#define BENCH_MAX_RESULTS 256
+
+typedef struct Bench_Result {
+	string name;
+	u64 sample_count;
+	u64 iterations;
+	bool stable;
+	// Per iteration
+	f64 min_cycles;
+	f64 median_cycles;
+	f64 p99_cycles;
+} Bench_Result;
+
+typedef struct Bench_Baseline {
+	string name;
+	f64 median_ns;
+} Bench_Baseline;
+
+typedef struct Bench_Run {
+	string name;
+	bool skip;
+	bool warming_up;
+	u64 batch_size;
+	u64 batch_start; // rdtsc, 0 before the first batch
+	u64 phase_start; // rdtsc at the start of warmup or measuring
+	u64 sample_count;
+	u64 iterations;
+	f64 last_round_median;
+} Bench_Run;
+
+Bench_Result bench_results[BENCH_MAX_RESULTS];
+u64 bench_result_count = 0;
+f64 bench_samples[BENCH_MAX_SAMPLES]; // Cycles per iteration of each batch in the current run
+f64 bench_sorted_samples[BENCH_MAX_SAMPLES];
+f64 bench_help_buffer[BENCH_MAX_SAMPLES];
+Bench_Baseline *bench_baselines = 0; // Growing array
+string bench_filter = {0};
+f64 bench_threshold_percent = 10.0;
+u64 bench_regression_count = 0;
+volatile u64 bench_sink;
+
+#define bench_keep(x) (bench_sink = (u64)(x))
+
+#define BENCH(name) \
+	for (Bench_Run _bench = bench_begin(STR(name)); bench_next_batch(&_bench);) \
+		for (u64 _bench_i = 0; _bench_i < _bench.batch_size; _bench_i++)
+
+inline f64 bench_cycles_to_ns(f64 cycles) {
+	return cycles*1000000000.0/rdtsc_frequency;
+}
+
+int bench_compare_f64(const void *a, const void *b) {
+	f64 x = *(f64*)a;
+	f64 y = *(f64*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// samples must be sorted
+f64 bench_percentile(f64 *samples, u64 count, f64 percent) {
+	u64 rank = (u64)ceil((f64)count*percent/100.0);
+	if (rank == 0) rank = 1;
+	return samples[min(rank, count)-1];
+}
+
+// Sorts a copy of the samples into bench_sorted_samples
+void bench_sort_samples(u64 count) {
+	memcpy(bench_sorted_samples, bench_samples, count*sizeof(f64));
+	merge_sort(bench_sorted_samples, bench_help_buffer, count, sizeof(f64), bench_compare_f64);
+}
+
+Bench_Baseline *bench_find_baseline(string name) {
+	if (!bench_baselines) return 0;
+	
+	u64 count = growing_array_get_valid_count(bench_baselines);
+	for (u64 i = 0; i < count; i++) {
+		if (strings_match(bench_baselines[i].name, name)) return &bench_baselines[i];
+	}
+	return 0;
+}
+
+void bench_finish(Bench_Run *run, bool stable) {
+	assert(bench_result_count < BENCH_MAX_RESULTS, "Too many benchmarks, increase BENCH_MAX_RESULTS");
+
+	bench_sort_samples(run->sample_count);
+
+	Bench_Result *result = &bench_results[bench_result_count++];
+	result->name = run->name;
+	result->sample_count = run->sample_count;
+	result->iterations = run->iterations;
+	result->stable = stable;
+	result->min_cycles = bench_sorted_samples[0];
+	result->median_cycles = bench_percentile(bench_sorted_samples, run->sample_count, 50.0);
+	result->p99_cycles = bench_percentile(bench_sorted_samples, run->sample_count, 99.0);
+
+	f64 median_ns = bench_cycles_to_ns(result->median_cycles);
+	print("%10.2f %10.2f %10.2f  %10.0f %10.0f %10.0f  ", bench_cycles_to_ns(result->min_cycles), median_ns, bench_cycles_to_ns(result->p99_cycles), result->min_cycles, result->median_cycles, result->p99_cycles);
+
+	Bench_Baseline *baseline = bench_find_baseline(result->name);
+	if (baseline) {
+		f64 change_percent = (median_ns-baseline->median_ns)/baseline->median_ns*100.0;
+		bool regressed = change_percent > bench_threshold_percent;
+		if (regressed) bench_regression_count += 1;
+		print("%+7.1f%% %cs ", change_percent, regressed ? "REGRESSED" : "         ");
+	} else {
+		print("                   ");
+	}
+
+	print("%s%cs\n", result->name, result->stable ? "" : " (unstable)");
+}
+
+Bench_Run bench_begin(string name) {
+	Bench_Run run = ZERO(Bench_Run);
+	run.name = name;
+	run.warming_up = true;
+	run.batch_size = 1;
+	if (bench_filter.count) {
+		run.skip = name.count < bench_filter.count || string_find_from_left(name, bench_filter) == -1;
+	}
+	return run;
+}
+
+bool bench_next_batch(Bench_Run *run) {
+	u64 now = rdtsc();
+	if (run->skip) return false;
+
+	if (run->batch_start == 0) {
+		run->phase_start = now;
+	} else {
+		u64 cycles = now-run->batch_start;
+
+		if (run->warming_up) {
+			if ((f64)cycles < BENCH_MIN_BATCH_SECONDS*rdtsc_frequency) {
+				run->batch_size *= 2;
+			} else if ((f64)(now-run->phase_start) >= BENCH_WARMUP_SECONDS*rdtsc_frequency) {
+				run->warming_up = false;
+				run->phase_start = now;
+			}
+		} else {
+			bench_samples[run->sample_count++] = (f64)cycles/(f64)run->batch_size;
+			run->iterations += run->batch_size;
+
+			bool out_of_time = (f64)(now-run->phase_start) >= BENCH_MAX_SECONDS*rdtsc_frequency;
+			if (run->sample_count % BENCH_SAMPLES_PER_ROUND == 0) {
+				bench_sort_samples(run->sample_count);
+				f64 median = bench_percentile(bench_sorted_samples, run->sample_count, 50.0);
+				f64 change_percent = fabs(median-run->last_round_median)/median*100.0;
+				bool stable = run->last_round_median > 0 && change_percent < BENCH_STABLE_PERCENT;
+				run->last_round_median = median;
+
+				if (stable || run->sample_count >= BENCH_MAX_SAMPLES) {
+					bench_finish(run, stable);
+					return false;
+				}
+			}
+			if (out_of_time && run->sample_count >= BENCH_MIN_SAMPLES) {
+				bench_finish(run, false);
+				return false;
+			}
+		}
+	}
+
+	run->batch_start = rdtsc();
+	return true;
+}
+
+///
+// Baseline file
+// One benchmark per line so it's easy to diff, and easy to read back without a json parser.
+
+void bench_write_baseline(string path) {
+	String_Builder builder;
+	string_builder_init_reserve(&builder, bench_result_count*256 + 256, get_heap_allocator());
+
+	string_builder_print(&builder, "{\"rdtsc_frequency\":%.0f,\"benchmarks\":[\n", rdtsc_frequency);
+	for (u64 i = 0; i < bench_result_count; i++) {
+		Bench_Result *r = &bench_results[i];
+		string_builder_print(&builder, "{\"name\":\"%s\",\"median_ns\":%.3f,\"min_ns\":%.3f,\"p99_ns\":%.3f,\"median_cycles\":%.1f,\"min_cycles\":%.1f,\"p99_cycles\":%.1f,\"samples\":%llu,\"iterations\":%llu}%cs\n", r->name, bench_cycles_to_ns(r->median_cycles), bench_cycles_to_ns(r->min_cycles), bench_cycles_to_ns(r->p99_cycles), r->median_cycles, r->min_cycles, r->p99_cycles, r->sample_count, r->iterations, i == bench_result_count-1 ? "" : ",");
+	}
+	string_builder_append(&builder, STR("]}\n"));
+
+	if (os_write_entire_file_s(path, builder.result)) {
+		print("Saved baseline to %s\n", path);
+	} else {
+		log_error("Failed writing baseline to %s", path);
+	}
+
+	dealloc(get_heap_allocator(), builder.buffer);
+}
+
+// Only reads what bench_write_baseline() writes: non-negative decimals
+f64 bench_parse_f64(string s) {
+	f64 result = 0;
+	f64 fraction = 0;
+	for (u64 i = 0; i < s.count; i++) {
+		u8 c = s.data[i];
+		if (c == '.' && fraction == 0) {
+			fraction = 0.1;
+		} else if (c >= '0' && c <= '9') {
+			if (fraction > 0) {
+				result += (f64)(c-'0')*fraction;
+				fraction *= 0.1;
+			} else {
+				result = result*10.0 + (f64)(c-'0');
+			}
+		} else {
+			break;
+		}
+	}
+	return result;
+}
+
+// The value after "key": in line, up to the next , or }
+string bench_find_json_value(string line, string key) {
+	s64 key_index = line.count > key.count ? string_find_from_left(line, key) : -1;
+	if (key_index == -1) return (string){0};
+
+	string value = line;
+	value.data  += key_index+key.count;
+	value.count -= key_index+key.count;
+	if (value.count && value.data[0] == '"') {
+		value.data  += 1;
+		value.count -= 1;
+		s64 end = value.count ? string_find_from_left(value, STR("\"")) : -1;
+		value.count = end == -1 ? 0 : (u64)end;
+	}
+	return value;
+}
+
+bool bench_read_baseline(string path) {
+	string data;
+	if (!os_read_entire_file_s(path, &data, get_heap_allocator())) return false;
+
+	growing_array_init((void**)&bench_baselines, sizeof(Bench_Baseline), get_heap_allocator());
+
+	u64 line_start = 0;
+	for (u64 i = 0; i <= data.count; i++) {
+		if (i < data.count && data.data[i] != '\n') continue;
+
+		u64 line_count = i-line_start;
+		string line = line_count ? string_view(data, line_start, line_count) : (string){0};
+		line_start = i+1;
+
+		string name = bench_find_json_value(line, STR("\"name\":"));
+		string median = bench_find_json_value(line, STR("\"median_ns\":"));
+		if (!name.count || !median.count) continue;
+
+		// Names point into data, which is kept for the rest of the program
+		Bench_Baseline baseline = { name, bench_parse_f64(median) };
+		if (baseline.median_ns > 0) growing_array_add((void**)&bench_baselines, &baseline);
+	}
+
+	return true;
+}
+
+///
+// What the threaded benchmarks run
+
+#define BENCH_MAX_THREADS 16
+
+void bench_run_threads(Thread_Proc proc, void *data, u64 thread_count) {
+	assert(thread_count <= BENCH_MAX_THREADS, "Too many threads for a benchmark");
+	Thread threads[BENCH_MAX_THREADS];
+	for (u64 i = 0; i < thread_count; i++) {
+		os_thread_init(&threads[i], proc);
+		threads[i].data = data;
+		os_thread_start(&threads[i]);
+	}
+	for (u64 i = 0; i < thread_count; i++) {
+		os_thread_join(&threads[i]);
+		os_thread_destroy(&threads[i]);
+	}
+}
+
+// Every thread keeps its own live set of small allocations, so it mostly hits its thread cache
+void bench_heap_churn_proc(Thread *t) {
+	u64 op_count = *(u64*)t->data;
+	Allocator heap = get_heap_allocator();
+	
+	void *live[256];
+	u64 seed = t->id;
+	for (u64 i = 0; i < 256; i++) live[i] = alloc_uninitialized(heap, 64);
+	for (u64 i = 0; i < op_count; i++) {
+		seed = seed * MULTIPLIER + INCREMENT;
+		u64 index = (seed >> 32) % 256;
+		dealloc(heap, live[index]);
+		live[index] = alloc_uninitialized(heap, 8 + (seed >> 16) % 1016);
+	}
+	for (u64 i = 0; i < 256; i++) dealloc(heap, live[i]);
+}
+
+typedef struct Bench_Lock_Data {
+	Mutex mutex;
+	Spinlock spinlock;
+	bool use_spinlock;
+	u64 lock_count; // Per thread
+	volatile u64 counter;
+} Bench_Lock_Data;
+// Every thread hammers the same lock with a tiny critical section, which is the worst case
+void bench_lock_proc(Thread *t) {
+	Bench_Lock_Data *data = (Bench_Lock_Data*)t->data;
+	for (u64 i = 0; i < data->lock_count; i++) {
+		if (data->use_spinlock) spinlock_acquire_or_wait(&data->spinlock);
+		else                    mutex_acquire_or_wait(&data->mutex);
+		
+		data->counter += 1;
+		
+		if (data->use_spinlock) spinlock_release(&data->spinlock);
+		else                    mutex_release(&data->mutex);
+	}
+}
+
+// What Binary_Semaphore used to be: yield and poll until signaled. For comparison.
+typedef struct Bench_Polling_Semaphore {
+	volatile bool signaled;
+	Mutex mutex;
+} Bench_Polling_Semaphore;
+void bench_polling_semaphore_wait(Bench_Polling_Semaphore *sem) {
+	mutex_acquire_or_wait(&sem->mutex);
+	while (!sem->signaled) {
+		mutex_release(&sem->mutex);
+		os_yield_thread();
+		mutex_acquire_or_wait(&sem->mutex);
+	}
+	sem->signaled = false;
+	mutex_release(&sem->mutex);
+}
+void bench_polling_semaphore_signal(Bench_Polling_Semaphore *sem) {
+	mutex_acquire_or_wait(&sem->mutex);
+	sem->signaled = true;
+	mutex_release(&sem->mutex);
+}
+
+typedef struct Bench_Wake_Data {
+	bool use_polling;
+	volatile bool done;
+	Event event;
+	Event ack_event;
+	Bench_Polling_Semaphore polling;
+	Bench_Polling_Semaphore polling_ack;
+} Bench_Wake_Data;
+void bench_wake_waiter_proc(Thread *t) {
+	Bench_Wake_Data *data = (Bench_Wake_Data*)t->data;
+	while (true) {
+		if (data->use_polling) bench_polling_semaphore_wait(&data->polling);
+		else                   event_wait(&data->event);
+		if (data->done) break;
+		if (data->use_polling) bench_polling_semaphore_signal(&data->polling_ack);
+		else                   event_signal(&data->ack_event);
+	}
+}
+// Signals the waiter & waits for it to signal back, one iteration is one round trip
+void bench_wake_round_trips(const char *name, bool use_polling) {
+	Bench_Wake_Data data = ZERO(Bench_Wake_Data);
+	data.use_polling = use_polling;
+	event_init(&data.event, false, false);
+	event_init(&data.ack_event, false, false);
+	mutex_init(&data.polling.mutex);
+	mutex_init(&data.polling_ack.mutex);
+	
+	Thread waiter;
+	os_thread_init(&waiter, bench_wake_waiter_proc);
+	waiter.data = &data;
+	os_thread_start(&waiter);
+	
+	BENCH(name) {
+		if (use_polling) {
+			bench_polling_semaphore_signal(&data.polling);
+			bench_polling_semaphore_wait(&data.polling_ack);
+		} else {
+			event_signal(&data.event);
+			event_wait(&data.ack_event);
+		}
+	}
+	
+	data.done = true;
+	if (use_polling) bench_polling_semaphore_signal(&data.polling);
+	else             event_signal(&data.event);
+	os_thread_join(&waiter);
+	os_thread_destroy(&waiter);
+	mutex_destroy(&data.polling.mutex);
+	mutex_destroy(&data.polling_ack.mutex);
+}
+
+void bench_sqrt_range_proc(u64 first, u64 end, void *data) {
+	float32 *values = (float32*)data;
+	for (u64 i = first; i < end; i++) values[i] = sqrtf((float32)i) * 0.5f + values[i];
+}
+
+typedef enum Bench_Queue_Kind {
+	BENCH_QUEUE_SPSC,
+	BENCH_QUEUE_MPMC,
+	BENCH_QUEUE_SPINLOCK, // Spsc_Queue behind a Spinlock, what we'd do without lock-free queues
+} Bench_Queue_Kind;
+typedef struct Bench_Queue_Data {
+	Bench_Queue_Kind kind;
+	Spsc_Queue spsc;
+	Mpmc_Queue mpmc;
+	Spinlock lock;
+	u64 producer_count;
+	u64 items_per_producer;
+	u64 batch_size;
+	volatile u64 next_thread;
+	volatile u64 consumed;
+} Bench_Queue_Data;
+u64 bench_queue_push(Bench_Queue_Data *data, u64 *items, u64 count) {
+	switch (data->kind) {
+		case BENCH_QUEUE_SPSC: return spsc_queue_push_many(&data->spsc, items, count);
+		case BENCH_QUEUE_MPMC: {
+			u64 pushed = 0;
+			while (pushed < count && mpmc_queue_push(&data->mpmc, &items[pushed])) pushed += 1;
+			return pushed;
+		}
+		case BENCH_QUEUE_SPINLOCK: {
+			spinlock_acquire_or_wait(&data->lock);
+			u64 pushed = spsc_queue_push_many(&data->spsc, items, count);
+			spinlock_release(&data->lock);
+			return pushed;
+		}
+	}
+	return 0;
+}
+u64 bench_queue_pop(Bench_Queue_Data *data, u64 *items, u64 max_count) {
+	switch (data->kind) {
+		case BENCH_QUEUE_SPSC: return spsc_queue_pop_many(&data->spsc, items, max_count);
+		case BENCH_QUEUE_MPMC: {
+			u64 popped = 0;
+			while (popped < max_count && mpmc_queue_pop(&data->mpmc, &items[popped])) popped += 1;
+			return popped;
+		}
+		case BENCH_QUEUE_SPINLOCK: {
+			spinlock_acquire_or_wait(&data->lock);
+			u64 popped = spsc_queue_pop_many(&data->spsc, items, max_count);
+			spinlock_release(&data->lock);
+			return popped;
+		}
+	}
+	return 0;
+}
+// The first producer_count threads produce, the rest consume
+void bench_queue_proc(Thread *t) {
+	Bench_Queue_Data *data = (Bench_Queue_Data*)t->data;
+	u64 thread_index = atomic64_fetch_add(&data->next_thread, 1, MEMORY_ORDER_RELAXED);
+	const u64 total = data->items_per_producer*data->producer_count;
+	
+	u64 items[64];
+	u32 backoff = 1;
+	u32 spins = 0;
+	if (thread_index < data->producer_count) {
+		u64 value = 0;
+		while (value < data->items_per_producer) {
+			u64 count = min(data->batch_size, data->items_per_producer-value);
+			for (u64 i = 0; i < count; i++) items[i] = value+i;
+			u64 pushed = 0;
+			while (pushed < count) {
+				u64 n = bench_queue_push(data, items+pushed, count-pushed);
+				if (n == 0) {
+					spin_wait_backoff(&backoff, &spins);
+				} else {
+					backoff = 1;
+					pushed += n;
+				}
+			}
+			value += count;
+		}
+	} else {
+		while (data->consumed < total) {
+			u64 count = bench_queue_pop(data, items, data->batch_size);
+			if (count == 0) {
+				spin_wait_backoff(&backoff, &spins);
+				continue;
+			}
+			backoff = 1;
+			bench_keep(items[count-1]);
+			atomic64_fetch_add(&data->consumed, count, MEMORY_ORDER_RELAXED);
+		}
+	}
+}
+void bench_queue_run(Bench_Queue_Data *data, u64 consumer_count) {
+	data->next_thread = 0;
+	data->consumed = 0;
+	bench_run_threads(bench_queue_proc, data, data->producer_count+consumer_count);
+}
+
+void bench_fiber_yield_proc(void *p) {
+	volatile bool *done = (volatile bool*)p;
+	while (!*done) fiber_yield();
+}
+
+///
+// The benchmarks
+
+void run_benchmarks() {
+
+	///
+	// Memory
+
+	Allocator heap = get_heap_allocator();
+
+	BENCH("heap_alloc & dealloc 64 bytes") {
+		void *p = alloc(heap, 64);
+		bench_keep(p);
+		dealloc(heap, p);
+	}
+	BENCH("heap_alloc & dealloc 4 KB") {
+		void *p = alloc(heap, 4096);
+		bench_keep(p);
+		dealloc(heap, p);
+	}
+	BENCH("heap_alloc & dealloc 1 MB") {
+		void *p = alloc(heap, 1024*1024);
+		bench_keep(p);
+		dealloc(heap, p);
+	}
+
+	// Churns a live set of random sized allocations, mostly small with the odd big one
+	#define BENCH_HEAP_LIVE_COUNT 4096
+	void **live = alloc(heap, BENCH_HEAP_LIVE_COUNT*sizeof(void*));
+	for (u64 i = 0; i < BENCH_HEAP_LIVE_COUNT; i++) {
+		live[i] = alloc_uninitialized(heap, get_random_int_in_range(8, 2048));
+	}
+	BENCH("heap dealloc & alloc in a live set of 4096, 8..512 bytes & 1/16 2 KB..64 KB") {
+		u64 index = get_random() % BENCH_HEAP_LIVE_COUNT;
+		dealloc(heap, live[index]);
+		u64 size;
+		if (get_random() % 16 == 0) size = get_random_int_in_range(2048, KB(64));
+		else                        size = get_random_int_in_range(8, 512);
+		live[index] = alloc_uninitialized(heap, size);
+	}
+	for (u64 i = 0; i < BENCH_HEAP_LIVE_COUNT; i++) dealloc(heap, live[i]);
+	dealloc(heap, live);
+	
+	// Zeroing what needs to be zeroed vs zeroing everything, on memory which was just trimmed
+	// like after loading a level
+	BENCH("heap_trim, alloc 512 KB & dealloc") {
+		heap_trim();
+		void *p = alloc(heap, KB(512));
+		bench_keep(p);
+		dealloc(heap, p);
+	}
+	BENCH("heap_trim, alloc_uninitialized 512 KB + memset & dealloc") {
+		heap_trim();
+		void *p = alloc_uninitialized(heap, KB(512));
+		memset(p, 0, KB(512));
+		bench_keep(p);
+		dealloc(heap, p);
+	}
+	
+	// Like the growing_array example, while something else keeps allocating
+	typedef struct Bench_Circle {
+		Vector2 pos;
+		float radius;
+	} Bench_Circle;
+	BENCH("growing_array_add 10000 circles, one at a time") {
+		Bench_Circle *circles;
+		growing_array_init((void**)&circles, sizeof(Bench_Circle), heap);
+		void *others[64];
+		for (int i = 0; i < 10000; i++) {
+			Bench_Circle c = {v2((f32)i, (f32)i), (f32)i};
+			growing_array_add((void**)&circles, &c);
+			if (i % 256 == 0) others[i/256 % 64] = alloc_uninitialized(heap, 200);
+		}
+		for (int i = 0; i < 10000; i += 256) dealloc(heap, others[i/256 % 64]);
+		bench_keep(circles[9999].radius);
+		growing_array_deinit((void**)&circles);
+	}
+	
+	Pool pool;
+	pool_init(&pool, 64, false);
+	BENCH("pool_alloc & pool_dealloc 64 bytes") {
+		void *p = pool_alloc(&pool);
+		bench_keep(p);
+		pool_dealloc(&pool, p);
+	}
+	pool_destroy(&pool);
+	
+	u64 churn_op_count = 20000;
+	BENCH("heap churn, 1 thread x 20k dealloc & alloc (incl. thread start & join)") {
+		bench_run_threads(bench_heap_churn_proc, &churn_op_count, 1);
+	}
+	BENCH("heap churn, 4 threads x 20k dealloc & alloc (incl. thread start & join)") {
+		bench_run_threads(bench_heap_churn_proc, &churn_op_count, 4);
+	}
+
+	///
+	// Hash table
+
+	#define BENCH_HASH_TABLE_COUNT 4096
+	u64 *keys = alloc(heap, BENCH_HASH_TABLE_COUNT*sizeof(u64));
+	Hash_Table table = make_hash_table(u64, u64, heap);
+	for (u64 i = 0; i < BENCH_HASH_TABLE_COUNT; i++) {
+		u64 key = get_random();
+		keys[i] = key;
+		hash_table_add(&table, key, i);
+	}
+	u64 key_index = 0;
+	BENCH("hash_table_find 4096 u64 keys") {
+		u64 key = keys[key_index++ & (BENCH_HASH_TABLE_COUNT-1)];
+		u64 *value = hash_table_find(&table, key);
+		bench_keep(*value);
+	}
+	hash_table_destroy(&table);
+	dealloc(heap, keys);
+
+	///
+	// Sorting
+
+	// Same numbers as the comment on radix_sort() in utility.c
+	#define BENCH_SORT_COUNT 100000
+	u64 *sort_source = alloc(heap, BENCH_SORT_COUNT*sizeof(u64)*3);
+	u64 *sort_items = sort_source+BENCH_SORT_COUNT;
+	u64 *sort_help = sort_items+BENCH_SORT_COUNT;
+	for (u64 i = 0; i < BENCH_SORT_COUNT; i++) {
+		sort_source[i] = get_random() & ((1ULL << 21)-1);
+	}
+	BENCH("radix_sort 100k u64, 21 bits (incl. copying in the unsorted items)") {
+		memcpy(sort_items, sort_source, BENCH_SORT_COUNT*sizeof(u64));
+		radix_sort(sort_items, sort_help, BENCH_SORT_COUNT, sizeof(u64), 0, 21);
+		bench_keep(sort_items[0]);
+	}
+	dealloc(heap, sort_source);
+	
+	// A big frame's worth of quads, where radix_sort_parallel() is meant to pay off
+	#define BENCH_BIG_SORT_COUNT 1000000
+	sort_source = alloc(heap, BENCH_BIG_SORT_COUNT*sizeof(u64)*3);
+	sort_items = sort_source+BENCH_BIG_SORT_COUNT;
+	sort_help = sort_items+BENCH_BIG_SORT_COUNT;
+	for (u64 i = 0; i < BENCH_BIG_SORT_COUNT; i++) {
+		sort_source[i] = get_random() & ((1ULL << 21)-1);
+	}
+	job_system_init(0);
+	BENCH("radix_sort 1M u64, 21 bits (incl. copying in the unsorted items)") {
+		memcpy(sort_items, sort_source, BENCH_BIG_SORT_COUNT*sizeof(u64));
+		radix_sort(sort_items, sort_help, BENCH_BIG_SORT_COUNT, sizeof(u64), 0, 21);
+		bench_keep(sort_items[0]);
+	}
+	BENCH("radix_sort_parallel 1M u64, 21 bits (incl. copying in the unsorted items)") {
+		memcpy(sort_items, sort_source, BENCH_BIG_SORT_COUNT*sizeof(u64));
+		radix_sort_parallel(sort_items, sort_help, BENCH_BIG_SORT_COUNT, sizeof(u64), 0, 21);
+		bench_keep(sort_items[0]);
+	}
+	dealloc(heap, sort_source);
+
+	///
+	// Strings
+
+	String_Builder builder;
+	string_builder_init_reserve(&builder, 1024, heap);
+	u64 format_count = 0;
+	string entity_name = STR("Berry bush");
+	BENCH("string_builder_print %d %.2f %.2f %s") {
+		builder.count = 0;
+		format_count += 1;
+		string_builder_print(&builder, "Entity %d at %.2f, %.2f is a %s\n", (int)format_count, (f64)format_count*0.5, (f64)format_count*0.25, entity_name);
+		bench_keep(builder.count);
+	}
+	BENCH("string_builder_print %s") {
+		builder.count = 0;
+		string_builder_print(&builder, "Entity is a %s\n", entity_name);
+		bench_keep(builder.count);
+	}
+	dealloc(heap, builder.buffer);
+
+	///
+	// Linmath
+
+	Matrix4 m4_a = m4_mul(m4_make_rotation(v3(0.3, 1.0, 0.2), 0.7), m4_make_scale(v3(2.0, 3.0, 4.0)));
+	Matrix4 m4_b = m4_make_translation(v3(10.0, -4.0, 2.5));
+	BENCH("m4_mul") {
+		m4_b.m[0][3] += 1.0f; // So it can't be moved out of the loop
+		bench_keep(m4_mul(m4_a, m4_b).m[1][2]);
+	}
+	BENCH("m4_inverse") {
+		m4_a.m[0][3] += 1.0f;
+		bench_keep(m4_inverse(m4_a).m[1][2]);
+	}
+
+	///
+	// Simd kernels, over arrays so the loads & stores count like they would in real use
+
+	#define BENCH_SIMD_COUNT 4096
+	float32 *simd_a = alloc_aligned(heap, BENCH_SIMD_COUNT*sizeof(float32)*3, 64);
+	float32 *simd_b = simd_a+BENCH_SIMD_COUNT;
+	float32 *simd_r = simd_b+BENCH_SIMD_COUNT;
+	s32 *simd_ia = (s32*)simd_a;
+	s32 *simd_ib = (s32*)simd_b;
+	s32 *simd_ir = (s32*)simd_r;
+	for (u64 i = 0; i < BENCH_SIMD_COUNT; i++) {
+		simd_a[i] = get_random_float32_in_range(1.0, 100.0);
+		simd_b[i] = get_random_float32_in_range(1.0, 100.0);
+	}
+	BENCH("simd_add_float32_128 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 4)  simd_add_float32_128(simd_a+i, simd_b+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_add_float32_256 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_add_float32_256(simd_a+i, simd_b+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_add_float32_512 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 16) simd_add_float32_512(simd_a+i, simd_b+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_mul_float32_256 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_mul_float32_256(simd_a+i, simd_b+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_div_float32_256 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_div_float32_256(simd_a+i, simd_b+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_sqrt_float32_256 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_sqrt_float32_256(simd_a+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_rsqrt_float32_256 x4096 floats") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_rsqrt_float32_256(simd_a+i, simd_r+i);
+		bench_keep(simd_r[0]);
+	}
+	BENCH("simd_dot_product_float32_128 x4096 floats") {
+		float32 sum = 0;
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 4)  sum += simd_dot_product_float32_128(simd_a+i, simd_b+i);
+		bench_keep(sum);
+	}
+	BENCH("simd_mul_int32_256 x4096 ints") {
+		for (u64 i = 0; i < BENCH_SIMD_COUNT; i += 8)  simd_mul_int32_256(simd_ia+i, simd_ib+i, simd_ir+i);
+		bench_keep(simd_ir[0]);
+	}
+	dealloc(heap, simd_a);
+
+	///
+	// Locks
+
+	Bench_Lock_Data lock_data = ZERO(Bench_Lock_Data);
+	mutex_init(&lock_data.mutex);
+	spinlock_init(&lock_data.spinlock);
+	BENCH("mutex_acquire_or_wait & mutex_release, uncontended") {
+		mutex_acquire_or_wait(&lock_data.mutex);
+		mutex_release(&lock_data.mutex);
+	}
+	BENCH("spinlock_acquire_or_wait & spinlock_release, uncontended") {
+		spinlock_acquire_or_wait(&lock_data.spinlock);
+		spinlock_release(&lock_data.spinlock);
+	}
+	lock_data.lock_count = 10000;
+	lock_data.use_spinlock = false;
+	BENCH("Mutex, 4 threads x 10k acquire & release (incl. thread start & join)") {
+		bench_run_threads(bench_lock_proc, &lock_data, 4);
+	}
+	lock_data.use_spinlock = true;
+	BENCH("Spinlock, 4 threads x 10k acquire & release (incl. thread start & join)") {
+		bench_run_threads(bench_lock_proc, &lock_data, 4);
+	}
+	bench_keep(lock_data.counter);
+	mutex_destroy(&lock_data.mutex);
+	
+	RW_Spinlock rw_lock;
+	rw_spinlock_init(&rw_lock);
+	BENCH("rw_spinlock read acquire & release, uncontended") {
+		rw_spinlock_acquire_read_or_wait(&rw_lock);
+		rw_spinlock_release_read(&rw_lock);
+	}
+	Seqlock seqlock;
+	seqlock_init(&seqlock);
+	u64 sequenced[4] = {0};
+	BENCH("seqlock read of 32 bytes, uncontended") {
+		u64 copy[4];
+		u32 sequence;
+		do {
+			sequence = seqlock_read_begin(&seqlock);
+			memcpy(copy, sequenced, sizeof(copy));
+		} while (seqlock_read_retry(&seqlock, sequence));
+		bench_keep(copy[0]);
+	}
+
+	///
+	// Waking up a waiting thread
+
+	bench_wake_round_trips("Event signal & wait for the other thread to signal back", false);
+	bench_wake_round_trips("Polling semaphore signal & wait for the other thread to signal back", true);
+
+	///
+	// Jobs
+
+	#define BENCH_PARALLEL_FOR_COUNT (1024*1024*4)
+	float32 *values = alloc(heap, sizeof(float32)*BENCH_PARALLEL_FOR_COUNT);
+	BENCH("sqrt over 4M floats on one thread") {
+		bench_sqrt_range_proc(0, BENCH_PARALLEL_FOR_COUNT, values);
+		bench_keep(values[0]);
+	}
+	BENCH("sqrt over 4M floats with parallel_for, grain 16k") {
+		parallel_for(BENCH_PARALLEL_FOR_COUNT, 16*1024, bench_sqrt_range_proc, values);
+		bench_keep(values[0]);
+	}
+	dealloc(heap, values);
+
+	///
+	// Queues, 100k items through each per iteration
+
+	Bench_Queue_Data *queue = alloc_aligned(heap, sizeof(Bench_Queue_Data), CACHE_LINE_SIZE);
+	memset(queue, 0, sizeof(*queue));
+	spsc_queue_init(&queue->spsc, sizeof(u64), 1024, heap);
+	mpmc_queue_init(&queue->mpmc, sizeof(u64), 1024, heap);
+	spinlock_init(&queue->lock);
+	
+	queue->producer_count = 1;
+	queue->items_per_producer = 100000;
+	queue->batch_size = 1;
+	queue->kind = BENCH_QUEUE_SPSC;
+	BENCH("Spsc_Queue, 1 -> 1 thread, 1 item at a time (incl. thread start & join)") {
+		bench_queue_run(queue, 1);
+	}
+	queue->kind = BENCH_QUEUE_SPINLOCK;
+	BENCH("Spinlock queue, 1 -> 1 thread, 1 item at a time (incl. thread start & join)") {
+		bench_queue_run(queue, 1);
+	}
+	queue->batch_size = 64;
+	queue->kind = BENCH_QUEUE_SPSC;
+	BENCH("Spsc_Queue, 1 -> 1 thread, batches of 64 (incl. thread start & join)") {
+		bench_queue_run(queue, 1);
+	}
+	queue->kind = BENCH_QUEUE_SPINLOCK;
+	BENCH("Spinlock queue, 1 -> 1 thread, batches of 64 (incl. thread start & join)") {
+		bench_queue_run(queue, 1);
+	}
+	
+	queue->producer_count = 4;
+	queue->items_per_producer = 25000;
+	queue->batch_size = 1;
+	queue->kind = BENCH_QUEUE_MPMC;
+	BENCH("Mpmc_Queue, 4 -> 4 threads, 1 item at a time (incl. thread start & join)") {
+		bench_queue_run(queue, 4);
+	}
+	queue->kind = BENCH_QUEUE_SPINLOCK;
+	BENCH("Spinlock queue, 4 -> 4 threads, 1 item at a time (incl. thread start & join)") {
+		bench_queue_run(queue, 4);
+	}
+	
+	spsc_queue_deinit(&queue->spsc);
+	mpmc_queue_deinit(&queue->mpmc);
+	dealloc(heap, queue);
+
+	///
+	// Fibers
+
+	volatile bool fibers_done = false;
+	fiber_start(bench_fiber_yield_proc, (void*)&fibers_done, 0);
+	BENCH("fiber_yield & resume, fibers_run(0) with one fiber") {
+		fibers_run(0.0);
+	}
+	fibers_done = true;
+	while (fibers_run(0.0)) {}
+
+	///
+	// Frame stats & profiler
+
+	u64 frame_index = 0;
+	BENCH("frame_stats_record") {
+		frame_index += 1;
+		frame_stats_record(FRAME_STATS_OS_UPDATE, (f64)(frame_index%100)/10000.0);
+	}
+	BENCH("frame_stats_get_summary") {
+		bench_keep(frame_stats_get_summary(FRAME_STATS_OS_UPDATE).p99*1000000.0);
+	}
+	frame_stats_reset();
+
+#if ENABLE_PROFILING
+	// The ring is emptied now and then so it never fills up and drops records, which is
+	// cheaper than keeping them
+	u64 scope_count = 0;
+	BENCH("tm_scope, incl. collecting the record") {
+		tm_scope("Benchmark scope") {
+			bench_keep(scope_count);
+		}
+		scope_count += 1;
+		if (scope_count % 1024 == 0) {
+			_profiler_lock_acquire();
+			_profiler_collect_records();
+			growing_array_clear((void**)&profile_records);
+			_profiler_lock_release();
+		}
+	}
+#endif
+
+#ifndef OOGABOOGA_HEADLESS
+	///
+	// Images
+
+	BENCH("make_image & delete_image of a font atlas") {
+		delete_image(make_image(FONT_ATLAS_WIDTH, FONT_ATLAS_HEIGHT, 1, 0, heap));
+	}
+	string image_path = STR("oogabooga/examples/berry_bush.png");
+	if (os_is_file(image_path)) {
+		BENCH("load_image_from_disk berry_bush.png & delete_image") {
+			Gfx_Image *image = load_image_from_disk(image_path, heap);
+			assert(image, "Failed loading %s", image_path);
+			delete_image(image);
+		}
+	} else {
+		log_warning("Skipping load_image_from_disk, %s not found", image_path);
+	}
+
+	///
+	// Audio, one 1024 frame buffer like the audio thread asks for
+
+	#define BENCH_AUDIO_FRAMES 1024
+	Audio_Format format_f32 = { AUDIO_BITS_32, 2, 48000 };
+	Audio_Format format_s16 = { AUDIO_BITS_16, 2, 48000 };
+	Audio_Format format_f32_44100 = { AUDIO_BITS_32, 2, 44100 };
+	f32 *audio_src = alloc(heap, BENCH_AUDIO_FRAMES*2*sizeof(f32)*2);
+	f32 *audio_dst = alloc(heap, BENCH_AUDIO_FRAMES*2*sizeof(f32)*2);
+	for (u64 i = 0; i < BENCH_AUDIO_FRAMES*2*2; i++) {
+		audio_src[i] = get_random_float32_in_range(-0.5, 0.5);
+	}
+	BENCH("convert_frames 1024 frames s16 -> f32") {
+		bench_keep(convert_frames(audio_dst, format_f32, audio_src, format_s16, BENCH_AUDIO_FRAMES));
+	}
+	BENCH("convert_frames 1024 frames f32 44100 -> 48000") {
+		bench_keep(convert_frames(audio_dst, format_f32, audio_src, format_f32_44100, BENCH_AUDIO_FRAMES));
+	}
+	BENCH("mix_frames 1024 frames f32") {
+		mix_frames(audio_dst, audio_src, BENCH_AUDIO_FRAMES, format_f32);
+		bench_keep(audio_dst[0]);
+	}
+	dealloc(heap, audio_src);
+	dealloc(heap, audio_dst);
+#endif // NOT OOGABOOGA_HEADLESS
+}
+
+int entry(int argc, char **argv) {
+
+	string baseline_path = STR("benchmarks_baseline.json");
+	bool save = false;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = STR(argv[i]);
+		if (strings_match(arg, STR("--save"))) {
+			save = true;
+		} else if (strings_match(arg, STR("--baseline")) && i+1 < argc) {
+			i += 1;
+			baseline_path = STR(argv[i]);
+		} else if (strings_match(arg, STR("--threshold")) && i+1 < argc) {
+			i += 1;
+			bench_threshold_percent = bench_parse_f64(STR(argv[i]));
+		} else if (strings_match(arg, STR("--filter")) && i+1 < argc) {
+			i += 1;
+			bench_filter = STR(argv[i]);
+		} else {
+			log_warning("Unknown argument '%s'", arg);
+		}
+	}
+
+#if CONFIGURATION != RELEASE
+	log_warning("Benchmarks in a debug build don't say much about a release build. Build with CONFIGURATION RELEASE.");
+#endif
+	if (!rdtsc_is_invariant) {
+		log_warning("CPU doesn't report an invariant TSC, cycles are off whenever the clock speed changes");
+	}
+
+	bool has_baseline = bench_read_baseline(baseline_path);
+	if (has_baseline) {
+		print("Comparing to %s, a median more than %.1f%% slower is a regression\n", baseline_path, bench_threshold_percent);
+	} else if (!save) {
+		print("No baseline at %s, run with --save to make one\n", baseline_path);
+	}
+
+	print("rdtsc at %.3f GHz\n\n", rdtsc_frequency/1000000000.0);
+	print("    min ns  median ns     p99 ns  min cycles median cyc p99 cycles  baseline           name\n");
+
+	run_benchmarks();
+
+	print("\n%llu benchmarks", bench_result_count);
+	if (has_baseline) print(", %llu regressed", bench_regression_count);
+	print("\n");
+
+	if (save) bench_write_baseline(baseline_path);
+
+	return bench_regression_count ? 1 : 0;
+}
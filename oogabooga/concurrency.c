@@ -2,6 +2,14 @@
 typedef struct Spinlock Spinlock;
 typedef struct Mutex Mutex;
 typedef struct Binary_Semaphore Binary_Semaphore;
+typedef struct Event Event;
+typedef struct Semaphore Semaphore;
+typedef struct Condition_Variable Condition_Variable;
+typedef struct RW_Spinlock RW_Spinlock;
+typedef struct Seqlock Seqlock;
+typedef struct Spsc_Queue Spsc_Queue;
+typedef struct Mpmc_Queue Mpmc_Queue;
+typedef struct Lock_Stats Lock_Stats;
 
 // These are probably your best friend for sync-free multi-processing.
 inline bool compare_and_swap_8(volatile uint8_t *a, uint8_t b, uint8_t old);
@@ -10,12 +18,73 @@ inline bool compare_and_swap_32(volatile uint32_t *a, uint32_t b, uint32_t old);
 inline bool compare_and_swap_64(volatile uint64_t *a, uint64_t b, uint64_t old);
 inline bool compare_and_swap_bool(volatile bool *a, bool b, bool old);
 
+///
+// Atomics (implemented in cpu.c)
+// order is one of MEMORY_ORDER_RELAXED, _ACQUIRE, _RELEASE, _ACQ_REL or _SEQ_CST, and should
+// be a constant so the compiler can pick the cheapest instruction for it.
+// Use acquire for loads that guard data written by another thread, release for stores that
+// publish data to another thread, and relaxed for counters nobody syncs on.
+// exchange & fetch_* return the previous value.
+inline void memory_fence(Memory_Order order);
+inline u32  atomic32_load(volatile u32 *a, Memory_Order order);
+inline u64  atomic64_load(volatile u64 *a, Memory_Order order);
+inline void atomic32_store(volatile u32 *a, u32 value, Memory_Order order);
+inline void atomic64_store(volatile u64 *a, u64 value, Memory_Order order);
+inline u32  atomic32_exchange(volatile u32 *a, u32 value, Memory_Order order);
+inline u64  atomic64_exchange(volatile u64 *a, u64 value, Memory_Order order);
+inline u32  atomic32_fetch_add(volatile u32 *a, u32 value, Memory_Order order);
+inline u64  atomic64_fetch_add(volatile u64 *a, u64 value, Memory_Order order);
+inline u32  atomic32_fetch_sub(volatile u32 *a, u32 value, Memory_Order order);
+inline u64  atomic64_fetch_sub(volatile u64 *a, u64 value, Memory_Order order);
+inline u32  atomic32_fetch_and(volatile u32 *a, u32 value, Memory_Order order);
+inline u64  atomic64_fetch_and(volatile u64 *a, u64 value, Memory_Order order);
+inline u32  atomic32_fetch_or(volatile u32 *a, u32 value, Memory_Order order);
+inline u64  atomic64_fetch_or(volatile u64 *a, u64 value, Memory_Order order);
+
+///
+// Lock contention tracking
+// With LOCK_TRACK_CONTENTION, every Spinlock and Mutex counts acquires, contended acquires
+// (the lock was taken when we first tried) and how many cycles were spent waiting.
+// Locks with the same name share their stats, so e.g. the sample_lock of every audio player
+// adds up to one row. Unnamed locks all count towards one "(unnamed)" row.
+// Dump a table with lock_dump_contention_stats(STR("lock_contention.txt")), and with
+// ENABLE_PROFILING the profiler gets a counter track per named lock every os_update().
+// spinlock_set_name() & mutex_set_name() do nothing without LOCK_TRACK_CONTENTION.
+#ifndef LOCK_STATS_MAX_COUNT
+	#define LOCK_STATS_MAX_COUNT 256 // Distinct lock names, the rest count as unnamed
+#endif
+typedef struct Lock_Stats {
+	string name;
+	volatile u64 acquire_count;
+	volatile u64 contended_count;
+	volatile u64 total_wait_cycles;
+	volatile u64 max_wait_cycles;
+	volatile u64 last_blocking_thread; // Who held the lock the last time someone had to wait
+	
+	// What was last sent to the profiler, so it gets per frame numbers
+	u64 reported_contended_count;
+	u64 reported_wait_cycles;
+} Lock_Stats;
+
+#if LOCK_TRACK_CONTENTION
+// Writes one line per lock name, most cycles spent waiting first
+bool ogb_instance
+lock_dump_contention_stats(string path);
+#endif
+
+
 ///
 // Spinlock "primitive"
 // Like a mutex but it eats up the entire core while waiting.
 // Beneficial if contention is low or sync speed is important
+#define SPINLOCK_MAX_BACKOFF 64 // In pause instructions
+#define SPINLOCK_YIELD_SPIN_COUNT 8192
 typedef struct Spinlock {
 	volatile bool locked;
+#if LOCK_TRACK_CONTENTION
+	volatile u64 holder_thread;
+	Lock_Stats *stats;
+#endif
 } Spinlock;
 
 void ogb_instance
@@ -31,20 +100,33 @@ spinlock_acquire_or_wait_timeout(Spinlock* l, f64 timeout_seconds);
 void ogb_instance
 spinlock_release(Spinlock* l);
 
+// name needs to stay valid, e.g. a string literal
+void ogb_instance
+spinlock_set_name(Spinlock *l, string name);
+
 
 ///
-// High-level mutex primitive (short spinlock then OS mutex lock)
-// Just spins for a few (configurable) microseconds with a spinlock,
-// and if acquiring fails it falls back to a OS mutex.
-#define MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS 100
+// High-level mutex primitive (futex style)
+// A single word lock. Taking a free mutex is one compare_and_swap and never enters the kernel.
+// If it's taken, we spin for a bit with backoff, since the holder is likely to release it
+// soon, and only if that fails the thread is parked in the kernel until the holder wakes it.
+// How long we spin adapts to how long it took to get the lock the last few times.
+// A zero initialized Mutex is a valid unlocked mutex.
+#define MUTEX_MAX_SPIN_COUNT 4096 // In pause instructions
+#define MUTEX_MAX_BACKOFF 64
 typedef struct Mutex {
-	Spinlock spinlock;
-	f64 spin_time_microseconds;
-	Mutex_Handle os_handle;
-	volatile bool spinlock_acquired;
+	volatile u32 state; // MUTEX_UNLOCKED, MUTEX_LOCKED or MUTEX_CONTENDED
+	u32 spin_count; // Running average of how many pauses it took to get the lock by spinning
 	volatile u64 acquiring_thread;
+#if LOCK_TRACK_CONTENTION
+	Lock_Stats *stats;
+#endif
 } Mutex;
 
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2 // Locked and there might be parked threads
+
 void ogb_instance
 mutex_init(Mutex *m);
 
@@ -57,12 +139,162 @@ mutex_acquire_or_wait(Mutex *m);
 void ogb_instance
 mutex_release(Mutex *m);
 
+// name needs to stay valid, e.g. a string literal
+void ogb_instance
+mutex_set_name(Mutex *m, string name);
+
+
+///
+// Reader-writer spinlock
+// Any number of readers or one writer. Writer preferring: once a writer is waiting, new
+// readers wait too, so a steady stream of readers can't starve writers.
+// For read-mostly data which is read from many threads with short critical sections.
+#define RW_SPINLOCK_WRITER         0x80000000
+#define RW_SPINLOCK_WRITER_WAITING 0x40000000
+typedef struct RW_Spinlock {
+	volatile u32 state; // Reader count | RW_SPINLOCK_WRITER | RW_SPINLOCK_WRITER_WAITING
+} RW_Spinlock;
+
+void ogb_instance
+rw_spinlock_init(RW_Spinlock *l);
+
+void ogb_instance
+rw_spinlock_acquire_read_or_wait(RW_Spinlock *l);
+
+void ogb_instance
+rw_spinlock_release_read(RW_Spinlock *l);
+
+void ogb_instance
+rw_spinlock_acquire_write_or_wait(RW_Spinlock *l);
+
+void ogb_instance
+rw_spinlock_release_write(RW_Spinlock *l);
+
+
+///
+// Seqlock
+// Readers never write to shared memory, so they don't slow each other (or the writer)
+// down. They copy the data and retry if a write happened in the meantime:
+//
+//     u32 sequence;
+//     do {
+//         sequence = seqlock_read_begin(&lock);
+//         copy = shared_data;
+//     } while (seqlock_read_retry(&lock, sequence));
+//
+// Writers are serialized with a spinlock:
+//
+//     seqlock_write_begin(&lock);
+//     shared_data = new_data;
+//     seqlock_write_end(&lock);
+//
+// Readers may see torn data before the retry check, so only copy plain data in the loop
+// and don't follow pointers read from it until the check passed.
+typedef struct Seqlock {
+	volatile u32 sequence; // Odd while a write is in progress
+	Spinlock writer_lock;
+} Seqlock;
+
+void ogb_instance
+seqlock_init(Seqlock *l);
+
+u32 ogb_instance
+seqlock_read_begin(Seqlock *l);
+
+bool ogb_instance
+seqlock_read_retry(Seqlock *l, u32 sequence);
+
+void ogb_instance
+seqlock_write_begin(Seqlock *l);
+
+void ogb_instance
+seqlock_write_end(Seqlock *l);
+
+
+///
+// Event
+// Waiting threads sleep in the kernel until the event is signaled.
+// Auto reset: signaling wakes one waiter and the event resets as that waiter returns.
+// Manual reset: signaling wakes all waiters and the event stays signaled until event_reset().
+typedef struct Event {
+	volatile u32 signaled;
+	volatile u32 waiter_count; // So signaling doesn't go to the kernel when nobody waits
+	bool manual_reset;
+} Event;
+
+void ogb_instance
+event_init(Event *e, bool manual_reset, bool initial_state);
+
+void ogb_instance
+event_signal(Event *e);
+
+void ogb_instance
+event_reset(Event *e);
+
+void ogb_instance
+event_wait(Event *e);
+
+// Returns false if timeout reached before the event was signaled
+bool ogb_instance
+event_wait_timeout(Event *e, f64 timeout_seconds);
+
+
+///
+// Counting semaphore
+// semaphore_wait() takes one from the count, or sleeps in the kernel until there is one.
+typedef struct Semaphore {
+	volatile u32 count;
+	volatile u32 waiter_count;
+} Semaphore;
+
+void ogb_instance
+semaphore_init(Semaphore *sem, u32 initial_count);
+
+void ogb_instance
+semaphore_signal(Semaphore *sem, u32 count);
+
+void ogb_instance
+semaphore_wait(Semaphore *sem);
+
+// Returns false instead of waiting if the count is 0
+bool ogb_instance
+semaphore_try_wait(Semaphore *sem);
+
+
+///
+// Condition variable
+// condition_variable_wait() releases the mutex, sleeps until signaled and acquires the mutex
+// again before it returns. It can return without a signal so always check your condition
+// in a loop:
+//
+//     mutex_acquire_or_wait(&m);
+//     while (!ready) condition_variable_wait(&cv, &m);
+//     mutex_release(&m);
+typedef struct Condition_Variable {
+	volatile u32 sequence;
+	volatile u32 waiter_count;
+} Condition_Variable;
+
+void ogb_instance
+condition_variable_init(Condition_Variable *cv);
+
+void ogb_instance
+condition_variable_wait(Condition_Variable *cv, Mutex *m);
+
+// Wakes one waiting thread
+void ogb_instance
+condition_variable_signal(Condition_Variable *cv);
+
+// Wakes all waiting threads
+void ogb_instance
+condition_variable_broadcast(Condition_Variable *cv);
+
 
 ///
 // Binary semaphore
+// An auto reset Event, kept for compatibility.
 typedef struct Binary_Semaphore {
-    volatile bool signaled;
-    Mutex mutex;
+    Event event;
 } Binary_Semaphore;
 
 void ogb_instance
@@ -78,38 +310,277 @@ void ogb_instance
 binary_semaphore_signal(Binary_Semaphore *sem);
 
 
+///
+// Bounded lock-free queues
+// For passing commands & data between threads without a lock, e.g. from the game thread to
+// the audio thread. Elements are copied in and out, like growing_array they are just
+// element_size bytes. Capacity is rounded up to a power of two and never grows: pushing
+// to a full queue returns false (or pushes fewer than asked) instead of waiting.
+//
+//     Spsc_Queue q;
+//     spsc_queue_init(&q, sizeof(Command), 256, get_heap_allocator());
+//
+//     // Producer thread
+//     if (!spsc_queue_push(&q, &command)) { /* full, try again later */ }
+//
+//     // Consumer thread
+//     Command commands[32];
+//     u64 count = spsc_queue_pop_many(&q, commands, 32);
+//
+// Spsc_Queue: exactly one thread pushes and exactly one thread pops. A push or pop is a
+//   copy and one release store, and batches cost the same as a single element.
+// Mpmc_Queue: any number of threads push and pop (Vyukov's bounded MPMC queue). Each
+//   push/pop is one compare_and_swap on the queue position.
+
+typedef struct Spsc_Queue {
+	// Written by the consumer
+	alignat(CACHE_LINE_SIZE) volatile u64 head;
+	u64 cached_tail; // Last tail the consumer saw, so it only touches the producer's line when it looks empty
+	
+	// Written by the producer
+	alignat(CACHE_LINE_SIZE) volatile u64 tail;
+	u64 cached_head; // Last head the producer saw, so it only touches the consumer's line when it looks full
+	
+	alignat(CACHE_LINE_SIZE) u8 *data;
+	u64 capacity;
+	u64 element_size;
+	Allocator allocator;
+} Spsc_Queue;
+
+void ogb_instance
+spsc_queue_init(Spsc_Queue *q, u64 element_size, u64 capacity, Allocator allocator);
+
+void ogb_instance
+spsc_queue_deinit(Spsc_Queue *q);
+
+// Producer only. Returns false if the queue is full.
+bool ogb_instance
+spsc_queue_push(Spsc_Queue *q, void *element);
+
+// Producer only. Pushes as many of the count elements as fit and returns how many that was.
+u64 ogb_instance
+spsc_queue_push_many(Spsc_Queue *q, void *elements, u64 count);
+
+// Consumer only. Returns false if the queue is empty.
+bool ogb_instance
+spsc_queue_pop(Spsc_Queue *q, void *element);
+
+// Consumer only. Pops up to max_count elements and returns how many it got.
+u64 ogb_instance
+spsc_queue_pop_many(Spsc_Queue *q, void *elements, u64 max_count);
+
+// May be out of date by the time it returns if the other thread is busy
+u64 ogb_instance
+spsc_queue_get_count(Spsc_Queue *q);
+
+typedef struct Mpmc_Queue {
+	alignat(CACHE_LINE_SIZE) volatile u64 enqueue_position;
+	alignat(CACHE_LINE_SIZE) volatile u64 dequeue_position;
+	
+	// Each cell is a u64 sequence followed by the element
+	alignat(CACHE_LINE_SIZE) u8 *cells;
+	u64 cell_size;
+	u64 capacity;
+	u64 element_size;
+	Allocator allocator;
+} Mpmc_Queue;
+
+void ogb_instance
+mpmc_queue_init(Mpmc_Queue *q, u64 element_size, u64 capacity, Allocator allocator);
+
+void ogb_instance
+mpmc_queue_deinit(Mpmc_Queue *q);
+
+// Returns false if the queue is full
+bool ogb_instance
+mpmc_queue_push(Mpmc_Queue *q, void *element);
+
+// Returns false if the queue is empty
+bool ogb_instance
+mpmc_queue_pop(Mpmc_Queue *q, void *element);
+
+
+#if LOCK_TRACK_CONTENTION
+// #Global
+ogb_instance Lock_Stats lock_stats[LOCK_STATS_MAX_COUNT]; // [0] is where unnamed locks count
+ogb_instance volatile u64 lock_stats_count;
+ogb_instance Spinlock lock_stats_lock;
+
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Lock_Stats lock_stats[LOCK_STATS_MAX_COUNT];
+volatile u64 lock_stats_count = 1;
+Spinlock lock_stats_lock = {0};
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+#endif // LOCK_TRACK_CONTENTION
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+// Pauses for a while, a little longer every time, and yields now and then in case the
+// thread we are waiting for got preempted.
+inline void spin_wait_backoff(u32 *backoff, u32 *spins) {
+	for (u32 i = 0; i < *backoff; i++) _mm_pause();
+	*spins += *backoff;
+	*backoff = min(*backoff*2, SPINLOCK_MAX_BACKOFF);
+	if (*spins >= SPINLOCK_YIELD_SPIN_COUNT) {
+		os_yield_thread();
+		*spins = 0;
+	}
+}
+
+///
+// Lock contention tracking
+
+#if LOCK_TRACK_CONTENTION
+Lock_Stats *lock_stats_get_by_name(string name) {
+	spinlock_acquire_or_wait(&lock_stats_lock);
+	Lock_Stats *stats = &lock_stats[0];
+	for (u64 i = 1; i < lock_stats_count; i++) {
+		if (strings_match(lock_stats[i].name, name)) {
+			stats = &lock_stats[i];
+			break;
+		}
+	}
+	if (stats == &lock_stats[0] && lock_stats_count < LOCK_STATS_MAX_COUNT) {
+		stats = &lock_stats[lock_stats_count];
+		stats->name = name;
+		atomic64_fetch_add(&lock_stats_count, 1, MEMORY_ORDER_RELEASE);
+	}
+	spinlock_release(&lock_stats_lock);
+	return stats;
+}
+// Called with the lock held. wait_start is 0 if we got the lock on the first try.
+void lock_stats_record_acquire(Lock_Stats **stats_pointer, u64 wait_start, u64 blocking_thread) {
+	Lock_Stats *stats = *stats_pointer;
+	if (!stats) {
+		stats = &lock_stats[0];
+		*stats_pointer = stats;
+	}
+	// Locks with the same name share stats, so these can race with other locks
+	atomic64_fetch_add(&stats->acquire_count, 1, MEMORY_ORDER_RELAXED);
+	if (wait_start) {
+		u64 wait_cycles = rdtsc()-wait_start;
+		atomic64_fetch_add(&stats->contended_count, 1, MEMORY_ORDER_RELAXED);
+		atomic64_fetch_add(&stats->total_wait_cycles, wait_cycles, MEMORY_ORDER_RELAXED);
+		u64 max_wait_cycles = stats->max_wait_cycles;
+		while (wait_cycles > max_wait_cycles && !compare_and_swap_64(&stats->max_wait_cycles, wait_cycles, max_wait_cycles)) {
+			max_wait_cycles = stats->max_wait_cycles;
+		}
+		// The holder might not have written its id yet, or just released
+		if (blocking_thread) stats->last_blocking_thread = blocking_thread;
+	}
+}
+int compare_lock_stats(const void *a, const void *b) {
+	const Lock_Stats *stats_a = (const Lock_Stats*)a;
+	const Lock_Stats *stats_b = (const Lock_Stats*)b;
+	if (stats_a->total_wait_cycles == stats_b->total_wait_cycles) return 0;
+	return stats_a->total_wait_cycles < stats_b->total_wait_cycles ? 1 : -1;
+}
+bool lock_dump_contention_stats(string path) {
+	u64 count = atomic64_load(&lock_stats_count, MEMORY_ORDER_ACQUIRE);
+	Lock_Stats *stats = (Lock_Stats*)alloc_uninitialized(get_heap_allocator(), sizeof(Lock_Stats)*count*2);
+	Lock_Stats *help_buffer = stats + count;
+	memcpy(stats, lock_stats, sizeof(Lock_Stats)*count);
+	
+	merge_sort(stats, help_buffer, count, sizeof(Lock_Stats), compare_lock_stats);
+	
+	String_Builder builder;
+	string_builder_init(&builder, get_heap_allocator());
+	string_builder_print(&builder, "acquires, contended, contended %%, total wait cycles, average wait cycles, max wait cycles, last blocking thread, name\n");
+	for (u64 i = 0; i < count; i++) {
+		Lock_Stats *s = &stats[i];
+		if (s->acquire_count == 0) continue;
+		float64 contended_percent = (float64)s->contended_count*100.0/(float64)s->acquire_count;
+		u64 average_wait_cycles = s->contended_count ? s->total_wait_cycles/s->contended_count : 0;
+		string name = s->name.count ? s->name : STR("(unnamed)");
+		string_builder_print(&builder, "%llu, %llu, %.2f, %llu, %llu, %llu, %llu, %s\n", s->acquire_count, s->contended_count, contended_percent, s->total_wait_cycles, average_wait_cycles, s->max_wait_cycles, s->last_blocking_thread, name);
+	}
+	
+	bool ok = os_write_entire_file_s(path, string_builder_get_string(builder));
+	dealloc(get_heap_allocator(), builder.buffer);
+	dealloc(get_heap_allocator(), stats);
+	return ok;
+}
+#endif // LOCK_TRACK_CONTENTION
+
+void spinlock_set_name(Spinlock *l, string name) {
+#if LOCK_TRACK_CONTENTION
+	assert(l != &lock_stats_lock, "lock_stats_lock can't be named, it's what names are looked up with");
+	l->stats = lock_stats_get_by_name(name);
+#endif
+}
+void mutex_set_name(Mutex *m, string name) {
+#if LOCK_TRACK_CONTENTION
+	m->stats = lock_stats_get_by_name(name);
+#endif
+}
+
+
+///
+// Spinlock "primitive"
 
 void spinlock_init(Spinlock *l) {
 	memset(l, 0, sizeof(*l));
 }
 void spinlock_acquire_or_wait(Spinlock* l) {
+#if LOCK_TRACK_CONTENTION
+	u64 wait_start = 0;
+	u64 blocking_thread = 0;
+#endif
 	while (true) {
-        bool expected = false;
-        if (compare_and_swap_bool(&l->locked, true, expected)) {
+		// Test before test-and-set so waiting cores only read the cache line instead
+		// of fighting over it with locked instructions
+        if (!l->locked && compare_and_swap_bool(&l->locked, true, false)) {
+#if LOCK_TRACK_CONTENTION
+			lock_stats_record_acquire(&l->stats, wait_start, blocking_thread);
+			l->holder_thread = context.thread_id;
+#endif
             return;
         }
+#if LOCK_TRACK_CONTENTION
+		if (!wait_start) {
+			wait_start = rdtsc();
+			blocking_thread = l->holder_thread;
+		}
+#endif
+        u32 backoff = 1;
+        u32 spins = 0;
         while (l->locked) {
-            // spinny boi
+            spin_wait_backoff(&backoff, &spins);
         }
     }
 }
 // Returns true on aquired, false if timeout seconds reached
 bool spinlock_acquire_or_wait_timeout(Spinlock* l, f64 timeout_seconds) {
     f64 start = os_get_current_time_in_seconds();
+#if LOCK_TRACK_CONTENTION
+	u64 wait_start = 0;
+	u64 blocking_thread = 0;
+#endif
 	while (true) {
-        bool expected = false;
-        if (compare_and_swap_bool(&l->locked, true, expected)) {
+        if (!l->locked && compare_and_swap_bool(&l->locked, true, false)) {
+#if LOCK_TRACK_CONTENTION
+			lock_stats_record_acquire(&l->stats, wait_start, blocking_thread);
+			l->holder_thread = context.thread_id;
+#endif
             return true;
         }
+#if LOCK_TRACK_CONTENTION
+		if (!wait_start) {
+			wait_start = rdtsc();
+			blocking_thread = l->holder_thread;
+		}
+#endif
         while (l->locked) {
-            // spinny boi
+            for (u64 i = 0; i < 16; i++) _mm_pause();
             if ((os_get_current_time_in_seconds()-start) >= timeout_seconds) return false;
         }
     }
     return true;
 }
 void spinlock_release(Spinlock* l) {
+#if LOCK_TRACK_CONTENTION
+	l->holder_thread = 0;
+#endif
 	bool expected = true;
     bool success = compare_and_swap_bool(&l->locked, false, expected);
     assert(success, "This thread should have acquired the spinlock but compare_and_swap failed");
@@ -117,66 +588,405 @@ void spinlock_release(Spinlock* l) {
 
 
 ///
-// High-level mutex primitive (short spinlock then OS mutex lock)
+// High-level mutex primitive (futex style)
 
 void mutex_init(Mutex *m) {
-	spinlock_init(&m->spinlock);
-	m->spin_time_microseconds = MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS;
-	m->os_handle = os_make_mutex();
-	m->spinlock_acquired = false;
+	m->state = MUTEX_UNLOCKED;
+	m->spin_count = 0;
 	m->acquiring_thread = 0;
+#if LOCK_TRACK_CONTENTION
+	m->stats = 0;
+#endif
 }
 void mutex_destroy(Mutex *m) {
-	os_destroy_mutex(m->os_handle);
+	assert(m->state == MUTEX_UNLOCKED, "Destroying a mutex which is still acquired");
+}
+void mutex_acquire_contended(Mutex *m) {
+	
+	// Spin while it looks like the holder will release soon. We spin at least a little
+	// even if it hasn't worked lately, so spin_count can grow again.
+	u32 max_spins = min(m->spin_count*2 + 64, MUTEX_MAX_SPIN_COUNT);
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (spins < max_spins && m->state != MUTEX_CONTENDED) {
+		for (u32 i = 0; i < backoff; i++) _mm_pause();
+		spins += backoff;
+		if (m->state == MUTEX_UNLOCKED && compare_and_swap_32(&m->state, MUTEX_LOCKED, MUTEX_UNLOCKED)) {
+			m->spin_count += ((s32)spins - (s32)m->spin_count) / 8;
+			return;
+		}
+		backoff = min(backoff*2, MUTEX_MAX_BACKOFF);
+	}
+	// Spinning didn't pay off, so spin less next time
+	m->spin_count -= m->spin_count / 8;
+	
+	// Park. Setting MUTEX_CONTENDED tells the holder it needs to wake someone on release.
+	// If the exchange returns MUTEX_UNLOCKED we got the lock (marked contended, which at
+	// worst costs one unnecessary wake).
+	while (atomic32_exchange(&m->state, MUTEX_CONTENDED, MEMORY_ORDER_ACQUIRE) != MUTEX_UNLOCKED) {
+		u32 contended = MUTEX_CONTENDED;
+		os_wait_on_address(&m->state, &contended, sizeof(u32), -1);
+	}
 }
 void mutex_acquire_or_wait(Mutex *m) {
-	if (spinlock_acquire_or_wait_timeout(&m->spinlock, m->spin_time_microseconds / 1000000.0)) {
-        assert(!m->spinlock_acquired, "Internal sync error in Mutex");
-    	m->spinlock_acquired = true;
-    }
-    os_lock_mutex(m->os_handle);
+#if LOCK_TRACK_CONTENTION
+	u64 wait_start = 0;
+	u64 blocking_thread = 0;
+#endif
+	if (!compare_and_swap_32(&m->state, MUTEX_LOCKED, MUTEX_UNLOCKED)) {
+#if LOCK_TRACK_CONTENTION
+		wait_start = rdtsc();
+		blocking_thread = m->acquiring_thread;
+#endif
+		mutex_acquire_contended(m);
+	}
     
     assert(!m->acquiring_thread, "Internal sync error in Mutex: Multiple threads acquired");
     m->acquiring_thread = context.thread_id;
+#if LOCK_TRACK_CONTENTION
+	lock_stats_record_acquire(&m->stats, wait_start, blocking_thread);
+#endif
 }
 void mutex_release(Mutex *m) {
 	assert(m->acquiring_thread != 0, "Tried to release a mutex which is not acquired");
 	assert(m->acquiring_thread == context.thread_id, "Non-owning thread tried to release mutex");
 	m->acquiring_thread = 0;
-	bool was_spinlock_acquired = m->spinlock_acquired;
-	m->spinlock_acquired = false;
-	os_unlock_mutex(m->os_handle);
-	if (was_spinlock_acquired) {
-		spinlock_release(&m->spinlock);
+	
+	u32 previous_state = atomic32_exchange(&m->state, MUTEX_UNLOCKED, MEMORY_ORDER_RELEASE);
+	assert(previous_state != MUTEX_UNLOCKED, "Internal sync error in Mutex: released an unlocked mutex");
+	if (previous_state == MUTEX_CONTENDED) {
+		os_wake_one_waiting_on_address(&m->state);
+	}
+}
+
+
+///
+// Reader-writer spinlock
+
+void rw_spinlock_init(RW_Spinlock *l) {
+	l->state = 0;
+}
+void rw_spinlock_acquire_read_or_wait(RW_Spinlock *l) {
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (true) {
+		u32 state = atomic32_load(&l->state, MEMORY_ORDER_RELAXED);
+		if (!(state & (RW_SPINLOCK_WRITER | RW_SPINLOCK_WRITER_WAITING))) {
+			if (compare_and_swap_32(&l->state, state+1, state)) return;
+			continue;
+		}
+		spin_wait_backoff(&backoff, &spins);
+	}
+}
+void rw_spinlock_release_read(RW_Spinlock *l) {
+	u32 previous = atomic32_fetch_sub(&l->state, 1, MEMORY_ORDER_RELEASE);
+	assert((previous & ~RW_SPINLOCK_WRITER_WAITING) != 0 && !(previous & RW_SPINLOCK_WRITER), "Released a RW_Spinlock which was not acquired for reading");
+}
+void rw_spinlock_acquire_write_or_wait(RW_Spinlock *l) {
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (true) {
+		u32 state = atomic32_load(&l->state, MEMORY_ORDER_RELAXED);
+		if ((state & ~RW_SPINLOCK_WRITER_WAITING) == 0) {
+			// No readers & no writer. This clears the waiting flag, other waiting writers set it again.
+			if (compare_and_swap_32(&l->state, RW_SPINLOCK_WRITER, state)) return;
+			continue;
+		}
+		if (!(state & RW_SPINLOCK_WRITER_WAITING)) {
+			atomic32_fetch_or(&l->state, RW_SPINLOCK_WRITER_WAITING, MEMORY_ORDER_RELAXED);
+		}
+		spin_wait_backoff(&backoff, &spins);
+	}
+}
+void rw_spinlock_release_write(RW_Spinlock *l) {
+	// Keep the waiting flag if another writer set it meanwhile
+	u32 previous = atomic32_fetch_and(&l->state, ~(u32)RW_SPINLOCK_WRITER, MEMORY_ORDER_RELEASE);
+	assert(previous & RW_SPINLOCK_WRITER, "Released a RW_Spinlock which was not acquired for writing");
+}
+
+///
+// Seqlock
+
+void seqlock_init(Seqlock *l) {
+	l->sequence = 0;
+	spinlock_init(&l->writer_lock);
+}
+u32 seqlock_read_begin(Seqlock *l) {
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (true) {
+		u32 sequence = atomic32_load(&l->sequence, MEMORY_ORDER_ACQUIRE);
+		if (!(sequence & 1)) return sequence;
+		spin_wait_backoff(&backoff, &spins);
+	}
+}
+bool seqlock_read_retry(Seqlock *l, u32 sequence) {
+	// Reads of the data must be done before we look at the sequence again
+	memory_fence(MEMORY_ORDER_ACQUIRE);
+	return atomic32_load(&l->sequence, MEMORY_ORDER_RELAXED) != sequence;
+}
+void seqlock_write_begin(Seqlock *l) {
+	spinlock_acquire_or_wait(&l->writer_lock);
+	atomic32_store(&l->sequence, l->sequence+1, MEMORY_ORDER_RELAXED);
+	// The odd sequence must be visible before any of the data writes
+	memory_fence(MEMORY_ORDER_RELEASE);
+}
+void seqlock_write_end(Seqlock *l) {
+	atomic32_store(&l->sequence, l->sequence+1, MEMORY_ORDER_RELEASE);
+	spinlock_release(&l->writer_lock);
+}
+
+///
+// Event
+
+void event_init(Event *e, bool manual_reset, bool initial_state) {
+	e->signaled = initial_state ? 1 : 0;
+	e->waiter_count = 0;
+	e->manual_reset = manual_reset;
+}
+void event_signal(Event *e) {
+	// Locked instruction so the store is visible before we read waiter_count
+	if (!compare_and_swap_32(&e->signaled, 1, 0)) return; // Already signaled
+	if (e->waiter_count == 0) return;
+	
+	if (e->manual_reset) os_wake_all_waiting_on_address(&e->signaled);
+	else                 os_wake_one_waiting_on_address(&e->signaled);
+}
+void event_reset(Event *e) {
+	e->signaled = 0;
+}
+bool event_wait_timeout(Event *e, f64 timeout_seconds) {
+	f64 end_time = timeout_seconds >= 0 ? os_get_current_time_in_seconds() + timeout_seconds : 0;
+	while (true) {
+		if (e->manual_reset) {
+			if (e->signaled) return true;
+		} else {
+			if (compare_and_swap_32(&e->signaled, 0, 1)) return true;
+		}
+		
+		f64 remaining = -1;
+		if (timeout_seconds >= 0) {
+			remaining = end_time - os_get_current_time_in_seconds();
+			if (remaining <= 0) return false;
+		}
+		
+		atomic32_fetch_add(&e->waiter_count, 1, MEMORY_ORDER_SEQ_CST);
+		u32 not_signaled = 0;
+		os_wait_on_address(&e->signaled, &not_signaled, sizeof(u32), remaining);
+		atomic32_fetch_sub(&e->waiter_count, 1, MEMORY_ORDER_RELAXED);
 	}
 }
+void event_wait(Event *e) {
+	event_wait_timeout(e, -1);
+}
 
+///
+// Counting semaphore
 
+void semaphore_init(Semaphore *sem, u32 initial_count) {
+	sem->count = initial_count;
+	sem->waiter_count = 0;
+}
+void semaphore_signal(Semaphore *sem, u32 count) {
+	if (count == 0) return;
+	atomic32_fetch_add(&sem->count, count, MEMORY_ORDER_SEQ_CST);
+	u32 wake_count = min(count, sem->waiter_count);
+	for (u32 i = 0; i < wake_count; i++) {
+		os_wake_one_waiting_on_address(&sem->count);
+	}
+}
+bool semaphore_try_wait(Semaphore *sem) {
+	u32 count = sem->count;
+	while (count > 0) {
+		if (compare_and_swap_32(&sem->count, count-1, count)) return true;
+		count = sem->count;
+	}
+	return false;
+}
+void semaphore_wait(Semaphore *sem) {
+	while (!semaphore_try_wait(sem)) {
+		atomic32_fetch_add(&sem->waiter_count, 1, MEMORY_ORDER_SEQ_CST);
+		u32 zero = 0;
+		os_wait_on_address(&sem->count, &zero, sizeof(u32), -1);
+		atomic32_fetch_sub(&sem->waiter_count, 1, MEMORY_ORDER_RELAXED);
+	}
+}
+
+///
+// Condition variable
+
+void condition_variable_init(Condition_Variable *cv) {
+	cv->sequence = 0;
+	cv->waiter_count = 0;
+}
+void condition_variable_wait(Condition_Variable *cv, Mutex *m) {
+	// If someone signals between us releasing the mutex and going to sleep, sequence
+	// has changed and the wait returns right away instead of missing the signal.
+	u32 sequence = cv->sequence;
+	atomic32_fetch_add(&cv->waiter_count, 1, MEMORY_ORDER_SEQ_CST);
+	mutex_release(m);
+	os_wait_on_address(&cv->sequence, &sequence, sizeof(u32), -1);
+	atomic32_fetch_sub(&cv->waiter_count, 1, MEMORY_ORDER_RELAXED);
+	mutex_acquire_or_wait(m);
+}
+void condition_variable_signal(Condition_Variable *cv) {
+	atomic32_fetch_add(&cv->sequence, 1, MEMORY_ORDER_SEQ_CST);
+	if (cv->waiter_count) os_wake_one_waiting_on_address(&cv->sequence);
+}
+void condition_variable_broadcast(Condition_Variable *cv) {
+	atomic32_fetch_add(&cv->sequence, 1, MEMORY_ORDER_SEQ_CST);
+	if (cv->waiter_count) os_wake_all_waiting_on_address(&cv->sequence);
+}
+
+///
+// Binary semaphore
 
 void binary_semaphore_init(Binary_Semaphore *sem, bool initial_state) {
-    sem->signaled = initial_state;
-    mutex_init(&sem->mutex);
+    event_init(&sem->event, false, initial_state);
 }
 
 void binary_semaphore_destroy(Binary_Semaphore *sem) {
-    mutex_destroy(&sem->mutex);
 }
 
 void binary_semaphore_wait(Binary_Semaphore *sem) {
-    mutex_acquire_or_wait(&sem->mutex);
-    while (!sem->signaled) {
-        mutex_release(&sem->mutex);
-        os_yield_thread();
-        mutex_acquire_or_wait(&sem->mutex);
-    }
-    sem->signaled = false;
-    mutex_release(&sem->mutex);
+    event_wait(&sem->event);
 }
 
 void binary_semaphore_signal(Binary_Semaphore *sem) {
-    mutex_acquire_or_wait(&sem->mutex);
-    sem->signaled = true;
-    mutex_release(&sem->mutex);
+    event_signal(&sem->event);
+}
+
+///
+// Bounded lock-free queues
+
+// Copies count elements between a ring buffer starting at index and a flat array,
+// in two parts if it wraps around the end.
+inline void ring_buffer_copy(u8 *ring, u64 capacity, u64 element_size, u64 index, u8 *flat, u64 count, bool to_ring) {
+	u64 first = index & (capacity-1);
+	u64 first_count = min(count, capacity-first);
+	u8 *ring_first = ring + first*element_size;
+	if (to_ring) {
+		memcpy(ring_first, flat, first_count*element_size);
+		memcpy(ring, flat + first_count*element_size, (count-first_count)*element_size);
+	} else {
+		memcpy(flat, ring_first, first_count*element_size);
+		memcpy(flat + first_count*element_size, ring, (count-first_count)*element_size);
+	}
+}
+
+void spsc_queue_init(Spsc_Queue *q, u64 element_size, u64 capacity, Allocator allocator) {
+	assert(element_size > 0, "Spsc_Queue element_size must not be 0");
+	assert(capacity > 0, "Spsc_Queue capacity must not be 0");
+	memset(q, 0, sizeof(*q));
+	q->capacity = get_next_power_of_two(capacity);
+	q->element_size = element_size;
+	q->allocator = allocator;
+	q->data = (u8*)alloc_aligned(allocator, q->capacity*element_size, CACHE_LINE_SIZE);
+}
+void spsc_queue_deinit(Spsc_Queue *q) {
+	dealloc(q->allocator, q->data);
+	q->data = 0;
+}
+u64 spsc_queue_push_many(Spsc_Queue *q, void *elements, u64 count) {
+	u64 tail = q->tail;
+	u64 free_count = q->capacity - (tail - q->cached_head);
+	if (free_count < count) {
+		q->cached_head = atomic64_load(&q->head, MEMORY_ORDER_ACQUIRE);
+		free_count = q->capacity - (tail - q->cached_head);
+	}
+	count = min(count, free_count);
+	if (count == 0) return 0;
+	
+	ring_buffer_copy(q->data, q->capacity, q->element_size, tail, (u8*)elements, count, true);
+	atomic64_store(&q->tail, tail+count, MEMORY_ORDER_RELEASE);
+	return count;
+}
+bool spsc_queue_push(Spsc_Queue *q, void *element) {
+	return spsc_queue_push_many(q, element, 1) == 1;
+}
+u64 spsc_queue_pop_many(Spsc_Queue *q, void *elements, u64 max_count) {
+	u64 head = q->head;
+	u64 available = q->cached_tail - head;
+	if (available < max_count) {
+		q->cached_tail = atomic64_load(&q->tail, MEMORY_ORDER_ACQUIRE);
+		available = q->cached_tail - head;
+	}
+	u64 count = min(max_count, available);
+	if (count == 0) return 0;
+	
+	ring_buffer_copy(q->data, q->capacity, q->element_size, head, (u8*)elements, count, false);
+	atomic64_store(&q->head, head+count, MEMORY_ORDER_RELEASE);
+	return count;
+}
+bool spsc_queue_pop(Spsc_Queue *q, void *element) {
+	return spsc_queue_pop_many(q, element, 1) == 1;
+}
+u64 spsc_queue_get_count(Spsc_Queue *q) {
+	u64 head = atomic64_load(&q->head, MEMORY_ORDER_ACQUIRE);
+	u64 tail = atomic64_load(&q->tail, MEMORY_ORDER_ACQUIRE);
+	// The two loads aren't one snapshot, so head can look like it's past tail
+	return tail > head ? tail - head : 0;
+}
+
+void mpmc_queue_init(Mpmc_Queue *q, u64 element_size, u64 capacity, Allocator allocator) {
+	assert(element_size > 0, "Mpmc_Queue element_size must not be 0");
+	assert(capacity > 0, "Mpmc_Queue capacity must not be 0");
+	memset(q, 0, sizeof(*q));
+	q->capacity = get_next_power_of_two(max(capacity, 2));
+	q->element_size = element_size;
+	q->cell_size = align_next(sizeof(u64) + element_size, sizeof(u64));
+	q->allocator = allocator;
+	q->cells = (u8*)alloc_aligned(allocator, q->capacity*q->cell_size, CACHE_LINE_SIZE);
+	
+	// A cell is free for the push at position p when its sequence is p, and holds the
+	// element for the pop at position p when its sequence is p+1.
+	for (u64 i = 0; i < q->capacity; i++) {
+		*(u64*)(q->cells + i*q->cell_size) = i;
+	}
+	memory_fence(MEMORY_ORDER_RELEASE);
+}
+void mpmc_queue_deinit(Mpmc_Queue *q) {
+	dealloc(q->allocator, q->cells);
+	q->cells = 0;
+}
+bool mpmc_queue_push(Mpmc_Queue *q, void *element) {
+	u64 position = atomic64_load(&q->enqueue_position, MEMORY_ORDER_RELAXED);
+	u8 *cell;
+	while (true) {
+		cell = q->cells + (position & (q->capacity-1))*q->cell_size;
+		u64 sequence = atomic64_load((volatile u64*)cell, MEMORY_ORDER_ACQUIRE);
+		s64 diff = (s64)(sequence - position);
+		if (diff == 0) {
+			if (compare_and_swap_64(&q->enqueue_position, position+1, position)) break;
+		} else if (diff < 0) {
+			// The pop from one lap ago hasn't happened yet
+			return false;
+		}
+		position = atomic64_load(&q->enqueue_position, MEMORY_ORDER_RELAXED);
+	}
+	memcpy(cell + sizeof(u64), element, q->element_size);
+	atomic64_store((volatile u64*)cell, position+1, MEMORY_ORDER_RELEASE);
+	return true;
+}
+bool mpmc_queue_pop(Mpmc_Queue *q, void *element) {
+	u64 position = atomic64_load(&q->dequeue_position, MEMORY_ORDER_RELAXED);
+	u8 *cell;
+	while (true) {
+		cell = q->cells + (position & (q->capacity-1))*q->cell_size;
+		u64 sequence = atomic64_load((volatile u64*)cell, MEMORY_ORDER_ACQUIRE);
+		s64 diff = (s64)(sequence - (position+1));
+		if (diff == 0) {
+			if (compare_and_swap_64(&q->dequeue_position, position+1, position)) break;
+		} else if (diff < 0) {
+			// Nothing pushed here yet
+			return false;
+		}
+		position = atomic64_load(&q->dequeue_position, MEMORY_ORDER_RELAXED);
+	}
+	memcpy(element, cell + sizeof(u64), q->element_size);
+	// Free for the push one lap ahead
+	atomic64_store((volatile u64*)cell, position+q->capacity, MEMORY_ORDER_RELEASE);
+	return true;
 }
 
-#endif
\ No newline at end of file
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
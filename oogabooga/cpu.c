@@ -17,12 +17,25 @@ typedef struct Cpu_Capabilities {
 	bool avx;
 	bool avx2;
 	bool avx512;
+	// rdtsc ticks at a constant rate regardless of clock speed & power state, so cycles
+	// can be converted to time (see calibrate_rdtsc_frequency())
+	bool invariant_tsc;
 	
 } Cpu_Capabilities;
 
 // I think this is the standard? (sse1)
 #define COMPILER_CAN_DO_SSE 1
 
+// Values match the gcc/clang __ATOMIC_* constants.
+// The operations are named atomic32_*/atomic64_* because C11 reserves atomic_* for <stdatomic.h>.
+typedef enum Memory_Order {
+	MEMORY_ORDER_RELAXED = 0,
+	MEMORY_ORDER_ACQUIRE = 2,
+	MEMORY_ORDER_RELEASE = 3,
+	MEMORY_ORDER_ACQ_REL = 4,
+	MEMORY_ORDER_SEQ_CST = 5,
+} Memory_Order;
+
 ///
 // Compiler specific stuff
 #if COMPILER_MVSC
@@ -105,6 +118,115 @@ typedef struct Cpu_Capabilities {
 	    return compare_and_swap_8((uint8_t*)a, (uint8_t)b, (uint8_t)old);
 	}
 	
+	#pragma intrinsic(_InterlockedExchange)
+	#pragma intrinsic(_InterlockedExchange64)
+	#pragma intrinsic(_InterlockedExchangeAdd)
+	#pragma intrinsic(_InterlockedExchangeAdd64)
+	#pragma intrinsic(_InterlockedAnd)
+	#pragma intrinsic(_InterlockedAnd64)
+	#pragma intrinsic(_InterlockedOr)
+	#pragma intrinsic(_InterlockedOr64)
+	
+	// x64 loads are already acquire and stores release, so only the compiler needs to be
+	// kept from reordering. Interlocked instructions are always full barriers, so the
+	// order doesn't matter for them. Only a seq_cst store needs a locked instruction.
+	inline void
+	memory_fence(Memory_Order order) {
+		if (order == MEMORY_ORDER_SEQ_CST) _mm_mfence();
+		else _ReadWriteBarrier();
+	}
+	
+	inline u32
+	atomic32_load(volatile u32 *a, Memory_Order order) {
+		u32 value = *a;
+		_ReadWriteBarrier();
+		return value;
+	}
+	inline u64
+	atomic64_load(volatile u64 *a, Memory_Order order) {
+		u64 value = *a;
+		_ReadWriteBarrier();
+		return value;
+	}
+	inline void
+	atomic32_store(volatile u32 *a, u32 value, Memory_Order order) {
+		if (order == MEMORY_ORDER_SEQ_CST) {
+			_InterlockedExchange((volatile long*)a, (long)value);
+		} else {
+			_ReadWriteBarrier();
+			*a = value;
+		}
+	}
+	inline void
+	atomic64_store(volatile u64 *a, u64 value, Memory_Order order) {
+		if (order == MEMORY_ORDER_SEQ_CST) {
+			_InterlockedExchange64((volatile long long*)a, (long long)value);
+		} else {
+			_ReadWriteBarrier();
+			*a = value;
+		}
+	}
+	
+	// These return the previous value
+	inline u32
+	atomic32_exchange(volatile u32 *a, u32 value, Memory_Order order) {
+		return (u32)_InterlockedExchange((volatile long*)a, (long)value);
+	}
+	inline u64
+	atomic64_exchange(volatile u64 *a, u64 value, Memory_Order order) {
+		return (u64)_InterlockedExchange64((volatile long long*)a, (long long)value);
+	}
+	inline u32
+	atomic32_fetch_add(volatile u32 *a, u32 value, Memory_Order order) {
+		return (u32)_InterlockedExchangeAdd((volatile long*)a, (long)value);
+	}
+	inline u64
+	atomic64_fetch_add(volatile u64 *a, u64 value, Memory_Order order) {
+		return (u64)_InterlockedExchangeAdd64((volatile long long*)a, (long long)value);
+	}
+	inline u32
+	atomic32_fetch_sub(volatile u32 *a, u32 value, Memory_Order order) {
+		return (u32)_InterlockedExchangeAdd((volatile long*)a, -(long)value);
+	}
+	inline u64
+	atomic64_fetch_sub(volatile u64 *a, u64 value, Memory_Order order) {
+		return (u64)_InterlockedExchangeAdd64((volatile long long*)a, -(long long)value);
+	}
+	inline u32
+	atomic32_fetch_and(volatile u32 *a, u32 value, Memory_Order order) {
+		return (u32)_InterlockedAnd((volatile long*)a, (long)value);
+	}
+	inline u64
+	atomic64_fetch_and(volatile u64 *a, u64 value, Memory_Order order) {
+		return (u64)_InterlockedAnd64((volatile long long*)a, (long long)value);
+	}
+	inline u32
+	atomic32_fetch_or(volatile u32 *a, u32 value, Memory_Order order) {
+		return (u32)_InterlockedOr((volatile long*)a, (long)value);
+	}
+	inline u64
+	atomic64_fetch_or(volatile u64 *a, u64 value, Memory_Order order) {
+		return (u64)_InterlockedOr64((volatile long long*)a, (long long)value);
+	}
+	
+	#pragma intrinsic(_BitScanForward64)
+	#pragma intrinsic(_BitScanReverse64)
+	
+	// Index of lowest set bit. x must not be 0.
+	inline u32 
+	bit_scan_forward_64(u64 x) {
+		unsigned long index;
+		_BitScanForward64(&index, x);
+		return (u32)index;
+	}
+	// Index of highest set bit. x must not be 0.
+	inline u32 
+	bit_scan_reverse_64(u64 x) {
+		unsigned long index;
+		_BitScanReverse64(&index, x);
+		return (u32)index;
+	}
+	
 	#define MEMORY_BARRIER _ReadWriteBarrier()
 	
 	#define thread_local __declspec(thread)
@@ -225,6 +347,82 @@ typedef struct Cpu_Capabilities {
 	    return compare_and_swap_8((uint8_t*)a, (uint8_t)b, (uint8_t)old);
 	}
 	
+	// order is folded away as long as it's a constant at the call site
+	inline void
+	memory_fence(Memory_Order order) {
+		__atomic_thread_fence((int)order);
+	}
+	
+	inline u32
+	atomic32_load(volatile u32 *a, Memory_Order order) {
+		return __atomic_load_n(a, (int)order);
+	}
+	inline u64
+	atomic64_load(volatile u64 *a, Memory_Order order) {
+		return __atomic_load_n(a, (int)order);
+	}
+	inline void
+	atomic32_store(volatile u32 *a, u32 value, Memory_Order order) {
+		__atomic_store_n(a, value, (int)order);
+	}
+	inline void
+	atomic64_store(volatile u64 *a, u64 value, Memory_Order order) {
+		__atomic_store_n(a, value, (int)order);
+	}
+	
+	// These return the previous value
+	inline u32
+	atomic32_exchange(volatile u32 *a, u32 value, Memory_Order order) {
+		return __atomic_exchange_n(a, value, (int)order);
+	}
+	inline u64
+	atomic64_exchange(volatile u64 *a, u64 value, Memory_Order order) {
+		return __atomic_exchange_n(a, value, (int)order);
+	}
+	inline u32
+	atomic32_fetch_add(volatile u32 *a, u32 value, Memory_Order order) {
+		return __atomic_fetch_add(a, value, (int)order);
+	}
+	inline u64
+	atomic64_fetch_add(volatile u64 *a, u64 value, Memory_Order order) {
+		return __atomic_fetch_add(a, value, (int)order);
+	}
+	inline u32
+	atomic32_fetch_sub(volatile u32 *a, u32 value, Memory_Order order) {
+		return __atomic_fetch_sub(a, value, (int)order);
+	}
+	inline u64
+	atomic64_fetch_sub(volatile u64 *a, u64 value, Memory_Order order) {
+		return __atomic_fetch_sub(a, value, (int)order);
+	}
+	inline u32
+	atomic32_fetch_and(volatile u32 *a, u32 value, Memory_Order order) {
+		return __atomic_fetch_and(a, value, (int)order);
+	}
+	inline u64
+	atomic64_fetch_and(volatile u64 *a, u64 value, Memory_Order order) {
+		return __atomic_fetch_and(a, value, (int)order);
+	}
+	inline u32
+	atomic32_fetch_or(volatile u32 *a, u32 value, Memory_Order order) {
+		return __atomic_fetch_or(a, value, (int)order);
+	}
+	inline u64
+	atomic64_fetch_or(volatile u64 *a, u64 value, Memory_Order order) {
+		return __atomic_fetch_or(a, value, (int)order);
+	}
+	
+	// Index of lowest set bit. x must not be 0.
+	inline u32 
+	bit_scan_forward_64(u64 x) {
+		return (u32)__builtin_ctzll(x);
+	}
+	// Index of highest set bit. x must not be 0.
+	inline u32 
+	bit_scan_reverse_64(u64 x) {
+		return (u32)(63 - __builtin_clzll(x));
+	}
+	
 	#define MEMORY_BARRIER {__asm__ __volatile__("" ::: "memory");__sync_synchronize();}
 	
 	#define thread_local __thread
@@ -251,6 +449,19 @@ typedef struct Cpu_Capabilities {
     
     #define DEPRECATED(proc, msg) 
     
+    inline u32 
+    bit_scan_forward_64(u64 x) {
+    	u32 i = 0;
+    	while (!(x & 1)) { x >>= 1; i += 1; }
+    	return i;
+    }
+    inline u32 
+    bit_scan_reverse_64(u64 x) {
+    	u32 i = 0;
+    	while (x >>= 1) i += 1;
+    	return i;
+    }
+    
     #define MEMORY_BARRIER
     
     #warning "Compiler is not explicitly supported, some things will probably not work as expected"
@@ -278,6 +489,12 @@ query_cpu_capabilities() {
     result.avx2 = (ext_info.ebx & (1 << 5)) != 0;
     
     result.avx512 = (ext_info.ebx & (1 << 16)) != 0;
+    
+    Cpu_Info_X86 max_ext_info = cpuid(0x80000000);
+    if (max_ext_info.eax >= 0x80000007) {
+    	Cpu_Info_X86 power_info = cpuid(0x80000007);
+    	result.invariant_tsc = (power_info.edx & (1 << 8)) != 0;
+    }
 
     return result;
 }
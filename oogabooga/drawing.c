@@ -18,6 +18,7 @@
 	void draw_text(Gfx_Font *font, string text, u32 raster_height, Vector2 position, Vector2 scale, Vector4 color);
 	Gfx_Text_Metrics draw_text_and_measure(Gfx_Font *font, string text, u32 raster_height, Vector2 position, Vector2 scale, Vector4 color);
 	void draw_line(Vector2 p0, Vector2 p1, float line_width, Vector4 color);
+	void draw_frame_stats_overlay(Gfx_Font *font, u32 raster_height, Vector2 position);
 */
 
 // We use radix sort so the exact bit count is of importance
@@ -146,14 +147,7 @@ Draw_Quad *draw_quad_projected(Draw_Quad quad, Matrix4 world_to_clip) {
 		
 		u64 new_count = max(get_next_power_of_two(draw_frame.num_quads+1), 128);
 		
-		Draw_Quad *new_buffer = alloc(get_heap_allocator(), new_count*sizeof(Draw_Quad));
-		
-		if (quad_buffer) {
-			memcpy(new_buffer, quad_buffer, draw_frame.num_quads*sizeof(Draw_Quad));
-			dealloc(get_heap_allocator(), quad_buffer);
-		}
-		
-		quad_buffer = new_buffer;
+		quad_buffer = reallocate(get_heap_allocator(), quad_buffer, allocated_quads*sizeof(Draw_Quad), new_count*sizeof(Draw_Quad));
 		allocated_quads = new_count;
 	}
 	
@@ -324,3 +318,43 @@ void draw_line(Vector2 p0, Vector2 p1, float line_width, Vector4 color) {
 #define COLOR_WHITE ((Vector4){1.0, 1.0, 1.0, 1.0})
 #define COLOR_BLACK ((Vector4){0.0, 0.0, 0.0, 1.0})
 
+// Frame_Stats summaries (frame_stats.c) in milliseconds with a graph of the latest frame times,
+// top left corner at position. Call it last in the frame with a pixel projection, like text.
+void draw_frame_stats_overlay(Gfx_Font *font, u32 raster_height, Vector2 position) {
+	Gfx_Font_Metrics metrics = get_font_metrics(font, raster_height);
+	float line_height = metrics.line_spacing;
+	float padding = line_height*0.5;
+	float graph_height = line_height*3;
+	
+	string lines[FRAME_STATS_KIND_COUNT];
+	float width = 0;
+	for (u64 i = 0; i < FRAME_STATS_KIND_COUNT; i++) {
+		Frame_Stats_Summary s = frame_stats_get_summary(i);
+		lines[i] = tprint("%s: last %.2f avg %.2f p50 %.2f p95 %.2f p99 %.2f max %.2f", frame_stats_get_kind_name(i), s.last*1000.0, s.average*1000.0, s.p50*1000.0, s.p95*1000.0, s.p99*1000.0, s.max*1000.0);
+		Gfx_Text_Metrics m = measure_text(font, lines[i], raster_height, v2(1, 1));
+		width = max(width, m.functional_size.x);
+	}
+	
+	float height = padding*3 + line_height*FRAME_STATS_KIND_COUNT + graph_height;
+	draw_rect(v2(position.x, position.y-height), v2(width+padding*2, height), v4(0, 0, 0, 0.7));
+	
+	float y = position.y - padding - metrics.latin_ascent;
+	for (u64 i = 0; i < FRAME_STATS_KIND_COUNT; i++) {
+		draw_text(font, lines[i], raster_height, v2(position.x+padding, y), v2(1, 1), COLOR_WHITE);
+		y -= line_height;
+	}
+	
+	// Frame time graph, scaled to the slowest frame. Frames slower than 60fps are red.
+	f32 history[FRAME_STATS_HISTORY_COUNT];
+	u64 count = frame_stats_get_history(FRAME_STATS_FRAME_TIME, history, FRAME_STATS_HISTORY_COUNT);
+	f32 slowest = 1.0f/60.0f;
+	for (u64 i = 0; i < count; i++) slowest = max(slowest, history[i]);
+	
+	float bar_width = width/(float)FRAME_STATS_HISTORY_COUNT;
+	float graph_bottom = position.y - height + padding;
+	for (u64 i = 0; i < count; i++) {
+		float bar_height = graph_height*(history[i]/slowest);
+		Vector4 color = history[i] > 1.0f/60.0f ? COLOR_RED : COLOR_GREEN;
+		draw_rect(v2(position.x+padding+bar_width*i, graph_bottom), v2(bar_width, bar_height), color);
+	}
+}
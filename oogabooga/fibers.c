@@ -0,0 +1,390 @@
+/*
+	Fibers
+
+	Stackful coroutines for work which takes longer than a frame, like loading a level or
+	decoding a lot of images. A fiber runs like a normal function on its own small stack
+	and calls fiber_yield() now and then. fibers_run() is called once per frame and resumes
+	fibers until its time budget is used up, so the work is spread over as many frames as
+	it needs without a hand written state machine.
+
+	Usage:
+
+		void load_level_proc(void *data) {
+			Level *level = (Level*)data;
+			for (u64 i = 0; i < level->image_count; i++) {
+				level->images[i] = load_image_from_disk(level->image_paths[i], get_heap_allocator());
+				fiber_yield();
+			}
+
+			// Hand the heavy part to the job system and wait without blocking the frame
+			Job_Counter baking = {0};
+			job_submit(level->bake_jobs, level->bake_job_count, &baking);
+			fiber_await(&baking);
+
+			level->loaded = true;
+		}
+
+		Job_Counter loading = {0};
+		fiber_start(load_level_proc, &level, &loading);
+
+		while (!window.should_close) {
+			...
+			fibers_run(0.002); // At most ~2ms of fiber work per frame
+			if (job_counter_is_done(&loading)) ...
+			...
+		}
+
+	Fibers only run inside fibers_run(), on the thread which calls it, one at a time, so
+	they don't need to lock anything from each other or from that thread.
+	A fiber is only switched out when it calls fiber_yield() or fiber_await(), so the budget
+	is exceeded by however long the last fiber runs before it yields.
+	Blocking calls (file IO, mutexes, job_wait) inside a fiber block the whole frame.
+
+	Stacks are FIBER_STACK_SIZE bytes of program memory. Finished fibers keep their stack
+	in a free list for the next fiber_start(), and the memory is never given back.
+	In debug, the lowest page of every stack stays locked so an overflow crashes right away
+	instead of corrupting memory.
+*/
+
+#ifndef FIBER_STACK_SIZE
+	#define FIBER_STACK_SIZE KB(64)
+#endif
+
+typedef void(*Fiber_Proc)(void *data);
+
+typedef enum Fiber_State {
+	FIBER_READY,
+	FIBER_RUNNING,
+	FIBER_DONE,
+} Fiber_State;
+
+// Lives at the top of its own stack
+typedef struct Fiber {
+	void *stack_pointer; // Saved when switched out
+	void *stack; // Lowest address of the program memory pages
+	Fiber_State state;
+	Fiber_Proc proc;
+	void *data;
+	Job_Counter *counter;
+	Job_Counter *awaited_counter;
+	struct Fiber *next;
+} Fiber;
+
+// counter may be 0. It is incremented right away and decremented when proc returns, so
+// job_counter_is_done() and fiber_await() work on fibers too.
+// Must be called from the thread which calls fibers_run().
+void ogb_instance
+fiber_start(Fiber_Proc proc, void *data, Job_Counter *counter);
+
+// Switches back to fibers_run(). The fiber continues where it left off, in this
+// fibers_run() if there is budget left or in a later one.
+void ogb_instance
+fiber_yield();
+
+// Yields until counter reaches 0. Waiting fibers are skipped without being resumed.
+void ogb_instance
+fiber_await(Job_Counter *counter);
+
+// 0 if not called from a fiber
+Fiber *ogb_instance
+fiber_get_current();
+
+// Resumes fibers round robin until budget_seconds has passed or none of them can run.
+// At least one fiber is resumed if one can run, even if the budget is 0.
+// Returns how many fibers are not done yet.
+u64 ogb_instance
+fibers_run(f64 budget_seconds);
+
+
+// #Global
+ogb_instance Fiber *fiber_queue_first; // Fibers which aren't done, in the order they run
+ogb_instance Fiber *fiber_queue_last;
+ogb_instance u64 fiber_count;
+ogb_instance Fiber *fiber_free_list;
+ogb_instance u64 fiber_thread_id; // The thread running fibers
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Fiber *fiber_queue_first = 0;
+Fiber *fiber_queue_last = 0;
+u64 fiber_count = 0;
+Fiber *fiber_free_list = 0;
+u64 fiber_thread_id = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+thread_local Fiber *fiber_current = 0;
+thread_local void *fiber_scheduler_stack_pointer = 0;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+///
+// Context switch
+
+// Saves the callee saved registers on the current stack, stores the stack pointer in
+// *save_stack_pointer and continues on load_stack_pointer where it was saved last time.
+void fiber_switch_stack(void **save_stack_pointer, void *load_stack_pointer);
+// Where a new fiber starts, with the Fiber in rbx and fiber_main in rsi
+void fiber_entry_trampoline();
+
+#if (COMPILER_GCC || COMPILER_CLANG) && TARGET_OS == WINDOWS
+#define FIBER_SUPPORTED 1
+
+// Windows x64: rbx, rbp, rdi, rsi, r12-r15, xmm6-xmm15, the MXCSR & x87 control words are
+// callee saved. The stack bounds in the TEB are switched too, since stack probes for big
+// stack frames and the unwinder check against them.
+// Switch frame, from the saved stack pointer up:
+//     [0, 160)   xmm6-xmm15
+//     160        MXCSR
+//     164        x87 control word
+//     168        TEB StackBase
+//     176        TEB StackLimit
+//     184        TEB DeallocationStack
+//     192        (padding)
+//     200        r15, r14, r13, r12, rsi, rdi, rbx, rbp
+//     264        return address
+#define FIBER_SWITCH_FRAME_SIZE 272
+__asm__(
+	".text\n"
+	".globl fiber_switch_stack\n"
+	".p2align 4\n"
+	"fiber_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %rdi\n"
+	"	pushq %rsi\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $200, %rsp\n"
+	"	movaps %xmm6,   0(%rsp)\n"
+	"	movaps %xmm7,  16(%rsp)\n"
+	"	movaps %xmm8,  32(%rsp)\n"
+	"	movaps %xmm9,  48(%rsp)\n"
+	"	movaps %xmm10, 64(%rsp)\n"
+	"	movaps %xmm11, 80(%rsp)\n"
+	"	movaps %xmm12, 96(%rsp)\n"
+	"	movaps %xmm13, 112(%rsp)\n"
+	"	movaps %xmm14, 128(%rsp)\n"
+	"	movaps %xmm15, 144(%rsp)\n"
+	"	stmxcsr 160(%rsp)\n"
+	"	fnstcw 164(%rsp)\n"
+	"	movq %gs:0x08, %rax\n"
+	"	movq %rax, 168(%rsp)\n"
+	"	movq %gs:0x10, %rax\n"
+	"	movq %rax, 176(%rsp)\n"
+	"	movq %gs:0x1478, %rax\n"
+	"	movq %rax, 184(%rsp)\n"
+
+	"	movq %rsp, (%rcx)\n"
+	"	movq %rdx, %rsp\n"
+
+	"	movq 184(%rsp), %rax\n"
+	"	movq %rax, %gs:0x1478\n"
+	"	movq 176(%rsp), %rax\n"
+	"	movq %rax, %gs:0x10\n"
+	"	movq 168(%rsp), %rax\n"
+	"	movq %rax, %gs:0x08\n"
+	"	fldcw 164(%rsp)\n"
+	"	ldmxcsr 160(%rsp)\n"
+	"	movaps   0(%rsp), %xmm6\n"
+	"	movaps  16(%rsp), %xmm7\n"
+	"	movaps  32(%rsp), %xmm8\n"
+	"	movaps  48(%rsp), %xmm9\n"
+	"	movaps  64(%rsp), %xmm10\n"
+	"	movaps  80(%rsp), %xmm11\n"
+	"	movaps  96(%rsp), %xmm12\n"
+	"	movaps 112(%rsp), %xmm13\n"
+	"	movaps 128(%rsp), %xmm14\n"
+	"	movaps 144(%rsp), %xmm15\n"
+	"	addq $200, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rsi\n"
+	"	popq %rdi\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+
+	// Entered with ret, so rsp is 16 byte aligned. Reserve the shadow space and call
+	// fiber_main(fiber), which never returns.
+	".globl fiber_entry_trampoline\n"
+	".p2align 4\n"
+	"fiber_entry_trampoline:\n"
+	"	movq %rbx, %rcx\n"
+	"	subq $32, %rsp\n"
+	"	callq *%rsi\n"
+	"	ud2\n"
+);
+
+// Builds the switch frame fiber_switch_stack() expects, so switching to it "returns"
+// into fiber_entry_trampoline.
+void *fiber_init_stack(Fiber *fiber, void *stack_top, void(*fiber_main)(Fiber*)) {
+	u8 *top = (u8*)((u64)stack_top & ~15ULL);
+	u8 *frame = top - FIBER_SWITCH_FRAME_SIZE;
+	memset(frame, 0, FIBER_SWITCH_FRAME_SIZE);
+
+	*(u32*)(frame+160) = 0x1F80; // Default MXCSR, all exceptions masked
+	*(u16*)(frame+164) = 0x027F; // Default x64 x87 control word, 53 bit precision
+	*(u64*)(frame+168) = (u64)top;
+	*(u64*)(frame+176) = (u64)fiber->stack;
+	*(u64*)(frame+184) = (u64)fiber->stack;
+	*(u64*)(frame+200+8*4) = (u64)fiber_main; // rsi
+	*(u64*)(frame+200+8*6) = (u64)fiber; // rbx
+	*(u64*)(frame+264) = (u64)fiber_entry_trampoline;
+
+	return frame;
+}
+
+#else
+#define FIBER_SUPPORTED 0
+// x64 MSVC has no inline assembly, and there is no other OS layer to switch stacks for yet
+void fiber_switch_stack(void **save_stack_pointer, void *load_stack_pointer) {
+	panic("Fibers are not supported with this compiler/OS");
+}
+void *fiber_init_stack(Fiber *fiber, void *stack_top, void(*fiber_main)(Fiber*)) {
+	panic("Fibers are not supported with this compiler/OS");
+	return 0;
+}
+#endif
+
+///
+// Scheduling
+
+void fiber_main(Fiber *fiber) {
+	fiber->proc(fiber->data);
+
+	fiber->state = FIBER_DONE;
+	if (fiber->counter) atomic64_fetch_sub(&fiber->counter->pending, 1, MEMORY_ORDER_RELEASE);
+
+	void *unused;
+	fiber_switch_stack(&unused, fiber_scheduler_stack_pointer);
+	panic("Resumed a fiber which is done");
+}
+
+Fiber *fiber_get_current() {
+	return fiber_current;
+}
+
+Fiber *fiber_alloc() {
+	Fiber *fiber = fiber_free_list;
+	if (fiber) {
+		fiber_free_list = fiber->next;
+		return fiber;
+	}
+
+	u64 size = align_next(FIBER_STACK_SIZE, os.page_size);
+	assert(size >= os.page_size*2, "FIBER_STACK_SIZE must be at least two pages");
+
+	// The heap reserves program memory under heap_lock too
+	spinlock_acquire_or_wait(&heap_lock);
+	u8 *stack = (u8*)os_reserve_next_memory_pages(size);
+	spinlock_release(&heap_lock);
+
+	// Program memory pages start out locked in debug. Leaving the lowest one locked makes
+	// it a guard page.
+	os_unlock_program_memory_pages(stack+os.page_size, size-os.page_size);
+
+	fiber = (Fiber*)(stack + size - align_next(sizeof(Fiber), 16));
+	memset(fiber, 0, sizeof(Fiber));
+	fiber->stack = stack;
+	return fiber;
+}
+
+void fiber_queue_push(Fiber *fiber) {
+	fiber->next = 0;
+	if (fiber_queue_last) fiber_queue_last->next = fiber;
+	else                  fiber_queue_first = fiber;
+	fiber_queue_last = fiber;
+}
+Fiber *fiber_queue_pop() {
+	Fiber *fiber = fiber_queue_first;
+	if (fiber) {
+		fiber_queue_first = fiber->next;
+		if (!fiber_queue_first) fiber_queue_last = 0;
+		fiber->next = 0;
+	}
+	return fiber;
+}
+
+void fiber_start(Fiber_Proc proc, void *data, Job_Counter *counter) {
+	assert(FIBER_SUPPORTED, "Fibers are not supported with this compiler/OS");
+	if (!fiber_thread_id) fiber_thread_id = context.thread_id;
+	assert(fiber_thread_id == context.thread_id, "fiber_start() must be called from the thread which runs fibers_run()");
+
+	Fiber *fiber = fiber_alloc();
+	fiber->state = FIBER_READY;
+	fiber->proc = proc;
+	fiber->data = data;
+	fiber->counter = counter;
+	fiber->awaited_counter = 0;
+	// The Fiber sits at the top of its stack, so the stack starts right below it
+	fiber->stack_pointer = fiber_init_stack(fiber, fiber, fiber_main);
+
+	if (counter) atomic64_fetch_add(&counter->pending, 1, MEMORY_ORDER_RELAXED);
+
+	fiber_queue_push(fiber);
+	fiber_count += 1;
+}
+
+void fiber_yield() {
+	Fiber *fiber = fiber_current;
+	assert(fiber, "fiber_yield() called outside of a fiber");
+	fiber_switch_stack(&fiber->stack_pointer, fiber_scheduler_stack_pointer);
+}
+
+void fiber_await(Job_Counter *counter) {
+	Fiber *fiber = fiber_current;
+	assert(fiber, "fiber_await() called outside of a fiber");
+	if (job_counter_is_done(counter)) return;
+	fiber->awaited_counter = counter;
+	fiber_switch_stack(&fiber->stack_pointer, fiber_scheduler_stack_pointer);
+}
+
+u64 fibers_run(f64 budget_seconds) {
+	if (!fiber_count) return 0;
+	assert(!fiber_current, "fibers_run() called from a fiber");
+	assert(fiber_thread_id == context.thread_id, "fibers_run() must be called from the thread which started the fibers");
+
+	f64 start = os_get_current_time_in_seconds();
+
+	// Fibers we passed over because they are waiting. Once all of them are, we stop.
+	u64 waiting_in_a_row = 0;
+	bool resumed_any = false;
+
+	while (fiber_count && waiting_in_a_row < fiber_count) {
+		if (resumed_any && os_get_current_time_in_seconds()-start >= budget_seconds) break;
+
+		Fiber *fiber = fiber_queue_pop();
+
+		if (fiber->awaited_counter) {
+			if (!job_counter_is_done(fiber->awaited_counter)) {
+				fiber_queue_push(fiber);
+				waiting_in_a_row += 1;
+				continue;
+			}
+			fiber->awaited_counter = 0;
+		}
+		waiting_in_a_row = 0;
+
+		fiber->state = FIBER_RUNNING;
+		fiber_current = fiber;
+		fiber_switch_stack(&fiber_scheduler_stack_pointer, fiber->stack_pointer);
+		fiber_current = 0;
+		resumed_any = true;
+
+		if (fiber->state == FIBER_DONE) {
+			fiber->next = fiber_free_list;
+			fiber_free_list = fiber;
+			fiber_count -= 1;
+		} else {
+			fiber->state = FIBER_READY;
+			fiber_queue_push(fiber);
+		}
+	}
+
+	return fiber_count;
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
@@ -0,0 +1,213 @@
+/*
+	Frame stats
+
+	Live timing numbers which are always on, also without ENABLE_PROFILING: frame time,
+	os_update(), gfx_update() and the audio callback (do_program_audio_sample()).
+	Each of these keeps the last FRAME_STATS_HISTORY_COUNT samples in a ring, plus a log
+	scale histogram of the same samples so percentiles don't need a sort. Recording a sample
+	is a couple of adds under an uncontended spinlock, and a summary walks the ring & the
+	histogram once, so it's fine to query every frame.
+
+	Usage:
+
+		Frame_Stats_Summary frame = frame_stats_get_summary(FRAME_STATS_FRAME_TIME);
+		if (frame.p99 > 1.0/60.0) log_warning("Frames are dropping, p99 is %.2fms", frame.p99*1000.0);
+
+		// Or just show all of it (drawing.c)
+		draw_frame_stats_overlay(font, 16, v2(-window.width/2+10, window.height/2-10));
+
+	Frame time is the time between two os_update() calls.
+	You can record your own samples with frame_stats_record() on one of the kinds, for
+	example FRAME_STATS_FRAME_TIME if you don't call os_update() once per frame.
+	Percentiles are the middle of their histogram bucket, which is within ~3% of the real
+	value. Average & max are exact.
+*/
+
+#define FRAME_STATS_HISTORY_COUNT 256 // Samples the summary is over
+// Samples below 16us get a bucket per microsecond, above that each power of two is split
+// into 16 buckets, up to 2^(4+FRAME_STATS_OCTAVE_COUNT) us (~67 seconds)
+#define FRAME_STATS_BUCKETS_PER_OCTAVE 16
+#define FRAME_STATS_OCTAVE_COUNT 22
+#define FRAME_STATS_BUCKET_COUNT (FRAME_STATS_BUCKETS_PER_OCTAVE*(FRAME_STATS_OCTAVE_COUNT+1))
+
+typedef enum Frame_Stats_Kind {
+	FRAME_STATS_FRAME_TIME,
+	FRAME_STATS_OS_UPDATE,
+	FRAME_STATS_GFX_UPDATE,
+	FRAME_STATS_AUDIO_CALLBACK,
+
+	FRAME_STATS_KIND_COUNT
+} Frame_Stats_Kind;
+
+typedef struct Frame_Stats_Series {
+	Spinlock lock;
+	f32 samples[FRAME_STATS_HISTORY_COUNT]; // Seconds, ring
+	u16 buckets[FRAME_STATS_BUCKET_COUNT]; // How many of the samples in the ring are in each bucket
+	u64 sample_count; // Ever recorded. Next slot is sample_count%FRAME_STATS_HISTORY_COUNT
+} Frame_Stats_Series;
+
+// All in seconds
+typedef struct Frame_Stats_Summary {
+	f64 last;
+	f64 average;
+	f64 p50;
+	f64 p95;
+	f64 p99;
+	f64 max;
+	u64 sample_count; // In the window, at most FRAME_STATS_HISTORY_COUNT
+} Frame_Stats_Summary;
+
+// #Global
+ogb_instance Frame_Stats_Series frame_stats[FRAME_STATS_KIND_COUNT];
+ogb_instance u64 frame_stats_last_frame_start;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Frame_Stats_Series frame_stats[FRAME_STATS_KIND_COUNT] = {0};
+u64 frame_stats_last_frame_start = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+void ogb_instance
+frame_stats_record(Frame_Stats_Kind kind, f64 seconds);
+
+Frame_Stats_Summary ogb_instance
+frame_stats_get_summary(Frame_Stats_Kind kind);
+
+// Copies up to max_count of the latest samples, oldest first. Returns how many were copied.
+u64 ogb_instance
+frame_stats_get_history(Frame_Stats_Kind kind, f32 *samples, u64 max_count);
+
+void ogb_instance
+frame_stats_reset();
+
+string ogb_instance
+frame_stats_get_kind_name(Frame_Stats_Kind kind);
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+inline u32 frame_stats_get_bucket(f64 seconds) {
+	u64 us = seconds > 0 ? (u64)(seconds*1000000.0) : 0;
+	if (us < FRAME_STATS_BUCKETS_PER_OCTAVE) return (u32)us;
+
+	u32 octave = bit_scan_reverse_64(us) - 4; // 4 = log2(FRAME_STATS_BUCKETS_PER_OCTAVE)
+	if (octave >= FRAME_STATS_OCTAVE_COUNT) return FRAME_STATS_BUCKET_COUNT-1;
+	u32 sub = (u32)(us >> octave) & (FRAME_STATS_BUCKETS_PER_OCTAVE-1);
+	return FRAME_STATS_BUCKETS_PER_OCTAVE + octave*FRAME_STATS_BUCKETS_PER_OCTAVE + sub;
+}
+// Middle of the bucket, in seconds
+inline f64 frame_stats_get_bucket_value(u32 bucket) {
+	if (bucket < FRAME_STATS_BUCKETS_PER_OCTAVE) return ((f64)bucket + 0.5)/1000000.0;
+
+	u32 octave = (bucket-FRAME_STATS_BUCKETS_PER_OCTAVE)/FRAME_STATS_BUCKETS_PER_OCTAVE;
+	u32 sub = (bucket-FRAME_STATS_BUCKETS_PER_OCTAVE)%FRAME_STATS_BUCKETS_PER_OCTAVE;
+	u64 low = (u64)(FRAME_STATS_BUCKETS_PER_OCTAVE+sub) << octave;
+	u64 width = 1ULL << octave;
+	return ((f64)low + (f64)width*0.5)/1000000.0;
+}
+
+void frame_stats_record(Frame_Stats_Kind kind, f64 seconds) {
+	assert(kind < FRAME_STATS_KIND_COUNT, "Invalid Frame_Stats_Kind %d", kind);
+	Frame_Stats_Series *series = &frame_stats[kind];
+
+	spinlock_acquire_or_wait(&series->lock);
+
+	u64 slot = series->sample_count % FRAME_STATS_HISTORY_COUNT;
+	if (series->sample_count >= FRAME_STATS_HISTORY_COUNT) {
+		series->buckets[frame_stats_get_bucket(series->samples[slot])] -= 1;
+	}
+	series->samples[slot] = (f32)seconds;
+	series->buckets[frame_stats_get_bucket(series->samples[slot])] += 1;
+	series->sample_count += 1;
+
+	spinlock_release(&series->lock);
+}
+
+Frame_Stats_Summary frame_stats_get_summary(Frame_Stats_Kind kind) {
+	assert(kind < FRAME_STATS_KIND_COUNT, "Invalid Frame_Stats_Kind %d", kind);
+	Frame_Stats_Series *series = &frame_stats[kind];
+
+	Frame_Stats_Summary summary = ZERO(Frame_Stats_Summary);
+
+	spinlock_acquire_or_wait(&series->lock);
+
+	u64 count = min(series->sample_count, FRAME_STATS_HISTORY_COUNT);
+	if (count == 0) {
+		spinlock_release(&series->lock);
+		return summary;
+	}
+
+	summary.sample_count = count;
+	summary.last = series->samples[(series->sample_count-1) % FRAME_STATS_HISTORY_COUNT];
+
+	f64 sum = 0;
+	for (u64 i = 0; i < count; i++) {
+		f64 s = series->samples[i];
+		sum += s;
+		if (s > summary.max) summary.max = s;
+	}
+	summary.average = sum/(f64)count;
+
+	// Smallest bucket which has at least this many samples at or below it
+	u64 rank_50 = (count*50+99)/100;
+	u64 rank_95 = (count*95+99)/100;
+	u64 rank_99 = (count*99+99)/100;
+	u64 seen = 0;
+	for (u32 i = 0; i < FRAME_STATS_BUCKET_COUNT && seen < rank_99; i++) {
+		if (!series->buckets[i]) continue;
+		u64 before = seen;
+		seen += series->buckets[i];
+		f64 value = frame_stats_get_bucket_value(i);
+		if (before < rank_50 && seen >= rank_50) summary.p50 = value;
+		if (before < rank_95 && seen >= rank_95) summary.p95 = value;
+		if (before < rank_99 && seen >= rank_99) summary.p99 = value;
+	}
+
+	spinlock_release(&series->lock);
+
+	// The middle of the top bucket can be above the biggest sample
+	summary.p50 = min(summary.p50, summary.max);
+	summary.p95 = min(summary.p95, summary.max);
+	summary.p99 = min(summary.p99, summary.max);
+
+	return summary;
+}
+
+u64 frame_stats_get_history(Frame_Stats_Kind kind, f32 *samples, u64 max_count) {
+	assert(kind < FRAME_STATS_KIND_COUNT, "Invalid Frame_Stats_Kind %d", kind);
+	Frame_Stats_Series *series = &frame_stats[kind];
+
+	spinlock_acquire_or_wait(&series->lock);
+
+	u64 count = min(min(series->sample_count, FRAME_STATS_HISTORY_COUNT), max_count);
+	u64 first = series->sample_count-count;
+	for (u64 i = 0; i < count; i++) {
+		samples[i] = series->samples[(first+i) % FRAME_STATS_HISTORY_COUNT];
+	}
+
+	spinlock_release(&series->lock);
+
+	return count;
+}
+
+void frame_stats_reset() {
+	for (u64 i = 0; i < FRAME_STATS_KIND_COUNT; i++) {
+		Frame_Stats_Series *series = &frame_stats[i];
+		spinlock_acquire_or_wait(&series->lock);
+		memset(series->buckets, 0, sizeof(series->buckets));
+		series->sample_count = 0;
+		spinlock_release(&series->lock);
+	}
+	frame_stats_last_frame_start = 0;
+}
+
+string frame_stats_get_kind_name(Frame_Stats_Kind kind) {
+	switch (kind) {
+		case FRAME_STATS_FRAME_TIME:     return STR("Frame");
+		case FRAME_STATS_OS_UPDATE:      return STR("os_update");
+		case FRAME_STATS_GFX_UPDATE:     return STR("gfx_update");
+		case FRAME_STATS_AUDIO_CALLBACK: return STR("Audio");
+		case FRAME_STATS_KIND_COUNT: break;
+	}
+	return STR("");
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
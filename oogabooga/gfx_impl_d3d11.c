@@ -60,6 +60,8 @@ void *d3d11_staging_quad_buffer = 0;
 ID3D11Buffer *d3d11_cbuffer = 0;
 u64 d3d11_cbuffer_size = 0;
 
+u64 d3d11_frame_draw_call_count = 0;
+
 Draw_Quad *sort_quad_buffer = 0;
 u64 sort_quad_buffer_size = 0;
 
@@ -560,6 +562,8 @@ void gfx_init() {
 }
 
 void d3d11_draw_call(int number_of_rendered_quads, ID3D11ShaderResourceView **textures, u64 num_textures) {
+	d3d11_frame_draw_call_count += 1;
+	
 	ID3D11DeviceContext_OMSetBlendState(d3d11_context, d3d11_blend_state, 0, 0xffffffff);
 	ID3D11DeviceContext_OMSetRenderTargets(d3d11_context, 1, &d3d11_window_render_target_view, 0); 
 	ID3D11DeviceContext_RSSetState(d3d11_context, d3d11_rasterizer);
@@ -628,8 +632,7 @@ void d3d11_process_draw_frame() {
 		assert(SUCCEEDED(hr), "CreateBuffer failed");
 		d3d11_quad_vbo_size = required_size;
 		
-		d3d11_staging_quad_buffer = alloc(get_heap_allocator(), d3d11_quad_vbo_size);
-		assert((u64)d3d11_staging_quad_buffer%16 == 0);
+		d3d11_staging_quad_buffer = alloc_aligned(get_heap_allocator(), d3d11_quad_vbo_size, CACHE_LINE_SIZE);
 		
 		log_verbose("Grew quad vbo to %d bytes.", d3d11_quad_vbo_size);
 	}
@@ -656,7 +659,7 @@ void d3d11_process_draw_frame() {
 					sort_quad_buffer = alloc(get_heap_allocator(), allocated_quads*sizeof(Draw_Quad));
 					sort_quad_buffer_size = allocated_quads*sizeof(Draw_Quad);
 				}
-				radix_sort(quad_buffer, sort_quad_buffer, draw_frame.num_quads, sizeof(Draw_Quad), offsetof(Draw_Quad, z), MAX_Z_BITS);
+				radix_sort_parallel(quad_buffer, sort_quad_buffer, draw_frame.num_quads, sizeof(Draw_Quad), offsetof(Draw_Quad, z), MAX_Z_BITS);
 			}
 		
 			for (u64 i = 0; i < draw_frame.num_quads; i++)  {
@@ -851,6 +854,7 @@ void d3d11_process_draw_frame() {
 void gfx_update() {
 	if (window.should_close) return;
 	
+	u64 start_cycles = rdtsc();
 	
 
 	HRESULT hr;
@@ -865,7 +869,12 @@ void gfx_update() {
 		d3d11_update_swapchain();
 	}
 
+	tm_counter("Quads", draw_frame.num_quads);
+	d3d11_frame_draw_call_count = 0;
+	
 	d3d11_process_draw_frame();
+	
+	tm_counter("Draw calls", d3d11_frame_draw_call_count);
 
 	tm_scope("Present") {
 		IDXGISwapChain1_Present(d3d11_swap_chain, window.enable_vsync, window.enable_vsync ? 0 : DXGI_PRESENT_ALLOW_TEARING);
@@ -876,6 +885,7 @@ void gfx_update() {
 	d3d11_output_debug_messages();
 #endif
 	
+	frame_stats_record(FRAME_STATS_GFX_UPDATE, rdtsc_to_seconds(rdtsc()-start_cycles));
 }
 
 
@@ -885,7 +895,9 @@ void gfx_init_image(Gfx_Image *image, void *initial_data) {
     if (!initial_data){
     	// #Incomplete 8 bit width assumed
     	data = alloc(image->allocator, image->width*image->height*image->channels);
+#if !DO_ZERO_INITIALIZATION
     	memset(data, 0, image->width*image->height*image->channels);
+#endif
     }
     
 	assert(image->channels > 0 && image->channels <= 4 && image->channels != 3, "Only 1, 2 or 4 channels allowed on images. Got %d", image->channels);
@@ -34,9 +34,16 @@ typedef enum Gfx_Filter_Mode {
 typedef struct Gfx_Image {
 	u32 width, height, channels;
 	Gfx_Handle gfx_handle;
-	Allocator allocator;
+	Allocator allocator; // For pixel data. The Gfx_Image itself comes from gfx_image_pool
 } Gfx_Image;
 
+// #Global
+ogb_instance Pool gfx_image_pool;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Pool gfx_image_pool = POOL_INITIALIZER(sizeof(Gfx_Image), false);
+#endif
+
 Gfx_Image *
 make_image(u32 width, u32 height, u32 channels, void *initial_data, Allocator allocator);
 Gfx_Image *
@@ -63,7 +70,8 @@ shader_recompile_with_extension(string ext_source, u64 cbuffer_size);
 // initial_data can be null to leave image data uninitialized
 Gfx_Image *
 make_image(u32 width, u32 height, u32 channels, void *initial_data, Allocator allocator) {
-	Gfx_Image *image = alloc(allocator, sizeof(Gfx_Image) + width*height*channels);
+	Gfx_Image *image = pool_alloc(&gfx_image_pool);
+	memset(image, 0, sizeof(Gfx_Image));
 	
 	assert(channels > 0 && channels <= 4, "Only 1, 2, 3 or 4 channels allowed on images. Got %d", channels);
 	
@@ -84,7 +92,8 @@ load_image_from_disk(string path, Allocator allocator) {
     bool ok = os_read_entire_file(path, &png, allocator);
     if (!ok) return 0;
 
-    Gfx_Image *image = alloc(allocator, sizeof(Gfx_Image));
+    Gfx_Image *image = pool_alloc(&gfx_image_pool);
+    memset(image, 0, sizeof(Gfx_Image));
     
     int width, height, channels;
     stbi_set_flip_vertically_on_load(1);
@@ -93,7 +102,7 @@ load_image_from_disk(string path, Allocator allocator) {
     
     
     if (!stb_data) {
-        dealloc(allocator, image);
+        pool_dealloc(&gfx_image_pool, image);
         dealloc_string(allocator, png);
         return 0;
     }
@@ -121,5 +130,5 @@ delete_image(Gfx_Image *image) {
     image->width = 0;
     image->height = 0;
     gfx_deinit_image(image);
-    dealloc(image->allocator, image);
+    pool_dealloc(&gfx_image_pool, image);
 }
@@ -5,6 +5,8 @@
 	
 		void growing_array_init_reserve(void **array, u64 block_size_in_bytes, u64 count_to_reserve, Allocator allocator);
 		void growing_array_init(void **array, u64 block_size_in_bytes, Allocator allocator);
+		void growing_array_init_reserve_aligned(void **array, u64 block_size_in_bytes, u64 count_to_reserve, u64 alignment, Allocator allocator);
+		void growing_array_init_aligned(void **array, u64 block_size_in_bytes, u64 alignment, Allocator allocator);
 		void growing_array_deinit(void **array);
 		
 		void *growing_array_add_empty(void **array);
@@ -36,6 +38,10 @@
 	    
 	    growing_array_deinit(&things);
 	    
+	    // Items start at a 64 byte aligned address, also after growing.
+	    // The allocator needs to support alloc_aligned() for alignments over 16.
+	    growing_array_init_aligned(&things, sizeof(Thing), CACHE_LINE_SIZE, allocator);
+	    
 	    Thing new_thing;
 	    growing_array_add(&things, &new_thing); // 'thing' is copied
 	    
@@ -72,8 +78,24 @@ typedef struct Growing_Array_Header {
     u32 allocated_count;
     u32 block_size_in_bytes;
     Allocator allocator;
+    u64 alignment; // Of the items. The header sits right before them.
+    u64 padding;
 } Growing_Array_Header;
 
+#define GROWING_ARRAY_DEFAULT_ALIGNMENT 16
+
+// Where the items start in the allocation
+inline u64 
+get_growing_array_items_offset(u64 alignment) {
+	return align_next(sizeof(Growing_Array_Header), alignment);
+}
+inline void*
+growing_array_allocate(u64 items_size, u64 alignment, Allocator allocator) {
+	u64 size = get_growing_array_items_offset(alignment) + items_size;
+	if (alignment <= GROWING_ARRAY_DEFAULT_ALIGNMENT) return alloc(allocator, size);
+	return alloc_aligned(allocator, size, alignment);
+}
+
 bool 
 check_growing_array_signature(void **array) {
 	Growing_Array_Header *header = ((Growing_Array_Header*)*array) - 1;
@@ -81,21 +103,33 @@ check_growing_array_signature(void **array) {
 	return true;
 }
 
+// alignment must be a power of two
 void
-growing_array_init_reserve(void **array, u64 block_size_in_bytes, u64 count_to_reserve, Allocator allocator) {
+growing_array_init_reserve_aligned(void **array, u64 block_size_in_bytes, u64 count_to_reserve, u64 alignment, Allocator allocator) {
+    assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Growing array alignment must be a power of two, got %llu", alignment);
+    alignment = max(alignment, GROWING_ARRAY_DEFAULT_ALIGNMENT);
     
     count_to_reserve = get_next_power_of_two(count_to_reserve);
-    u64 bytes_to_allocate = count_to_reserve*block_size_in_bytes + sizeof(Growing_Array_Header);
     
-    Growing_Array_Header *header = (Growing_Array_Header*)alloc(allocator, bytes_to_allocate);
+    u8 *items = (u8*)growing_array_allocate(count_to_reserve*block_size_in_bytes, alignment, allocator) + get_growing_array_items_offset(alignment);
+    Growing_Array_Header *header = ((Growing_Array_Header*)items) - 1;
     
     header->allocator = allocator;
     header->block_size_in_bytes = block_size_in_bytes;
     header->valid_count = 0;
     header->allocated_count = count_to_reserve;
+    header->alignment = alignment;
     header->signature = GROWING_ARRAY_SIGNATURE;
     
-    *array = header+1;
+    *array = items;
+}
+void
+growing_array_init_reserve(void **array, u64 block_size_in_bytes, u64 count_to_reserve, Allocator allocator) {
+    growing_array_init_reserve_aligned(array, block_size_in_bytes, count_to_reserve, GROWING_ARRAY_DEFAULT_ALIGNMENT, allocator);
+}
+void
+growing_array_init_aligned(void **array, u64 block_size_in_bytes, u64 alignment, Allocator allocator) {
+    growing_array_init_reserve_aligned(array, block_size_in_bytes, 8, alignment, allocator);
 }
 void
 growing_array_init(void **array, u64 block_size_in_bytes, Allocator allocator) {
@@ -105,7 +139,7 @@ void
 growing_array_deinit(void **array) {
 	assert(check_growing_array_signature(array), "Not a valid growing array");
     Growing_Array_Header *header = ((Growing_Array_Header*)*array) - 1;
-    dealloc(header->allocator, header);
+    dealloc(header->allocator, (u8*)*array - get_growing_array_items_offset(header->alignment));
 }
 
 void
@@ -115,19 +149,26 @@ growing_array_reserve(void **array, u64 count_to_reserve) {
     
     if (header->allocated_count >= count_to_reserve) return;
     
-    u64 old_allocated_bytes = header->allocated_count*header->block_size_in_bytes+sizeof(Growing_Array_Header);
+    u64 offset = get_growing_array_items_offset(header->alignment);
+    u8 *old_allocation = (u8*)*array - offset;
+    u64 old_allocated_bytes = header->allocated_count*header->block_size_in_bytes+offset;
     count_to_reserve = get_next_power_of_two(count_to_reserve);
-    u64 bytes_to_allocate = count_to_reserve*header->block_size_in_bytes+sizeof(Growing_Array_Header);
-    Growing_Array_Header *new_header = (Growing_Array_Header*)alloc(header->allocator, bytes_to_allocate);
-    
-    memcpy(new_header, header, old_allocated_bytes);
-    
+    u64 bytes_to_allocate = count_to_reserve*header->block_size_in_bytes+offset;
+    
+    u8 *new_allocation;
+    if (header->alignment <= GROWING_ARRAY_DEFAULT_ALIGNMENT) {
+        new_allocation = (u8*)reallocate(header->allocator, old_allocation, old_allocated_bytes, bytes_to_allocate);
+    } else {
+        // reallocate() may not keep the alignment
+        new_allocation = (u8*)alloc_aligned(header->allocator, bytes_to_allocate, header->alignment);
+        memcpy(new_allocation, old_allocation, old_allocated_bytes);
+        dealloc(header->allocator, old_allocation);
+    }
     
-    *array = new_header+1;
+    *array = new_allocation + offset;
     
+    Growing_Array_Header *new_header = ((Growing_Array_Header*)*array) - 1;
     new_header->allocated_count = count_to_reserve;
-    
-    dealloc(header->allocator, header);
 }
 
 void*
@@ -0,0 +1,637 @@
+
+/*
+	Job system
+
+	Work-stealing job scheduler with one worker per logical processor. The thread that waits
+	on a job counter runs jobs while it waits, so one less worker thread than there are
+	logical processors is started.
+
+	Every worker owns a Chase-Lev deque. The owner pushes & pops jobs at the bottom without
+	any locking while idle workers steal from the top. Jobs submitted from a thread that
+	isn't a worker (like the main thread) go into a shared queue which workers pull from in
+	batches.
+
+	Usage:
+
+		Job_Counter counter = {0};
+		Job jobs[64];
+		for (u64 i = 0; i < 64; i++) jobs[i] = (Job){ my_job_proc, &my_data[i] };
+		job_submit(jobs, 64, &counter);
+
+		// Do other things ...
+
+		job_wait(&counter); // Runs jobs until all 64 are done
+
+		// Split [0, 100000) into ranges of 1024 and process them on all workers
+		parallel_for(100000, 1024, my_range_proc, &my_data);
+
+	The job system is started by job_system_init(), or by the first job_submit() or
+	parallel_for().
+	Idle workers spin for a moment and then sleep until a submit wakes them.
+	Jobs may submit more jobs and wait on them, but they should not block on anything
+	else for long since that takes a worker out of the pool.
+	If a queue is full, the jobs that don't fit are run right away by the submitting thread.
+*/
+
+#ifndef JOB_DEQUE_CAPACITY
+	#define JOB_DEQUE_CAPACITY 4096 // Must be a power of two
+#endif
+#define JOB_DEQUE_MASK (JOB_DEQUE_CAPACITY-1)
+
+// How many jobs a worker moves from the shared queue to its own deque at a time
+#define JOB_SHARED_QUEUE_BATCH_SIZE 32
+
+#ifndef RADIX_SORT_PARALLEL_MIN_ITEM_COUNT
+	#define RADIX_SORT_PARALLEL_MIN_ITEM_COUNT 16384
+#endif
+#define RADIX_SORT_PARALLEL_MIN_CHUNK_SIZE 4096 // In items
+#define RADIX_SORT_MAX_PASS_COUNT 8
+
+typedef struct Job_Counter {
+	volatile u64 pending;
+} Job_Counter;
+
+typedef void(*Job_Proc)(void *data);
+typedef struct Job {
+	Job_Proc proc;
+	void *data;
+	Job_Counter *counter; // Set by job_submit
+} Job;
+
+typedef void(*Parallel_For_Proc)(u64 first, u64 end, void *data);
+
+typedef struct Job_Deque {
+	// top is moved by thieves, bottom only by the owner, so keep them on separate cache lines
+	alignat(CACHE_LINE_SIZE) volatile u64 top;
+	alignat(CACHE_LINE_SIZE) volatile u64 bottom;
+	alignat(CACHE_LINE_SIZE) Job jobs[JOB_DEQUE_CAPACITY];
+} Job_Deque;
+
+typedef struct Job_Worker {
+	Job_Deque deque;
+	Thread thread;
+	u64 index;
+	u64 random_state; // For picking steal victims
+} Job_Worker;
+
+// worker_count 0 means one less than the number of logical processors (but at least 1).
+// Does nothing if the job system is already running.
+void ogb_instance
+job_system_init(u64 worker_count);
+
+// All submitted jobs must be done
+void ogb_instance
+job_system_deinit();
+
+// Jobs are copied, so the array can be reused right away. counter may be 0.
+void ogb_instance
+job_submit(Job *jobs, u64 count, Job_Counter *counter);
+
+// Runs other jobs until counter reaches 0
+void ogb_instance
+job_wait(Job_Counter *counter);
+
+inline bool
+job_counter_is_done(Job_Counter *counter);
+
+// Calls proc with consecutive ranges of at most grain_size indices until [0, count) is
+// covered, spread over all workers. Returns when every range is done.
+// grain_size 0 picks a size which gives each worker a few ranges.
+void ogb_instance
+parallel_for(u64 count, u64 grain_size, Parallel_For_Proc proc, void *data);
+
+// Same arguments & result as radix_sort(), but the counting and scattering of every pass
+// is split over the job workers. Each chunk of the collection gets its own counts, and
+// the chunks scatter into separate parts of every bucket so the sort stays stable.
+// Collections with less than RADIX_SORT_PARALLEL_MIN_ITEM_COUNT items use radix_sort().
+void ogb_instance
+radix_sort_parallel(void *collection, void *help_buffer, u64 item_count, u64 item_size, u64 sort_value_offset_in_item, u64 number_of_bits);
+
+// #Global
+ogb_instance Job_Worker *job_workers;
+ogb_instance u64 job_worker_count;
+ogb_instance Job_Deque *job_shared_queue; // Only touched with job_shared_queue_lock
+ogb_instance Spinlock job_shared_queue_lock;
+ogb_instance Spinlock job_system_init_lock;
+ogb_instance volatile bool job_system_running;
+ogb_instance Semaphore job_wake_semaphore; // Idle workers sleep on this
+ogb_instance volatile u64 job_sleeping_worker_count;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Job_Worker *job_workers = 0;
+u64 job_worker_count = 0;
+Job_Deque *job_shared_queue = 0;
+Spinlock job_shared_queue_lock = {0};
+Spinlock job_system_init_lock = {0};
+volatile bool job_system_running = false;
+Semaphore job_wake_semaphore = {0};
+volatile u64 job_sleeping_worker_count = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+thread_local s64 job_worker_index = -1;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+inline bool
+job_counter_is_done(Job_Counter *counter) {
+	return atomic64_load(&counter->pending, MEMORY_ORDER_ACQUIRE) == 0;
+}
+
+///
+// Chase-Lev deque
+
+// Owner only. Returns how many jobs fit.
+u64
+job_deque_push(Job_Deque *d, Job *jobs, u64 count, Job_Counter *counter) {
+	s64 b = (s64)d->bottom;
+	s64 t = (s64)atomic64_load(&d->top, MEMORY_ORDER_ACQUIRE);
+	u64 space = JOB_DEQUE_CAPACITY - (u64)(b-t);
+	u64 n = min(count, space);
+	for (u64 i = 0; i < n; i++) {
+		Job *job = &d->jobs[(u64)(b+(s64)i) & JOB_DEQUE_MASK];
+		*job = jobs[i];
+		job->counter = counter;
+	}
+	// Jobs must be visible before the new bottom is
+	atomic64_store(&d->bottom, (u64)(b+(s64)n), MEMORY_ORDER_RELEASE);
+	return n;
+}
+
+// Owner only
+bool
+job_deque_pop(Job_Deque *d, Job *job) {
+	s64 b = (s64)d->bottom - 1;
+	atomic64_store(&d->bottom, (u64)b, MEMORY_ORDER_RELAXED);
+	// The store to bottom must be visible before we read top, otherwise a thief and the
+	// owner could both take the last job
+	memory_fence(MEMORY_ORDER_SEQ_CST);
+	s64 t = (s64)atomic64_load(&d->top, MEMORY_ORDER_RELAXED);
+
+	if (t > b) {
+		d->bottom = (u64)(b+1);
+		return false;
+	}
+
+	*job = d->jobs[(u64)b & JOB_DEQUE_MASK];
+	if (t == b) {
+		// Last job, race the thieves for it
+		bool won = compare_and_swap_64(&d->top, (u64)(t+1), (u64)t);
+		d->bottom = (u64)(b+1);
+		return won;
+	}
+	return true;
+}
+
+// Any thread
+bool
+job_deque_steal(Job_Deque *d, Job *job) {
+	s64 t = (s64)atomic64_load(&d->top, MEMORY_ORDER_ACQUIRE);
+	memory_fence(MEMORY_ORDER_SEQ_CST);
+	s64 b = (s64)atomic64_load(&d->bottom, MEMORY_ORDER_ACQUIRE);
+	if (t >= b) return false;
+
+	// This might read a job which is being overwritten, but then someone else took it
+	// and top moved on so the CAS fails.
+	*job = d->jobs[(u64)t & JOB_DEQUE_MASK];
+	return compare_and_swap_64(&d->top, (u64)(t+1), (u64)t);
+}
+
+///
+// Scheduling
+
+bool
+job_take_from_shared_queue(Job *job) {
+	if (job_shared_queue->top == job_shared_queue->bottom) return false;
+
+	spinlock_acquire_or_wait(&job_shared_queue_lock);
+	u64 top = job_shared_queue->top;
+	u64 available = job_shared_queue->bottom - top;
+	if (available == 0) {
+		spinlock_release(&job_shared_queue_lock);
+		return false;
+	}
+	*job = job_shared_queue->jobs[top & JOB_DEQUE_MASK];
+	top += 1;
+	available -= 1;
+
+	// Workers take a batch so they don't come back to the lock for every job
+	if (job_worker_index >= 0 && available > 0) {
+		Job_Deque *own = &job_workers[job_worker_index].deque;
+		u64 n = min(available, JOB_SHARED_QUEUE_BATCH_SIZE);
+		for (u64 i = 0; i < n; i++) {
+			Job *next = &job_shared_queue->jobs[top & JOB_DEQUE_MASK];
+			if (job_deque_push(own, next, 1, next->counter) == 0) break;
+			top += 1;
+		}
+	}
+	job_shared_queue->top = top;
+	spinlock_release(&job_shared_queue_lock);
+	return true;
+}
+
+bool
+job_find(Job *job) {
+	u64 random_state;
+	if (job_worker_index >= 0) {
+		Job_Worker *worker = &job_workers[job_worker_index];
+		if (job_deque_pop(&worker->deque, job)) return true;
+		random_state = worker->random_state;
+		worker->random_state = random_state*6364136223846793005ULL + 1442695040888963407ULL;
+	} else {
+		random_state = rdtsc();
+	}
+
+	if (job_take_from_shared_queue(job)) return true;
+
+	u64 first = (random_state >> 33) % job_worker_count;
+	for (u64 i = 0; i < job_worker_count; i++) {
+		u64 victim = (first+i) % job_worker_count;
+		if ((s64)victim == job_worker_index) continue;
+		if (job_deque_steal(&job_workers[victim].deque, job)) return true;
+	}
+	return false;
+}
+
+inline void
+job_run(Job *job) {
+	job->proc(job->data);
+	if (job->counter) atomic64_fetch_sub(&job->counter->pending, 1, MEMORY_ORDER_RELEASE);
+}
+
+void
+job_worker_proc(Thread *t) {
+	Job_Worker *worker = (Job_Worker*)t->data;
+	job_worker_index = (s64)worker->index;
+
+	u64 idle_count = 0;
+	while (job_system_running) {
+		Job job;
+		if (job_find(&job)) {
+			job_run(&job);
+			idle_count = 0;
+			continue;
+		}
+
+		// Back off from spinning to yielding to sleeping the longer there is nothing to do
+		idle_count += 1;
+		if (idle_count < 64) {
+			for (u64 i = 0; i < 16; i++) _mm_pause();
+		} else if (idle_count < 128) {
+			os_yield_thread();
+		} else {
+			// Count ourselves as sleeping before looking for jobs one last time. A submit
+			// pushes before it reads the count, so either it sees us or we see its jobs.
+			atomic64_fetch_add(&job_sleeping_worker_count, 1, MEMORY_ORDER_SEQ_CST);
+			bool found = job_find(&job);
+			if (!found) semaphore_wait(&job_wake_semaphore);
+			atomic64_fetch_sub(&job_sleeping_worker_count, 1, MEMORY_ORDER_RELAXED);
+			if (found) job_run(&job);
+			idle_count = 0;
+		}
+	}
+
+	job_worker_index = -1;
+}
+
+void
+job_system_init(u64 worker_count) {
+	if (job_system_running) return;
+
+	spinlock_acquire_or_wait(&job_system_init_lock);
+	if (job_system_running) {
+		spinlock_release(&job_system_init_lock);
+		return;
+	}
+
+	if (worker_count == 0) {
+		u64 logical_processors = os_get_number_of_logical_processors();
+		worker_count = logical_processors > 1 ? logical_processors-1 : 1;
+	}
+
+	Allocator heap = get_heap_allocator();
+
+	job_shared_queue = alloc_aligned(heap, sizeof(Job_Deque), CACHE_LINE_SIZE);
+	job_shared_queue->top = 0;
+	job_shared_queue->bottom = 0;
+	spinlock_init(&job_shared_queue_lock);
+	spinlock_set_name(&job_shared_queue_lock, STR("job_shared_queue_lock"));
+
+	job_worker_count = worker_count;
+	job_workers = alloc_aligned(heap, sizeof(Job_Worker)*worker_count, CACHE_LINE_SIZE);
+
+	semaphore_init(&job_wake_semaphore, 0);
+	job_sleeping_worker_count = 0;
+
+	for (u64 i = 0; i < worker_count; i++) {
+		Job_Worker *worker = &job_workers[i];
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+		worker->index = i;
+		worker->random_state = i*0x9E3779B97F4A7C15ULL + 1;
+		os_thread_init(&worker->thread, job_worker_proc);
+		worker->thread.data = worker;
+	}
+
+	// Other threads check this without the lock, so everything above must be visible first.
+	// Workers exit when it's false, so it has to be set before they start.
+	MEMORY_BARRIER;
+	job_system_running = true;
+
+	for (u64 i = 0; i < worker_count; i++) {
+		os_thread_start(&job_workers[i].thread);
+	}
+
+	spinlock_release(&job_system_init_lock);
+}
+
+void
+job_system_deinit() {
+	spinlock_acquire_or_wait(&job_system_init_lock);
+	if (!job_system_running) {
+		spinlock_release(&job_system_init_lock);
+		return;
+	}
+
+	assert(job_shared_queue->top == job_shared_queue->bottom, "Job system deinitialized with jobs still in the queue");
+
+	job_system_running = false;
+	semaphore_signal(&job_wake_semaphore, (u32)job_worker_count);
+	for (u64 i = 0; i < job_worker_count; i++) {
+		os_thread_join(&job_workers[i].thread);
+		os_thread_destroy(&job_workers[i].thread);
+		assert(job_workers[i].deque.top == job_workers[i].deque.bottom, "Job system deinitialized with jobs still in a worker queue");
+	}
+
+	Allocator heap = get_heap_allocator();
+	dealloc(heap, job_workers);
+	dealloc(heap, job_shared_queue);
+	job_workers = 0;
+	job_shared_queue = 0;
+	job_worker_count = 0;
+
+	spinlock_release(&job_system_init_lock);
+}
+
+void
+job_submit(Job *jobs, u64 count, Job_Counter *counter) {
+	if (count == 0) return;
+
+	job_system_init(0);
+
+	if (counter) atomic64_fetch_add(&counter->pending, count, MEMORY_ORDER_RELAXED);
+
+	u64 pushed;
+	if (job_worker_index >= 0) {
+		pushed = job_deque_push(&job_workers[job_worker_index].deque, jobs, count, counter);
+	} else {
+		spinlock_acquire_or_wait(&job_shared_queue_lock);
+		pushed = job_deque_push(job_shared_queue, jobs, count, counter);
+		spinlock_release(&job_shared_queue_lock);
+	}
+
+	// Wake sleeping workers. The fence makes sure the jobs are visible before we read the count.
+	memory_fence(MEMORY_ORDER_SEQ_CST);
+	u64 sleeping_count = atomic64_load(&job_sleeping_worker_count, MEMORY_ORDER_RELAXED);
+	if (sleeping_count > 0) {
+		semaphore_signal(&job_wake_semaphore, (u32)min(sleeping_count, pushed));
+	}
+
+	// Queue is full, so run the rest here
+	for (u64 i = pushed; i < count; i++) {
+		Job job = jobs[i];
+		job.counter = counter;
+		job_run(&job);
+	}
+}
+
+void
+job_wait(Job_Counter *counter) {
+	u64 idle_count = 0;
+	while (!job_counter_is_done(counter)) {
+		Job job;
+		if (job_system_running && job_find(&job)) {
+			job_run(&job);
+			idle_count = 0;
+			continue;
+		}
+
+		// The last jobs are running on other workers. Don't sleep, they should be done soon.
+		idle_count += 1;
+		if (idle_count < 64) _mm_pause();
+		else os_yield_thread();
+	}
+}
+
+typedef struct Parallel_For_State {
+	Parallel_For_Proc proc;
+	void *data;
+	u64 count;
+	u64 grain_size;
+	u64 range_count;
+	alignat(CACHE_LINE_SIZE) volatile u64 next_range;
+} Parallel_For_State;
+
+// Every job keeps taking the next range until there are none left, so fast workers
+// end up doing more of them.
+void
+parallel_for_job_proc(void *data) {
+	Parallel_For_State *state = (Parallel_For_State*)data;
+	while (true) {
+		u64 range = atomic64_fetch_add(&state->next_range, 1, MEMORY_ORDER_RELAXED);
+		if (range >= state->range_count) break;
+		u64 first = range*state->grain_size;
+		u64 end = min(first+state->grain_size, state->count);
+		state->proc(first, end, state->data);
+	}
+}
+
+void
+parallel_for(u64 count, u64 grain_size, Parallel_For_Proc proc, void *data) {
+	if (count == 0) return;
+
+	job_system_init(0);
+
+	if (grain_size == 0) {
+		grain_size = max(count / ((job_worker_count+1)*4), 1);
+	}
+
+	u64 range_count = (count+grain_size-1) / grain_size;
+	if (range_count == 1) {
+		proc(0, count, data);
+		return;
+	}
+
+	Parallel_For_State state = {0};
+	state.proc = proc;
+	state.data = data;
+	state.count = count;
+	state.grain_size = grain_size;
+	state.range_count = range_count;
+	state.next_range = 0;
+
+	// This thread takes ranges too, so it only needs help from range_count-1 workers
+	Job_Counter counter = {0};
+	u64 helper_count = min(range_count-1, job_worker_count);
+	Job jobs[64];
+	for (u64 i = 0; i < 64; i++) jobs[i] = (Job){ parallel_for_job_proc, &state, 0 };
+	for (u64 submitted = 0; submitted < helper_count; submitted += 64) {
+		job_submit(jobs, min(helper_count-submitted, 64), &counter);
+	}
+
+	parallel_for_job_proc(&state);
+
+	job_wait(&counter);
+}
+
+///
+// Parallel radix sort
+
+typedef struct Radix_Sort_Parallel_State {
+	u8 *src;
+	u8 *dst;
+	u64 item_count;
+	u64 item_size;
+	u64 sort_value_offset_in_item;
+	u64 sign_shift;
+	u32 pass_count;
+	u32 pass; // The pass counted/scattered by the current parallel_for
+	u64 chunk_size;
+	u64 chunk_count;
+	u64 *counts; // [chunk][pass][digit]
+} Radix_Sort_Parallel_State;
+
+inline u64 *radix_sort_parallel_counts(Radix_Sort_Parallel_State *state, u64 chunk, u32 pass) {
+	return state->counts + (chunk*state->pass_count + pass)*RADIX_SORT_RADIX;
+}
+
+// Before the first pass the counts of every pass are taken in one read
+void radix_sort_parallel_count_all_proc(u64 first, u64 end, void *data) {
+	Radix_Sort_Parallel_State *state = (Radix_Sort_Parallel_State*)data;
+	for (u64 chunk = first; chunk < end; chunk++) {
+		u64 *counts = radix_sort_parallel_counts(state, chunk, 0);
+		memset(counts, 0, state->pass_count*RADIX_SORT_RADIX*sizeof(u64));
+		u64 first_item = chunk*state->chunk_size;
+		u64 end_item = min(first_item+state->chunk_size, state->item_count);
+		for (u64 i = first_item; i < end_item; i++) {
+			u64 key = radix_sort_key(state->src + i*state->item_size, state->sort_value_offset_in_item, state->sign_shift);
+			for (u32 pass = 0; pass < state->pass_count; pass++) {
+				++counts[pass*RADIX_SORT_RADIX + ((key >> (pass*RADIX_SORT_BITS_PER_PASS)) & RADIX_SORT_MASK)];
+			}
+		}
+	}
+}
+// After a scatter the chunks hold different items, so later passes are counted again
+void radix_sort_parallel_count_proc(u64 first, u64 end, void *data) {
+	Radix_Sort_Parallel_State *state = (Radix_Sort_Parallel_State*)data;
+	u32 shift = state->pass*RADIX_SORT_BITS_PER_PASS;
+	for (u64 chunk = first; chunk < end; chunk++) {
+		u64 *counts = radix_sort_parallel_counts(state, chunk, state->pass);
+		memset(counts, 0, RADIX_SORT_RADIX*sizeof(u64));
+		u64 first_item = chunk*state->chunk_size;
+		u64 end_item = min(first_item+state->chunk_size, state->item_count);
+		for (u64 i = first_item; i < end_item; i++) {
+			u64 key = radix_sort_key(state->src + i*state->item_size, state->sort_value_offset_in_item, state->sign_shift);
+			++counts[(key >> shift) & RADIX_SORT_MASK];
+		}
+	}
+}
+void radix_sort_parallel_scatter_proc(u64 first, u64 end, void *data) {
+	Radix_Sort_Parallel_State *state = (Radix_Sort_Parallel_State*)data;
+	u32 shift = state->pass*RADIX_SORT_BITS_PER_PASS;
+	u64 item_size = state->item_size;
+	u64 offsets[RADIX_SORT_RADIX];
+	for (u64 chunk = first; chunk < end; chunk++) {
+		// Where this chunk's part of each bucket starts: after all smaller digits, and
+		// after the same digit in the chunks before this one. Every chunk does its own
+		// prefix sum, so it's parallel too.
+		u64 running = 0;
+		for (u32 digit = 0; digit < RADIX_SORT_RADIX; digit++) {
+			for (u64 c = 0; c < state->chunk_count; c++) {
+				if (c == chunk) offsets[digit] = running;
+				running += radix_sort_parallel_counts(state, c, state->pass)[digit];
+			}
+		}
+		
+		u64 first_item = chunk*state->chunk_size;
+		u64 end_item = min(first_item+state->chunk_size, state->item_count);
+		for (u64 i = first_item; i < end_item; i++) {
+			u8 *item = state->src + i*item_size;
+			u32 digit = (radix_sort_key(item, state->sort_value_offset_in_item, state->sign_shift) >> shift) & RADIX_SORT_MASK;
+			memcpy(state->dst + offsets[digit]*item_size, item, item_size);
+			++offsets[digit];
+		}
+	}
+}
+void radix_sort_parallel_copy_proc(u64 first, u64 end, void *data) {
+	Radix_Sort_Parallel_State *state = (Radix_Sort_Parallel_State*)data;
+	memcpy(state->dst + first*state->item_size, state->src + first*state->item_size, (end-first)*state->item_size);
+}
+
+void
+radix_sort_parallel(void *collection, void *help_buffer, u64 item_count, u64 item_size, u64 sort_value_offset_in_item, u64 number_of_bits) {
+	assert(number_of_bits > 0 && number_of_bits <= 64, "radix_sort_parallel number_of_bits must be 1-64, got %llu", number_of_bits);
+	
+	if (item_count < RADIX_SORT_PARALLEL_MIN_ITEM_COUNT) {
+		radix_sort(collection, help_buffer, item_count, item_size, sort_value_offset_in_item, number_of_bits);
+		return;
+	}
+	
+	job_system_init(0);
+	
+	// A couple of chunks per thread so a slow worker doesn't hold everyone up
+	u64 chunk_count = min((job_worker_count+1)*2, item_count/RADIX_SORT_PARALLEL_MIN_CHUNK_SIZE);
+	if (chunk_count <= 1) {
+		radix_sort(collection, help_buffer, item_count, item_size, sort_value_offset_in_item, number_of_bits);
+		return;
+	}
+	
+	Radix_Sort_Parallel_State state = {0};
+	state.src = (u8*)collection;
+	state.dst = (u8*)help_buffer;
+	state.item_count = item_count;
+	state.item_size = item_size;
+	state.sort_value_offset_in_item = sort_value_offset_in_item;
+	state.sign_shift = 1ULL << (number_of_bits - 1);
+	state.pass_count = (u32)((number_of_bits + RADIX_SORT_BITS_PER_PASS - 1) / RADIX_SORT_BITS_PER_PASS);
+	state.chunk_size = (item_count+chunk_count-1)/chunk_count;
+	state.chunk_count = (item_count+state.chunk_size-1)/state.chunk_size;
+	state.counts = (u64*)alloc_uninitialized(get_heap_allocator(), state.chunk_count*state.pass_count*RADIX_SORT_RADIX*sizeof(u64));
+	
+	parallel_for(state.chunk_count, 1, radix_sort_parallel_count_all_proc, &state);
+	
+	// A pass where everything has the same digit wouldn't move anything, so skip it.
+	// Scatters only reorder items, so these totals hold for every pass.
+	bool skip_pass[RADIX_SORT_MAX_PASS_COUNT];
+	u64 first_key = radix_sort_key(state.src, sort_value_offset_in_item, state.sign_shift);
+	for (u32 pass = 0; pass < state.pass_count; pass++) {
+		u32 digit = (first_key >> (pass*RADIX_SORT_BITS_PER_PASS)) & RADIX_SORT_MASK;
+		u64 total = 0;
+		for (u64 chunk = 0; chunk < state.chunk_count; chunk++) {
+			total += radix_sort_parallel_counts(&state, chunk, pass)[digit];
+		}
+		skip_pass[pass] = total == item_count;
+	}
+	
+	bool counts_are_current = true;
+	for (u32 pass = 0; pass < state.pass_count; pass++) {
+		if (skip_pass[pass]) continue;
+		state.pass = pass;
+		
+		if (!counts_are_current) parallel_for(state.chunk_count, 1, radix_sort_parallel_count_proc, &state);
+		parallel_for(state.chunk_count, 1, radix_sort_parallel_scatter_proc, &state);
+		counts_are_current = false;
+		
+		u8 *temp = state.src;
+		state.src = state.dst;
+		state.dst = temp;
+	}
+	
+	if (state.src != (u8*)collection) {
+		state.dst = (u8*)collection;
+		parallel_for(item_count, state.chunk_size, radix_sort_parallel_copy_proc, &state);
+	}
+	
+	dealloc(get_heap_allocator(), state.counts);
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
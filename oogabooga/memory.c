@@ -25,11 +25,23 @@ void* initialization_allocator_proc(u64 size, void *p, Allocator_Message message
 			return p;
 			break;
 		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			// Initialization memory is static and never reused, so it's always zero
+			return initialization_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED:
+		case ALLOCATOR_ALLOCATE_ALIGNED_ZEROED: {
+			init_memory_head = (u8*)align_next(init_memory_head, (u64)p);
+			return initialization_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+		}
 		case ALLOCATOR_DEALLOCATE: {
 			return 0;
 		}
 		case ALLOCATOR_REALLOCATE: {
-			return 0;
+			void *new = initialization_allocator_proc(size, 0, ALLOCATOR_ALLOCATE, data);
+			// Old size is unknown, but it can't be more than what's between p and the new allocation
+			if (p) memcpy(new, p, min(size, (u64)((u8*)new-(u8*)p)));
+			return new;
 		}
 	}
 	return 0;
@@ -43,29 +55,80 @@ Allocator get_initialization_allocator() {
 
 ///
 ///
-// Basic general heap allocator, free list
+// General heap allocator, two-level segregated fit
 ///
-// Technically thread safe but synchronization is horrible.
-// Fragmentation is catastrophic.
-// We could fix it by merging free nodes every now and then
-// BUT: We aren't really supposed to allocate/deallocate directly on the heap too much anyways...
+// Free chunks are kept in size class bins. Small sizes (< HEAP_SMALL_CHUNK_SIZE) map linearly
+// to bins 16 bytes apart, larger sizes map to a first level by power of two and a second
+// level of HEAP_SL_INDEX_COUNT subdivisions. Two bitmaps tell us which bins are non-empty so
+// finding a fit is a couple of bit scans instead of walking free lists, i.e. O(1) no matter
+// how fragmented the heap gets.
+//
+// Every chunk (allocated or free) starts with its size, and the low bits of the size are
+// flags. A free chunk also stores its size in its last 8 bytes (footer) so the chunk after it
+// can find it and merge with it when it's freed.
+//
+// Small allocations go through per-thread caches (see Thread caches below) so they mostly
+// don't touch the global lock. Everything else still goes through one global lock.
+//
+// Allocations of HEAP_LARGE_ALLOCATION_THRESHOLD or more don't go in heap blocks at all. They
+// get their own pages mapped directly from the OS which are unmapped as soon as they are freed
+// (see Large allocations below).
 
 #define MAX_HEAP_BLOCK_SIZE align_next(MB(500), os.page_size)
 #define DEFAULT_HEAP_BLOCK_SIZE (min(MAX_HEAP_BLOCK_SIZE, program_memory_capacity))
-#define HEAP_ALIGNMENT (sizeof(Heap_Free_Node))
+#define HEAP_ALIGNMENT 16
+#define HEAP_ALIGNMENT_LOG2 4
+
+#define HEAP_SL_INDEX_COUNT_LOG2 4
+#define HEAP_SL_INDEX_COUNT (1 << HEAP_SL_INDEX_COUNT_LOG2)
+#define HEAP_FL_INDEX_SHIFT (HEAP_SL_INDEX_COUNT_LOG2 + HEAP_ALIGNMENT_LOG2)
+#define HEAP_FL_INDEX_MAX 38 // 256GB
+#define HEAP_FL_INDEX_COUNT (HEAP_FL_INDEX_MAX - HEAP_FL_INDEX_SHIFT + 1)
+#define HEAP_SMALL_CHUNK_SIZE (1ULL << HEAP_FL_INDEX_SHIFT)
+
+// Flags stored in the low bits of a chunk size
+#define HEAP_CHUNK_FREE      (1ULL << 0)
+#define HEAP_CHUNK_PREV_FREE (1ULL << 1)
+#define HEAP_CHUNK_SMALL     (1ULL << 2) // Object in a thread cache run, not a chunk in a block
+#define HEAP_CHUNK_LARGE     (1ULL << 3) // Own OS mapping outside of program memory
+#define HEAP_CHUNK_FLAGS     (HEAP_ALIGNMENT-1ULL)
+// Free chunks are never small so the bit is reused: the pages inside this free chunk were given
+// back to the OS by heap_trim() or never touched, so they read as zero. Cleared when the chunk
+// is merged or allocated.
+#define HEAP_CHUNK_PURGED    HEAP_CHUNK_SMALL
+
+#define HEAP_THREAD_CACHE_MAX_SIZE 1024
+#define HEAP_SMALL_CLASS_COUNT 20
+
+#ifndef HEAP_LARGE_ALLOCATION_THRESHOLD
+	#define HEAP_LARGE_ALLOCATION_THRESHOLD MB(1)
+#endif
+
+// Bucket i counts allocations of up to (16 << i) bytes, the last one counts everything bigger.
+#define HEAP_STATS_BUCKET_COUNT 24
+
 typedef struct Heap_Free_Node Heap_Free_Node;
 typedef struct Heap_Block Heap_Block;
+typedef struct Heap_Small_Run Heap_Small_Run;
+typedef struct Heap_Thread_Cache Heap_Thread_Cache;
+typedef struct Heap_Large_Allocation Heap_Large_Allocation;
 
+// size & block overlap with Heap_Allocation_Metadata
 typedef struct Heap_Free_Node {
 	u64 size;
+	Heap_Block *block;
 	Heap_Free_Node *next;
+	Heap_Free_Node *prev;
 } Heap_Free_Node;
 
+// Free node + footer
+#define HEAP_MIN_CHUNK_SIZE align_next(sizeof(Heap_Free_Node)+sizeof(u64), HEAP_ALIGNMENT)
+
 typedef struct Heap_Block {
 	u64 size;
-	Heap_Free_Node *free_head;
 	void* start;
 	Heap_Block *next;
+	Heap_Block *prev;
 	// 32 bytes !!
 #if CONFIGURATION == DEBUG
 	u64 total_allocated;
@@ -76,24 +139,64 @@ typedef struct Heap_Block {
 #define HEAP_META_SIGNATURE 6969694206942069ull
 typedef alignat(16) struct Heap_Allocation_Metadata {
 	u64 size;
-	Heap_Block *block;
+	union {
+		Heap_Block *block;
+		Heap_Small_Run *run; // If HEAP_CHUNK_SMALL
+		Heap_Large_Allocation *large; // If HEAP_CHUNK_LARGE
+	};
 #if CONFIGURATION == DEBUG
 	u64 signature;
 	u64 padding;
 #endif
 } Heap_Allocation_Metadata;
 
+// Large allocations start this far into their mapping, so they are aligned to this
+#define HEAP_LARGE_ALLOCATION_ALIGNMENT 64
+
+// Sits right before the allocation metadata. That's at the start of the mapping unless the
+// allocation was asked to be aligned to more than HEAP_LARGE_ALLOCATION_ALIGNMENT.
+typedef struct Heap_Large_Allocation {
+	union {
+		struct {
+			Heap_Large_Allocation *next;
+			Heap_Large_Allocation *prev;
+			u64 mapped_size;
+			u64 mapping_offset; // From the start of the mapping to this header
+		};
+		u8 padding[HEAP_LARGE_ALLOCATION_ALIGNMENT - sizeof(Heap_Allocation_Metadata)];
+	};
+	Heap_Allocation_Metadata meta;
+} Heap_Large_Allocation;
+
+typedef struct Heap_Bins {
+	u64 fl_bitmap;
+	u32 sl_bitmap[HEAP_FL_INDEX_COUNT];
+	Heap_Free_Node *heads[HEAP_FL_INDEX_COUNT][HEAP_SL_INDEX_COUNT];
+} Heap_Bins;
+
 // #Global
 ogb_instance Heap_Block *heap_head;
 ogb_instance bool heap_initted;
 ogb_instance Spinlock heap_lock;
+ogb_instance Heap_Bins heap_bins;
+ogb_instance Heap_Large_Allocation *heap_large_allocations;
+ogb_instance volatile u64 heap_realloc_in_place_count;
+ogb_instance volatile u64 heap_realloc_moved_count;
+ogb_instance u64 heap_chunk_operation_count; // Locked alloc/dealloc count, for the idle trim
+ogb_instance volatile u64 heap_profile_allocated_bytes; // Only counted with ENABLE_PROFILING
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
 Heap_Block *heap_head;
 bool heap_initted = false;
 Spinlock heap_lock;
+Heap_Bins heap_bins;
+Heap_Large_Allocation *heap_large_allocations = 0;
+volatile u64 heap_realloc_in_place_count = 0;
+volatile u64 heap_realloc_moved_count = 0;
+u64 heap_chunk_operation_count = 0;
+volatile u64 heap_profile_allocated_bytes = 0;
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
-	
+
 
 u64 get_heap_block_size_excluding_metadata(Heap_Block *block) {
 	return block->size - sizeof(Heap_Block);
@@ -101,6 +204,17 @@ u64 get_heap_block_size_excluding_metadata(Heap_Block *block) {
 u64 get_heap_block_size_including_metadata(Heap_Block *block) {
 	return block->size;
 }
+inline void *get_heap_block_end(Heap_Block *block) {
+	return (u8*)block->start + get_heap_block_size_excluding_metadata(block);
+}
+
+// Works on both free nodes and allocation metadata since they both start with the size
+inline u64 get_heap_chunk_size(void *chunk) {
+	return *(u64*)chunk & ~HEAP_CHUNK_FLAGS;
+}
+inline bool is_heap_chunk_free(void *chunk) {
+	return (*(u64*)chunk & HEAP_CHUNK_FREE) != 0;
+}
 
 bool is_pointer_in_program_memory(void *p) {
 	return (u8*)p >= (u8*)program_memory && (u8*)p<((u8*)program_memory+program_memory_capacity);
@@ -113,8 +227,23 @@ bool is_pointer_in_stack(void* p) {
 bool is_pointer_in_static_memory(void* p) {
     return (uintptr_t)p >= (uintptr_t)os.static_memory_start && (uintptr_t)p < (uintptr_t)os.static_memory_end;
 }
+bool is_pointer_in_large_heap_allocation(void *p) {
+	bool result = false;
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Large_Allocation *large = heap_large_allocations;
+	while (large) {
+		u8 *base = (u8*)large - large->mapping_offset;
+		if ((u8*)p >= base && (u8*)p < base+large->mapped_size) {
+			result = true;
+			break;
+		}
+		large = large->next;
+	}
+	spinlock_release(&heap_lock);
+	return result;
+}
 bool is_pointer_valid(void *p) {
-	return is_pointer_in_program_memory(p) || is_pointer_in_stack(p) || is_pointer_in_static_memory(p);
+	return is_pointer_in_program_memory(p) || is_pointer_in_stack(p) || is_pointer_in_static_memory(p) || is_pointer_in_large_heap_allocation(p);
 }
 
 // Meant for debug
@@ -126,27 +255,40 @@ void sanity_check_block(Heap_Block *block) {
 	assert(block->size < GB(256), "A heap block is corrupt.");
 	assert(block->size >= INITIAL_PROGRAM_MEMORY_SIZE, "A heap block is corrupt.");
 	assert((u64)block->start == (u64)block + sizeof(Heap_Block), "A heap block is corrupt.");
-	
 
-	Heap_Free_Node *node = block->free_head;	
-	
+	// Walk every chunk in the block physically
+	u8 *chunk = (u8*)block->start;
+	u8 *end = (u8*)get_heap_block_end(block);
+	bool previous_was_free = false;
 	u64 total_free = 0;
-	while (node != 0) {
-		Heap_Free_Node *other_node = node->next;
-		
-		assert(node->size < GB(256), "Heap is corrupt");
-		assert(is_pointer_in_program_memory(node), "Heap is corrupt");
-		
-		while (other_node != 0) {
-			assert(is_pointer_in_program_memory(other_node), "Heap is corrupt");
-			assert(other_node != node, "Circular reference in heap free node tree. This is probably an internal error, or an extremely unlucky result from heap corruption.");
-			other_node = other_node->next;
+	while (chunk < end) {
+		u64 size = get_heap_chunk_size(chunk);
+		assert(size >= HEAP_MIN_CHUNK_SIZE && size % HEAP_ALIGNMENT == 0, "Heap is corrupt");
+		assert(chunk+size <= end, "Heap is corrupt");
+
+		bool prev_free_flag = (*(u64*)chunk & HEAP_CHUNK_PREV_FREE) != 0;
+		assert(prev_free_flag == previous_was_free, "Heap chunk PREV_FREE flag is out of sync. This is probably an internal error.");
+
+		if (is_heap_chunk_free(chunk)) {
+			Heap_Free_Node *node = (Heap_Free_Node*)chunk;
+			assert(!previous_was_free, "Two adjacent free chunks were not merged. This is probably an internal error.");
+			assert(node->block == block, "Heap is corrupt");
+			assert(*(u64*)(chunk+size-sizeof(u64)) == size, "Heap free chunk footer is corrupt");
+			if (node->next) assert(node->next->prev == node, "Heap free list is corrupt");
+			if (node->prev) assert(node->prev->next == node, "Heap free list is corrupt");
+			total_free += size;
+			previous_was_free = true;
+		} else {
+			Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)chunk;
+			assert(meta->block == block, "Heap is corrupt");
+			assert(meta->signature == HEAP_META_SIGNATURE, "Heap is corrupt");
+			previous_was_free = false;
 		}
-		total_free += node->size;
-		assert(total_free <= block->size, "Free nodes are fucky wucky. This might be heap corruption, or possibly an internal error.");
-		node = node->next;
+
+		chunk += size;
 	}
-	
+	assert(chunk == end, "Heap chunks don't add up to the block size");
+
 	u64 expected_size = get_heap_block_size_excluding_metadata(block);
 	assert(block->total_allocated+total_free == expected_size, "Heap is corrupt.")
 #endif
@@ -155,62 +297,128 @@ inline void check_meta(Heap_Allocation_Metadata *meta) {
 #if CONFIGURATION == DEBUG
 	assert(meta->signature == HEAP_META_SIGNATURE, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
 #endif
+	assert(!is_heap_chunk_free(meta), "Heap error. Either 1) You passed a bad pointer to dealloc, 2) You deallocated the same pointer twice or 3) You corrupted the heap.");
 // If > 256GB then prolly not legit lol
-	assert(meta->size < 1024ULL*1024ULL*1024ULL*256ULL, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");	
-	assert(is_pointer_in_program_memory(meta->block), "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap."); 
+	assert(get_heap_chunk_size(meta) < 1024ULL*1024ULL*1024ULL*256ULL, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+	if (meta->size & HEAP_CHUNK_SMALL) {
+		// Small runs are declared further down, so only check what we can see from here
+		assert(is_pointer_in_program_memory(meta->run) && (u64)meta > (u64)meta->run, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+		return;
+	}
+	if (meta->size & HEAP_CHUNK_LARGE) {
+		assert(&meta->large->meta == meta, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+		assert(meta->large->mapping_offset + get_heap_chunk_size(meta) + sizeof(Heap_Large_Allocation) - sizeof(Heap_Allocation_Metadata) == meta->large->mapped_size, "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
+		return;
+	}
+	assert(is_pointer_in_program_memory(meta->block), "Heap error. Either 1) You passed a bad pointer to dealloc or 2) You corrupted the heap.");
 
 	assert((u64)meta >= (u64)meta->block->start && (u64)meta < (u64)meta->block->start+meta->block->size, "Heap error: Pointer is not in it's metadata block. This could be heap corruption but it's more likely an internal error. That's not good.");
 }
 
-typedef struct {
-	Heap_Free_Node *best_fit;
-	Heap_Free_Node *previous;
-	u64 delta;
-} Heap_Search_Result;
-Heap_Search_Result search_heap_block(Heap_Block *block, u64 size) {
-	
-	if (block->free_head == 0)  return (Heap_Search_Result){0, 0, 0};
-		
-	Heap_Free_Node *node = block->free_head;
-	Heap_Free_Node *previous = 0;
-	
-	Heap_Free_Node *best_fit = 0;
-	Heap_Free_Node *before_best_fit = 0;
-	u64 best_fit_delta = 0;
-	
-	while (node != 0) {
-		
-		if (node->size == size) {
-			Heap_Search_Result result;
-			result.best_fit = node;
-			result.previous = previous;
-			result.delta = 0;
-			assert(result.previous != result.best_fit, "Internal goof");
-			return result;
-		}
-		
-		if (node->size >= size) {
-			u64 delta = node->size - size;
-			
-			if (delta < best_fit_delta || !best_fit) {
-				before_best_fit = previous;
-				best_fit = node;
-				best_fit_delta = delta;
-			}
+///
+// Bins
+
+inline void heap_mapping_insert(u64 size, u32 *fl, u32 *sl) {
+	if (size < HEAP_SMALL_CHUNK_SIZE) {
+		*fl = 0;
+		*sl = (u32)(size / (HEAP_SMALL_CHUNK_SIZE / HEAP_SL_INDEX_COUNT));
+	} else {
+		u32 bit = bit_scan_reverse_64(size);
+		*sl = (u32)(size >> (bit - HEAP_SL_INDEX_COUNT_LOG2)) ^ (1 << HEAP_SL_INDEX_COUNT_LOG2);
+		*fl = bit - (HEAP_FL_INDEX_SHIFT - 1);
+	}
+}
+// Like insert, but rounds up to the next bin so whatever we find there is guaranteed to fit
+inline void heap_mapping_search(u64 size, u32 *fl, u32 *sl) {
+	if (size >= HEAP_SMALL_CHUNK_SIZE) {
+		size += (1ULL << (bit_scan_reverse_64(size) - HEAP_SL_INDEX_COUNT_LOG2)) - 1;
+	}
+	heap_mapping_insert(size, fl, sl);
+}
+
+Heap_Free_Node *heap_find_free_node(u64 size) {
+	u32 fl, sl;
+	heap_mapping_search(size, &fl, &sl);
+
+	if (fl >= HEAP_FL_INDEX_COUNT) return 0;
+
+	u32 sl_map = heap_bins.sl_bitmap[fl] & (~0U << sl);
+	if (!sl_map) {
+		if (fl+1 >= HEAP_FL_INDEX_COUNT) return 0;
+		u64 fl_map = heap_bins.fl_bitmap & (~0ULL << (fl+1));
+		if (!fl_map) return 0;
+
+		fl = bit_scan_forward_64(fl_map);
+		sl_map = heap_bins.sl_bitmap[fl];
+		assert(sl_map, "Internal heap error: heap bitmaps are out of sync");
+	}
+	sl = bit_scan_forward_64(sl_map);
+
+	Heap_Free_Node *node = heap_bins.heads[fl][sl];
+	assert(node && get_heap_chunk_size(node) >= size, "Internal heap error");
+	return node;
+}
+
+void heap_remove_free_node(Heap_Free_Node *node) {
+	u32 fl, sl;
+	heap_mapping_insert(get_heap_chunk_size(node), &fl, &sl);
+
+	if (node->prev) node->prev->next = node->next;
+	if (node->next) node->next->prev = node->prev;
+
+	if (heap_bins.heads[fl][sl] == node) {
+		heap_bins.heads[fl][sl] = node->next;
+		if (!node->next) {
+			heap_bins.sl_bitmap[fl] &= ~(1U << sl);
+			if (!heap_bins.sl_bitmap[fl]) heap_bins.fl_bitmap &= ~(1ULL << fl);
 		}
-		
-		if (node->next) previous = node;
-		node = node->next;
 	}
-	
-	if (!best_fit)  return (Heap_Search_Result){0, 0, 0};
 
-	Heap_Search_Result result;
-	result.best_fit = best_fit;
-	result.previous = before_best_fit;
-	result.delta = best_fit_delta;
-	assert(result.previous != result.best_fit, "Internal goof");
-	return result;
+	node->next = 0;
+	node->prev = 0;
+}
+
+// Pages which are completely inside a free chunk, excluding the header and footer.
+inline bool get_heap_free_chunk_inner_pages(void *chunk, u64 size, void **first_page, void **last_page_end) {
+	*first_page = (void*)align_next((u8*)chunk + sizeof(Heap_Free_Node), os.page_size);
+	*last_page_end = (void*)align_previous((u8*)chunk + size - sizeof(u64), os.page_size);
+	return (u8*)*last_page_end > (u8*)*first_page;
+}
+
+// Writes the free chunk header & footer and puts it in its bin.
+// Caller is responsible for the chunk not neighbouring any other free chunk.
+Heap_Free_Node *heap_insert_free_chunk(void *chunk, u64 size, Heap_Block *block) {
+	assert(size >= HEAP_MIN_CHUNK_SIZE && size % HEAP_ALIGNMENT == 0, "Internal heap error");
+
+	Heap_Free_Node *node = (Heap_Free_Node*)chunk;
+	node->size = size | HEAP_CHUNK_FREE;
+	node->block = block;
+	*(u64*)((u8*)chunk+size-sizeof(u64)) = size;
+
+	u8 *next_chunk = (u8*)chunk + size;
+	if (next_chunk < (u8*)get_heap_block_end(block)) {
+		*(u64*)next_chunk |= HEAP_CHUNK_PREV_FREE;
+	}
+
+	u32 fl, sl;
+	heap_mapping_insert(size, &fl, &sl);
+
+	node->prev = 0;
+	node->next = heap_bins.heads[fl][sl];
+	if (node->next) node->next->prev = node;
+	heap_bins.heads[fl][sl] = node;
+
+	heap_bins.fl_bitmap |= 1ULL << fl;
+	heap_bins.sl_bitmap[fl] |= 1U << sl;
+
+	// Lock the pages which are completely inside the free chunk, except the header and footer
+	// which we still need to touch.
+	void *first_page, *last_page_end;
+	if (get_heap_free_chunk_inner_pages(chunk, size, &first_page, &last_page_end)) {
+		os_lock_program_memory_pages(first_page, (u64)last_page_end-(u64)first_page);
+	}
+
+	return node;
 }
 
 Heap_Block *make_heap_block(Heap_Block *parent, u64 size) {
@@ -220,163 +428,120 @@ Heap_Block *make_heap_block(Heap_Block *parent, u64 size) {
 	size = align_next(size, os.page_size);
 
 	Heap_Block *block = (Heap_Block*)os_reserve_next_memory_pages(size);
-		
+
 	assert((u64)block % os.page_size == 0, "Heap block not aligned to page size");
-	
+
 	if (parent) parent->next = block;
 	os_unlock_program_memory_pages(block, size);
-	
+
 #if CONFIGURATION == DEBUG
 	block->total_allocated = 0;
 #endif
-	
+
 	block->start = ((u8*)block)+sizeof(Heap_Block);
 	block->size = size;
 	block->next = 0;
-	block->free_head = (Heap_Free_Node*)block->start;
-	block->free_head->size = get_heap_block_size_excluding_metadata(block);
-	block->free_head->next = 0;
-	
+	block->prev = parent;
+
+	Heap_Free_Node *node = heap_insert_free_chunk(block->start, get_heap_block_size_excluding_metadata(block), block);
+#if CONFIGURATION != DEBUG
+	// Fresh program memory is zero (in debug it's filled with 0xBA)
+	node->size |= HEAP_CHUNK_PURGED;
+#endif
+
 	return block;
 }
 
 void heap_init() {
 	if (heap_initted) return;
 	assert(HEAP_ALIGNMENT == 16);
+	assert((1 << HEAP_ALIGNMENT_LOG2) == HEAP_ALIGNMENT);
 	assert(sizeof(Heap_Allocation_Metadata) % HEAP_ALIGNMENT == 0);
+	assert(sizeof(Heap_Block) % HEAP_ALIGNMENT == 0);
+	assert(sizeof(Heap_Large_Allocation) == HEAP_LARGE_ALLOCATION_ALIGNMENT);
 	heap_initted = true;
+	memset(&heap_bins, 0, sizeof(heap_bins));
 	heap_head = make_heap_block(0, DEFAULT_HEAP_BLOCK_SIZE);
 	spinlock_init(&heap_lock);
+	spinlock_set_name(&heap_lock, STR("heap_lock"));
 }
 
-void *heap_alloc(u64 size) {
+inline u64 get_heap_chunk_size_for_allocation(u64 size) {
+	size += sizeof(Heap_Allocation_Metadata);
+	size = align_next(size, HEAP_ALIGNMENT);
+	return max(size, HEAP_MIN_CHUNK_SIZE);
+}
 
-	if (!heap_initted) heap_init();
+// heap_lock needs to be held
+// If clean_begin & clean_end are not 0 they are set to a range inside the allocation which is
+// known to be zero, so zeroing the allocation only needs to do the rest. May be empty.
+Heap_Allocation_Metadata *heap_alloc_chunk(u64 size, void **clean_begin, void **clean_end) {
 
-	// #Sync #Speed oof
-	spinlock_acquire_or_wait(&heap_lock);
-	
+	size = get_heap_chunk_size_for_allocation(size);
+	heap_chunk_operation_count += 1;
 
+	assert(size < MAX_HEAP_BLOCK_SIZE, "Allocation does not fit in a heap block. Large allocations should go through heap_alloc_large(), is HEAP_LARGE_ALLOCATION_THRESHOLD set higher than MAX_HEAP_BLOCK_SIZE?");
 
 
-	
-	size += sizeof(Heap_Allocation_Metadata);
-	
-	size = (size+HEAP_ALIGNMENT) & ~(HEAP_ALIGNMENT-1);
-	
-	assert(size < MAX_HEAP_BLOCK_SIZE, "Past Charlie has been lazy and did not handle large allocations like this. I apologize on behalf of past Charlie. A quick fix could be to increase the heap block size for now. #Incomplete #Limitation");
-	
-	
 #if VERY_DEBUG
 	{
 		Heap_Block *block = heap_head;
-		
+
 		while (block != 0) {
 			sanity_check_block(block);
 			block = block->next;
 		}
 	}
 #endif
-	
-	Heap_Block *block = heap_head;
-	Heap_Block *last_block = 0;
-	Heap_Free_Node *best_fit = 0;
-	Heap_Block *best_fit_block = 0;
-	Heap_Free_Node *previous = 0;
-	u64 best_fit_delta = 0;
-	// #Speed
-	// Maybe instead of going through EVERY free node to find best fit we do a good-enough fit
-	while (block != 0) {
-
-		if (get_heap_block_size_excluding_metadata(block) < size) {
-			last_block = block;
-			block = block->next;
-			continue;
-		}
-	
-		Heap_Search_Result result = search_heap_block(block, size);
-		Heap_Free_Node *node = result.best_fit;
-		if (node) {
-			if (node->size < size) continue;
-			if (node->size == size) {
-				best_fit = node;
-				best_fit_block = block;
-				previous = result.previous;
-				best_fit_delta = 0;
-				break;
-			}
-			
-			u64 delta = node->size-size;
-			if (delta < best_fit_delta || !best_fit) {
-				best_fit = node;
-				best_fit_block = block;
-				previous = result.previous;
-				best_fit_delta = delta;
-			}
-		}
-		
-		last_block = block;
-		block = block->next;
-	}
-	
+
+	Heap_Free_Node *best_fit = heap_find_free_node(size);
+
 	if (!best_fit) {
-		block = make_heap_block(last_block, max(DEFAULT_HEAP_BLOCK_SIZE, size));
-		previous = 0;
-		best_fit = block->free_head;
-		best_fit_block = block;
+		Heap_Block *last_block = heap_head;
+		while (last_block->next) last_block = last_block->next;
+
+		// Size may be rounded up to the next bin in search, so make sure the new block
+		// actually lands in a bin that fits.
+		u64 block_size = max(DEFAULT_HEAP_BLOCK_SIZE, size + (size >> HEAP_SL_INDEX_COUNT_LOG2));
+		make_heap_block(last_block, block_size);
+		best_fit = heap_find_free_node(size);
 	}
-		
-	
+
 	assert(best_fit != 0, "Internal heap error");
-	
+
+	heap_remove_free_node(best_fit);
+
+	Heap_Block *block = best_fit->block;
+	u64 free_size = get_heap_chunk_size(best_fit);
+	bool purged = (best_fit->size & HEAP_CHUNK_PURGED) != 0;
+	void *first_clean_page = 0, *last_clean_page_end = 0;
+	if (!purged || !get_heap_free_chunk_inner_pages(best_fit, free_size, &first_clean_page, &last_clean_page_end)) {
+		first_clean_page = last_clean_page_end = 0;
+	}
+
 	// Unlock best fit
-	
-	// #Copypaste
-	void *free_tail = (u8*)best_fit + best_fit->size;
 	void *first_page = (void*)align_previous(best_fit, os.page_size);
-	void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-	if ((u8*)last_page_end > (u8*)first_page) {
-		os_unlock_program_memory_pages(first_page, (u64)last_page_end-(u64)first_page);
-	}
-	
-	Heap_Free_Node *new_free_node = 0;
-	if (size != best_fit->size) {
-		u64 remainder = best_fit->size - size;
-		new_free_node = (Heap_Free_Node*)(((u8*)best_fit)+size);
-		new_free_node->size = remainder;
-		new_free_node->next = best_fit->next;
-		
-		// Lock remaining free node
-		// #Copypaste
-		void *free_tail = (u8*)new_free_node + new_free_node->size;
-		void *next_page = (void*)align_next(new_free_node, os.page_size);
-		void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-		if ((u8*)last_page_end > (u8*)next_page) {
-			os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
+	void *last_page_end = (void*)align_next((u8*)best_fit + free_size, os.page_size);
+	os_unlock_program_memory_pages(first_page, (u64)last_page_end-(u64)first_page);
+
+	if (free_size - size >= HEAP_MIN_CHUNK_SIZE) {
+		// Split, the remainder goes back in a bin
+		Heap_Free_Node *rest = heap_insert_free_chunk((u8*)best_fit + size, free_size - size, block);
+		// The inner pages of the remainder are inside ours, so they are still clean
+		if (purged) rest->size |= HEAP_CHUNK_PURGED;
+	} else {
+		size = free_size;
+		u8 *next_chunk = (u8*)best_fit + size;
+		if (next_chunk < (u8*)get_heap_block_end(block)) {
+			*(u64*)next_chunk &= ~HEAP_CHUNK_PREV_FREE;
 		}
 	}
-	
-	
-	if (previous && new_free_node) {
-		assert(previous->next == best_fit, "Internal heap error");
-		previous->next = new_free_node;
-	} else if (previous) {
-		assert(previous->next == best_fit, "Internal heap error");
-		previous->next = best_fit->next;
-	}
-	
-	if (best_fit_block->free_head == best_fit) {
-		// If we allocated the first free node then replace with new free node or just
-		// remove it if perfect fit.
-		if (new_free_node) {
-			new_free_node->next = best_fit_block->free_head->next;
-			best_fit_block->free_head = new_free_node;
-		} else best_fit_block->free_head = best_fit_block->free_head->next;
-	}
-	
+
+	// Free chunks always have an allocated chunk before them (or nothing) since neighbouring
+	// free chunks are always merged.
 	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)best_fit;
 	meta->size = size;
-	meta->block = best_fit_block;
+	meta->block = block;
 #if CONFIGURATION == DEBUG
 	meta->signature = HEAP_META_SIGNATURE;
 	meta->block->total_allocated += size;
@@ -387,277 +552,1763 @@ void *heap_alloc(u64 size) {
 #if VERY_DEBUG
 	sanity_check_block(meta->block);
 #endif
-	
-	// #Sync #Speed oof
-	spinlock_release(&heap_lock);
-	
-	
-	void *p = ((u8*)meta)+sizeof(Heap_Allocation_Metadata);
-	assert((u64)p % HEAP_ALIGNMENT == 0, "Internal heap error. Result pointer is not aligned to HEAP_ALIGNMENT");
-	return p;
+
+	if (clean_begin && clean_end) {
+		u8 *user_begin = (u8*)meta + sizeof(Heap_Allocation_Metadata);
+		u8 *user_end = (u8*)meta + size;
+		*clean_begin = max((u8*)first_clean_page, user_begin);
+		*clean_end = min((u8*)last_clean_page_end, user_end);
+		if (*clean_end < *clean_begin) *clean_end = *clean_begin;
+	}
+
+	return meta;
 }
-void heap_dealloc(void *p) {
-	// #Sync #Speed oof
-	
-	if (!heap_initted) heap_init();
 
-	spinlock_acquire_or_wait(&heap_lock);
-	
-	assert(is_pointer_in_program_memory(p), "A bad pointer was passed tp heap_dealloc: it is out of program memory bounds!"); 
-	p = (u8*)p-sizeof(Heap_Allocation_Metadata);
-	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(p);
+// heap_lock needs to be held
+void heap_dealloc_chunk(Heap_Allocation_Metadata *meta) {
 	check_meta(meta);
-	
+	heap_chunk_operation_count += 1;
+
 	// Yoink meta data before we start overwriting it
 	Heap_Block *block = meta->block;
-	u64 size = meta->size;
-	
-#if CONFIGURATION == DEBUG
-	memset(p, 0x69696969, size);
-#endif
-	
+	u64 size = get_heap_chunk_size(meta);
+	bool prev_free = (meta->size & HEAP_CHUNK_PREV_FREE) != 0;
+
 	#if VERY_DEBUG
 		sanity_check_block(block);
 	#endif
-	
-	Heap_Free_Node *new_node = cast(Heap_Free_Node*)p;
-	new_node->size = size;
-	
-	if (new_node < block->free_head) {
-		// #Copypaste
-		void *free_tail = (u8*)new_node + new_node->size;
-		void *next_page = (void*)align_next(new_node, os.page_size);
-		void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-		if ((u8*)last_page_end > (u8*)next_page) {
-			os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-		}
-		
-		if ((u8*)new_node+size == (u8*)block->free_head) {
-			new_node->size = size + block->free_head->size;
-			new_node->next = block->free_head->next;
-			block->free_head = new_node;
-		} else {
-			new_node->next = block->free_head;
-			block->free_head = new_node;
-		}
-		
-	} else {
-	
-		if (!block->free_head) {
-			block->free_head = new_node;
-			new_node->next = 0;
-			
-			// #Copypaste
-			void *free_tail = (u8*)new_node + new_node->size;
-			void *next_page = (void*)align_next(new_node, os.page_size);
-			void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-			if ((u8*)last_page_end > (u8*)next_page) {
-				os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-			}
-			
-		} else {
-			Heap_Free_Node *node = block->free_head;
-		
-			while (true) {
-			
-				assert(node != 0, "We didn't find where the free node should be! This is likely heap corruption (or, hopefully not, an internal error)");
-				
-				// In retrospect, I don't remember a good reason to care about where the
-				// free nodes are... maybe I'm just dumb right now? #Speed #Memory
-				// ... ACtually, it's probably to easily know when to merge free nodes.
-				// BUT. Maybe it's not worth the performance hit? Then again, if the heap
-				// allocator slows down your program you should rethink your memory management
-				// anyways...
-				
-				if (new_node >= node) {
-					u8* node_tail = (u8*)node + node->size;
-					if (cast(u8*)new_node == node_tail) {
-						
-						// We need to account for the cases where we coalesce free blocks with start/end in the middle
-						// of a page.
-						
-						u64 new_node_size = new_node->size;
-						
-						// #Copypaste
-						void *free_tail = (u8*)new_node + new_node->size;
-						void *next_page = (void*)align_previous(node_tail, os.page_size);
-						void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-
-						if ((u8*)next_page < (u8*)node) next_page = (u8*)next_page + os.page_size;
-						
-						if ((u8*)last_page_end > (u8*)next_page) {
-							os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-						}
-						
-						node->size += new_node_size;
-						
-						break;
-					} else {
-						new_node->next = node->next;
-						node->next = new_node;
-						
-						u8* new_node_tail = (u8*)new_node + new_node->size;
-						if (new_node->next && (u8*)new_node->next == new_node_tail) {
-							new_node->size += new_node->next->size;
-							new_node->next = new_node->next->next;
-						}
-						
-						// #Copypaste
-						void *free_tail = (u8*)new_node + new_node->size;
-						void *next_page = (void*)align_next(new_node, os.page_size);
-						void *last_page_end = (void*)align_previous(free_tail, os.page_size);
-						if ((u8*)last_page_end > (u8*)next_page) {
-							os_lock_program_memory_pages(next_page, (u64)last_page_end-(u64)next_page);
-						}
-						
-						break;
-					}
-				}
-				
-				node = node->next;
-			}
-		}
-	}
-	
 
 #if CONFIGURATION == DEBUG
+	memset(meta, 0x69696969, size);
 	block->total_allocated -= size;
 #endif
 
-#if VERY_DEBUG
-	sanity_check_block(block);
-#endif
-	// #Sync #Speed oof
-	spinlock_release(&heap_lock);
-}
+	u8 *chunk = (u8*)meta;
 
-void* heap_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
-	switch (message) {
-		case ALLOCATOR_ALLOCATE: {
-			return heap_alloc(size);
-			break;
-		}
-		case ALLOCATOR_DEALLOCATE: {
-			heap_dealloc(p);
-			return 0;
-		}
-		case ALLOCATOR_REALLOCATE: {
-			if (!p) {
-				return heap_alloc(size);
-			}
-			assert(is_pointer_valid(p), "Invalid pointer passed to heap allocator reallocate");
-			Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)(((u64)p)-sizeof(Heap_Allocation_Metadata));
-			check_meta(meta);
-			void *new = heap_alloc(size);
-			memcpy(new, p, min(size, meta->size));
-			heap_dealloc(p);
-			return new;
-		}
+	// Merge with previous chunk
+	if (prev_free) {
+		u64 prev_size = *(u64*)(chunk-sizeof(u64));
+		Heap_Free_Node *prev = (Heap_Free_Node*)(chunk-prev_size);
+		assert(is_heap_chunk_free(prev) && get_heap_chunk_size(prev) == prev_size, "Heap free chunk footer is corrupt");
+		heap_remove_free_node(prev);
+		chunk = (u8*)prev;
+		size += prev_size;
 	}
-	return 0;
-}
 
-Allocator get_heap_allocator() {
-	Allocator heap_allocator;
-	
-	heap_allocator.proc = heap_allocator_proc;
-	heap_allocator.data = 0;
-	
-	return heap_allocator;
+	// Merge with next chunk
+	u8 *next_chunk = chunk + size;
+	if (next_chunk < (u8*)get_heap_block_end(block) && is_heap_chunk_free(next_chunk)) {
+		Heap_Free_Node *next = (Heap_Free_Node*)next_chunk;
+		heap_remove_free_node(next);
+		size += get_heap_chunk_size(next);
+	}
+
+	heap_insert_free_chunk(chunk, size, block);
+
+#if VERY_DEBUG
+	sanity_check_block(block);
+#endif
 }
 
 ///
+// Thread caches
 ///
-// Temporary storage
-///
+// Allocations up to HEAP_THREAD_CACHE_MAX_SIZE never touch heap_lock in the common case.
+// Each thread has a cache with a "magazine" of runs per size class. A run is one regular heap
+// allocation carved into same-sized objects. The owning thread allocates & frees objects in
+// its own runs without any sync.
+// Objects freed by another thread are pushed on the owning cache's remote free list with a
+// CAS, and the owner puts them back in their runs next time it runs out of objects.
+// heap_lock is only taken to get a new run from the heap or give an empty run back.
+//
+// When a thread exits its cache is abandoned and the next new thread adopts it, since there
+// might still be live objects in its runs.
 
-#ifndef TEMPORARY_STORAGE_SIZE
-	#define TEMPORARY_STORAGE_SIZE (1024ULL*1024ULL*2ULL) // 2mb
-#endif
+#define HEAP_SMALL_RUN_MIN_SIZE KB(16)
+#define HEAP_SMALL_RUN_MIN_OBJECT_COUNT 16
 
-ogb_instance void* talloc(u64);
-ogb_instance void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void*);
+// Object sizes are 16 byte steps up to 128, then 4 steps per power of two.
+const u64 heap_small_class_sizes[HEAP_SMALL_CLASS_COUNT] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+};
+
+typedef struct Heap_Small_Run {
+	Heap_Thread_Cache *owner;
+	Heap_Small_Run *next;
+	Heap_Small_Run *prev;
+	void *free_list; // Next pointer is stored where the object data goes
+	u8 *bump; // Objects from here to end were never handed out
+	u8 *end;
+	u64 stride;
+	u32 class_index;
+	u32 used_count;
+} Heap_Small_Run;
+
+typedef struct Heap_Thread_Cache {
+	// Runs with free objects. Full runs are unlinked until something is freed in them.
+	Heap_Small_Run *runs[HEAP_SMALL_CLASS_COUNT];
+	volatile u64 remote_free_head; // void*
+	u64 thread_id;
+	Heap_Thread_Cache *next_abandoned;
+	Heap_Thread_Cache *next_registered; // Every cache ever made, for heap_get_stats()
+	u64 allocation_counts[HEAP_STATS_BUCKET_COUNT]; // Only touched by the owning thread
+} Heap_Thread_Cache;
 
 // #Global
-ogb_instance Allocator 
-get_temporary_allocator();
+ogb_instance Heap_Thread_Cache *heap_abandoned_thread_caches;
+ogb_instance Heap_Thread_Cache *heap_registered_thread_caches;
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
-thread_local void * temporary_storage = 0;
-thread_local void * temporary_storage_pointer = 0;
-thread_local bool   has_warned_temporary_storage_overflow = false;
-thread_local Allocator temp_allocator;
+Heap_Thread_Cache *heap_abandoned_thread_caches = 0;
+Heap_Thread_Cache *heap_registered_thread_caches = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
 
-ogb_instance Allocator 
-get_temporary_allocator() {
-	return temp_allocator;
-}
-#endif
+thread_local Heap_Thread_Cache *heap_thread_cache = 0;
 
-ogb_instance void* 
-temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data);
+inline u32 get_heap_small_class_index(u64 size) {
+	assert(size > 0 && size <= HEAP_THREAD_CACHE_MAX_SIZE, "Internal heap error");
+	if (size <= 128) return (u32)((size-1) >> 4);
+	u32 bit = bit_scan_reverse_64(size-1);
+	return 8 + (bit-7)*4 + (u32)(((size-1) - (1ULL << bit)) >> (bit-2));
+}
 
-ogb_instance void 
-temporary_storage_init(u64 arena_size);
+Heap_Thread_Cache *heap_get_thread_cache() {
+	if (heap_thread_cache) return heap_thread_cache;
 
-ogb_instance void* 
-talloc(u64 size);
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Thread_Cache *cache = heap_abandoned_thread_caches;
+	if (cache) {
+		heap_abandoned_thread_caches = cache->next_abandoned;
+	} else {
+		cache = (Heap_Thread_Cache*)((u8*)heap_alloc_chunk(sizeof(Heap_Thread_Cache), 0, 0)+sizeof(Heap_Allocation_Metadata));
+		memset(cache, 0, sizeof(Heap_Thread_Cache));
+		cache->next_registered = heap_registered_thread_caches;
+		heap_registered_thread_caches = cache;
+	}
+	spinlock_release(&heap_lock);
+
+	cache->next_abandoned = 0;
+	cache->thread_id = context.thread_id;
+	heap_thread_cache = cache;
+	return cache;
+}
+
+inline void heap_small_run_link(Heap_Thread_Cache *cache, Heap_Small_Run *run) {
+	run->prev = 0;
+	run->next = cache->runs[run->class_index];
+	if (run->next) run->next->prev = run;
+	cache->runs[run->class_index] = run;
+}
+inline void heap_small_run_unlink(Heap_Thread_Cache *cache, Heap_Small_Run *run) {
+	if (run->prev) run->prev->next = run->next;
+	else cache->runs[run->class_index] = run->next;
+	if (run->next) run->next->prev = run->prev;
+	run->next = 0;
+	run->prev = 0;
+}
+inline bool heap_small_run_has_free_objects(Heap_Small_Run *run) {
+	return run->free_list || run->bump < run->end;
+}
+
+// Puts a freed object back in its run. Owner thread only.
+void heap_small_run_put_back(Heap_Thread_Cache *cache, Heap_Allocation_Metadata *meta) {
+	Heap_Small_Run *run = meta->run;
+	assert(run->owner == cache, "Internal heap error");
+
+	bool was_full = !heap_small_run_has_free_objects(run);
+
+	void *p = (u8*)meta + sizeof(Heap_Allocation_Metadata);
+#if CONFIGURATION == DEBUG
+	memset(p, 0x69, run->stride-sizeof(Heap_Allocation_Metadata));
+#endif
+	meta->size |= HEAP_CHUNK_FREE;
+	*(void**)p = run->free_list;
+	run->free_list = p;
+
+	assert(run->used_count > 0, "Internal heap error");
+	run->used_count -= 1;
+
+	if (was_full) heap_small_run_link(cache, run);
+
+	// Give completely empty runs back to the heap, unless it's the only one we have for this class
+	if (run->used_count == 0 && (run->next || run->prev)) {
+		heap_small_run_unlink(cache, run);
+		spinlock_acquire_or_wait(&heap_lock);
+		heap_dealloc_chunk((Heap_Allocation_Metadata*)((u8*)run-sizeof(Heap_Allocation_Metadata)));
+		spinlock_release(&heap_lock);
+	}
+}
+
+void heap_thread_cache_collect_remote_frees(Heap_Thread_Cache *cache) {
+	if (!cache->remote_free_head) return;
+
+	u64 head = atomic64_exchange(&cache->remote_free_head, 0, MEMORY_ORDER_ACQUIRE);
+
+	void *p = (void*)head;
+	while (p) {
+		void *next = *(void**)p;
+		heap_small_run_put_back(cache, (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata)));
+		p = next;
+	}
+}
+
+Heap_Small_Run *heap_make_small_run(Heap_Thread_Cache *cache, u32 class_index) {
+	u64 stride = heap_small_class_sizes[class_index] + sizeof(Heap_Allocation_Metadata);
+	u64 run_size = max(HEAP_SMALL_RUN_MIN_SIZE, sizeof(Heap_Small_Run) + stride*HEAP_SMALL_RUN_MIN_OBJECT_COUNT);
+
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Allocation_Metadata *chunk = heap_alloc_chunk(run_size, 0, 0);
+	spinlock_release(&heap_lock);
+
+	Heap_Small_Run *run = (Heap_Small_Run*)((u8*)chunk + sizeof(Heap_Allocation_Metadata));
+	memset(run, 0, sizeof(Heap_Small_Run));
+	run->owner = cache;
+	run->stride = stride;
+	run->class_index = class_index;
+	run->bump = (u8*)run + sizeof(Heap_Small_Run);
+	run->end = run->bump + ((get_heap_chunk_size(chunk) - sizeof(Heap_Allocation_Metadata) - sizeof(Heap_Small_Run)) / stride) * stride;
+
+	heap_small_run_link(cache, run);
+	return run;
+}
+
+void *heap_thread_cache_alloc(Heap_Thread_Cache *cache, u64 size) {
+	u32 class_index = get_heap_small_class_index(size);
+
+	Heap_Small_Run *run = cache->runs[class_index];
+	if (!run) {
+		heap_thread_cache_collect_remote_frees(cache);
+		run = cache->runs[class_index];
+		if (!run) run = heap_make_small_run(cache, class_index);
+	}
+
+	void *p;
+	Heap_Allocation_Metadata *meta;
+	if (run->free_list) {
+		p = run->free_list;
+		run->free_list = *(void**)p;
+		meta = (Heap_Allocation_Metadata*)((u8*)p - sizeof(Heap_Allocation_Metadata));
+		assert(meta->size & HEAP_CHUNK_FREE, "Heap error. Memory was written to after it was freed.");
+	} else {
+		meta = (Heap_Allocation_Metadata*)run->bump;
+		run->bump += run->stride;
+		p = (u8*)meta + sizeof(Heap_Allocation_Metadata);
+	}
+
+	meta->size = run->stride | HEAP_CHUNK_SMALL;
+	meta->run = run;
+#if CONFIGURATION == DEBUG
+	meta->signature = HEAP_META_SIGNATURE;
+#endif
+	run->used_count += 1;
+
+	if (!heap_small_run_has_free_objects(run)) heap_small_run_unlink(cache, run);
+
+	return p;
+}
+
+void heap_thread_cache_dealloc(Heap_Allocation_Metadata *meta) {
+	check_meta(meta);
+	Heap_Small_Run *run = meta->run;
+
+	if (run->owner == heap_thread_cache) {
+		heap_small_run_put_back(run->owner, meta);
+	} else {
+		// Another thread owns this, hand it back through its remote free list.
+		Heap_Thread_Cache *owner = run->owner;
+		void *p = (u8*)meta + sizeof(Heap_Allocation_Metadata);
+		u64 head;
+		do {
+			head = owner->remote_free_head;
+			*(void**)p = (void*)head;
+		} while (!compare_and_swap_64(&owner->remote_free_head, (u64)p, head));
+	}
+}
+
+///
+// Large allocations
+///
+// Each large allocation is its own OS mapping aligned to os.granularity, so there's nothing to
+// fragment and the memory goes back to the OS the moment it's freed. Growing tries to map the
+// virtual range right after the mapping so we don't need to move.
+// heap_lock only guards the list, the mapping/unmapping happens outside of it.
+
+// user_offset is how far into the mapping the allocation starts
+inline u64 get_heap_large_mapping_size(u64 user_offset, u64 size) {
+	return align_next(user_offset + size, os.granularity);
+}
+inline u64 get_heap_large_chunk_size(Heap_Large_Allocation *large) {
+	return large->mapped_size - large->mapping_offset - sizeof(Heap_Large_Allocation) + sizeof(Heap_Allocation_Metadata);
+}
+
+// Alignment must be a power of two
+void *heap_alloc_large(u64 size, u64 alignment) {
+	alignment = max(alignment, HEAP_LARGE_ALLOCATION_ALIGNMENT);
+
+	// The mapping is only os.granularity aligned, so we may need to slide the header forward.
+	// It never needs more than this.
+	u64 max_user_offset = align_next(sizeof(Heap_Large_Allocation), alignment);
+	u64 mapped_size = get_heap_large_mapping_size(max_user_offset, size);
+
+	u8 *base = (u8*)os_map_pages(0, mapped_size);
+	assert(base, "Failed mapping %llu bytes for a large heap allocation. Are we out of memory?", mapped_size);
+
+	u8 *p = (u8*)align_next(base + sizeof(Heap_Large_Allocation), alignment);
+	Heap_Large_Allocation *large = (Heap_Large_Allocation*)(p - sizeof(Heap_Large_Allocation));
+
+	large->mapped_size = mapped_size;
+	large->mapping_offset = (u64)((u8*)large - base);
+	large->prev = 0;
+	large->meta.size = get_heap_large_chunk_size(large) | HEAP_CHUNK_LARGE;
+	large->meta.large = large;
+#if CONFIGURATION == DEBUG
+	large->meta.signature = HEAP_META_SIGNATURE;
+#endif
+
+	spinlock_acquire_or_wait(&heap_lock);
+	large->next = heap_large_allocations;
+	if (large->next) large->next->prev = large;
+	heap_large_allocations = large;
+	spinlock_release(&heap_lock);
+
+	return p;
+}
+
+void heap_dealloc_large(Heap_Allocation_Metadata *meta) {
+	check_meta(meta);
+	Heap_Large_Allocation *large = meta->large;
+
+	spinlock_acquire_or_wait(&heap_lock);
+	if (large->prev) large->prev->next = large->next;
+	else heap_large_allocations = large->next;
+	if (large->next) large->next->prev = large->prev;
+	spinlock_release(&heap_lock);
+
+	os_unmap_pages((u8*)large - large->mapping_offset, large->mapped_size);
+}
+
+bool heap_try_grow_large_in_place(Heap_Allocation_Metadata *meta, u64 size) {
+	check_meta(meta);
+	Heap_Large_Allocation *large = meta->large;
+
+	u8 *base = (u8*)large - large->mapping_offset;
+	u64 new_mapped_size = get_heap_large_mapping_size(large->mapping_offset + sizeof(Heap_Large_Allocation), size);
+	if (new_mapped_size <= large->mapped_size) return true;
+
+	u64 extra = new_mapped_size - large->mapped_size;
+	void *tail = base + large->mapped_size;
+
+	// Only succeeds if nothing else is mapped there
+	if (os_map_pages(tail, extra) != tail) return false;
+
+	large->mapped_size = new_mapped_size;
+	meta->size = get_heap_large_chunk_size(large) | HEAP_CHUNK_LARGE;
+	return true;
+}
+
+// Gives completely empty runs back to the heap. heap_lock needs to be held, and the cache must
+// be the calling thread's or one that nobody owns.
+void heap_thread_cache_release_empty_runs(Heap_Thread_Cache *cache) {
+	for (u32 i = 0; i < HEAP_SMALL_CLASS_COUNT; i++) {
+		Heap_Small_Run *run = cache->runs[i];
+		while (run) {
+			Heap_Small_Run *next = run->next;
+			if (run->used_count == 0) {
+				heap_small_run_unlink(cache, run);
+				heap_dealloc_chunk((Heap_Allocation_Metadata*)((u8*)run-sizeof(Heap_Allocation_Metadata)));
+			}
+			run = next;
+		}
+	}
+}
+
+// Called when a thread exits
+void heap_thread_cache_release() {
+	Heap_Thread_Cache *cache = heap_thread_cache;
+	if (!cache) return;
+
+	heap_thread_cache_collect_remote_frees(cache);
+
+	spinlock_acquire_or_wait(&heap_lock);
+	heap_thread_cache_release_empty_runs(cache);
+	// Runs with live objects stay with the cache until some new thread adopts it
+	cache->thread_id = 0;
+	cache->next_abandoned = heap_abandoned_thread_caches;
+	heap_abandoned_thread_caches = cache;
+	spinlock_release(&heap_lock);
+
+	heap_thread_cache = 0;
+}
+
+inline u32 get_heap_stats_bucket(u64 size) {
+	if (size <= 16) return 0;
+	return (u32)min(bit_scan_reverse_64(size-1) - 3, HEAP_STATS_BUCKET_COUNT-1);
+}
+
+// If zero, the first size bytes are zero. Only the parts not already known to be zero are
+// written: large allocations are fresh pages from the OS, and chunks carved from purged or never
+// touched free chunks only need the edges around their clean pages zeroed.
+void *heap_alloc_internal(u64 size, bool zero) {
+
+	if (!heap_initted) heap_init();
+
+	Heap_Thread_Cache *cache = heap_get_thread_cache();
+	cache->allocation_counts[get_heap_stats_bucket(size)] += 1;
+
+	if (size <= HEAP_THREAD_CACHE_MAX_SIZE) {
+		void *p = heap_thread_cache_alloc(cache, size);
+		assert((u64)p % HEAP_ALIGNMENT == 0, "Internal heap error. Result pointer is not aligned to HEAP_ALIGNMENT");
+		if (zero) memset(p, 0, size);
+		return p;
+	}
+	if (size >= HEAP_LARGE_ALLOCATION_THRESHOLD) {
+		void *p = heap_alloc_large(size, HEAP_LARGE_ALLOCATION_ALIGNMENT);
+		assert((u64)p % HEAP_ALIGNMENT == 0, "Internal heap error. Result pointer is not aligned to HEAP_ALIGNMENT");
+		return p;
+	}
+
+	u8 *clean_begin, *clean_end;
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Allocation_Metadata *meta = heap_alloc_chunk(size, (void**)&clean_begin, (void**)&clean_end);
+	// #Sync #Speed oof
+	spinlock_release(&heap_lock);
+
+
+	u8 *p = ((u8*)meta)+sizeof(Heap_Allocation_Metadata);
+	assert((u64)p % HEAP_ALIGNMENT == 0, "Internal heap error. Result pointer is not aligned to HEAP_ALIGNMENT");
+
+	if (zero) {
+		u8 *end = p + size;
+		clean_end = min(clean_end, end);
+		if (clean_end > clean_begin) {
+			memset(p, 0, clean_begin-p);
+			memset(clean_end, 0, end-clean_end);
+		} else {
+			memset(p, 0, size);
+		}
+	}
+
+	return p;
+}
+#if ENABLE_PROFILING
+// Usable size, same as heap_get_allocation_size()
+inline u64 heap_profile_allocation_size(void *p) {
+	return get_heap_chunk_size((u8*)p-sizeof(Heap_Allocation_Metadata)) - sizeof(Heap_Allocation_Metadata);
+}
+void heap_profile_alloc(void *p) {
+	u64 size = heap_profile_allocation_size(p);
+	u64 bytes = atomic64_fetch_add(&heap_profile_allocated_bytes, size, MEMORY_ORDER_RELAXED) + size;
+	// Small allocations are too frequent to each get a point, os_update() reports once per frame
+	if (size > HEAP_THREAD_CACHE_MAX_SIZE) tm_counter("Heap allocated bytes", bytes);
+}
+void heap_profile_dealloc(void *p) {
+	atomic64_fetch_sub(&heap_profile_allocated_bytes, heap_profile_allocation_size(p), MEMORY_ORDER_RELAXED);
+}
+#endif
+
+void *heap_alloc(u64 size) {
+	void *p = heap_alloc_internal(size, false);
+#if ENABLE_PROFILING
+	heap_profile_alloc(p);
+#endif
+	return p;
+}
+void *heap_alloc_zeroed(u64 size) {
+	void *p = heap_alloc_internal(size, true);
+#if ENABLE_PROFILING
+	heap_profile_alloc(p);
+#endif
+	return p;
+}
+void heap_dealloc(void *p) {
+
+	if (!heap_initted) heap_init();
+
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata));
+
+	if (!is_pointer_in_program_memory(p)) {
+#if CONFIGURATION == DEBUG
+		assert(is_pointer_in_large_heap_allocation(p), "A bad pointer was passed tp heap_dealloc: it is out of program memory bounds!");
+#endif
+#if CONFIGURATION != RELEASE
+		// Anything else out here would get unlinked & unmapped as if it was a large allocation
+		assert((meta->size & HEAP_CHUNK_LARGE) && meta->large == (Heap_Large_Allocation*)((u8*)p - sizeof(Heap_Large_Allocation)), "A bad pointer was passed tp heap_dealloc: it is out of program memory bounds and not a large heap allocation!");
+#endif
+#if ENABLE_PROFILING
+		heap_profile_dealloc(p);
+#endif
+		heap_dealloc_large(meta);
+		return;
+	}
+
+#if ENABLE_PROFILING
+	heap_profile_dealloc(p);
+#endif
+
+	if (meta->size & HEAP_CHUNK_SMALL) {
+		heap_thread_cache_dealloc(meta);
+		return;
+	}
+
+	// #Sync #Speed oof
+	spinlock_acquire_or_wait(&heap_lock);
+	heap_dealloc_chunk(meta);
+	// #Sync #Speed oof
+	spinlock_release(&heap_lock);
+}
+
+// heap_lock needs to be held
+// Grows or shrinks a chunk into/out of the free chunk right after it, if any.
+bool heap_try_resize_chunk_in_place(Heap_Allocation_Metadata *meta, u64 size) {
+	check_meta(meta);
+
+	size = get_heap_chunk_size_for_allocation(size);
+
+	Heap_Block *block = meta->block;
+	u64 current_size = get_heap_chunk_size(meta);
+	u8 *chunk = (u8*)meta;
+	u8 *block_end = (u8*)get_heap_block_end(block);
+
+	u8 *next_chunk = chunk + current_size;
+	bool next_free = next_chunk < block_end && is_heap_chunk_free(next_chunk);
+
+	u64 available = current_size;
+	if (next_free) available += get_heap_chunk_size(next_chunk);
+
+	if (available < size) return false;
+	if (size <= current_size && current_size - size < HEAP_MIN_CHUNK_SIZE) return true; // Not worth splitting
+
+	#if VERY_DEBUG
+		sanity_check_block(block);
+	#endif
+
+	if (next_free) {
+		Heap_Free_Node *next = (Heap_Free_Node*)next_chunk;
+		heap_remove_free_node(next);
+
+		void *first_page = (void*)align_previous(next, os.page_size);
+		void *last_page_end = (void*)align_next((u8*)next + get_heap_chunk_size(next), os.page_size);
+		os_unlock_program_memory_pages(first_page, (u64)last_page_end-(u64)first_page);
+	}
+
+	if (available - size >= HEAP_MIN_CHUNK_SIZE) {
+		heap_insert_free_chunk(chunk + size, available - size, block);
+	} else {
+		size = available;
+		u8 *after = chunk + size;
+		if (after < block_end) *(u64*)after &= ~HEAP_CHUNK_PREV_FREE;
+	}
+
+#if CONFIGURATION == DEBUG
+	block->total_allocated += size;
+	block->total_allocated -= current_size;
+#endif
+	meta->size = size | (meta->size & HEAP_CHUNK_PREV_FREE);
+
+	#if VERY_DEBUG
+		sanity_check_block(block);
+	#endif
+
+	return true;
+}
+
+// heap_lock needs to be held
+// Allocates a bigger chunk and gives the part in front of the aligned address back as its own
+// free chunk, so the result is a normal chunk that deallocs like any other.
+Heap_Allocation_Metadata *heap_alloc_chunk_aligned(u64 size, u64 alignment) {
+	assert(alignment > HEAP_ALIGNMENT, "Internal heap error");
+
+	Heap_Allocation_Metadata *meta = heap_alloc_chunk(size + alignment + HEAP_MIN_CHUNK_SIZE, 0, 0);
+	u8 *p = (u8*)meta + sizeof(Heap_Allocation_Metadata);
+
+	if ((u64)p % alignment != 0) {
+		// The front part needs to be big enough to be a free chunk
+		u8 *aligned_p = (u8*)align_next(p + HEAP_MIN_CHUNK_SIZE, alignment);
+		Heap_Allocation_Metadata *aligned_meta = (Heap_Allocation_Metadata*)(aligned_p - sizeof(Heap_Allocation_Metadata));
+		u64 front_size = (u64)((u8*)aligned_meta - (u8*)meta);
+		u64 total_size = get_heap_chunk_size(meta);
+
+		aligned_meta->size = total_size - front_size;
+		aligned_meta->block = meta->block;
+#if CONFIGURATION == DEBUG
+		aligned_meta->signature = HEAP_META_SIGNATURE;
+#endif
+		meta->size = front_size | (meta->size & HEAP_CHUNK_PREV_FREE);
+		heap_dealloc_chunk(meta);
+
+		meta = aligned_meta;
+	}
+
+	// Give back what we don't need at the end
+	heap_try_resize_chunk_in_place(meta, size);
+
+	return meta;
+}
+
+// Alignment must be a power of two. If zero, the first size bytes are zero.
+void *heap_alloc_aligned_internal(u64 size, u64 alignment, bool zero) {
+	assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Alignment must be a power of two, got %llu", alignment);
+
+	if (alignment <= HEAP_ALIGNMENT) return heap_alloc_internal(size, zero);
+
+	if (!heap_initted) heap_init();
+
+	Heap_Thread_Cache *cache = heap_get_thread_cache();
+	cache->allocation_counts[get_heap_stats_bucket(size)] += 1;
+
+	void *p;
+	if (size >= HEAP_LARGE_ALLOCATION_THRESHOLD) {
+		// Fresh pages from the OS, already zero
+		p = heap_alloc_large(size, alignment);
+	} else {
+		// #Sync #Speed oof
+		spinlock_acquire_or_wait(&heap_lock);
+		Heap_Allocation_Metadata *meta = heap_alloc_chunk_aligned(size, alignment);
+		// #Sync #Speed oof
+		spinlock_release(&heap_lock);
+
+		p = ((u8*)meta)+sizeof(Heap_Allocation_Metadata);
+		if (zero) memset(p, 0, size);
+	}
+
+	assert((u64)p % alignment == 0, "Internal heap error. Result pointer is not aligned to %llu", alignment);
+	return p;
+}
+void *heap_alloc_aligned(u64 size, u64 alignment) {
+	void *p = heap_alloc_aligned_internal(size, alignment, false);
+#if ENABLE_PROFILING
+	heap_profile_alloc(p);
+#endif
+	return p;
+}
+void *heap_alloc_aligned_zeroed(u64 size, u64 alignment) {
+	void *p = heap_alloc_aligned_internal(size, alignment, true);
+#if ENABLE_PROFILING
+	heap_profile_alloc(p);
+#endif
+	return p;
+}
+
+// Size the user can use, which may be more than what was requested.
+u64 heap_get_allocation_size(void *p) {
+	Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata));
+	check_meta(meta);
+	return get_heap_chunk_size(meta) - sizeof(Heap_Allocation_Metadata);
+}
+
+void* heap_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+	switch (message) {
+		case ALLOCATOR_ALLOCATE: {
+			return heap_alloc(size);
+			break;
+		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			return heap_alloc_zeroed(size);
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			return heap_alloc_aligned(size, (u64)p);
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED_ZEROED: {
+			return heap_alloc_aligned_zeroed(size, (u64)p);
+		}
+		case ALLOCATOR_DEALLOCATE: {
+			heap_dealloc(p);
+			return 0;
+		}
+		case ALLOCATOR_REALLOCATE: {
+			if (!p) {
+				return heap_alloc(size);
+			}
+#if CONFIGURATION == DEBUG
+			assert(is_pointer_valid(p), "Invalid pointer passed to heap allocator reallocate");
+#endif
+			u64 old_size = heap_get_allocation_size(p);
+			Heap_Allocation_Metadata *meta = (Heap_Allocation_Metadata*)((u8*)p-sizeof(Heap_Allocation_Metadata));
+			
+			bool in_place = false;
+			if (meta->size & HEAP_CHUNK_SMALL) {
+				in_place = size <= old_size;
+			} else if (meta->size & HEAP_CHUNK_LARGE) {
+				in_place = size <= old_size || heap_try_grow_large_in_place(meta, size);
+			} else if (size < HEAP_LARGE_ALLOCATION_THRESHOLD) {
+				spinlock_acquire_or_wait(&heap_lock);
+				in_place = heap_try_resize_chunk_in_place(meta, size);
+				spinlock_release(&heap_lock);
+			}
+			
+			if (in_place) {
+				atomic64_fetch_add(&heap_realloc_in_place_count, 1, MEMORY_ORDER_RELAXED);
+#if ENABLE_PROFILING
+				atomic64_fetch_add(&heap_profile_allocated_bytes, heap_get_allocation_size(p)-old_size, MEMORY_ORDER_RELAXED);
+#endif
+				return p;
+			}
+			
+			atomic64_fetch_add(&heap_realloc_moved_count, 1, MEMORY_ORDER_RELAXED);
+			
+			void *new = heap_alloc(size);
+			memcpy(new, p, min(size, old_size));
+			heap_dealloc(p);
+			return new;
+		}
+	}
+	return 0;
+}
+
+Allocator get_heap_allocator() {
+	Allocator heap_allocator;
+	
+	heap_allocator.proc = heap_allocator_proc;
+	heap_allocator.data = 0;
+	
+	return heap_allocator;
+}
+
+///
+// Heap stats
+///
+// Available in all configurations so you can look at the heap in a release build.
+// heap_get_stats() walks every block under heap_lock, so it's not something to call every frame
+// if the heap is big.
+// Objects handed out by thread caches live in runs which are regular heap chunks, so they count
+// as used as long as the run is alive.
+
+typedef struct Heap_Stats {
+	u64 block_count;
+	u64 committed_bytes; // Heap blocks + large allocation mappings
+	u64 used_bytes; // Allocated chunks including metadata, + large allocation mappings
+	u64 free_bytes;
+	u64 free_node_count;
+	u64 largest_free_node;
+	// 0 when all free memory is one chunk, approaching 1 the more it's split up
+	float64 fragmentation;
+
+	u64 large_allocation_count;
+	u64 large_allocation_bytes;
+
+	u64 realloc_in_place_count;
+	u64 realloc_moved_count;
+
+	// Number of heap_alloc calls since startup, see HEAP_STATS_BUCKET_COUNT
+	u64 allocation_counts[HEAP_STATS_BUCKET_COUNT];
+} Heap_Stats;
+
+u64 get_heap_stats_bucket_max_size(u32 bucket) {
+	if (bucket >= HEAP_STATS_BUCKET_COUNT-1) return UINT64_MAX;
+	return 16ULL << bucket;
+}
+
+Heap_Stats heap_get_stats() {
+	if (!heap_initted) heap_init();
+
+	Heap_Stats stats = ZERO(Heap_Stats);
+
+	spinlock_acquire_or_wait(&heap_lock);
+
+	Heap_Block *block = heap_head;
+	while (block) {
+		stats.block_count += 1;
+		stats.committed_bytes += get_heap_block_size_including_metadata(block);
+
+		u8 *chunk = (u8*)block->start;
+		u8 *end = (u8*)get_heap_block_end(block);
+		while (chunk < end) {
+			u64 size = get_heap_chunk_size(chunk);
+			if (is_heap_chunk_free(chunk)) {
+				stats.free_bytes += size;
+				stats.free_node_count += 1;
+				stats.largest_free_node = max(stats.largest_free_node, size);
+			} else {
+				stats.used_bytes += size;
+			}
+			chunk += size;
+		}
+
+		block = block->next;
+	}
+
+	Heap_Large_Allocation *large = heap_large_allocations;
+	while (large) {
+		stats.large_allocation_count += 1;
+		stats.large_allocation_bytes += large->mapped_size;
+		large = large->next;
+	}
+	stats.committed_bytes += stats.large_allocation_bytes;
+	stats.used_bytes += stats.large_allocation_bytes;
+
+	// Other threads may be bumping their counts while we read, that's fine for stats.
+	Heap_Thread_Cache *cache = heap_registered_thread_caches;
+	while (cache) {
+		for (u32 i = 0; i < HEAP_STATS_BUCKET_COUNT; i++) {
+			stats.allocation_counts[i] += cache->allocation_counts[i];
+		}
+		cache = cache->next_registered;
+	}
+
+	spinlock_release(&heap_lock);
+
+	if (stats.free_bytes) {
+		stats.fragmentation = 1.0 - (float64)stats.largest_free_node/(float64)stats.free_bytes;
+	}
+	stats.realloc_in_place_count = heap_realloc_in_place_count;
+	stats.realloc_moved_count = heap_realloc_moved_count;
+
+	return stats;
+}
+
+void log_heap_stats(Heap_Stats stats) {
+	log("Heap: %llu blocks, %llu KB committed, %llu KB used, %llu KB free in %llu nodes (largest %llu KB, %.2f fragmentation)",
+		stats.block_count, stats.committed_bytes/1024, stats.used_bytes/1024,
+		stats.free_bytes/1024, stats.free_node_count, stats.largest_free_node/1024, stats.fragmentation);
+	log("Heap: %llu large allocations (%llu KB), %llu reallocs in place, %llu moved",
+		stats.large_allocation_count, stats.large_allocation_bytes/1024,
+		stats.realloc_in_place_count, stats.realloc_moved_count);
+	for (u32 i = 0; i < HEAP_STATS_BUCKET_COUNT; i++) {
+		if (!stats.allocation_counts[i]) continue;
+		if (i == HEAP_STATS_BUCKET_COUNT-1) {
+			log("Heap:     > %llu bytes: %llu allocations", get_heap_stats_bucket_max_size(i-1), stats.allocation_counts[i]);
+		} else {
+			log("Heap:    <= %llu bytes: %llu allocations", get_heap_stats_bucket_max_size(i), stats.allocation_counts[i]);
+		}
+	}
+}
+
+///
+// Trimming
+///
+// Freed memory stays with the heap so it can be reused quickly, which means a long session keeps
+// its peak memory usage forever. heap_trim() gives what it can back to the OS:
+//   - Empty small runs of the calling thread's cache, and of caches left behind by exited
+//     threads, go back to the heap so they merge with their neighbours. (Free chunks are already
+//     merged with both neighbours on dealloc.) Caches of other running threads are only touched
+//     by their owners, so their empty runs stay until those threads call heap_trim() themselves.
+//   - Completely free heap blocks at the end of program memory are released and program memory
+//     is rewound so the next block reuses the address space.
+//   - Pages completely inside free chunks are purged with os_purge_pages(). They stay usable, so
+//     allocating from them later doesn't need to do anything special.
+// Returns the number of bytes given back to the OS.
+//
+// heap_start_idle_trim() starts a thread which calls heap_trim() whenever there were no locked
+// heap operations for a whole interval. That thread has no cache of its own, so it can't give
+// back empty runs cached by running threads, only those of exited threads.
+
+u64 heap_trim() {
+	if (!heap_initted) heap_init();
+
+	Heap_Thread_Cache *cache = heap_thread_cache;
+	if (cache) heap_thread_cache_collect_remote_frees(cache);
+
+	// Take the abandoned caches so nobody adopts them while we collect their remote frees, which
+	// can't be done with heap_lock held. A thread starting meanwhile just gets a new cache.
+	spinlock_acquire_or_wait(&heap_lock);
+	Heap_Thread_Cache *abandoned = heap_abandoned_thread_caches;
+	heap_abandoned_thread_caches = 0;
+	spinlock_release(&heap_lock);
+
+	for (Heap_Thread_Cache *it = abandoned; it; it = it->next_abandoned) {
+		heap_thread_cache_collect_remote_frees(it);
+	}
+
+	spinlock_acquire_or_wait(&heap_lock);
+
+	if (cache) heap_thread_cache_release_empty_runs(cache);
+
+	if (abandoned) {
+		Heap_Thread_Cache *last = abandoned;
+		heap_thread_cache_release_empty_runs(last);
+		while (last->next_abandoned) {
+			last = last->next_abandoned;
+			heap_thread_cache_release_empty_runs(last);
+		}
+		last->next_abandoned = heap_abandoned_thread_caches;
+		heap_abandoned_thread_caches = abandoned;
+	}
+
+	u64 bytes_returned = 0;
+
+	// Release empty trailing blocks. The first block is never released.
+	while (true) {
+		Heap_Block *last = heap_head;
+		while (last->next) last = last->next;
+
+		if (last == heap_head) break;
+		// Something else reserved program memory after this block
+		if (get_heap_block_end(last) != program_memory_next) break;
+
+		Heap_Free_Node *node = (Heap_Free_Node*)last->start;
+		u64 free_size = get_heap_block_size_excluding_metadata(last);
+		if (!is_heap_chunk_free(node) || get_heap_chunk_size(node) != free_size) break;
+
+		u64 already_purged = 0;
+		void *first_page, *last_page_end;
+		if ((node->size & HEAP_CHUNK_PURGED) && get_heap_free_chunk_inner_pages(node, free_size, &first_page, &last_page_end)) {
+			already_purged = (u64)last_page_end-(u64)first_page;
+		}
+
+		heap_remove_free_node(node);
+		last->prev->next = 0;
+
+		u64 block_size = get_heap_block_size_including_metadata(last);
+		os_purge_pages(last, block_size);
+		program_memory_next = last;
+
+		bytes_returned += block_size - already_purged;
+	}
+
+	// Purge pages inside free chunks
+	Heap_Block *block = heap_head;
+	while (block) {
+		u8 *chunk = (u8*)block->start;
+		u8 *end = (u8*)get_heap_block_end(block);
+		while (chunk < end) {
+			u64 size = get_heap_chunk_size(chunk);
+			if (is_heap_chunk_free(chunk) && !(*(u64*)chunk & HEAP_CHUNK_PURGED)) {
+				void *first_page, *last_page_end;
+				if (get_heap_free_chunk_inner_pages(chunk, size, &first_page, &last_page_end)) {
+					os_purge_pages(first_page, (u64)last_page_end-(u64)first_page);
+					bytes_returned += (u64)last_page_end-(u64)first_page;
+				}
+				*(u64*)chunk |= HEAP_CHUNK_PURGED;
+			}
+			chunk += size;
+		}
+		block = block->next;
+	}
+
+	spinlock_release(&heap_lock);
+
+	return bytes_returned;
+}
+
+// #Global
+ogb_instance Thread heap_idle_trim_thread;
+ogb_instance volatile bool heap_idle_trim_running;
+ogb_instance float64 heap_idle_trim_interval;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Thread heap_idle_trim_thread;
+volatile bool heap_idle_trim_running = false;
+float64 heap_idle_trim_interval = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+void heap_idle_trim_proc(Thread *t) {
+	u64 last_count = heap_chunk_operation_count;
+	u64 trimmed_count = UINT64_MAX;
+	while (heap_idle_trim_running) {
+		// Sleep in small steps so stopping doesn't wait for a whole interval
+		float64 wake_time = os_get_current_time_in_seconds() + heap_idle_trim_interval;
+		while (heap_idle_trim_running && os_get_current_time_in_seconds() < wake_time) {
+			os_sleep(10);
+		}
+		if (!heap_idle_trim_running) break;
+
+		u64 count = heap_chunk_operation_count;
+		if (count == last_count && count != trimmed_count) {
+			heap_trim();
+			trimmed_count = count;
+		}
+		last_count = count;
+	}
+}
+
+void heap_start_idle_trim(float64 interval_seconds) {
+	assert(!heap_idle_trim_running, "Heap idle trim is already running");
+	assert(interval_seconds > 0, "Heap idle trim interval must be more than 0");
+	heap_idle_trim_interval = interval_seconds;
+	heap_idle_trim_running = true;
+	os_thread_init(&heap_idle_trim_thread, heap_idle_trim_proc);
+	os_thread_start(&heap_idle_trim_thread);
+}
+void heap_stop_idle_trim() {
+	if (!heap_idle_trim_running) return;
+	heap_idle_trim_running = false;
+	os_thread_join(&heap_idle_trim_thread);
+	os_thread_destroy(&heap_idle_trim_thread);
+}
+
+///
+// Callsite tracking
+///
+// With HEAP_TRACK_CALLSITES, alloc() and alloc_uninitialized() are macros that record the
+// file & line of every heap allocation (see base.c). Dump with heap_dump_callsite_stats().
+// Any allocator other than the heap allocator is not tracked.
+
+#if HEAP_TRACK_CALLSITES
+
+#ifndef HEAP_CALLSITE_TABLE_SIZE
+	#define HEAP_CALLSITE_TABLE_SIZE 4096 // Must be a power of two
+#endif
+
+typedef struct Heap_Callsite {
+	const char *file;
+	u64 line;
+	u64 count;
+	u64 bytes;
+} Heap_Callsite;
+
+// #Global
+ogb_instance Heap_Callsite heap_callsites[HEAP_CALLSITE_TABLE_SIZE];
+ogb_instance u64 heap_callsite_count;
+ogb_instance Spinlock heap_callsite_lock;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Heap_Callsite heap_callsites[HEAP_CALLSITE_TABLE_SIZE];
+u64 heap_callsite_count = 0;
+Spinlock heap_callsite_lock = ZERO(Spinlock);
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+void heap_track_callsite(const char *file, u64 line, u64 size) {
+	// __FILE__ is a string literal so the pointer is a good enough key
+	u64 hash = ((u64)file * 31 + line) * 0x9E3779B97F4A7C15ull;
+	u64 index = (hash >> 32) & (HEAP_CALLSITE_TABLE_SIZE-1);
+
+	spinlock_acquire_or_wait(&heap_callsite_lock);
+	for (u64 probe = 0; probe < HEAP_CALLSITE_TABLE_SIZE; probe++) {
+		Heap_Callsite *site = &heap_callsites[(index+probe) & (HEAP_CALLSITE_TABLE_SIZE-1)];
+		if (!site->file) {
+			site->file = file;
+			site->line = line;
+			heap_callsite_count += 1;
+		}
+		if (site->file == file && site->line == line) {
+			site->count += 1;
+			site->bytes += size;
+			break;
+		}
+	}
+	// If the table is full we just stop tracking new callsites
+	spinlock_release(&heap_callsite_lock);
+}
 
-ogb_instance void 
-reset_temporary_storage();
+void *alloc_tracked(Allocator allocator, u64 size, bool initialize, const char *file, u64 line) {
+	if (allocator.proc == heap_allocator_proc) heap_track_callsite(file, line, size);
+	// Parentheses so we call the function and not the macro
+	if (initialize) return (alloc)(allocator, size);
+	else            return (alloc_uninitialized)(allocator, size);
+}
+
+int compare_heap_callsites(const void *a, const void *b) {
+	const Heap_Callsite *site_a = (const Heap_Callsite*)a;
+	const Heap_Callsite *site_b = (const Heap_Callsite*)b;
+	if (site_a->count == site_b->count) return 0;
+	return site_a->count < site_b->count ? 1 : -1;
+}
+
+// Writes one line per callsite, most allocations first
+bool heap_dump_callsite_stats(string path) {
+	Heap_Callsite *sites = (Heap_Callsite*)alloc_uninitialized(get_heap_allocator(), sizeof(Heap_Callsite)*HEAP_CALLSITE_TABLE_SIZE*2);
+	Heap_Callsite *help_buffer = sites + HEAP_CALLSITE_TABLE_SIZE;
+
+	spinlock_acquire_or_wait(&heap_callsite_lock);
+	u64 count = 0;
+	for (u64 i = 0; i < HEAP_CALLSITE_TABLE_SIZE; i++) {
+		if (heap_callsites[i].file) sites[count++] = heap_callsites[i];
+	}
+	spinlock_release(&heap_callsite_lock);
+
+	merge_sort(sites, help_buffer, count, sizeof(Heap_Callsite), compare_heap_callsites);
+
+	String_Builder builder;
+	string_builder_init(&builder, get_heap_allocator());
+	string_builder_print(&builder, "count, bytes, callsite\n");
+	for (u64 i = 0; i < count; i++) {
+		string_builder_print(&builder, "%llu, %llu, %cs:%llu\n", sites[i].count, sites[i].bytes, sites[i].file, sites[i].line);
+	}
+
+	bool ok = os_write_entire_file_s(path, string_builder_get_string(builder));
+
+	dealloc(get_heap_allocator(), builder.buffer);
+	dealloc(get_heap_allocator(), sites);
+	return ok;
+}
+
+#endif // HEAP_TRACK_CALLSITES
+
+///
+///
+// Arenas
+///
+// Reserves a big range of virtual memory up front and commits pages as the arena grows, so
+// pointers never move and there's no real memory cost to reserving way more than you need.
+// Freeing is popping back to a mark (or resetting), i.e. one pointer assignment no matter how
+// many allocations were made.
+//
+// Not thread safe, one arena should be used by one thread at a time.
+//
+// Usage:
+//     Arena level_arena;
+//     arena_init(&level_arena, 0);
+//     Allocator a = get_arena_allocator(&level_arena);
+//     ... load the level with allocator a ...
+//     arena_reset(&level_arena); // Everything in the level is gone
+//
+//     arena_scope(&level_arena) {
+//         void *scratch = arena_push(&level_arena, 1024);
+//     } // scratch is popped here. Don't return or break out of the scope!
+
+#ifndef ARENA_DEFAULT_RESERVE_SIZE
+	#define ARENA_DEFAULT_RESERVE_SIZE GB(16)
+#endif
+#ifndef ARENA_COMMIT_SIZE
+	#define ARENA_COMMIT_SIZE KB(64)
+#endif
+#define ARENA_ALIGNMENT 16
+
+typedef struct Arena {
+	u8 *base;
+	u64 reserved_size;
+	u64 committed_size;
+	u64 used;
+	u64 high_water_mark; // Most that was used at once. Never lowered by the arena itself.
+	u64 dirty_size; // Nothing past this was ever handed out, so it's still zero from the OS
+	u8 *last_allocation; // So the allocator can dealloc/realloc the last allocation in place
+} Arena;
+
+// Where the arena was at some point, pop back to it to free everything pushed after it.
+typedef u64 Arena_Mark;
+
+ogb_instance void
+arena_init(Arena *arena, u64 reserve_size);
+
+ogb_instance void
+arena_destroy(Arena *arena);
+
+ogb_instance void*
+arena_push(Arena *arena, u64 size);
+
+ogb_instance void*
+arena_push_aligned(Arena *arena, u64 size, u64 alignment);
+
+ogb_instance Arena_Mark
+arena_get_mark(Arena *arena);
+
+ogb_instance void
+arena_pop_to_mark(Arena *arena, Arena_Mark mark);
+
+ogb_instance void
+arena_reset(Arena *arena);
 
+ogb_instance void*
+arena_allocator_proc(u64 size, void *p, Allocator_Message message, void *data);
+
+ogb_instance Allocator
+get_arena_allocator(Arena *arena);
+
+#define arena_scope(arena) for (Arena_Mark _arena_scope_mark_ = arena_get_mark(arena), _arena_scope_i_ = 0; _arena_scope_i_ == 0; _arena_scope_i_ += 1, arena_pop_to_mark(arena, _arena_scope_mark_))
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
-void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+
+// reserve_size 0 is ARENA_DEFAULT_RESERVE_SIZE
+void arena_init(Arena *arena, u64 reserve_size) {
+	if (reserve_size == 0) reserve_size = ARENA_DEFAULT_RESERVE_SIZE;
+	reserve_size = align_next(reserve_size, os.granularity);
+	
+	memset(arena, 0, sizeof(Arena));
+	arena->base = (u8*)os_reserve_pages(reserve_size);
+	assert(arena->base, "Failed reserving %llu bytes of address space for arena", reserve_size);
+	arena->reserved_size = reserve_size;
+}
+
+void arena_destroy(Arena *arena) {
+	if (arena->base) os_unmap_pages(arena->base, arena->reserved_size);
+	memset(arena, 0, sizeof(Arena));
+}
+
+// Alignment must be a power of two, anything below ARENA_ALIGNMENT is ARENA_ALIGNMENT
+void *arena_push_aligned(Arena *arena, u64 size, u64 alignment) {
+	assert(arena->base, "Arena was not initialized, call arena_init() first");
+	assert(alignment > 0 && (alignment & (alignment-1)) == 0, "Alignment must be a power of two, got %llu", alignment);
+	
+	alignment = max(alignment, ARENA_ALIGNMENT);
+	u64 start = align_next((u64)arena->base + arena->used, alignment) - (u64)arena->base;
+	u64 end = start + size;
+	
+	assert(end <= arena->reserved_size, "Arena is out of memory (reserved %llu bytes). Pass a bigger reserve_size to arena_init().", arena->reserved_size);
+	
+	if (end > arena->committed_size) {
+		u64 new_committed_size = min(align_next(end, ARENA_COMMIT_SIZE), arena->reserved_size);
+		bool ok = os_commit_pages(arena->base + arena->committed_size, new_committed_size - arena->committed_size);
+		assert(ok, "Failed committing memory for arena. Are we out of memory?");
+		arena->committed_size = new_committed_size;
+	}
+	
+	arena->used = end;
+	arena->last_allocation = arena->base + start;
+	if (end > arena->high_water_mark) arena->high_water_mark = end;
+	if (end > arena->dirty_size) arena->dirty_size = end;
+	
+	return arena->base + start;
+}
+
+void *arena_push(Arena *arena, u64 size) {
+	return arena_push_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+Arena_Mark arena_get_mark(Arena *arena) {
+	return arena->used;
+}
+
+void arena_pop_to_mark(Arena *arena, Arena_Mark mark) {
+	assert(mark <= arena->used, "Arena mark is ahead of the arena. Did you pop to marks in the wrong order?");
+	arena->used = mark;
+	arena->last_allocation = 0;
+}
+
+// Committed pages are kept for reuse.
+void arena_reset(Arena *arena) {
+	arena_pop_to_mark(arena, 0);
+}
+
+void *arena_allocator_proc(u64 size, void *p, Allocator_Message message, void *data) {
+	Arena *arena = (Arena*)data;
 	switch (message) {
 		case ALLOCATOR_ALLOCATE: {
-			return talloc(size);
+			return arena_push(arena, size);
 			break;
 		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			u64 dirty_size = arena->dirty_size;
+			u8 *result = (u8*)arena_push(arena, size);
+			u64 start = (u64)(result - arena->base);
+			if (start < dirty_size) memset(result, 0, min(size, dirty_size-start));
+			return result;
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			return arena_push_aligned(arena, size, (u64)p);
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED_ZEROED: {
+			u64 dirty_size = arena->dirty_size;
+			u8 *result = (u8*)arena_push_aligned(arena, size, (u64)p);
+			u64 start = (u64)(result - arena->base);
+			if (start < dirty_size) memset(result, 0, min(size, dirty_size-start));
+			return result;
+		}
 		case ALLOCATOR_DEALLOCATE: {
+			// We can only give back the last allocation, everything else goes when the arena is reset
+			if (p && p == arena->last_allocation) {
+				arena->used = (u64)((u8*)p - arena->base);
+				arena->last_allocation = 0;
+			}
 			return 0;
 		}
 		case ALLOCATOR_REALLOCATE: {
-			return 0;
+			if (!p) {
+				return arena_push(arena, size);
+			}
+			assert((u8*)p >= arena->base && (u8*)p < arena->base+arena->used, "Pointer passed to arena reallocate does not belong to the arena");
+			if (p == arena->last_allocation) {
+				// Last allocation can just grow or shrink in place
+				arena->used = (u64)((u8*)p - arena->base);
+				return arena_push(arena, size);
+			}
+			// We don't know the old size, but it can't be more than what's between p and the top.
+			u64 max_old_size = (u64)(arena->base + arena->used - (u8*)p);
+			void *new = arena_push(arena, size);
+			memcpy(new, p, min(size, max_old_size));
+			return new;
 		}
 	}
 	return 0;
 }
 
-void temporary_storage_init(u64 arena_size) {
+Allocator get_arena_allocator(Arena *arena) {
+	Allocator a;
+	a.proc = arena_allocator_proc;
+	a.data = arena;
+	return a;
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+///
+///
+// Pools
+///
+// For lots of objects of the same size. Objects are carved out of chunks of pages mapped
+// directly from the OS, so they don't fragment the heap and their addresses never change.
+// Freed objects go on an intrusive free list (the link is stored in the freed object itself),
+// so both allocating and freeing is O(1).
+//
+// Pools are thread safe. With use_thread_cache each thread keeps a few freed objects for
+// itself so it mostly doesn't need to take the pool lock. Pools with thread caching need to
+// outlive the threads that use them.
+//
+// Pools can be declared statically without calling pool_init():
+//     Pool thing_pool = POOL_INITIALIZER(sizeof(Thing), false);
+
+#ifndef POOL_CHUNK_SIZE
+	#define POOL_CHUNK_SIZE KB(64)
+#endif
+#define POOL_ALIGNMENT 16
+#define POOL_CHUNK_HEADER_SIZE 16
+#define POOL_THREAD_CACHE_SLOTS 8 // Number of pools one thread can cache for at a time
+#define POOL_THREAD_CACHE_BATCH 32
+
+typedef struct Pool Pool;
+typedef struct Pool {
+	u64 object_size;
+	bool use_thread_cache;
 	
-	temporary_storage = heap_alloc(arena_size);
-	assert(temporary_storage, "Failed allocating temporary storage");
-	temporary_storage_pointer = temporary_storage;
+	Spinlock lock;
+	void *free_list;
+	u8 *bump; // Objects from here to end in the last chunk were never handed out
+	u8 *end;
+	void *chunks; // First bytes in each chunk points to the next chunk
+	u64 chunk_count;
+	
+	u64 id; // So thread caches can tell a new pool from a destroyed one at the same address
+	Pool *next_registered;
+} Pool;
 
-	temp_allocator.proc = temp_allocator_proc;
-	temp_allocator.data = 0;
+#define POOL_INITIALIZER(size, thread_cache) {.object_size = (size), .use_thread_cache = (thread_cache)}
+
+typedef struct Pool_Thread_Cache {
+	Pool *pool;
+	u64 pool_id;
+	void *free_list;
+	u64 count;
+} Pool_Thread_Cache;
+
+ogb_instance void
+pool_init(Pool *pool, u64 object_size, bool use_thread_cache);
+
+ogb_instance void
+pool_destroy(Pool *pool);
+
+// Returns uninitialized memory
+ogb_instance void*
+pool_alloc(Pool *pool);
+
+ogb_instance void
+pool_dealloc(Pool *pool, void *p);
+
+ogb_instance void*
+pool_allocator_proc(u64 size, void *p, Allocator_Message message, void *data);
+
+ogb_instance Allocator
+get_pool_allocator(Pool *pool);
+
+// Gives the objects in this thread's caches back to their pools. Called when a thread exits.
+ogb_instance void
+pool_thread_cache_flush();
+
+// #Global
+ogb_instance Spinlock pool_registry_lock;
+ogb_instance Pool *pool_registry;
+ogb_instance volatile u64 pool_next_id;
+// Bumped when a thread cached pool is destroyed, so other threads know to drop their slots for it
+ogb_instance volatile u64 pool_destroy_generation;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Spinlock pool_registry_lock = {0};
+Pool *pool_registry = 0;
+volatile u64 pool_next_id = 1;
+volatile u64 pool_destroy_generation = 0;
+thread_local Pool_Thread_Cache pool_thread_caches[POOL_THREAD_CACHE_SLOTS];
+thread_local u64 pool_thread_cache_generation = 0;
+
+inline u64 get_pool_stride(Pool *pool) {
+	return max(align_next(pool->object_size, POOL_ALIGNMENT), sizeof(void*));
+}
+
+void pool_init(Pool *pool, u64 object_size, bool use_thread_cache) {
+	assert(object_size > 0, "Pool object size must be more than 0");
+	memset(pool, 0, sizeof(Pool));
+	pool->object_size = object_size;
+	pool->use_thread_cache = use_thread_cache;
+	spinlock_init(&pool->lock);
+}
+
+// pool->lock needs to be held
+void pool_register(Pool *pool) {
+	if (pool->id) return;
 	
-	temp_allocator.proc = temp_allocator_proc;
+	pool->id = atomic64_fetch_add(&pool_next_id, 1, MEMORY_ORDER_RELAXED);
+	
+	if (pool->use_thread_cache) {
+		spinlock_acquire_or_wait(&pool_registry_lock);
+		pool->next_registered = pool_registry;
+		pool_registry = pool;
+		spinlock_release(&pool_registry_lock);
+	}
 }
 
-void* talloc(u64 size) {
+void pool_destroy(Pool *pool) {
+	if (pool->use_thread_cache && pool->id) {
+		spinlock_acquire_or_wait(&pool_registry_lock);
+		Pool **it = &pool_registry;
+		while (*it && *it != pool) it = &(*it)->next_registered;
+		if (*it) *it = pool->next_registered;
+		atomic64_fetch_add(&pool_destroy_generation, 1, MEMORY_ORDER_RELAXED);
+		spinlock_release(&pool_registry_lock);
+		
+		for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) {
+			if (pool_thread_caches[i].pool == pool) pool_thread_caches[i] = ZERO(Pool_Thread_Cache);
+		}
+	}
+	
+	void *chunk = pool->chunks;
+	while (chunk) {
+		void *next = *(void**)chunk;
+		os_unmap_pages(chunk, *((u64*)chunk+1));
+		chunk = next;
+	}
+	
+	pool_init(pool, pool->object_size, pool->use_thread_cache);
+}
+
+// pool->lock needs to be held
+void *pool_alloc_locked(Pool *pool) {
+	if (!pool->id) pool_register(pool);
+	
+	if (pool->free_list) {
+		void *p = pool->free_list;
+		pool->free_list = *(void**)p;
+		return p;
+	}
+	
+	u64 stride = get_pool_stride(pool);
+	
+	if (pool->bump + stride > pool->end) {
+		u64 chunk_size = align_next(max(POOL_CHUNK_SIZE, POOL_CHUNK_HEADER_SIZE + stride*16), os.granularity);
+		u8 *chunk = (u8*)os_map_pages(0, chunk_size);
+		assert(chunk, "Failed mapping pages for pool. Are we out of memory?");
+		
+		*(void**)chunk = pool->chunks;
+		*((u64*)chunk+1) = chunk_size;
+		pool->chunks = chunk;
+		pool->chunk_count += 1;
+		
+		pool->bump = chunk + POOL_CHUNK_HEADER_SIZE;
+		pool->end = chunk + chunk_size;
+	}
+	
+	void *p = pool->bump;
+	pool->bump += stride;
+	return p;
+}
+
+// pool->lock needs to be held
+void pool_dealloc_locked(Pool *pool, void *p) {
+	*(void**)p = pool->free_list;
+	pool->free_list = p;
+}
+
+// Meant for debug
+bool pool_owns_pointer(Pool *pool, void *p) {
+	u64 stride = get_pool_stride(pool);
+	spinlock_acquire_or_wait(&pool->lock);
+	bool result = false;
+	u8 *chunk = (u8*)pool->chunks;
+	while (chunk) {
+		u64 chunk_size = *((u64*)chunk+1);
+		u8 *first = chunk + POOL_CHUNK_HEADER_SIZE;
+		if ((u8*)p >= first && (u8*)p < chunk + chunk_size) {
+			result = ((u64)((u8*)p - first) % stride) == 0;
+			break;
+		}
+		chunk = *(u8**)chunk;
+	}
+	spinlock_release(&pool->lock);
+	return result;
+}
+
+// Empties this thread's slots for pools which were destroyed (on any thread). Their objects
+// went away with the pool so there's nothing to give back.
+void pool_thread_cache_drop_destroyed() {
+	spinlock_acquire_or_wait(&pool_registry_lock);
+	for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) {
+		Pool_Thread_Cache *cache = &pool_thread_caches[i];
+		if (!cache->pool) continue;
+		
+		Pool *pool = pool_registry;
+		while (pool && !(pool == cache->pool && pool->id == cache->pool_id)) pool = pool->next_registered;
+		
+		if (!pool) *cache = ZERO(Pool_Thread_Cache);
+	}
+	pool_thread_cache_generation = pool_destroy_generation;
+	spinlock_release(&pool_registry_lock);
+}
+
+Pool_Thread_Cache *pool_get_thread_cache(Pool *pool) {
+	if (pool_thread_cache_generation != atomic64_load(&pool_destroy_generation, MEMORY_ORDER_RELAXED)) {
+		pool_thread_cache_drop_destroyed();
+	}
 	
-	assert(size < TEMPORARY_STORAGE_SIZE, "Bruddah this is too large for temp allocator");
+	Pool_Thread_Cache *empty = 0;
+	for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) {
+		Pool_Thread_Cache *cache = &pool_thread_caches[i];
+		if (cache->pool == pool && cache->pool_id == pool->id) return cache;
+		if (!cache->pool && !empty) empty = cache;
+	}
 	
-	void* p = temporary_storage_pointer;
+	// No more slots, this thread just won't cache for this pool
+	if (!empty || !pool->id) return 0;
 	
-	temporary_storage_pointer = (u8*)temporary_storage_pointer + size;
+	empty->pool = pool;
+	empty->pool_id = pool->id;
+	empty->free_list = 0;
+	empty->count = 0;
+	return empty;
+}
+
+void *pool_alloc(Pool *pool) {
+	assert(pool->object_size > 0, "Pool was not initialized, call pool_init() or use POOL_INITIALIZER");
 	
-	if ((u8*)temporary_storage_pointer >= (u8*)temporary_storage+TEMPORARY_STORAGE_SIZE) {
-		if (!has_warned_temporary_storage_overflow) {
-			os_write_string_to_stdout(STR("WARNING: temporary storage was overflown, we wrap around at the start.\n"));
+	if (pool->use_thread_cache && pool->id) {
+		Pool_Thread_Cache *cache = pool_get_thread_cache(pool);
+		if (cache) {
+			if (!cache->free_list) {
+				spinlock_acquire_or_wait(&pool->lock);
+				for (u64 i = 0; i < POOL_THREAD_CACHE_BATCH; i++) {
+					void *p = pool_alloc_locked(pool);
+					*(void**)p = cache->free_list;
+					cache->free_list = p;
+				}
+				spinlock_release(&pool->lock);
+				cache->count = POOL_THREAD_CACHE_BATCH;
+			}
+			void *p = cache->free_list;
+			cache->free_list = *(void**)p;
+			cache->count -= 1;
+			return p;
 		}
-		temporary_storage_pointer = temporary_storage;
-		return talloc(size);;
 	}
 	
+	spinlock_acquire_or_wait(&pool->lock);
+	void *p = pool_alloc_locked(pool);
+	spinlock_release(&pool->lock);
+	
 	return p;
 }
 
+void pool_dealloc(Pool *pool, void *p) {
+#if CONFIGURATION == DEBUG
+	assert(pool_owns_pointer(pool, p), "Pointer passed to pool_dealloc was not allocated from this pool");
+	memset(p, 0x69, pool->object_size);
+#endif
+	
+	if (pool->use_thread_cache) {
+		Pool_Thread_Cache *cache = pool_get_thread_cache(pool);
+		if (cache) {
+			*(void**)p = cache->free_list;
+			cache->free_list = p;
+			cache->count += 1;
+			
+			if (cache->count >= POOL_THREAD_CACHE_BATCH*2) {
+				spinlock_acquire_or_wait(&pool->lock);
+				for (u64 i = 0; i < POOL_THREAD_CACHE_BATCH; i++) {
+					void *object = cache->free_list;
+					cache->free_list = *(void**)object;
+					pool_dealloc_locked(pool, object);
+				}
+				spinlock_release(&pool->lock);
+				cache->count -= POOL_THREAD_CACHE_BATCH;
+			}
+			return;
+		}
+	}
+	
+	spinlock_acquire_or_wait(&pool->lock);
+	pool_dealloc_locked(pool, p);
+	spinlock_release(&pool->lock);
+}
+
+void pool_thread_cache_flush() {
+	spinlock_acquire_or_wait(&pool_registry_lock);
+	for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) {
+		Pool_Thread_Cache *cache = &pool_thread_caches[i];
+		if (!cache->pool) continue;
+		
+		// Only touch the pool if it still exists
+		Pool *pool = pool_registry;
+		while (pool && !(pool == cache->pool && pool->id == cache->pool_id)) pool = pool->next_registered;
+		
+		if (pool) {
+			spinlock_acquire_or_wait(&pool->lock);
+			while (cache->free_list) {
+				void *object = cache->free_list;
+				cache->free_list = *(void**)object;
+				pool_dealloc_locked(pool, object);
+			}
+			spinlock_release(&pool->lock);
+		}
+		
+		*cache = ZERO(Pool_Thread_Cache);
+	}
+	spinlock_release(&pool_registry_lock);
+}
+
+void *pool_allocator_proc(u64 size, void *p, Allocator_Message message, void *data) {
+	Pool *pool = (Pool*)data;
+	switch (message) {
+		case ALLOCATOR_ALLOCATE: {
+			assert(size <= pool->object_size, "Allocation of %llu bytes does not fit in pool of %llu byte objects", size, pool->object_size);
+			return pool_alloc(pool);
+			break;
+		}
+		case ALLOCATOR_ALLOCATE_ZEROED: {
+			assert(size <= pool->object_size, "Allocation of %llu bytes does not fit in pool of %llu byte objects", size, pool->object_size);
+			void *result = pool_alloc(pool);
+			memset(result, 0, size);
+			return result;
+		}
+		case ALLOCATOR_ALLOCATE_ALIGNED: {
+			// Objects are only POOL_ALIGNMENT aligned
+			if ((u64)p > POOL_ALIGNMENT) return 0;
+			assert(size <= pool->object_size, "Allocation of %llu bytes does not fit in pool of %llu byte objects", size, pool->object_size);
+			return pool_alloc(pool);
+		}
+		case ALLOCATOR_DEALLOCATE: {
+			pool_dealloc(pool, p);
+			return 0;
+		}
+		case ALLOCATOR_REALLOCATE: {
+			assert(size <= pool->object_size, "Reallocation to %llu bytes does not fit in pool of %llu byte objects", size, pool->object_size);
+			if (!p) return pool_alloc(pool);
+			return p;
+		}
+	}
+	return 0;
+}
+
+Allocator get_pool_allocator(Pool *pool) {
+	Allocator a;
+	a.proc = pool_allocator_proc;
+	a.data = pool;
+	return a;
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+///
+///
+// Temporary storage
+///
+// A thread local arena. It reserves TEMPORARY_STORAGE_RESERVE_SIZE of address space and commits
+// more pages as it's needed, so it never runs out (unless you use a whole lot) and it never
+// wraps around and overwrites older temporary allocations.
+// reset_temporary_storage() should be called once a frame, and temp_save()/temp_restore() can
+// be used to give back scratch memory sooner:
+//     Arena_Mark mark = temp_save();
+//     ... lots of talloc ...
+//     temp_restore(mark);
+
+#ifndef TEMPORARY_STORAGE_SIZE
+	#define TEMPORARY_STORAGE_SIZE (1024ULL*1024ULL*2ULL) // 2mb, committed up front on the main thread
+#endif
+#ifndef TEMPORARY_STORAGE_RESERVE_SIZE
+	#define TEMPORARY_STORAGE_RESERVE_SIZE GB(1)
+#endif
+
+ogb_instance void* talloc(u64);
+ogb_instance void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void*);
+
+// #Global
+ogb_instance Allocator 
+get_temporary_allocator();
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+thread_local Arena temporary_storage;
+thread_local u64 temporary_storage_frame_high_water_mark = 0;
+thread_local u64 temporary_storage_max_high_water_mark = 0;
+thread_local Allocator temp_allocator;
+
+ogb_instance Allocator 
+get_temporary_allocator() {
+	return temp_allocator;
+}
+#endif
+
+ogb_instance void* 
+temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data);
+
+// initial_size is committed up front
+ogb_instance void 
+temporary_storage_init(u64 initial_size);
+
+ogb_instance void 
+temporary_storage_deinit();
+
+ogb_instance void* 
+talloc(u64 size);
+
+ogb_instance Arena_Mark 
+temp_save();
+
+// Everything talloc'd after the mark was saved is freed
+ogb_instance void 
+temp_restore(Arena_Mark mark);
+
+ogb_instance void 
+reset_temporary_storage();
+
+// Most temporary storage used at once between the last two reset_temporary_storage() calls
+ogb_instance u64 
+get_temporary_storage_frame_high_water_mark();
+
+// Most temporary storage used at once in any frame on this thread
+ogb_instance u64 
+get_temporary_storage_max_high_water_mark();
+
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+void* temp_allocator_proc(u64 size, void *p, Allocator_Message message, void* data) {
+	return arena_allocator_proc(size, p, message, &temporary_storage);
+}
+
+void temporary_storage_init(u64 initial_size) {
+	
+	arena_init(&temporary_storage, max(TEMPORARY_STORAGE_RESERVE_SIZE, initial_size));
+	
+	if (initial_size > 0) {
+		u64 commit_size = min(align_next(initial_size, ARENA_COMMIT_SIZE), temporary_storage.reserved_size);
+		bool ok = os_commit_pages(temporary_storage.base, commit_size);
+		assert(ok, "Failed allocating temporary storage");
+		temporary_storage.committed_size = commit_size;
+	}
+	
+	temporary_storage_frame_high_water_mark = 0;
+	temporary_storage_max_high_water_mark = 0;
+
+	temp_allocator.proc = temp_allocator_proc;
+	temp_allocator.data = 0;
+}
+
+void temporary_storage_deinit() {
+	arena_destroy(&temporary_storage);
+}
+
+void* talloc(u64 size) {
+	return arena_push(&temporary_storage, size);
+}
+
+Arena_Mark temp_save() {
+	return arena_get_mark(&temporary_storage);
+}
+void temp_restore(Arena_Mark mark) {
+	arena_pop_to_mark(&temporary_storage, mark);
+}
+
 void reset_temporary_storage() {
-	temporary_storage_pointer = temporary_storage;	
-	has_warned_temporary_storage_overflow = true;
+	temporary_storage_frame_high_water_mark = temporary_storage.high_water_mark;
+	if (temporary_storage_frame_high_water_mark > temporary_storage_max_high_water_mark) {
+		temporary_storage_max_high_water_mark = temporary_storage_frame_high_water_mark;
+	}
+	temporary_storage.high_water_mark = 0;
+	arena_reset(&temporary_storage);
+}
+
+u64 get_temporary_storage_frame_high_water_mark() {
+	return temporary_storage_frame_high_water_mark;
+}
+u64 get_temporary_storage_max_high_water_mark() {
+	return max(temporary_storage_max_high_water_mark, temporary_storage.high_water_mark);
 }
 
 #endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
\ No newline at end of file
@@ -87,7 +87,8 @@
 				#define RUN_TESTS 1
 				
 		- ENABLE_PROFILING
-			Enable time profiling which will be dumped to google_trace.json.
+			Enable time profiling which will be dumped to google_trace_time.json (microseconds)
+			and google_trace_cycles.json (cycles).
 		
 			0: Disable
 			1: Enable
@@ -101,7 +102,63 @@
 					tm_scope
 					tm_scope_var
 					tm_scope_accum
+					tm_counter
+					tm_frame_mark
+				os_update() marks frames and reports heap bytes & temporary storage use,
+				gfx_update() reports quads & draw calls and the audio thread active players.
+				Each thread records into its own ring buffer of PROFILER_THREAD_BUFFER_CAPACITY
+				records (default 65536) which a background thread keeps draining. If a thread
+				records faster than that, records are dropped and you get a warning on exit.
 					
+		- ENABLE_SAMPLING_PROFILER
+			Sample the call stack of every thread which is using cpu time about once per
+			millisecond and write sampling_profile.folded on exit, for flamegraph.pl,
+			inferno or speedscope. Sees everything, not just what's in a tm_scope.
+			
+			0: Disable
+			1: Enable
+			
+			Example:
+			
+				#define ENABLE_SAMPLING_PROFILER 1
+				
+			Note:
+				Stacks are walked through frame pointers, so compile with -fno-omit-frame-pointer
+				-mno-omit-leaf-frame-pointer and keep the pdb around for symbols (also in release).
+				Threads started with os_thread_start() are sampled automatically. Threads are
+				stopped for a few microseconds per sample, the exact cost is logged on exit.
+				See "Sampling profiler" in profiling.c.
+					
+		- HEAP_TRACK_CALLSITES
+			Record the file & line of every heap allocation made with alloc() or 
+			alloc_uninitialized() so you can see where allocations come from.
+			
+			0: Disable
+			1: Enable
+			
+			Example:
+			
+				#define HEAP_TRACK_CALLSITES 1
+				
+			Note:
+				Dump the table with heap_dump_callsite_stats(STR("heap_callsites.txt")).
+				heap_get_stats() is always available and does not need this.
+				
+		- LOCK_TRACK_CONTENTION
+			Count acquires, contended acquires and cycles spent waiting for every Spinlock
+			and Mutex, per lock name (see spinlock_set_name() & mutex_set_name()).
+			
+			0: Disable
+			1: Enable
+			
+			Example:
+			
+				#define LOCK_TRACK_CONTENTION 1
+				
+			Note:
+				Dump the table with lock_dump_contention_stats(STR("lock_contention.txt")).
+				With ENABLE_PROFILING, named locks also get counter tracks in the google trace files.
+				
 		- OOGABOOGA_HEADLESS
             Run oogabooga in headless mode, i.e. no window, no graphics, no audio.
             Useful if you only need the oogabooga standard library for something like a game server.
@@ -197,6 +254,18 @@ typedef u8 bool;
 	#define ENABLE_SIMD 1
 #endif
 
+#ifndef HEAP_TRACK_CALLSITES
+	#define HEAP_TRACK_CALLSITES 0
+#endif
+
+#ifndef LOCK_TRACK_CONTENTION
+	#define LOCK_TRACK_CONTENTION 0
+#endif
+
+#ifndef ENABLE_SAMPLING_PROFILER
+	#define ENABLE_SAMPLING_PROFILER 0
+#endif
+
 #ifndef INITIAL_PROGRAM_MEMORY_SIZE
     #define INITIAL_PROGRAM_MEMORY_SIZE MB(5)
 #endif
@@ -230,7 +299,7 @@ typedef u8 bool;
 	#define COBJMACROS
 	#undef noreturn
 	#include <Windows.h>
-    #if CONFIGURATION == DEBUG
+    #if CONFIGURATION == DEBUG || ENABLE_SAMPLING_PROFILER
     	#include <dbghelp.h>
     #endif
 	#define TARGET_OS WINDOWS
@@ -311,6 +380,9 @@ typedef u8 bool;
 #include "random.c"
 #include "color.c"
 #include "memory.c"
+#include "jobs.c"
+#include "fibers.c"
+#include "frame_stats.c"
 #include "input.c"
 
 #ifndef OOGABOOGA_HEADLESS
@@ -362,6 +434,7 @@ void default_logger(Log_Level level, string s) {
 
 	if (!_default_logger_mutex_initted) {
 		mutex_init(&_default_logger_mutex);
+		mutex_set_name(&_default_logger_mutex, STR("_default_logger_mutex"));
 		_default_logger_mutex_initted = true;
 	}
 	
@@ -384,8 +457,13 @@ void oogabooga_init(u64 program_memory_size) {
 	temp_allocator = get_initialization_allocator();
 	Cpu_Capabilities features = query_cpu_capabilities();
 	os_init(program_memory_size);
+	calibrate_rdtsc_frequency();
 	heap_init();
 	temporary_storage_init(TEMPORARY_STORAGE_SIZE);
+#if ENABLE_SAMPLING_PROFILER
+	sampling_profiler_register_current_thread();
+	sampling_profiler_start();
+#endif
 	log_info("Ooga booga version is %d.%02d.%03d", OGB_VERSION_MAJOR, OGB_VERSION_MINOR, OGB_VERSION_PATCH);
 #ifndef OOGABOOGA_HEADLESS
 	gfx_init();
@@ -401,6 +479,8 @@ void oogabooga_init(u64 program_memory_size) {
 	log_verbose("CPU has avx:    %cs", features.avx ? "true" : "false");
 	log_verbose("CPU has avx2:   %cs", features.avx2 ? "true" : "false");
 	log_verbose("CPU has avx512: %cs", features.avx512 ? "true" : "false");
+	log_verbose("CPU has invariant tsc: %cs", features.invariant_tsc ? "true" : "false");
+	log_verbose("rdtsc frequency: %.3f GHz", rdtsc_frequency/1000000000.0);
 }
 #endif
 
@@ -436,6 +516,13 @@ int main(int argc, char **argv) {
 	
 	dump_profile_result();
 	
+#endif
+
+#if ENABLE_SAMPLING_PROFILER
+	
+	sampling_profiler_stop();
+	sampling_profiler_dump_folded(STR("sampling_profile.folded"));
+	
 #endif
 	
 	printf("Ooga booga program exit with code %i\n", code);
@@ -341,7 +341,7 @@ void os_init(u64 program_memory_capacity) {
 	os.crt_vsnprintf = (Crt_Vsnprintf_Proc)os_dynamic_library_load_symbol(os.crt, STR("vsnprintf"));
 	assert(os.crt_vsnprintf, "Missing vsnprintf in crt");
 
-#if CONFIGURATION == DEBUG
+#if CONFIGURATION == DEBUG || ENABLE_SAMPLING_PROFILER
 	HANDLE process = GetCurrentProcess();
 	SymInitialize(process, NULL, TRUE);
 #endif
@@ -359,6 +359,10 @@ void os_init(u64 program_memory_capacity) {
 	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
 	timeBeginPeriod(1);
 #endif
+#if ENABLE_SAMPLING_PROFILER && CONFIGURATION != RELEASE
+	// The sampler sleeps 1ms at a time, which needs the timer resolution release builds ask for above
+	timeBeginPeriod(1);
+#endif
 
 	SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
 	
@@ -484,9 +488,23 @@ DWORD WINAPI win32_thread_invoker(LPVOID param) {
 	context = t->initial_context;
 	context.thread_id = GetCurrentThreadId();
 	
+#if ENABLE_SAMPLING_PROFILER
+	sampling_profiler_register_current_thread();
+#endif
+	
 	t->proc(t);
 	
-	heap_dealloc(temporary_storage);
+#if ENABLE_SAMPLING_PROFILER
+	sampling_profiler_unregister_current_thread();
+#endif
+	
+	temporary_storage_deinit();
+	pool_thread_cache_flush();
+	heap_thread_cache_release();
+	
+#if ENABLE_PROFILING
+	_profiler_retire_current_thread();
+#endif
 	
 	return 0;
 }
@@ -620,6 +638,21 @@ void os_high_precision_sleep(f64 ms) {
 	timeEndPeriod(1);
 }
 
+bool os_wait_on_address(volatile void *address, void *compare_address, u64 size, f64 timeout_seconds) {
+	assert(size == 1 || size == 2 || size == 4 || size == 8, "os_wait_on_address size must be 1, 2, 4 or 8, was %llu", size);
+	DWORD ms = timeout_seconds < 0 ? INFINITE : (DWORD)(timeout_seconds*1000.0);
+	if (WaitOnAddress(address, compare_address, (SIZE_T)size, ms)) return true;
+	DWORD error = GetLastError();
+	assert(error == ERROR_TIMEOUT, "WaitOnAddress failed with error %d", error);
+	return false;
+}
+void os_wake_one_waiting_on_address(volatile void *address) {
+	WakeByAddressSingle((PVOID)address);
+}
+void os_wake_all_waiting_on_address(volatile void *address) {
+	WakeByAddressAll((PVOID)address);
+}
+
 
 ///
 ///
@@ -638,6 +671,15 @@ float64 os_get_current_time_in_seconds() {
     }
     return (double)counter.QuadPart / (double)frequency.QuadPart;
 }
+float64 os_get_current_thread_cpu_time_in_seconds() {
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+		return -1.0;
+	}
+	u64 kernel = ((u64)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime;
+	u64 user   = ((u64)user_time.dwHighDateTime << 32)   | user_time.dwLowDateTime;
+	return (float64)(kernel+user) / 10000000.0; // 100 nanosecond units
+}
 
 
 ///
@@ -1061,6 +1103,39 @@ os_get_number_of_logical_processors() {
 ///
 #define WIN32_MAX_STACK_FRAMES 64
 #define WIN32_MAX_SYMBOL_NAME_LENGTH 256
+
+#if CONFIGURATION == DEBUG || ENABLE_SAMPLING_PROFILER
+// "file:line: name" with include_line, otherwise just the name. The address in hex if there's no symbol.
+string win32_symbolize_address(HANDLE process, u64 address, bool include_line, Allocator allocator) {
+    DWORD64 displacement = 0;
+    char buffer[sizeof(SYMBOL_INFO) + WIN32_MAX_SYMBOL_NAME_LENGTH * sizeof(TCHAR)];
+    PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = WIN32_MAX_SYMBOL_NAME_LENGTH;
+
+    string result;
+    if (SymFromAddr(process, address, &displacement, symbol)) {
+        IMAGEHLP_LINE64 line;
+        DWORD displacement_line;
+        line.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
+
+        if (include_line && SymGetLineFromAddr64(process, address, &displacement_line, &line)) {
+            u64 length = (u64)(symbol->NameLen + strlen(line.FileName) + 50);
+            result.data = (u8 *)alloc(allocator, length);
+            result.count = format_string_to_buffer_va((char *)result.data, length, "%cs:%d: %cs", line.FileName, line.LineNumber, symbol->Name);
+        } else {
+            result.data = (u8 *)alloc(allocator, symbol->NameLen + 1);
+            memcpy(result.data, symbol->Name, symbol->NameLen + 1);
+            result.count = symbol->NameLen;
+        }
+    } else {
+        result.data = (u8 *)alloc(allocator, 32);
+        result.count = format_string_to_buffer_va((char *)result.data, 32, "0x%llx", address);
+    }
+    return result;
+}
+#endif
+
 string *
 os_get_stack_trace(u64 *trace_count, Allocator allocator) {
 #if CONFIGURATION == DEBUG
@@ -1111,35 +1186,8 @@ os_get_stack_trace(u64 *trace_count, Allocator allocator) {
             break;
         }
 
-        DWORD64 displacement = 0;
-        char buffer[sizeof(SYMBOL_INFO) + WIN32_MAX_SYMBOL_NAME_LENGTH * sizeof(TCHAR)];
-        PSYMBOL_INFO symbol = (PSYMBOL_INFO)buffer;
-        symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
-        symbol->MaxNameLen = WIN32_MAX_SYMBOL_NAME_LENGTH;
-
-        if (SymFromAddr(process, stack.AddrPC.Offset, &displacement, symbol)) {
-            IMAGEHLP_LINE64 line;
-            DWORD displacement_line;
-            line.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
-
-            char *result;
-            if (SymGetLineFromAddr64(process, stack.AddrPC.Offset, &displacement_line, &line)) {
-                u64 length = (u64)(symbol->NameLen + strlen(line.FileName) + 50);
-                result = (char *)alloc(allocator, length);
-                format_string_to_buffer_va(result, length, "%cs:%d: %cs", line.FileName, line.LineNumber, symbol->Name);
-            } else {
-                u64 length = (u64)(symbol->NameLen + 1);
-                result = (char *)alloc(allocator, length);
-                memcpy(result, symbol->Name, symbol->NameLen + 1);
-            }
-            stack_strings[*trace_count].data = (u8 *)result;
-            stack_strings[*trace_count].count = strlen(result);
-            (*trace_count)++;
-        } else {
-            stack_strings[*trace_count].data = (u8 *)alloc(allocator, 32);
-            stack_strings[*trace_count].count = format_string_to_buffer_va((char *)stack_strings[*trace_count].data, 32, "0x%llx", stack.AddrPC.Offset);
-            (*trace_count)++;
-        }
+        stack_strings[*trace_count] = win32_symbolize_address(process, stack.AddrPC.Offset, true, allocator);
+        (*trace_count)++;
     }
 
     return stack_strings;
@@ -1156,6 +1204,59 @@ os_get_stack_trace(u64 *trace_count, Allocator allocator) {
 #endif // NOT DEBUG
 }
 
+string
+os_get_symbol_name(u64 address, Allocator allocator) {
+#if CONFIGURATION == DEBUG || ENABLE_SAMPLING_PROFILER
+	return win32_symbolize_address(GetCurrentProcess(), address, false, allocator);
+#else
+	string result;
+	result.data = (u8 *)alloc(allocator, 32);
+	result.count = format_string_to_buffer_va((char *)result.data, 32, "0x%llx", address);
+	return result;
+#endif
+}
+
+Thread_Handle
+os_get_current_thread_handle() {
+	// GetCurrentThread() is a pseudo handle which means "the calling thread" to whoever uses it
+	HANDLE process = GetCurrentProcess();
+	HANDLE handle = 0;
+	BOOL ok = DuplicateHandle(process, GetCurrentThread(), process, &handle, THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0);
+	assert(ok, "Failed duplicating thread handle");
+	return handle;
+}
+void
+os_close_thread_handle(Thread_Handle thread) {
+	CloseHandle(thread);
+}
+
+u64
+os_get_thread_cpu_cycles(Thread_Handle thread) {
+	ULONG64 cycles = 0;
+	QueryThreadCycleTime(thread, &cycles);
+	return (u64)cycles;
+}
+
+u64
+os_capture_thread_stack(Thread_Handle thread, void *stack_base, u64 *frames, u64 max_frames) {
+#ifdef _M_X64
+	if (SuspendThread(thread) == (DWORD)-1) return 0;
+	
+	// SuspendThread() only asks, GetThreadContext() waits until the thread has actually stopped
+	CONTEXT thread_context;
+	thread_context.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+	u64 count = 0;
+	if (GetThreadContext(thread, &thread_context)) {
+		count = walk_frame_pointers(thread_context.Rip, thread_context.Rbp, thread_context.Rsp, (u64)stack_base, frames, max_frames);
+	}
+	
+	ResumeThread(thread);
+	return count;
+#else
+	return 0;
+#endif
+}
+
 bool os_grow_program_memory(u64 new_size) {
 	os_lock_mutex(program_memory_mutex); // #Sync
 	if (program_memory_capacity >= new_size) {
@@ -1281,6 +1382,99 @@ os_lock_program_memory_pages(void *start, u64 size) {
 #endif
 }
 
+void*
+os_map_pages(void *address, u64 size) {
+	assert(size % os.granularity == 0, "size was not aligned to granularity in os_map_pages");
+	assert((u64)address % os.granularity == 0, "address was not aligned to granularity in os_map_pages");
+	
+	void *p = VirtualAlloc(address, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	
+	if (address && p != address) {
+		if (p) VirtualFree(p, 0, MEM_RELEASE);
+		return 0;
+	}
+	
+	return p;
+}
+
+void*
+os_reserve_pages(u64 size) {
+	assert(size % os.granularity == 0, "size was not aligned to granularity in os_reserve_pages");
+	
+	return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool
+os_commit_pages(void *start, u64 size) {
+	assert((u64)start % os.page_size == 0, "When committing memory pages, the start address must be the start of a page");
+	assert(size       % os.page_size == 0, "When committing memory pages, the size must be aligned to page_size");
+	
+	return VirtualAlloc(start, size, MEM_COMMIT, PAGE_READWRITE) == start;
+}
+
+void
+os_decommit_pages(void *start, u64 size) {
+	assert((u64)start % os.page_size == 0, "When decommitting memory pages, the start address must be the start of a page");
+	assert(size       % os.page_size == 0, "When decommitting memory pages, the size must be aligned to page_size");
+	
+	BOOL ok = VirtualFree(start, size, MEM_DECOMMIT);
+	assert(ok, "VirtualFree Failed with error %d", GetLastError());
+}
+
+void
+os_purge_pages(void *start, u64 size) {
+	assert((u64)start % os.page_size == 0, "When purging memory pages, the start address must be the start of a page");
+	assert(size       % os.page_size == 0, "When purging memory pages, the size must be aligned to page_size");
+	
+	// Decommit & commit again one region at a time, since regions may be different allocations
+	// and we want to keep each region's protection (program memory pages may be locked).
+	u8 *p = (u8*)start;
+	u8 *end = (u8*)start+size;
+	while (p < end) {
+		MEMORY_BASIC_INFORMATION info;
+		SIZE_T ok = VirtualQuery(p, &info, sizeof(info));
+		assert(ok, "VirtualQuery Failed with error %d", GetLastError());
+		assert(info.State == MEM_COMMIT, "os_purge_pages on pages which are not committed");
+		
+		u8 *region_end = min((u8*)info.BaseAddress + info.RegionSize, end);
+		u64 region_size = (u64)(region_end-p);
+		
+		BOOL decommitted = VirtualFree(p, region_size, MEM_DECOMMIT);
+		assert(decommitted, "VirtualFree Failed with error %d", GetLastError());
+		void *committed = VirtualAlloc(p, region_size, MEM_COMMIT, info.Protect);
+		assert(committed == p, "VirtualAlloc Failed with error %d", GetLastError());
+		
+		p = region_end;
+	}
+}
+
+void
+os_unmap_pages(void *start, u64 size) {
+	// Each os_map_pages()/os_reserve_pages() call is its own allocation to windows and
+	// MEM_RELEASE can only release one whole allocation at a time.
+	u8 *p = (u8*)start;
+	while (p < (u8*)start+size) {
+		MEMORY_BASIC_INFORMATION info;
+		SIZE_T ok = VirtualQuery(p, &info, sizeof(info));
+		assert(ok, "VirtualQuery Failed with error %d", GetLastError());
+		assert(info.AllocationBase == p, "os_unmap_pages range does not line up with os_map_pages mappings");
+		
+		// One allocation is several regions if only parts of it are committed
+		u8 *next = (u8*)info.BaseAddress + info.RegionSize;
+		while (next < (u8*)start+size) {
+			ok = VirtualQuery(next, &info, sizeof(info));
+			assert(ok, "VirtualQuery Failed with error %d", GetLastError());
+			if (info.AllocationBase != p) break;
+			next += info.RegionSize;
+		}
+		
+		BOOL freed = VirtualFree(p, 0, MEM_RELEASE);
+		assert(freed, "VirtualFree Failed with error %d", GetLastError());
+		
+		p = next;
+	}
+}
+
 ///
 ///
 // Mouse pointer
@@ -1716,6 +1910,21 @@ win32_audio_thread(Thread *t) {
 
 void os_update() {
 
+	u64 start_cycles = rdtsc();
+	if (frame_stats_last_frame_start) {
+		frame_stats_record(FRAME_STATS_FRAME_TIME, rdtsc_to_seconds(start_cycles-frame_stats_last_frame_start));
+	}
+	frame_stats_last_frame_start = start_cycles;
+
+#if ENABLE_PROFILING
+	tm_frame_mark();
+	tm_counter("Heap allocated bytes", heap_profile_allocated_bytes);
+	tm_counter("Temporary storage high water", get_temporary_storage_frame_high_water_mark());
+#if LOCK_TRACK_CONTENTION
+	_profiler_report_lock_stats();
+#endif
+#endif
+
 #ifndef OOGABOOGA_HEADLESS
 	UINT dpi = GetDpiForWindow(window._os_handle);
     float dpi_scale_factor = dpi / 96.0f;
@@ -1832,6 +2041,8 @@ void os_update() {
 		win32_window_proc(window._os_handle, WM_CLOSE, 0, 0);
 	}
 #endif /* OOGABOOGA_HEADLESS */
+
+	frame_stats_record(FRAME_STATS_OS_UPDATE, rdtsc_to_seconds(rdtsc()-start_cycles));
 }
 
 #ifndef OOGABOOGA_HEADLESS
@@ -102,7 +102,7 @@ typedef struct Thread {
 	u64 id; // This is valid after os_thread_start
 	Context initial_context;
 	void* data;
-	u64 temporary_storage_size; // Defaults to KB(10)
+	u64 temporary_storage_size; // Committed up front, grows past it when needed. Defaults to KB(10)
 	Thread_Proc proc;
 	Thread_Handle os_handle;
 	
@@ -157,6 +157,18 @@ os_yield_thread();
 void ogb_instance
 os_high_precision_sleep(f64 ms);
 
+// Parks the thread while the size (1, 2, 4 or 8) bytes at address are equal to the bytes at
+// compare_address. Like a futex. Can return without a wake, so always check the value again.
+// Returns false if timeout_seconds passed. Negative timeout_seconds waits forever.
+bool ogb_instance
+os_wait_on_address(volatile void *address, void *compare_address, u64 size, f64 timeout_seconds);
+
+void ogb_instance
+os_wake_one_waiting_on_address(volatile void *address);
+
+void ogb_instance
+os_wake_all_waiting_on_address(volatile void *address);
+
 
 ///
 ///
@@ -168,6 +180,10 @@ DEPRECATED(u64 os_get_current_cycle_count(), "use rdtsc() instead");
 float64 ogb_instance
 os_get_current_time_in_seconds();
 
+// Time the calling thread has spent running (user + kernel), not wall clock time
+float64 ogb_instance
+os_get_current_thread_cpu_time_in_seconds();
+
 ///
 ///
 // Dynamic Libraries
@@ -397,6 +413,52 @@ os_get_number_of_logical_processors();
 ogb_instance string*
 os_get_stack_trace(u64 *trace_count, Allocator allocator);
 
+// Function name at address, or the address in hex if there's no debug info for it.
+// Needs CONFIGURATION == DEBUG or ENABLE_SAMPLING_PROFILER.
+ogb_instance string
+os_get_symbol_name(u64 address, Allocator allocator);
+
+// A handle to the calling thread that other threads can use. Close with os_close_thread_handle().
+ogb_instance Thread_Handle
+os_get_current_thread_handle();
+
+ogb_instance void
+os_close_thread_handle(Thread_Handle thread);
+
+// Cycles the thread has spent running. Only goes up while it's running, unlike rdtsc().
+ogb_instance u64
+os_get_thread_cpu_cycles(Thread_Handle thread);
+
+// Stops another thread, walks its frame pointers into frames (leaf first) and lets it go again.
+// Doesn't allocate or take locks while the thread is stopped. Returns the frame count, 0 on failure.
+ogb_instance u64
+os_capture_thread_stack(Thread_Handle thread, void *stack_base, u64 *frames, u64 max_frames);
+
+// Follows the saved frame pointer chain ([frame] = caller's frame, [frame+8] = return address).
+// Stops at anything outside [stack_low, stack_high), unaligned or not moving up the stack, so a
+// function without a frame pointer cuts the walk short instead of crashing it.
+inline u64
+walk_frame_pointers(u64 pc, u64 frame, u64 stack_low, u64 stack_high, u64 *frames, u64 max_frames) {
+	if (max_frames == 0) return 0;
+
+	u64 count = 0;
+	frames[count++] = pc;
+	while (count < max_frames) {
+		if (frame < stack_low || frame+2*sizeof(u64) > stack_high || (frame & (sizeof(u64)-1))) break;
+
+		u64 *record = (u64*)frame;
+		u64 caller_frame = record[0];
+		u64 return_address = record[1];
+		if (return_address == 0) break;
+
+		frames[count++] = return_address;
+
+		if (caller_frame <= frame) break;
+		frame = caller_frame;
+	}
+	return count;
+}
+
 inline void 
 dump_stack_trace() {
 	u64 count;
@@ -442,6 +504,42 @@ os_unlock_program_memory_pages(void *start, u64 size);
 void ogb_instance
 os_lock_program_memory_pages(void *start, u64 size);
 
+// Maps pages directly from the OS, outside of program memory. Pages are zeroed and ready to use.
+// - size must be aligned to os.granularity
+// - If address is not 0, this only succeeds if the pages can be mapped at exactly that address,
+//   otherwise returns 0.
+ogb_instance void*
+os_map_pages(void *address, u64 size);
+
+// Reserves address space without backing it with memory. Commit what you need with
+// os_commit_pages() and release the whole range with os_unmap_pages().
+// - size must be aligned to os.granularity
+ogb_instance void*
+os_reserve_pages(u64 size);
+
+// Pages are zeroed when they are first committed.
+// - start & size must be aligned to os.page_size
+bool ogb_instance
+os_commit_pages(void *start, u64 size);
+
+// Gives the memory back to the OS but keeps the address space reserved.
+// - start & size must be aligned to os.page_size
+void ogb_instance
+os_decommit_pages(void *start, u64 size);
+
+// Gives the physical memory behind committed pages back to the OS (like madvise MADV_DONTNEED),
+// but keeps them committed with the same protection so they can be used again right away.
+// The pages read as zero next time they're touched.
+// - start & size must be aligned to os.page_size
+// - The range may span several mappings, including program memory.
+void ogb_instance
+os_purge_pages(void *start, u64 size);
+
+// start & size must cover whole os_map_pages() or os_reserve_pages() ranges, but that may be
+// several contiguous ones.
+void ogb_instance
+os_unmap_pages(void *start, u64 size);
+
 ///
 ///
 // Mouse pointer
@@ -1,43 +1,463 @@
+///
+// rdtsc calibration
+// rdtsc counts cycles of a fixed reference clock. To turn cycles into time we measure how
+// many of them pass per second of os_get_current_time_in_seconds(). oogabooga_init() does
+// a short calibration on startup, and calling calibrate_rdtsc_frequency() again later
+// measures over the whole time since then, which is more precise.
+// Only meaningful if the cpu has an invariant TSC (rdtsc_is_invariant), otherwise the rate
+// changes with clock speed.
 
+#define RDTSC_CALIBRATION_SECONDS 0.01
+
+// #Global
+ogb_instance f64 rdtsc_frequency; // Cycles per second, 0 until calibrated
+ogb_instance bool rdtsc_is_invariant;
+ogb_instance u64 rdtsc_calibration_start_cycles;
+ogb_instance f64 rdtsc_calibration_start_seconds;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+f64 rdtsc_frequency = 0;
+bool rdtsc_is_invariant = false;
+u64 rdtsc_calibration_start_cycles = 0;
+f64 rdtsc_calibration_start_seconds = 0;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+void ogb_instance
+calibrate_rdtsc_frequency();
+
+inline f64
+rdtsc_to_seconds(u64 cycles) {
+	assert(rdtsc_frequency > 0, "rdtsc frequency is not calibrated");
+	return (f64)cycles/rdtsc_frequency;
+}
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+// Reads both clocks as close together as we can get them
+void _rdtsc_sample_clocks(u64 *cycles, f64 *seconds) {
+	u64 before = rdtsc();
+	*seconds = os_get_current_time_in_seconds();
+	u64 after = rdtsc();
+	*cycles = before + (after-before)/2;
+}
+void calibrate_rdtsc_frequency() {
+	u64 cycles;
+	f64 seconds;
+	if (rdtsc_calibration_start_cycles == 0) {
+		rdtsc_is_invariant = query_cpu_capabilities().invariant_tsc;
+		_rdtsc_sample_clocks(&rdtsc_calibration_start_cycles, &rdtsc_calibration_start_seconds);
+		do {
+			_rdtsc_sample_clocks(&cycles, &seconds);
+		} while (seconds-rdtsc_calibration_start_seconds < RDTSC_CALIBRATION_SECONDS);
+	} else {
+		_rdtsc_sample_clocks(&cycles, &seconds);
+	}
+	rdtsc_frequency = (f64)(cycles-rdtsc_calibration_start_cycles)/(seconds-rdtsc_calibration_start_seconds);
+}
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+///
+// Profiler
+// tm_scope() writes a fixed size binary record into a ring buffer owned by the calling
+// thread: no lock, no formatting, just a copy and a release store. A background thread
+// moves the records from the rings into one array, and dump_profile_result() converts them
+// to google trace json twice:
+//     google_trace_time.json: ts & dur in microseconds, from the calibrated rdtsc frequency
+//     google_trace_cycles.json: ts & dur in cycles (the viewer says us, read it as cycles)
+// If a thread fills its ring faster than it's drained, new records are dropped and counted.
+// tm_counter() records a value on a counter track, and tm_frame_mark() (called by os_update())
+// puts a frame marker in the trace along with the "Frame time (ms)" counter. Both go through
+// the same rings as the scopes.
+// When a thread exits its ring is retired. The collector drains it, and the next thread which
+// needs a ring takes it over instead of allocating a new one.
+
+#ifndef PROFILER_THREAD_BUFFER_CAPACITY
+	#define PROFILER_THREAD_BUFFER_CAPACITY 65536 // Records per thread, rounded up to a power of two
+#endif
+#define PROFILER_COLLECT_INTERVAL_MS 2
+
+typedef enum Profile_Record_Kind {
+	PROFILE_RECORD_SCOPE,
+	PROFILE_RECORD_COUNTER,
+	PROFILE_RECORD_FRAME_MARK,
+} Profile_Record_Kind;
+
+typedef struct Profile_Record {
+	u64 start; // rdtsc
+	union {
+		u64 duration; // In cycles, PROFILE_RECORD_SCOPE
+		f64 value; // PROFILE_RECORD_COUNTER
+	};
+	// Points into the string passed to tm_scope/tm_counter, which is a literal, so it's still
+	// there when the record is converted
+	u8 *name_data;
+	u32 name_count;
+	u16 thread_index; // Into the thread buffer list, which knows the thread id
+	u16 kind; // Profile_Record_Kind
+} Profile_Record;
+
+typedef struct Profile_Thread_Buffer {
+	Spsc_Queue records; // Pushed by the thread, popped by the collector
+	u64 thread_id;
+	u32 thread_index; // Changes when the buffer is taken over by another thread
+	volatile u64 dropped_count;
+	volatile bool retired; // The thread exited, so any new thread can take it over
+	struct Profile_Thread_Buffer *next;
+} Profile_Thread_Buffer;
+
+#if LOCK_TRACK_CONTENTION
+typedef struct Profile_Lock_Sample {
+	u64 time; // rdtsc
+	Lock_Stats *stats;
+	u64 contended_count; // Since the last sample
+	u64 wait_cycles; // Since the last sample
+} Profile_Lock_Sample;
+#endif
 
 // #Global
-ogb_instance String_Builder _profile_output;
 ogb_instance bool profiler_initted;
-ogb_instance Spinlock _profiler_lock;
+ogb_instance Spinlock _profiler_lock; // Guards the collected records & the thread buffer list
+ogb_instance Spinlock _profiler_init_lock;
+ogb_instance Profile_Record *profile_records; // Growing array
+ogb_instance Profile_Thread_Buffer *profile_thread_buffers;
+ogb_instance u64 *profile_thread_ids; // Growing array, thread id of each record thread_index
+ogb_instance Thread profile_collector_thread;
+ogb_instance volatile bool profile_collector_running;
+ogb_instance u64 profile_last_frame_mark;
+#if LOCK_TRACK_CONTENTION
+ogb_instance Profile_Lock_Sample *profile_lock_samples; // Growing array
+#endif
 
 #if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
-String_Builder _profile_output = {0};
 bool profiler_initted = false;
 Spinlock _profiler_lock;
+Spinlock _profiler_init_lock = {0};
+Profile_Record *profile_records = 0;
+Profile_Thread_Buffer *profile_thread_buffers = 0;
+u64 *profile_thread_ids = 0;
+Thread profile_collector_thread;
+volatile bool profile_collector_running = false;
+u64 profile_last_frame_mark = 0;
+#if LOCK_TRACK_CONTENTION
+Profile_Lock_Sample *profile_lock_samples = 0;
 #endif
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+thread_local Profile_Thread_Buffer *profile_thread_buffer = 0;
+// Set while this thread is inside the profiler. Records made then (the heap reports counters)
+// are dropped if the thread has no buffer yet, instead of recursing into making one.
+thread_local bool profile_thread_is_busy = false;
+
+// Writes google_trace_time.json & google_trace_cycles.json. Called on exit with ENABLE_PROFILING.
+void ogb_instance
+dump_profile_result();
+
+void ogb_instance
+_profiler_report_time_cycles(string name, u64 count, u64 start);
+
+void ogb_instance
+_profiler_report_counter(string name, f64 value);
+
+void ogb_instance
+_profiler_report_frame_mark();
+
+// Called when a thread exits with ENABLE_PROFILING
+void ogb_instance
+_profiler_retire_current_thread();
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+inline void _profiler_lock_acquire() {
+	profile_thread_is_busy = true;
+	spinlock_acquire_or_wait(&_profiler_lock);
+}
+inline void _profiler_lock_release() {
+	spinlock_release(&_profiler_lock);
+	profile_thread_is_busy = false;
+}
+
+// _profiler_lock must be held
+void _profiler_collect_buffer_records(Profile_Thread_Buffer *buffer) {
+	u64 available = spsc_queue_get_count(&buffer->records);
+	if (available == 0) return;
+	
+	u64 first = growing_array_get_valid_count(profile_records);
+	growing_array_resize((void**)&profile_records, first+available);
+	u64 count = spsc_queue_pop_many(&buffer->records, profile_records+first, available);
+	growing_array_resize((void**)&profile_records, first+count);
+}
+
+// Moves everything that's in the thread rings right now into profile_records.
+// _profiler_lock must be held.
+void _profiler_collect_records() {
+	for (Profile_Thread_Buffer *buffer = profile_thread_buffers; buffer; buffer = buffer->next) {
+		_profiler_collect_buffer_records(buffer);
+	}
+}
+
+void _profiler_collector_proc(Thread *t) {
+	while (profile_collector_running) {
+		os_sleep(PROFILER_COLLECT_INTERVAL_MS);
+		_profiler_lock_acquire();
+		_profiler_collect_records();
+		_profiler_lock_release();
+	}
+}
+
+// Relative to the start of the calibration, so the numbers stay small
+inline f64 _profiler_cycles_to_microseconds(u64 cycles) {
+	return (f64)(s64)(cycles-rdtsc_calibration_start_cycles)*1000000.0/rdtsc_frequency;
+}
+inline u64 _profiler_relative_cycles(u64 cycles) {
+	return cycles-rdtsc_calibration_start_cycles;
+}
+
+// _profiler_lock must be held
+void _profiler_write_trace(string path, bool in_cycles, u64 *thread_ids) {
+	u64 record_count = growing_array_get_valid_count(profile_records);
+	
+	String_Builder builder;
+	string_builder_init_reserve(&builder, record_count*128 + 1024, get_heap_allocator());
+	
+	string_builder_print(&builder, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"unit\":\"%cs\",\"rdtsc_frequency\":%.0f,\"invariant_tsc\":%cs},\"traceEvents\":[", in_cycles ? "cycles" : "microseconds", rdtsc_frequency, rdtsc_is_invariant ? "true" : "false");
+	if (in_cycles) {
+		string_builder_print(&builder, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"Cycles (read us as cycles)\"}},");
+	}
+	
+	for (u64 i = 0; i < record_count; i++) {
+		Profile_Record *r = &profile_records[i];
+		string name = (string){ r->name_count, r->name_data };
+		u64 tid = thread_ids[r->thread_index];
+		switch (r->kind) {
+			case PROFILE_RECORD_SCOPE: {
+				if (in_cycles) {
+					string_builder_print(&builder, "{\"cat\":\"function\",\"dur\":%llu,\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%llu,\"ts\":%llu},", r->duration, name, tid, _profiler_relative_cycles(r->start));
+				} else {
+					string_builder_print(&builder, "{\"cat\":\"function\",\"dur\":%.3f,\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f},", (f64)r->duration*1000000.0/rdtsc_frequency, name, tid, _profiler_cycles_to_microseconds(r->start));
+				}
+				break;
+			}
+			case PROFILE_RECORD_COUNTER: {
+				if (in_cycles) {
+					string_builder_print(&builder, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"tid\":%llu,\"ts\":%llu,\"args\":{\"value\":%.15g}},", name, tid, _profiler_relative_cycles(r->start), r->value);
+				} else {
+					string_builder_print(&builder, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f,\"args\":{\"value\":%.15g}},", name, tid, _profiler_cycles_to_microseconds(r->start), r->value);
+				}
+				break;
+			}
+			case PROFILE_RECORD_FRAME_MARK: {
+				if (in_cycles) {
+					string_builder_print(&builder, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%llu,\"ts\":%llu},", name, tid, _profiler_relative_cycles(r->start));
+				} else {
+					string_builder_print(&builder, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f},", name, tid, _profiler_cycles_to_microseconds(r->start));
+				}
+				break;
+			}
+		}
+	}
+	
+#if LOCK_TRACK_CONTENTION
+	u64 sample_count = growing_array_get_valid_count(profile_lock_samples);
+	for (u64 i = 0; i < sample_count; i++) {
+		Profile_Lock_Sample *sample = &profile_lock_samples[i];
+		if (in_cycles) {
+			string_builder_print(&builder, "{\"name\":\"Lock %s\",\"ph\":\"C\",\"pid\":0,\"tid\":0,\"ts\":%llu,\"args\":{\"contended\":%llu,\"wait_cycles\":%llu}},", sample->stats->name, _profiler_relative_cycles(sample->time), sample->contended_count, sample->wait_cycles);
+		} else {
+			string_builder_print(&builder, "{\"name\":\"Lock %s\",\"ph\":\"C\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"args\":{\"contended\":%llu,\"wait_cycles\":%llu}},", sample->stats->name, _profiler_cycles_to_microseconds(sample->time), sample->contended_count, sample->wait_cycles);
+		}
+	}
+#endif
+	
+	string_builder_append(&builder, STR("{}]}"));
+	
+	if (os_write_entire_file_s(path, builder.result)) {
+		log_verbose("Wrote profiling result to %s", path);
+	} else {
+		log_error("Failed writing profiling result to %s", path);
+	}
+	
+	dealloc(get_heap_allocator(), builder.buffer);
+}
 
 void dump_profile_result() {
-	File file = os_file_open("google_trace.json", O_CREATE | O_WRITE);
+	if (!profiler_initted) return;
 	
-	os_file_write_string(file, STR("["));
-	os_file_write_string(file, _profile_output.result);
-	os_file_write_string(file, STR("{}]"));
+	if (profile_collector_running) {
+		profile_collector_running = false;
+		os_thread_join(&profile_collector_thread);
+		os_thread_destroy(&profile_collector_thread);
+	}
+	
+	// Measure over the whole run for the most precise conversion to time
+	calibrate_rdtsc_frequency();
+	if (!rdtsc_is_invariant) {
+		log_warning("CPU doesn't report an invariant TSC, so google_trace_time.json is off wherever the clock speed changed. Use google_trace_cycles.json to compare.");
+	}
 	
-	os_file_close(file);
+	_profiler_lock_acquire();
 	
-	log_verbose("Wrote profiling result to google_trace.json");
+	_profiler_collect_records();
+	
+	u64 dropped_count = 0;
+	for (Profile_Thread_Buffer *buffer = profile_thread_buffers; buffer; buffer = buffer->next) {
+		dropped_count += buffer->dropped_count;
+	}
+	if (dropped_count) {
+		log_warning("Profiler dropped %llu records because a thread's buffer was full. Try a bigger PROFILER_THREAD_BUFFER_CAPACITY.", dropped_count);
+	}
+	
+	_profiler_write_trace(STR("google_trace_time.json"), false, profile_thread_ids);
+	_profiler_write_trace(STR("google_trace_cycles.json"), true, profile_thread_ids);
+	
+	_profiler_lock_release();
 }
-void _profiler_report_time_cycles(string name, u64 count, u64 start) {
+void _profiler_init_if_needed() {
+	if (profiler_initted) return;
+	
+	bool was_busy = profile_thread_is_busy;
+	profile_thread_is_busy = true;
+	spinlock_acquire_or_wait(&_profiler_init_lock);
 	if (!profiler_initted) {
+		if (rdtsc_frequency == 0) calibrate_rdtsc_frequency();
+		
 		spinlock_init(&_profiler_lock);
-		profiler_initted = true;
+		spinlock_set_name(&_profiler_lock, STR("_profiler_lock"));
+		
+		growing_array_init_reserve((void**)&profile_records, sizeof(Profile_Record), 1024*64, get_heap_allocator());
+		growing_array_init((void**)&profile_thread_ids, sizeof(u64), get_heap_allocator());
+#if LOCK_TRACK_CONTENTION
+		growing_array_init((void**)&profile_lock_samples, sizeof(Profile_Lock_Sample), get_heap_allocator());
+#endif
 		
-		string_builder_init_reserve(&_profile_output, 1024*1000, get_heap_allocator());	
+		profile_collector_running = true;
+		os_thread_init(&profile_collector_thread, _profiler_collector_proc);
+		os_thread_start(&profile_collector_thread);
 		
+		MEMORY_BARRIER;
+		profiler_initted = true;
 	}
+	spinlock_release(&_profiler_init_lock);
+	profile_thread_is_busy = was_busy;
+}
+Profile_Thread_Buffer *_profiler_make_thread_buffer() {
+	_profiler_init_if_needed();
 	
-	spinlock_acquire_or_wait(&_profiler_lock);
+	u64 thread_id = get_context().thread_id;
 	
-	string fmt = STR("{\"cat\":\"function\",\"dur\":%.3f,\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%zu,\"ts\":%lld},");
-	string_builder_print(&_profile_output, fmt, (float64)count*1000, name, get_context().thread_id, start*1000);
+	_profiler_lock_acquire();
 	
-	spinlock_release(&_profiler_lock);
+	Profile_Thread_Buffer *buffer = profile_thread_buffers;
+	while (buffer && !buffer->retired) buffer = buffer->next;
+	
+	if (buffer) {
+		// Records already in it belong to the exited thread
+		_profiler_collect_buffer_records(buffer);
+		buffer->retired = false;
+	} else {
+		buffer = alloc_aligned(get_heap_allocator(), sizeof(Profile_Thread_Buffer), CACHE_LINE_SIZE);
+		spsc_queue_init(&buffer->records, sizeof(Profile_Record), PROFILER_THREAD_BUFFER_CAPACITY, get_heap_allocator());
+		buffer->dropped_count = 0;
+		buffer->retired = false;
+		buffer->next = profile_thread_buffers;
+		profile_thread_buffers = buffer;
+	}
+	
+	// New index either way, so records of the previous owner keep their thread id
+	buffer->thread_id = thread_id;
+	buffer->thread_index = (u32)growing_array_get_valid_count(profile_thread_ids);
+	growing_array_add((void**)&profile_thread_ids, &thread_id);
+	
+	_profiler_lock_release();
+	
+	return buffer;
 }
+void _profiler_retire_current_thread() {
+	Profile_Thread_Buffer *buffer = profile_thread_buffer;
+	// Anything recorded after this is dropped
+	profile_thread_is_busy = true;
+	if (!buffer) return;
+	
+	profile_thread_buffer = 0;
+	// Everything this thread pushed must be visible to whoever takes the buffer over
+	MEMORY_BARRIER;
+	buffer->retired = true;
+}
+inline void _profiler_push_record(Profile_Record *record) {
+	Profile_Thread_Buffer *buffer = profile_thread_buffer;
+	if (!buffer) {
+		if (profile_thread_is_busy) return;
+		profile_thread_is_busy = true;
+		buffer = _profiler_make_thread_buffer();
+		profile_thread_buffer = buffer;
+		profile_thread_is_busy = false;
+	}
+	
+	record->thread_index = (u16)buffer->thread_index;
+	if (!spsc_queue_push(&buffer->records, record)) {
+		buffer->dropped_count += 1;
+	}
+}
+void _profiler_report_time_cycles(string name, u64 count, u64 start) {
+	Profile_Record record;
+	record.start = start;
+	record.duration = count;
+	record.name_data = name.data;
+	record.name_count = (u32)name.count;
+	record.kind = PROFILE_RECORD_SCOPE;
+	_profiler_push_record(&record);
+}
+void _profiler_report_counter(string name, f64 value) {
+	Profile_Record record;
+	record.start = rdtsc();
+	record.value = value;
+	record.name_data = name.data;
+	record.name_count = (u32)name.count;
+	record.kind = PROFILE_RECORD_COUNTER;
+	_profiler_push_record(&record);
+}
+void _profiler_report_frame_mark() {
+	u64 now = rdtsc();
+	
+	Profile_Record record;
+	record.start = now;
+	record.duration = 0;
+	string name = STR("Frame");
+	record.name_data = name.data;
+	record.name_count = (u32)name.count;
+	record.kind = PROFILE_RECORD_FRAME_MARK;
+	_profiler_push_record(&record);
+	
+	if (profile_last_frame_mark) {
+		_profiler_report_counter(STR("Frame time (ms)"), (f64)(now-profile_last_frame_mark)*1000.0/rdtsc_frequency);
+	}
+	profile_last_frame_mark = now;
+}
+#if LOCK_TRACK_CONTENTION
+// Counter tracks with how many contended acquires and wait cycles each named lock had since
+// the last call. os_update() calls this once per frame with ENABLE_PROFILING.
+void _profiler_report_lock_stats() {
+	_profiler_init_if_needed();
+	
+	u64 now = rdtsc();
+	u64 count = atomic64_load(&lock_stats_count, MEMORY_ORDER_ACQUIRE);
+	
+	_profiler_lock_acquire();
+	
+	for (u64 i = 1; i < count; i++) {
+		Lock_Stats *stats = &lock_stats[i];
+		u64 contended_count = stats->contended_count;
+		u64 wait_cycles = stats->total_wait_cycles;
+		Profile_Lock_Sample sample = { now, stats, contended_count-stats->reported_contended_count, wait_cycles-stats->reported_wait_cycles };
+		growing_array_add((void**)&profile_lock_samples, &sample);
+		stats->reported_contended_count = contended_count;
+		stats->reported_wait_cycles = wait_cycles;
+	}
+	
+	_profiler_lock_release();
+}
+#endif
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
 #if ENABLE_PROFILING
 #define tm_scope(name) \
     for (u64 start_time = rdtsc(), end_time = start_time, elapsed_time = 0; \
@@ -51,8 +471,270 @@ void _profiler_report_time_cycles(string name, u64 count, u64 start) {
     for (u64 start_time = rdtsc(), end_time = start_time, elapsed_time = 0; \
          elapsed_time == 0; \
          elapsed_time = (end_time = rdtsc()) - start_time, var+=elapsed_time)
+#define tm_counter(name, value) _profiler_report_counter(STR(name), (f64)(value))
+#define tm_frame_mark() _profiler_report_frame_mark()
 #else
 	#define tm_scope(...)
 	#define tm_scope_var(...)
 	#define tm_scope_accum(...)
-#endif
\ No newline at end of file
+	#define tm_counter(...)
+	#define tm_frame_mark()
+#endif
+
+///
+// Sampling profiler
+// tm_scope() only sees code somebody remembered to instrument. With ENABLE_SAMPLING_PROFILER a
+// background thread wakes up every SAMPLING_PROFILER_INTERVAL_MS and, for every registered
+// thread which used cpu time since the last tick (so blocked & idle threads don't pile up
+// samples), stops the thread and walks its frame pointers (os_capture_thread_stack()).
+// The stack goes straight into one buffer allocated up front. Nothing is allocated or locked
+// while a thread is stopped, so it's fine to catch it in the middle of alloc() or holding a lock.
+// sampling_profiler_dump_folded() symbolizes the samples with the same code os_get_stack_trace()
+// uses and writes one "thread <id>;outer;...;leaf <count>" line per unique stack, which is the
+// input format of flamegraph.pl, inferno & speedscope.
+// Frames are only found through frame pointers, so compile with -fno-omit-frame-pointer (and
+// -mno-omit-leaf-frame-pointer). A function without one hides its caller, it doesn't break the walk.
+// The Windows implementation stops the thread with SuspendThread() from the sampler thread rather
+// than interrupting it with a timer signal, and QueryThreadCycleTime() stands in for a cpu time timer.
+#ifndef SAMPLING_PROFILER_BUFFER_SIZE
+	#define SAMPLING_PROFILER_BUFFER_SIZE (32ull*1024*1024) // Bytes. ~1 hour of one busy thread at 1kHz with 20 frame stacks
+#endif
+#define SAMPLING_PROFILER_INTERVAL_MS 1
+#define SAMPLING_PROFILER_MAX_FRAMES 128
+#define SAMPLING_PROFILER_MAX_THREADS 64
+
+typedef struct Sampled_Thread {
+	Thread_Handle handle;
+	void *stack_base;
+	u64 thread_id;
+	u64 last_cpu_cycles; // To skip threads which didn't run since the last tick
+	bool active;
+} Sampled_Thread;
+
+// #Global
+ogb_instance Spinlock sampling_profiler_lock; // Guards sampled_threads
+ogb_instance Sampled_Thread sampled_threads[SAMPLING_PROFILER_MAX_THREADS];
+// Samples back to back: thread id, frame count, frames (leaf first)
+ogb_instance u64 *sampling_profiler_buffer;
+ogb_instance u64 sampling_profiler_buffer_used; // In u64s
+ogb_instance u64 sampling_profiler_sample_count;
+ogb_instance u64 sampling_profiler_dropped_count;
+ogb_instance u64 sampling_profiler_stopped_cycles; // Time threads spent stopped for a sample, in total
+ogb_instance Thread sampling_profiler_thread;
+ogb_instance volatile bool sampling_profiler_running;
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+Spinlock sampling_profiler_lock = {0};
+Sampled_Thread sampled_threads[SAMPLING_PROFILER_MAX_THREADS] = {0};
+u64 *sampling_profiler_buffer = 0;
+u64 sampling_profiler_buffer_used = 0;
+u64 sampling_profiler_sample_count = 0;
+u64 sampling_profiler_dropped_count = 0;
+u64 sampling_profiler_stopped_cycles = 0;
+Thread sampling_profiler_thread;
+volatile bool sampling_profiler_running = false;
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+// Threads started with os_thread_start() and the main thread are registered automatically
+// with ENABLE_SAMPLING_PROFILER. Threads made some other way need to do it themselves.
+void ogb_instance
+sampling_profiler_register_current_thread();
+
+void ogb_instance
+sampling_profiler_unregister_current_thread();
+
+void ogb_instance
+sampling_profiler_start();
+
+void ogb_instance
+sampling_profiler_stop();
+
+// Called on exit with ENABLE_SAMPLING_PROFILER, writing sampling_profile.folded
+bool ogb_instance
+sampling_profiler_dump_folded(string path);
+
+#if !OOGABOOGA_LINK_EXTERNAL_INSTANCE
+
+void sampling_profiler_register_current_thread() {
+	Thread_Handle handle = os_get_current_thread_handle();
+	u64 thread_id = get_context().thread_id;
+	
+	spinlock_acquire_or_wait(&sampling_profiler_lock);
+	for (u64 i = 0; i < SAMPLING_PROFILER_MAX_THREADS; i++) {
+		Sampled_Thread *thread = &sampled_threads[i];
+		if (thread->active) continue;
+		
+		thread->handle = handle;
+		thread->stack_base = os_get_stack_base();
+		thread->thread_id = thread_id;
+		thread->last_cpu_cycles = 0;
+		thread->active = true;
+		spinlock_release(&sampling_profiler_lock);
+		return;
+	}
+	spinlock_release(&sampling_profiler_lock);
+	
+	os_close_thread_handle(handle);
+	log_warning("More than %d threads are registered, the sampling profiler won't see thread %llu", SAMPLING_PROFILER_MAX_THREADS, thread_id);
+}
+void sampling_profiler_unregister_current_thread() {
+	u64 thread_id = get_context().thread_id;
+	
+	// Waits for the sampler to be done with this thread
+	spinlock_acquire_or_wait(&sampling_profiler_lock);
+	for (u64 i = 0; i < SAMPLING_PROFILER_MAX_THREADS; i++) {
+		Sampled_Thread *thread = &sampled_threads[i];
+		if (!thread->active || thread->thread_id != thread_id) continue;
+		
+		os_close_thread_handle(thread->handle);
+		thread->active = false;
+		break;
+	}
+	spinlock_release(&sampling_profiler_lock);
+}
+
+void _sampling_profiler_proc(Thread *t) {
+	u64 self_id = get_context().thread_id;
+	u64 capacity = SAMPLING_PROFILER_BUFFER_SIZE/sizeof(u64);
+	
+	while (sampling_profiler_running) {
+		os_sleep(SAMPLING_PROFILER_INTERVAL_MS);
+		
+		spinlock_acquire_or_wait(&sampling_profiler_lock);
+		for (u64 i = 0; i < SAMPLING_PROFILER_MAX_THREADS; i++) {
+			Sampled_Thread *thread = &sampled_threads[i];
+			if (!thread->active || thread->thread_id == self_id) continue;
+			
+			u64 cpu_cycles = os_get_thread_cpu_cycles(thread->handle);
+			if (cpu_cycles == thread->last_cpu_cycles) continue;
+			thread->last_cpu_cycles = cpu_cycles;
+			
+			if (sampling_profiler_buffer_used+2+SAMPLING_PROFILER_MAX_FRAMES > capacity) {
+				sampling_profiler_dropped_count += 1;
+				continue;
+			}
+			
+			u64 *sample = sampling_profiler_buffer+sampling_profiler_buffer_used;
+			u64 start = rdtsc();
+			u64 frame_count = os_capture_thread_stack(thread->handle, thread->stack_base, sample+2, SAMPLING_PROFILER_MAX_FRAMES);
+			sampling_profiler_stopped_cycles += rdtsc()-start;
+			if (frame_count == 0) continue;
+			
+			sample[0] = thread->thread_id;
+			sample[1] = frame_count;
+			sampling_profiler_buffer_used += 2+frame_count;
+			sampling_profiler_sample_count += 1;
+		}
+		spinlock_release(&sampling_profiler_lock);
+	}
+}
+
+void sampling_profiler_start() {
+	if (sampling_profiler_running) return;
+	
+	if (rdtsc_frequency == 0) calibrate_rdtsc_frequency();
+	
+	if (!sampling_profiler_buffer) {
+		// Allocated (and touched, with DO_ZERO_INITIALIZATION) here so sampling never page faults
+		sampling_profiler_buffer = alloc(get_heap_allocator(), SAMPLING_PROFILER_BUFFER_SIZE);
+	}
+	
+	sampling_profiler_running = true;
+	os_thread_init(&sampling_profiler_thread, _sampling_profiler_proc);
+	os_thread_start(&sampling_profiler_thread);
+}
+void sampling_profiler_stop() {
+	if (!sampling_profiler_running) return;
+	
+	sampling_profiler_running = false;
+	os_thread_join(&sampling_profiler_thread);
+	os_thread_destroy(&sampling_profiler_thread);
+}
+
+int _sampling_profiler_compare_samples(const void *a, const void *b) {
+	const u64 *x = *(const u64**)a;
+	const u64 *y = *(const u64**)b;
+	
+	// Thread id, frame count, then the frames
+	u64 count = 2+min(x[1], y[1]);
+	for (u64 i = 0; i < count; i++) {
+		if (x[i] != y[i]) return x[i] < y[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+bool sampling_profiler_dump_folded(string path) {
+	assert(!sampling_profiler_running, "Stop the sampling profiler before dumping it");
+	
+	Allocator allocator = get_heap_allocator();
+	u64 sample_count = sampling_profiler_sample_count;
+	
+	if (sampling_profiler_dropped_count) {
+		log_warning("Sampling profiler dropped %llu samples because its buffer was full. Try a bigger SAMPLING_PROFILER_BUFFER_SIZE.", sampling_profiler_dropped_count);
+	}
+	if (sample_count) {
+		f64 stopped_us = rdtsc_to_seconds(sampling_profiler_stopped_cycles)*1000000.0/(f64)sample_count;
+		log_verbose("Sampling profiler took %llu samples, stopping a thread for %.1fus each (%.2f%% of a busy thread at %dms intervals)", sample_count, stopped_us, stopped_us/(SAMPLING_PROFILER_INTERVAL_MS*1000.0)*100.0, SAMPLING_PROFILER_INTERVAL_MS);
+	}
+	
+	// Sort so equal stacks are next to each other
+	u64 **samples = sample_count ? alloc(allocator, sample_count*2*sizeof(u64*)) : 0;
+	u64 **help_buffer = samples+sample_count;
+	u64 *next = sampling_profiler_buffer;
+	for (u64 i = 0; i < sample_count; i++) {
+		samples[i] = next;
+		next += 2+next[1];
+	}
+	merge_sort(samples, help_buffer, sample_count, sizeof(u64*), _sampling_profiler_compare_samples);
+	
+	Hash_Table symbols = make_hash_table(u64, string, allocator);
+	String_Builder builder;
+	string_builder_init_reserve(&builder, 1024*64, allocator);
+	
+	for (u64 i = 0; i < sample_count;) {
+		u64 *sample = samples[i];
+		u64 same_count = 1;
+		while (i+same_count < sample_count && _sampling_profiler_compare_samples(&samples[i], &samples[i+same_count]) == 0) {
+			same_count += 1;
+		}
+		
+		string_builder_print(&builder, "thread %llu", sample[0]);
+		u64 frame_count = sample[1];
+		u64 *frames = sample+2;
+		for (s64 f = (s64)frame_count-1; f >= 0; f--) {
+			// Return addresses are the instruction after the call, which can be the start of
+			// the next function or line
+			u64 address = f == 0 ? frames[f] : frames[f]-1;
+			
+			string *name = (string*)hash_table_find(&symbols, address);
+			if (!name) {
+				string symbol = os_get_symbol_name(address, allocator);
+				hash_table_add(&symbols, address, symbol);
+				name = (string*)hash_table_find(&symbols, address);
+			}
+			string_builder_print(&builder, ";%s", *name);
+		}
+		string_builder_print(&builder, " %llu\n", same_count);
+		
+		i += same_count;
+	}
+	
+	bool ok = os_write_entire_file_s(path, builder.result);
+	if (ok) {
+		log_verbose("Wrote sampling profile to %s", path);
+	} else {
+		log_error("Failed writing sampling profile to %s", path);
+	}
+	
+	for (u64 i = 0; i < symbols.count; i++) {
+		string *symbol = (string*)hash_table_get_nth_value(&symbols, i);
+		dealloc(allocator, symbol->data);
+	}
+	hash_table_destroy(&symbols);
+	dealloc(allocator, builder.buffer);
+	if (samples) dealloc(allocator, samples);
+	
+	return ok;
+}
+
+#endif // NOT OOGABOOGA_LINK_EXTERNAL_INSTANCE
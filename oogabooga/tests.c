@@ -14,17 +14,20 @@ void log_heap() {
 		
 		print("\tBLOCK @ 0x%I64x, %llu bytes\n", (u64)block, block->size);
 		
-		Heap_Free_Node *node = block->free_head;
+		u8 *chunk = (u8*)block->start;
 
 		u64 total_free = 0;
 		
-		while (node != 0) {
+		while (chunk < (u8*)get_heap_block_end(block)) {
 		
-			print("\t\tFREE NODE @ 0x%I64x, %llu bytes\n", (u64)node, node->size);
+			u64 size = get_heap_chunk_size(chunk);
 			
-			total_free += node->size;
+			if (is_heap_chunk_free(chunk)) {
+				print("\t\tFREE NODE @ 0x%I64x, %llu bytes\n", (u64)chunk, size);
+				total_free += size;
+			}
 		
-			node = node->next;
+			chunk += size;
 		}
 		
 		print("\t TOTAL FREE: %llu\n\n", total_free);
@@ -139,6 +142,30 @@ void test_allocator(bool do_log_heap) {
     
     assert(old_foo == foo, "Temp allocator goof");
     
+    // Temp storage grows instead of wrapping around and overwriting old allocations
+    u8 *first_temp = talloc(64);
+    memset(first_temp, 0x42, 64);
+    for (int i = 0; i < 64; ++i) {
+        u8 *p = talloc(KB(64));
+        memset(p, 0x43, KB(64));
+    }
+    for (int i = 0; i < 64; ++i) {
+        assert(first_temp[i] == 0x42, "Temp storage overwrote an old allocation");
+    }
+    
+    Arena_Mark temp_mark = temp_save();
+    u8 *scratch = talloc(1024);
+    Arena_Mark inner_temp_mark = temp_save();
+    talloc(1024);
+    temp_restore(inner_temp_mark);
+    assert(talloc(1024) == scratch + 1024, "temp_restore did not restore nested mark");
+    temp_restore(temp_mark);
+    assert(talloc(1024) == scratch, "temp_restore did not restore");
+    
+    reset_temporary_storage();
+    assert(get_temporary_storage_frame_high_water_mark() >= KB(64)*64, "Temp storage high water mark is wrong");
+    assert(get_temporary_storage_max_high_water_mark() >= get_temporary_storage_frame_high_water_mark(), "Temp storage high water mark is wrong");
+    
     // Repeated Allocation and Free
     for (int i = 0; i < 10000; ++i) {
         void* temp = alloc(heap, 128);
@@ -192,11 +219,424 @@ void test_allocator(bool do_log_heap) {
         dealloc(heap, blocks[i]);
     }
     
+    // Reallocate grows/shrinks in place when the next chunk is free
+    u8 *grow = alloc(heap, 4000);
+    memset(grow, 0x11, 4000);
+    u64 in_place_before = heap_realloc_in_place_count;
+    u8 *grown = reallocate(heap, grow, 4000, 8000);
+    for (u64 i = 0; i < 4000; i++) assert(grown[i] == 0x11, "Reallocate lost data");
+    for (u64 i = 4000; i < 8000; i++) assert(grown[i] == 0, "Reallocate did not zero the new memory");
+    memset(grown, 0x22, 8000);
+    u8 *blocker = alloc(heap, 4000);
+    u8 *shrunk = reallocate(heap, grown, 8000, 3000);
+    assert(shrunk == grown, "Shrinking should always be in place");
+    for (u64 i = 0; i < 3000; i++) assert(shrunk[i] == 0x22, "Reallocate lost data");
+    u8 *moved = reallocate(heap, shrunk, 3000, 20000);
+    for (u64 i = 0; i < 3000; i++) assert(moved[i] == 0x22, "Reallocate lost data");
+    assert(heap_realloc_in_place_count > in_place_before, "Reallocate never happened in place");
+    dealloc(heap, moved);
+    dealloc(heap, blocker);
+    
+    // Large allocations get their own pages outside of the heap blocks
+    u8 *large = alloc(heap, MB(3));
+    assert(!is_pointer_in_program_memory(large), "Large allocation should be mapped outside of program memory");
+    assert(is_pointer_valid(large+MB(3)-1), "Large allocation should be a valid pointer");
+    for (u64 i = 0; i < MB(3); i += 4096) assert(large[i] == 0, "Large allocation was not zeroed");
+    memset(large, 0xAB, MB(3));
+    large = heap_allocator_proc(MB(7), large, ALLOCATOR_REALLOCATE, 0);
+    for (u64 i = 0; i < MB(3); i++) assert(large[i] == 0xAB, "Large allocation was corrupted in realloc");
+    memset(large, 0xCD, MB(7));
+    large = heap_allocator_proc(MB(2), large, ALLOCATOR_REALLOCATE, 0);
+    for (u64 i = 0; i < MB(2); i++) assert(large[i] == 0xCD, "Large allocation was corrupted in realloc");
+    dealloc(heap, large);
+    assert(!is_pointer_in_large_heap_allocation(large), "Large allocation was not unmapped");
+    
     assert(bytes_match(check_bytes, check_bytes_copy, 1024), "Memory corrupt");
     
     if (do_log_heap) log_heap();
 }
 
+void test_heap_stats() {
+	Allocator heap = get_heap_allocator();
+	
+	Heap_Stats before = heap_get_stats();
+	
+	assert(before.block_count >= 1, "Heap stats failed");
+	assert(before.used_bytes + before.free_bytes + before.large_allocation_bytes + before.block_count*sizeof(Heap_Block) == before.committed_bytes, "Heap stats don't add up");
+	assert(before.largest_free_node <= before.free_bytes, "Heap stats failed");
+	assert(before.fragmentation >= 0.0 && before.fragmentation <= 1.0, "Heap stats failed");
+	
+	void *small = alloc(heap, 10);
+	void *medium = alloc(heap, KB(8));
+	void *large = alloc(heap, HEAP_LARGE_ALLOCATION_THRESHOLD);
+	
+	Heap_Stats after = heap_get_stats();
+	
+	assert(after.allocation_counts[0] == before.allocation_counts[0]+1, "Heap stats did not count a 10 byte allocation");
+	assert(after.allocation_counts[9] == before.allocation_counts[9]+1, "Heap stats did not count an 8KB allocation");
+	assert(after.large_allocation_count == before.large_allocation_count+1, "Heap stats did not count a large allocation");
+	assert(after.used_bytes >= before.used_bytes+KB(8)+HEAP_LARGE_ALLOCATION_THRESHOLD, "Heap stats did not count used bytes");
+	
+	// Punch holes so there's more than one free node
+	void *holes[16];
+	for (u64 i = 0; i < 16; i++) holes[i] = alloc(heap, KB(4));
+	for (u64 i = 0; i < 16; i += 2) dealloc(heap, holes[i]);
+	
+	Heap_Stats fragmented = heap_get_stats();
+	assert(fragmented.free_node_count >= 8, "Heap stats did not count free nodes");
+	assert(fragmented.fragmentation > 0.0, "Heap stats fragmentation failed");
+	
+	for (u64 i = 1; i < 16; i += 2) dealloc(heap, holes[i]);
+	dealloc(heap, small);
+	dealloc(heap, medium);
+	dealloc(heap, large);
+	
+	Heap_Stats end = heap_get_stats();
+	assert(end.large_allocation_count == before.large_allocation_count, "Heap stats failed");
+	assert(end.free_node_count <= fragmented.free_node_count, "Heap stats failed");
+}
+
+void heap_trim_test_thread_proc(Thread *t) {
+	void **objects = (void**)t->data;
+	for (u64 i = 0; i < 512; i++) objects[i] = alloc(get_heap_allocator(), 200);
+}
+
+void test_heap_trim() {
+	Allocator heap = get_heap_allocator();
+	
+	Heap_Stats before = heap_get_stats();
+	
+	// Allocate until the heap needs a new block
+	const u64 max_count = 1024;
+	void **pointers = alloc(heap, max_count*sizeof(void*));
+	u64 count = 0;
+	while (count < max_count) {
+		pointers[count] = alloc(heap, KB(512));
+		memset(pointers[count], 0xAB, KB(512));
+		count += 1;
+		if (heap_get_stats().block_count > before.block_count) break;
+	}
+	assert(heap_get_stats().block_count > before.block_count, "Heap did not grow");
+	
+	for (u64 i = 0; i < count; i++) dealloc(heap, pointers[i]);
+	
+	u64 returned = heap_trim();
+	assert(returned >= KB(512)*(count-1), "heap_trim returned less than what was freed (%llu bytes)", returned);
+	
+	Heap_Stats after = heap_get_stats();
+	// Empty blocks from before may be released too
+	assert(after.block_count <= before.block_count, "heap_trim did not release the empty trailing block");
+	
+	// Nothing changed, so nothing more to give back
+	assert(heap_trim() == 0, "heap_trim purged the same pages twice");
+	
+	// Purged memory is still usable
+	for (u64 i = 0; i < count; i++) {
+		pointers[i] = alloc(heap, KB(512));
+		u8 *p = (u8*)pointers[i];
+		for (u64 j = 0; j < KB(512); j += 997) assert(p[j] == 0, "Allocation from trimmed memory was not zero initialized");
+		memset(p, 0xCD, KB(512));
+	}
+	for (u64 i = 0; i < count; i++) dealloc(heap, pointers[i]);
+	dealloc(heap, pointers);
+	
+	heap_trim();
+	
+	// Runs of exited threads are given back once their objects are freed elsewhere
+	void *thread_objects[512];
+	Thread thread;
+	os_thread_init(&thread, heap_trim_test_thread_proc);
+	thread.data = thread_objects;
+	os_thread_start(&thread);
+	os_thread_join(&thread);
+	for (u64 i = 0; i < 512; i++) dealloc(heap, thread_objects[i]);
+	
+	heap_trim();
+	
+	spinlock_acquire_or_wait(&heap_lock);
+	for (Heap_Thread_Cache *cache = heap_abandoned_thread_caches; cache; cache = cache->next_abandoned) {
+		assert(!cache->remote_free_head, "heap_trim did not collect the remote frees of an exited thread");
+		for (u32 i = 0; i < HEAP_SMALL_CLASS_COUNT; i++) {
+			for (Heap_Small_Run *run = cache->runs[i]; run; run = run->next) {
+				assert(run->used_count > 0, "heap_trim did not release an empty run of an exited thread");
+			}
+		}
+	}
+	spinlock_release(&heap_lock);
+}
+
+void test_zero_initialization() {
+	Allocator heap = get_heap_allocator();
+	
+	// Sizes for the thread cache, chunks (with clean pages in the middle) and large allocations
+	const u64 sizes[] = { 100, KB(3), KB(64), KB(300), HEAP_LARGE_ALLOCATION_THRESHOLD, MB(3) };
+	for (u64 i = 0; i < sizeof(sizes)/sizeof(u64); i++) {
+		u64 size = sizes[i];
+		// First round may come from clean memory, second reuses what we just dirtied
+		for (u64 round = 0; round < 2; round++) {
+			u8 *p = alloc(heap, size);
+			for (u64 j = 0; j < size; j++) assert(p[j] == 0, "alloc() of %llu bytes was not zero at %llu", size, j);
+			memset(p, 0xFF, size);
+			dealloc(heap, p);
+		}
+	}
+	
+	// Dirty a big range, trim it and dirty parts of it again
+	u8 *big = alloc(heap, KB(600));
+	memset(big, 0xFF, KB(600));
+	dealloc(heap, big);
+	heap_trim();
+	u8 *first = alloc(heap, KB(100));
+	memset(first, 0xFF, KB(100));
+	u8 *second = alloc(heap, KB(400));
+	for (u64 j = 0; j < KB(400); j++) assert(second[j] == 0, "alloc() from trimmed memory was not zero at %llu", j);
+	dealloc(heap, first);
+	dealloc(heap, second);
+	
+	// Arena only needs to zero memory it handed out before
+	Arena arena;
+	arena_init(&arena, MB(16));
+	Allocator a = get_arena_allocator(&arena);
+	for (u64 round = 0; round < 2; round++) {
+		u8 *p = alloc(a, KB(200));
+		for (u64 j = 0; j < KB(200); j++) assert(p[j] == 0, "Arena alloc() was not zero at %llu", j);
+		memset(p, 0xFF, KB(200));
+		arena_reset(&arena);
+	}
+	arena_destroy(&arena);
+
+}
+
+void test_alloc_aligned() {
+	Allocator heap = get_heap_allocator();
+	
+	Arena arena;
+	arena_init(&arena, MB(64));
+	
+	Allocator allocators[] = { heap, get_temporary_allocator(), get_arena_allocator(&arena) };
+	const u64 alignments[] = { 8, 16, 32, 64, 128, 4096 };
+	const u64 sizes[] = { 1, 24, 100, 1000, KB(5), KB(100), HEAP_LARGE_ALLOCATION_THRESHOLD+7 };
+	
+	void *pointers[6*7];
+	for (u64 a = 0; a < sizeof(allocators)/sizeof(Allocator); a++) {
+		u64 n = 0;
+		for (u64 i = 0; i < sizeof(alignments)/sizeof(u64); i++) {
+			for (u64 j = 0; j < sizeof(sizes)/sizeof(u64); j++) {
+				u8 *p = alloc_aligned(allocators[a], sizes[j], alignments[i]);
+				assert((u64)p % alignments[i] == 0, "alloc_aligned returned a pointer not aligned to %llu", alignments[i]);
+#if DO_ZERO_INITIALIZATION
+				for (u64 k = 0; k < sizes[j]; k++) assert(p[k] == 0, "alloc_aligned did not zero initialize");
+#endif
+				memset(p, (u8)n, sizes[j]);
+				pointers[n++] = p;
+			}
+		}
+		n = 0;
+		for (u64 i = 0; i < sizeof(alignments)/sizeof(u64); i++) {
+			for (u64 j = 0; j < sizeof(sizes)/sizeof(u64); j++) {
+				u8 *p = (u8*)pointers[n];
+				assert(p[0] == (u8)n && p[sizes[j]-1] == (u8)n, "alloc_aligned allocations overlap");
+				dealloc(allocators[a], p);
+				n += 1;
+			}
+		}
+	}
+	
+	// Mixed with normal allocations so aligned chunks end up next to everything else
+	void *mixed[256];
+	for (u64 i = 0; i < 256; i++) {
+		mixed[i] = (i % 2) ? alloc_aligned(heap, 2000+i*8, CACHE_LINE_SIZE) : alloc(heap, 2000+i*8);
+		memset(mixed[i], 0xAB, 2000+i*8);
+	}
+	for (u64 i = 0; i < 256; i += 2) dealloc(heap, mixed[i]);
+	for (u64 i = 1; i < 256; i += 2) dealloc(heap, mixed[i]);
+	
+	// Large aligned allocations get their own mapping too, even when aligned to more than a mapping is
+	const u64 large_alignments[] = { 4096, os.granularity, os.granularity*4, MB(1) };
+	for (u64 i = 0; i < sizeof(large_alignments)/sizeof(u64); i++) {
+		u64 size = HEAP_LARGE_ALLOCATION_THRESHOLD*2+3;
+		u8 *p = alloc_aligned(heap, size, large_alignments[i]);
+		assert((u64)p % large_alignments[i] == 0, "Large alloc_aligned returned a pointer not aligned to %llu", large_alignments[i]);
+		assert(!is_pointer_in_program_memory(p), "Large aligned allocation was put in a heap block");
+		assert(heap_get_allocation_size(p) >= size, "Large aligned allocation is smaller than requested");
+		memset(p, 0xCD, size);
+		p = reallocate(heap, p, size, size*2);
+		assert(p[0] == 0xCD && p[size-1] == 0xCD, "Large aligned allocation lost its data when it grew");
+		memset(p, 0xCD, size*2);
+		dealloc(heap, p);
+	}
+	
+	// Growing arrays keep the alignment when they grow
+	Allocator array_allocators[] = { heap, get_temporary_allocator() };
+	for (u64 a = 0; a < 2; a++) {
+		float32 *samples;
+		growing_array_init_aligned((void**)&samples, sizeof(float32), CACHE_LINE_SIZE, array_allocators[a]);
+		for (u64 i = 0; i < 10000; i++) {
+			float32 sample = (float32)i;
+			growing_array_add((void**)&samples, &sample);
+			assert((u64)samples % CACHE_LINE_SIZE == 0, "Aligned growing array lost its alignment");
+		}
+		for (u64 i = 0; i < 10000; i++) assert(samples[i] == (float32)i, "Aligned growing array lost items when growing");
+		growing_array_deinit((void**)&samples);
+	}
+	
+	arena_destroy(&arena);
+}
+
+void test_arena() {
+	Arena arena;
+	arena_init(&arena, MB(64));
+	
+	u8 *a = arena_push(&arena, 100);
+	u8 *b = arena_push(&arena, 1);
+	assert((u64)a % ARENA_ALIGNMENT == 0 && (u64)b % ARENA_ALIGNMENT == 0, "Arena allocations are not aligned");
+	assert(b > a+99, "Arena allocations overlap");
+	memset(a, 1, 100);
+	*b = 2;
+	
+	// Pages are committed as we go
+	u8 *big = arena_push(&arena, MB(10));
+	memset(big, 3, MB(10));
+	assert(arena.committed_size >= arena.used, "Arena did not commit the memory it handed out");
+	
+	Arena_Mark mark = arena_get_mark(&arena);
+	arena_scope(&arena) {
+		u8 *scoped = arena_push(&arena, KB(5));
+		memset(scoped, 4, KB(5));
+		arena_scope(&arena) {
+			arena_push(&arena, 64);
+		}
+		assert(arena_get_mark(&arena) == mark + KB(5), "Nested arena scope did not pop");
+	}
+	assert(arena_get_mark(&arena) == mark, "Arena scope did not pop");
+	
+	u8 *after = arena_push(&arena, 16);
+	assert(after == big + MB(10), "Arena did not reuse popped memory");
+	
+	arena_pop_to_mark(&arena, mark);
+	
+	// Allocator adapter
+	Allocator allocator = get_arena_allocator(&arena);
+	
+	int *numbers;
+	growing_array_init_reserve((void**)&numbers, sizeof(int), 4, allocator);
+	for (int i = 0; i < 1000; i++) growing_array_add((void**)&numbers, &i);
+	for (int i = 0; i < 1000; i++) assert(numbers[i] == i, "Growing array in arena is corrupt");
+	growing_array_deinit((void**)&numbers);
+	
+	String_Builder sb;
+	string_builder_init(&sb, allocator);
+	for (int i = 0; i < 100; i++) string_builder_print(&sb, "%d,", i);
+	string result = string_builder_get_string(sb);
+	assert(string_starts_with(result, STR("0,1,2,3,")), "String builder in arena is corrupt");
+	
+	u8 *last = alloc(allocator, 32);
+	memset(last, 5, 32);
+	u8 *grown = allocator.proc(64, last, ALLOCATOR_REALLOCATE, allocator.data);
+	assert(grown == last, "Last arena allocation should grow in place");
+	for (u64 i = 0; i < 32; i++) assert(grown[i] == 5, "Arena reallocate lost data");
+	
+	for (u64 i = 0; i < 100; i++) assert(a[i] == 1, "Arena memory was corrupted");
+	assert(*b == 2, "Arena memory was corrupted");
+	for (u64 i = 0; i < MB(10); i++) assert(big[i] == 3, "Arena memory was corrupted");
+	
+	arena_reset(&arena);
+	assert(arena.used == 0, "Arena reset did not reset");
+	assert(arena_push(&arena, 8) == a, "Arena reset did not reuse memory");
+	
+	arena_destroy(&arena);
+}
+
+typedef struct Pool_Test_Object {
+	u64 id;
+	u8 payload[40];
+} Pool_Test_Object;
+void pool_test_thread_proc(Thread *t) {
+	Pool *pool = (Pool*)t->data;
+	Pool_Test_Object *objects[256];
+	u64 tag = (u64)objects; // Unique per thread
+	for (u64 n = 0; n < 100; n++) {
+		for (u64 i = 0; i < 256; i++) {
+			objects[i] = pool_alloc(pool);
+			objects[i]->id = tag+i;
+		}
+		for (u64 i = 0; i < 256; i++) {
+			assert(objects[i]->id == tag+i, "Pool object was handed out twice");
+			pool_dealloc(pool, objects[i]);
+		}
+	}
+}
+void pool_test_destroy_thread_proc(Thread *t) {
+	Pool *pools = (Pool*)t->data;
+	for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) pool_destroy(&pools[i]);
+}
+
+void test_pool() {
+	Pool pool;
+	pool_init(&pool, sizeof(Pool_Test_Object), false);
+	
+	const u64 count = 10000; // More than one chunk
+	Pool_Test_Object **objects = alloc(get_heap_allocator(), count*sizeof(void*));
+	for (u64 i = 0; i < count; i++) {
+		objects[i] = pool_alloc(&pool);
+		assert((u64)objects[i] % POOL_ALIGNMENT == 0, "Pool object is not aligned");
+		objects[i]->id = i;
+	}
+	assert(pool.chunk_count > 1, "Pool should have needed more than one chunk");
+	for (u64 i = 0; i < count; i++) assert(objects[i]->id == i, "Pool objects overlap");
+	
+	// Freed objects are reused before new ones
+	Pool_Test_Object *freed = objects[1234];
+	pool_dealloc(&pool, freed);
+	objects[1234] = pool_alloc(&pool);
+	assert(objects[1234] == freed, "Pool did not reuse freed object");
+	
+	u64 chunk_count = pool.chunk_count;
+	for (u64 i = 0; i < count; i++) pool_dealloc(&pool, objects[i]);
+	for (u64 i = 0; i < count; i++) objects[i] = pool_alloc(&pool);
+	assert(pool.chunk_count == chunk_count, "Pool did not reuse freed objects");
+	for (u64 i = 0; i < count; i++) pool_dealloc(&pool, objects[i]);
+	
+	// Allocator adapter
+	Allocator allocator = get_pool_allocator(&pool);
+	Pool_Test_Object *o = alloc(allocator, sizeof(Pool_Test_Object));
+	for (u64 i = 0; i < sizeof(Pool_Test_Object); i++) assert(((u8*)o)[i] == 0, "Pool allocator did not zero initialize");
+	dealloc(allocator, o);
+	
+	pool_destroy(&pool);
+	assert(pool.chunk_count == 0, "Pool was not destroyed");
+	
+	// Shared between threads, with thread caching
+	Pool shared = POOL_INITIALIZER(sizeof(Pool_Test_Object), true);
+	const u64 num_threads = 8;
+	Thread threads[8];
+	for (u64 i = 0; i < num_threads; i++) {
+		os_thread_init(&threads[i], pool_test_thread_proc);
+		threads[i].data = &shared;
+	}
+	for (u64 i = 0; i < num_threads; i++) os_thread_start(&threads[i]);
+	for (u64 i = 0; i < num_threads; i++) os_thread_join(&threads[i]);
+	pool_destroy(&shared);
+	
+	// Pools destroyed on another thread don't keep holding this thread's cache slots
+	Pool cached_pools[POOL_THREAD_CACHE_SLOTS];
+	for (u64 i = 0; i < POOL_THREAD_CACHE_SLOTS; i++) {
+		pool_init(&cached_pools[i], sizeof(Pool_Test_Object), true);
+		pool_dealloc(&cached_pools[i], pool_alloc(&cached_pools[i]));
+	}
+	Thread destroyer;
+	os_thread_init(&destroyer, pool_test_destroy_thread_proc);
+	destroyer.data = cached_pools;
+	os_thread_start(&destroyer);
+	os_thread_join(&destroyer);
+	Pool after = POOL_INITIALIZER(sizeof(Pool_Test_Object), true);
+	pool_dealloc(&after, pool_alloc(&after));
+	assert(pool_get_thread_cache(&after), "Destroyed pools still hold thread cache slots");
+	pool_destroy(&after);
+	
+	dealloc(get_heap_allocator(), objects);
+}
+
 void test_thread_proc1(Thread* t) {
 	os_sleep(5);
 	print("Hello from thread %llu\n", t->id);
@@ -258,6 +698,64 @@ void test_allocator_threaded(Thread *t) {
     }
 }
 
+// Objects allocated on one thread and freed on another go back through the owning thread
+// cache's remote free list.
+typedef struct Heap_Remote_Free_Test_Data {
+	u8 *pointers[512];
+	u64 first;
+	u64 count;
+} Heap_Remote_Free_Test_Data;
+void heap_remote_free_test_alloc_proc(Thread *t) {
+	Heap_Remote_Free_Test_Data *data = (Heap_Remote_Free_Test_Data*)t->data;
+	Allocator heap = get_heap_allocator();
+	for (u64 i = data->first; i < data->first+data->count; i++) {
+		u64 size = 8 + (i*37) % HEAP_THREAD_CACHE_MAX_SIZE;
+		data->pointers[i] = alloc(heap, size);
+		memset(data->pointers[i], (u8)i, size);
+	}
+}
+void heap_remote_free_test_dealloc_proc(Thread *t) {
+	Heap_Remote_Free_Test_Data *data = (Heap_Remote_Free_Test_Data*)t->data;
+	Allocator heap = get_heap_allocator();
+	for (u64 i = data->first; i < data->first+data->count; i++) {
+		u64 size = 8 + (i*37) % HEAP_THREAD_CACHE_MAX_SIZE;
+		for (u64 j = 0; j < size; j++) assert(data->pointers[i][j] == (u8)i, "Heap memory was corrupted between threads");
+		dealloc(heap, data->pointers[i]);
+	}
+}
+void test_allocator_thread_caches() {
+	Allocator heap = get_heap_allocator();
+	
+	Heap_Remote_Free_Test_Data *data = alloc(heap, sizeof(Heap_Remote_Free_Test_Data));
+	Thread t;
+	Thread this_thread = ZERO(Thread);
+	this_thread.data = data;
+	
+	for (u64 round = 0; round < 4; round++) {
+		// Other thread allocates everything
+		data->first = 0;
+		data->count = 512;
+		os_thread_init(&t, heap_remote_free_test_alloc_proc);
+		t.data = data;
+		os_thread_start(&t);
+		os_thread_join(&t);
+		
+		// We free half of it after the owner thread is gone
+		data->count = 256;
+		heap_remote_free_test_dealloc_proc(&this_thread);
+		
+		// We allocate the first half again, then another thread frees everything
+		heap_remote_free_test_alloc_proc(&this_thread);
+		data->count = 512;
+		os_thread_init(&t, heap_remote_free_test_dealloc_proc);
+		t.data = data;
+		os_thread_start(&t);
+		os_thread_join(&t);
+	}
+	
+	dealloc(heap, data);
+}
+
 void test_strings() {
 	Allocator heap = get_heap_allocator();
 	{
@@ -1188,15 +1686,15 @@ void test_mutex() {
     
     // Test initialization
     mutex_init(&m);
-    assert(m.spin_time_microseconds == MUTEX_DEFAULT_SPIN_TIME_MICROSECONDS, "Failed: Default spin time incorrect");
-    assert(!m.spinlock_acquired, "Failed: Spinlock should not be acquired after initialization");
+    assert(m.state == MUTEX_UNLOCKED, "Failed: Mutex should not be acquired after initialization");
 
     // Test acquire and release without contention
     mutex_acquire_or_wait(&m);
-    assert(m.spinlock_acquired, "Failed: Mutex should be acquired after mutex_acquire_or_wait");
+    assert(m.state == MUTEX_LOCKED, "Failed: Mutex should be acquired after mutex_acquire_or_wait");
+    assert(m.acquiring_thread == context.thread_id, "Failed: Mutex should be owned by this thread");
     
     mutex_release(&m);
-    assert(!m.spinlock_acquired, "Failed: Spinlock should not be acquired after mutex_release");
+    assert(m.state == MUTEX_UNLOCKED, "Failed: Mutex should not be acquired after mutex_release");
 
     // Clean up
     mutex_destroy(&m);
@@ -1227,6 +1725,888 @@ void test_mutex() {
     mutex_destroy(&data.mutex);
 }
 
+typedef struct Lock_Contention_Test_Data {
+	Mutex mutex;
+	Spinlock spinlock;
+	bool use_spinlock;
+	u64 lock_count; // Per thread
+	volatile u64 counter;
+} Lock_Contention_Test_Data;
+void lock_contention_test_proc(Thread *t) {
+	Lock_Contention_Test_Data *data = (Lock_Contention_Test_Data*)t->data;
+	for (u64 i = 0; i < data->lock_count; i++) {
+		if (data->use_spinlock) spinlock_acquire_or_wait(&data->spinlock);
+		else                    mutex_acquire_or_wait(&data->mutex);
+		
+		data->counter += 1;
+		
+		if (data->use_spinlock) spinlock_release(&data->spinlock);
+		else                    mutex_release(&data->mutex);
+	}
+}
+// Every thread hammers the same lock with a tiny critical section, which is the worst case
+void test_lock_contention() {
+	Allocator heap = get_heap_allocator();
+	
+	const u64 lock_count = 100000;
+	Thread *threads = alloc(heap, sizeof(Thread)*16);
+	Lock_Contention_Test_Data data = {0};
+	mutex_init(&data.mutex);
+	spinlock_init(&data.spinlock);
+	mutex_set_name(&data.mutex, STR("test_lock_contention mutex"));
+	spinlock_set_name(&data.spinlock, STR("test_lock_contention spinlock"));
+	data.lock_count = lock_count;
+#if LOCK_TRACK_CONTENTION
+	u64 mutex_acquires_before = data.mutex.stats->acquire_count;
+	u64 spinlock_acquires_before = data.spinlock.stats->acquire_count;
+#endif
+	
+	for (u64 n = 2; n <= 16; n *= 2) {
+		for (u64 s = 0; s < 2; s++) {
+			data.use_spinlock = s == 1;
+			data.counter = 0;
+			for (u64 i = 0; i < n; i++) {
+				os_thread_init(&threads[i], lock_contention_test_proc);
+				threads[i].data = &data;
+			}
+			for (u64 i = 0; i < n; i++) os_thread_start(&threads[i]);
+			for (u64 i = 0; i < n; i++) os_thread_join(&threads[i]);
+			for (u64 i = 0; i < n; i++) os_thread_destroy(&threads[i]);
+			
+			assert(data.counter == n*lock_count, "Failed: %llu threads counted to %llu, expected %llu", n, data.counter, n*lock_count);
+		}
+	}
+	
+#if LOCK_TRACK_CONTENTION
+	const u64 expected_acquires = lock_count*(2+4+8+16);
+	Lock_Stats *locks[2] = { data.mutex.stats, data.spinlock.stats };
+	u64 acquires_before[2] = { mutex_acquires_before, spinlock_acquires_before };
+	for (u64 i = 0; i < 2; i++) {
+		Lock_Stats *stats = locks[i];
+		assert(stats != &lock_stats[0], "Failed: named lock counts as unnamed");
+		assert(stats->acquire_count-acquires_before[i] == expected_acquires, "Failed: lock stats %s counted %llu acquires, expected %llu", stats->name, stats->acquire_count-acquires_before[i], expected_acquires);
+		assert(stats->contended_count <= stats->acquire_count, "Failed: lock stats %s has more contended acquires than acquires", stats->name);
+		assert(stats->max_wait_cycles <= stats->total_wait_cycles, "Failed: lock stats %s max wait is more than total wait", stats->name);
+		assert(stats->contended_count == 0 || stats->total_wait_cycles > 0, "Failed: lock stats %s has contended acquires but no wait", stats->name);
+	}
+	Spinlock same_name;
+	spinlock_init(&same_name);
+	spinlock_set_name(&same_name, STR("test_lock_contention spinlock"));
+	assert(same_name.stats == data.spinlock.stats, "Failed: locks with the same name should share stats");
+	
+	assert(lock_dump_contention_stats(STR("lock_contention_test.txt")), "Failed: lock_dump_contention_stats");
+	string dump;
+	assert(os_read_entire_file_s(STR("lock_contention_test.txt"), &dump, heap), "Failed: reading lock contention dump");
+	assert(string_find_from_left(dump, STR("test_lock_contention mutex")) != -1, "Failed: lock contention dump is missing a lock");
+	dealloc_string(heap, dump);
+	os_file_delete_s(STR("lock_contention_test.txt"));
+#endif
+	
+	mutex_destroy(&data.mutex);
+	dealloc(heap, threads);
+}
+
+#define ATOMICS_TEST_THREAD_COUNT 4
+#define ATOMICS_TEST_ITERATIONS 100000
+typedef struct Atomics_Test_Data {
+	volatile u64 counter_64;
+	volatile u32 counter_32;
+	volatile u64 bits;
+	
+	RW_Spinlock rw_lock;
+	u64 protected_a; // Always equal to protected_b when read under the lock
+	u64 protected_b;
+	volatile u64 read_count;
+	
+	Seqlock seqlock;
+	u64 sequenced[4]; // Always {n, n*2, n*3, n*4}
+	volatile bool writer_done;
+} Atomics_Test_Data;
+void atomics_test_proc(Thread *t) {
+	Atomics_Test_Data *data = (Atomics_Test_Data*)t->data;
+	u64 thread_index = (u64)t->id % 64;
+	for (u64 i = 0; i < ATOMICS_TEST_ITERATIONS; i++) {
+		atomic64_fetch_add(&data->counter_64, 2, MEMORY_ORDER_RELAXED);
+		atomic64_fetch_sub(&data->counter_64, 1, MEMORY_ORDER_RELAXED);
+		atomic32_fetch_add(&data->counter_32, 1, MEMORY_ORDER_ACQ_REL);
+		
+		if (i % 64 == 0) {
+			rw_spinlock_acquire_write_or_wait(&data->rw_lock);
+			data->protected_a += 1;
+			data->protected_b += 1;
+			rw_spinlock_release_write(&data->rw_lock);
+		} else {
+			rw_spinlock_acquire_read_or_wait(&data->rw_lock);
+			assert(data->protected_a == data->protected_b, "Failed: RW_Spinlock reader saw a half done write");
+			rw_spinlock_release_read(&data->rw_lock);
+		}
+		
+		u64 copy[4];
+		u32 sequence;
+		do {
+			sequence = seqlock_read_begin(&data->seqlock);
+			memcpy(copy, data->sequenced, sizeof(copy));
+		} while (seqlock_read_retry(&data->seqlock, sequence));
+		assert(copy[1] == copy[0]*2 && copy[2] == copy[0]*3 && copy[3] == copy[0]*4, "Failed: Seqlock reader saw a torn write");
+	}
+	atomic64_fetch_or(&data->bits, 1ULL << thread_index, MEMORY_ORDER_RELAXED);
+}
+void atomics_test_seqlock_writer_proc(Thread *t) {
+	Atomics_Test_Data *data = (Atomics_Test_Data*)t->data;
+	for (u64 n = 1; !data->writer_done; n++) {
+		seqlock_write_begin(&data->seqlock);
+		data->sequenced[0] = n;
+		data->sequenced[1] = n*2;
+		data->sequenced[2] = n*3;
+		data->sequenced[3] = n*4;
+		seqlock_write_end(&data->seqlock);
+	}
+}
+void test_atomics() {
+	volatile u32 a32 = 5;
+	volatile u64 a64 = 5;
+	
+	assert(atomic32_load(&a32, MEMORY_ORDER_ACQUIRE) == 5, "Failed: atomic32_load");
+	atomic32_store(&a32, 7, MEMORY_ORDER_RELEASE);
+	assert(a32 == 7, "Failed: atomic32_store");
+	atomic32_store(&a32, 8, MEMORY_ORDER_SEQ_CST);
+	assert(atomic32_exchange(&a32, 3, MEMORY_ORDER_ACQ_REL) == 8 && a32 == 3, "Failed: atomic32_exchange");
+	assert(atomic32_fetch_add(&a32, 4, MEMORY_ORDER_RELAXED) == 3 && a32 == 7, "Failed: atomic32_fetch_add");
+	assert(atomic32_fetch_sub(&a32, 2, MEMORY_ORDER_RELAXED) == 7 && a32 == 5, "Failed: atomic32_fetch_sub");
+	assert(atomic32_fetch_and(&a32, 4, MEMORY_ORDER_RELAXED) == 5 && a32 == 4, "Failed: atomic32_fetch_and");
+	assert(atomic32_fetch_or(&a32, 3, MEMORY_ORDER_RELAXED) == 4 && a32 == 7, "Failed: atomic32_fetch_or");
+	assert(atomic32_fetch_sub(&a32, 8, MEMORY_ORDER_RELAXED) == 7 && a32 == 0xFFFFFFFF, "Failed: atomic32_fetch_sub wrap");
+	
+	assert(atomic64_load(&a64, MEMORY_ORDER_RELAXED) == 5, "Failed: atomic64_load");
+	atomic64_store(&a64, 0x100000000ULL, MEMORY_ORDER_SEQ_CST);
+	assert(a64 == 0x100000000ULL, "Failed: atomic64_store");
+	assert(atomic64_exchange(&a64, 3, MEMORY_ORDER_SEQ_CST) == 0x100000000ULL && a64 == 3, "Failed: atomic64_exchange");
+	assert(atomic64_fetch_add(&a64, 0x100000000ULL, MEMORY_ORDER_RELAXED) == 3 && a64 == 0x100000003ULL, "Failed: atomic64_fetch_add");
+	assert(atomic64_fetch_sub(&a64, 1, MEMORY_ORDER_RELAXED) == 0x100000003ULL && a64 == 0x100000002ULL, "Failed: atomic64_fetch_sub");
+	assert(atomic64_fetch_and(&a64, 0x100000000ULL, MEMORY_ORDER_RELAXED) == 0x100000002ULL && a64 == 0x100000000ULL, "Failed: atomic64_fetch_and");
+	assert(atomic64_fetch_or(&a64, 1, MEMORY_ORDER_RELAXED) == 0x100000000ULL && a64 == 0x100000001ULL, "Failed: atomic64_fetch_or");
+	memory_fence(MEMORY_ORDER_SEQ_CST);
+	memory_fence(MEMORY_ORDER_ACQUIRE);
+	
+	Atomics_Test_Data data = {0};
+	rw_spinlock_init(&data.rw_lock);
+	seqlock_init(&data.seqlock);
+	
+	Thread writer;
+	os_thread_init(&writer, atomics_test_seqlock_writer_proc);
+	writer.data = &data;
+	os_thread_start(&writer);
+	
+	Thread threads[ATOMICS_TEST_THREAD_COUNT];
+	for (u64 i = 0; i < ATOMICS_TEST_THREAD_COUNT; i++) {
+		os_thread_init(&threads[i], atomics_test_proc);
+		threads[i].data = &data;
+		os_thread_start(&threads[i]);
+	}
+	for (u64 i = 0; i < ATOMICS_TEST_THREAD_COUNT; i++) {
+		os_thread_join(&threads[i]);
+		os_thread_destroy(&threads[i]);
+	}
+	data.writer_done = true;
+	os_thread_join(&writer);
+	os_thread_destroy(&writer);
+	
+	const u64 total = ATOMICS_TEST_THREAD_COUNT*ATOMICS_TEST_ITERATIONS;
+	assert(data.counter_64 == total, "Failed: atomic 64 bit counter is %llu, expected %llu", data.counter_64, total);
+	assert(data.counter_32 == total, "Failed: atomic 32 bit counter is %u, expected %llu", data.counter_32, total);
+	assert(data.bits != 0, "Failed: atomic64_fetch_or from threads");
+	assert(data.protected_a == ATOMICS_TEST_THREAD_COUNT*((ATOMICS_TEST_ITERATIONS+63)/64), "Failed: RW_Spinlock writes got lost");
+	assert(data.rw_lock.state == 0, "Failed: RW_Spinlock should be free, state is 0x%x", data.rw_lock.state);
+	assert(!(data.seqlock.sequence & 1), "Failed: Seqlock sequence should be even after writes");
+
+}
+
+typedef struct Sync_Test_Data {
+	Event event;
+	Semaphore semaphore;
+	Condition_Variable cv;
+	Mutex mutex;
+	volatile u64 consumed;
+	u64 item_count;
+} Sync_Test_Data;
+void sync_test_consumer_proc(Thread *t) {
+	Sync_Test_Data *data = (Sync_Test_Data*)t->data;
+	for (u64 i = 0; i < data->item_count; i++) {
+		semaphore_wait(&data->semaphore);
+		mutex_acquire_or_wait(&data->mutex);
+		data->consumed += 1;
+		condition_variable_broadcast(&data->cv);
+		mutex_release(&data->mutex);
+	}
+	event_wait(&data->event);
+}
+void test_sync_primitives() {
+	{
+		Event e;
+		event_init(&e, false, false);
+		assert(!event_wait_timeout(&e, 0.001), "Failed: unsignaled event wait should time out");
+		event_signal(&e);
+		event_signal(&e);
+		assert(event_wait_timeout(&e, 0), "Failed: signaled event wait should return true");
+		assert(!event_wait_timeout(&e, 0), "Failed: auto reset event should reset after a wait");
+		
+		event_init(&e, true, true);
+		assert(event_wait_timeout(&e, 0), "Failed: manual reset event should start signaled");
+		assert(event_wait_timeout(&e, 0), "Failed: manual reset event should stay signaled");
+		event_reset(&e);
+		assert(!event_wait_timeout(&e, 0), "Failed: manual reset event should not be signaled after reset");
+		
+		Semaphore sem;
+		semaphore_init(&sem, 2);
+		assert(semaphore_try_wait(&sem), "Failed: semaphore_try_wait");
+		semaphore_wait(&sem);
+		assert(!semaphore_try_wait(&sem), "Failed: semaphore_try_wait should fail when count is 0");
+		semaphore_signal(&sem, 3);
+		assert(sem.count == 3, "Failed: semaphore count should be 3, was %u", sem.count);
+	}
+	
+	// Producer/consumers: the semaphore counts items, the condition variable tells the
+	// producer how many were consumed and the manual reset event lets everyone exit at the end.
+	{
+		Sync_Test_Data data = {0};
+		const u64 consumer_count = 4;
+		data.item_count = 1000;
+		event_init(&data.event, true, false);
+		semaphore_init(&data.semaphore, 0);
+		condition_variable_init(&data.cv);
+		mutex_init(&data.mutex);
+		
+		Thread threads[4];
+		for (u64 i = 0; i < consumer_count; i++) {
+			os_thread_init(&threads[i], sync_test_consumer_proc);
+			threads[i].data = &data;
+			os_thread_start(&threads[i]);
+		}
+		
+		u64 total = consumer_count*data.item_count;
+		for (u64 i = 0; i < total; i += 10) {
+			semaphore_signal(&data.semaphore, 10);
+		}
+		
+		mutex_acquire_or_wait(&data.mutex);
+		while (data.consumed != total) condition_variable_wait(&data.cv, &data.mutex);
+		mutex_release(&data.mutex);
+		
+		event_signal(&data.event);
+		for (u64 i = 0; i < consumer_count; i++) {
+			os_thread_join(&threads[i]);
+			os_thread_destroy(&threads[i]);
+		}
+		assert(data.consumed == total, "Failed: consumed %llu items, expected %llu", data.consumed, total);
+		assert(data.semaphore.count == 0, "Failed: semaphore count should be 0 after all items were consumed");
+	}
+}
+
+typedef struct Job_Test_Data {
+	u64 index;
+	u64 result;
+} Job_Test_Data;
+void job_test_square_proc(void *data) {
+	Job_Test_Data *d = (Job_Test_Data*)data;
+	d->result = d->index*d->index;
+}
+// Submits jobs from inside a job, so they go on the worker's own deque and get stolen
+void job_test_nested_proc(void *data) {
+	Job_Test_Data *d = (Job_Test_Data*)data;
+	Job_Test_Data children[16];
+	Job jobs[16];
+	for (u64 i = 0; i < 16; i++) {
+		children[i].index = d->index*16 + i;
+		children[i].result = 0;
+		jobs[i] = (Job){ job_test_square_proc, &children[i], 0 };
+	}
+	Job_Counter counter = {0};
+	job_submit(jobs, 16, &counter);
+	job_wait(&counter);
+	u64 sum = 0;
+	for (u64 i = 0; i < 16; i++) sum += children[i].result;
+	d->result = sum;
+}
+void job_test_mark_range_proc(u64 first, u64 end, void *data) {
+	u8 *marks = (u8*)data;
+	for (u64 i = first; i < end; i++) marks[i] += 1;
+}
+void test_job_system() {
+	Allocator heap = get_heap_allocator();
+
+	job_system_init(0);
+	assert(job_worker_count >= 1, "Failed: job system has no workers");
+
+	// More jobs than fit in a queue, the rest run on the submitting thread
+	const u64 job_count = JOB_DEQUE_CAPACITY*3 + 17;
+	Job_Test_Data *data = alloc(heap, sizeof(Job_Test_Data)*job_count);
+	Job *jobs = alloc(heap, sizeof(Job)*job_count);
+	for (u64 i = 0; i < job_count; i++) {
+		data[i].index = i;
+		data[i].result = 0;
+		jobs[i] = (Job){ job_test_square_proc, &data[i], 0 };
+	}
+	Job_Counter counter = {0};
+	job_submit(jobs, job_count, &counter);
+	job_wait(&counter);
+	assert(job_counter_is_done(&counter), "Failed: job counter not done after job_wait");
+	for (u64 i = 0; i < job_count; i++) {
+		assert(data[i].result == i*i, "Failed: job %llu was not run", i);
+	}
+
+	// Nested submits & waits
+	for (u64 i = 0; i < 256; i++) {
+		data[i].index = i;
+		data[i].result = 0;
+		jobs[i] = (Job){ job_test_nested_proc, &data[i], 0 };
+	}
+	job_submit(jobs, 256, &counter);
+	job_wait(&counter);
+	for (u64 i = 0; i < 256; i++) {
+		u64 expected = 0;
+		for (u64 j = i*16; j < i*16+16; j++) expected += j*j;
+		assert(data[i].result == expected, "Failed: nested job %llu got %llu, expected %llu", i, data[i].result, expected);
+	}
+
+	dealloc(heap, data);
+	dealloc(heap, jobs);
+
+	// parallel_for must hit every index exactly once
+	const u64 index_count = 1000003;
+	u8 *marks = alloc(heap, index_count);
+	u64 grain_sizes[] = { 0, 1, 7, 1024, index_count, index_count*2 };
+	for (u64 g = 0; g < sizeof(grain_sizes)/sizeof(u64); g++) {
+		u64 count = grain_sizes[g] == 1 ? 10007 : index_count;
+		memset(marks, 0, index_count);
+		parallel_for(count, grain_sizes[g], job_test_mark_range_proc, marks);
+		for (u64 i = 0; i < index_count; i++) {
+			assert(marks[i] == (i < count ? 1 : 0), "Failed: parallel_for grain %llu index %llu was visited %d times", grain_sizes[g], i, (int)marks[i]);
+		}
+	}
+	parallel_for(0, 0, job_test_mark_range_proc, marks);
+	dealloc(heap, marks);
+
+	job_system_deinit();
+	assert(!job_system_running, "Failed: job system still running after job_system_deinit");
+}
+
+typedef enum Queue_Test_Kind {
+	QUEUE_TEST_SPSC,
+	QUEUE_TEST_MPMC,
+} Queue_Test_Kind;
+#define QUEUE_TEST_MAX_PRODUCERS 16
+typedef struct Queue_Test_Item {
+	u64 value;
+	u32 producer;
+	u32 check;
+} Queue_Test_Item;
+typedef struct Queue_Test_Data {
+	Queue_Test_Kind kind;
+	Spsc_Queue spsc;
+	Mpmc_Queue mpmc;
+	u64 items_per_producer;
+	u64 producer_count;
+	u64 consumer_count;
+	u64 batch_size;
+	volatile u64 next_producer;
+	volatile u64 consumed;
+	volatile u64 sum;
+} Queue_Test_Data;
+u32 queue_test_check(u64 value, u32 producer) {
+	return (u32)(value*2654435761ULL) ^ (producer*0x9E3779B9);
+}
+u64 queue_test_push(Queue_Test_Data *data, Queue_Test_Item *items, u64 count) {
+	switch (data->kind) {
+		case QUEUE_TEST_SPSC: return spsc_queue_push_many(&data->spsc, items, count);
+		case QUEUE_TEST_MPMC: {
+			u64 pushed = 0;
+			while (pushed < count && mpmc_queue_push(&data->mpmc, &items[pushed])) pushed += 1;
+			return pushed;
+		}
+	}
+	return 0;
+}
+u64 queue_test_pop(Queue_Test_Data *data, Queue_Test_Item *items, u64 max_count) {
+	switch (data->kind) {
+		case QUEUE_TEST_SPSC: return spsc_queue_pop_many(&data->spsc, items, max_count);
+		case QUEUE_TEST_MPMC: {
+			u64 popped = 0;
+			while (popped < max_count && mpmc_queue_pop(&data->mpmc, &items[popped])) popped += 1;
+			return popped;
+		}
+	}
+	return 0;
+}
+void queue_test_producer_proc(Thread *t) {
+	Queue_Test_Data *data = (Queue_Test_Data*)t->data;
+	u32 producer = (u32)atomic64_fetch_add(&data->next_producer, 1, MEMORY_ORDER_RELAXED);
+	Queue_Test_Item items[64];
+	u64 value = 0;
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (value < data->items_per_producer) {
+		u64 count = min(data->batch_size, data->items_per_producer-value);
+		for (u64 i = 0; i < count; i++) {
+			items[i] = (Queue_Test_Item){ value+i, producer, queue_test_check(value+i, producer) };
+		}
+		u64 pushed = 0;
+		while (pushed < count) {
+			u64 n = queue_test_push(data, items+pushed, count-pushed);
+			if (n == 0) {
+				spin_wait_backoff(&backoff, &spins);
+			} else {
+				backoff = 1;
+				pushed += n;
+			}
+		}
+		value += count;
+	}
+}
+void queue_test_consumer_proc(Thread *t) {
+	Queue_Test_Data *data = (Queue_Test_Data*)t->data;
+	const u64 total = data->items_per_producer*data->producer_count;
+	
+	// Whatever order producers interleave in, each producer's items must come out in the
+	// order it pushed them.
+	u64 next_expected[QUEUE_TEST_MAX_PRODUCERS] = {0};
+	Queue_Test_Item items[64];
+	u64 sum = 0;
+	u32 backoff = 1;
+	u32 spins = 0;
+	while (data->consumed < total) {
+		u64 count = queue_test_pop(data, items, data->batch_size);
+		if (count == 0) {
+			spin_wait_backoff(&backoff, &spins);
+			continue;
+		}
+		backoff = 1;
+		for (u64 i = 0; i < count; i++) {
+			Queue_Test_Item item = items[i];
+			assert(item.producer < data->producer_count, "Failed: queue item has bad producer %u", item.producer);
+			assert(item.check == queue_test_check(item.value, item.producer), "Failed: queue item %llu from producer %u is corrupted", item.value, item.producer);
+			assert(item.value >= next_expected[item.producer], "Failed: queue item %llu from producer %u came out of order", item.value, item.producer);
+			if (data->consumer_count == 1) {
+				assert(item.value == next_expected[item.producer], "Failed: queue expected item %llu, got %llu", next_expected[item.producer], item.value);
+			}
+			next_expected[item.producer] = item.value+1;
+			sum += item.value;
+		}
+		atomic64_fetch_add(&data->consumed, count, MEMORY_ORDER_RELAXED);
+	}
+	atomic64_fetch_add(&data->sum, sum, MEMORY_ORDER_RELAXED);
+}
+void run_queue_test(Queue_Test_Kind kind, u64 producer_count, u64 consumer_count, u64 items_per_producer, u64 batch_size, u64 capacity) {
+	assert(producer_count <= QUEUE_TEST_MAX_PRODUCERS, "Too many producers for queue test");
+	assert(batch_size <= 64, "Batch too big for queue test");
+	Allocator heap = get_heap_allocator();
+	
+	Queue_Test_Data *data = alloc_aligned(heap, sizeof(Queue_Test_Data), CACHE_LINE_SIZE);
+	memset(data, 0, sizeof(*data));
+	data->kind = kind;
+	data->items_per_producer = items_per_producer;
+	data->producer_count = producer_count;
+	data->consumer_count = consumer_count;
+	data->batch_size = batch_size;
+	if (kind == QUEUE_TEST_MPMC) mpmc_queue_init(&data->mpmc, sizeof(Queue_Test_Item), capacity, heap);
+	else                         spsc_queue_init(&data->spsc, sizeof(Queue_Test_Item), capacity, heap);
+	
+	u64 thread_count = producer_count+consumer_count;
+	Thread *threads = alloc(heap, sizeof(Thread)*thread_count);
+	for (u64 i = 0; i < thread_count; i++) {
+		os_thread_init(&threads[i], i < producer_count ? queue_test_producer_proc : queue_test_consumer_proc);
+		threads[i].data = data;
+		os_thread_start(&threads[i]);
+	}
+	for (u64 i = 0; i < thread_count; i++) {
+		os_thread_join(&threads[i]);
+		os_thread_destroy(&threads[i]);
+	}
+	
+	u64 total = items_per_producer*producer_count;
+	u64 expected_sum = producer_count*(items_per_producer*(items_per_producer-1)/2);
+	assert(data->consumed == total, "Failed: queue consumed %llu items, expected %llu", data->consumed, total);
+	assert(data->sum == expected_sum, "Failed: queue item sum is %llu, expected %llu", data->sum, expected_sum);
+	
+	if (kind == QUEUE_TEST_MPMC) {
+		Queue_Test_Item item;
+		assert(!mpmc_queue_pop(&data->mpmc, &item), "Failed: Mpmc_Queue should be empty");
+		mpmc_queue_deinit(&data->mpmc);
+	} else {
+		assert(spsc_queue_get_count(&data->spsc) == 0, "Failed: Spsc_Queue should be empty");
+		spsc_queue_deinit(&data->spsc);
+	}
+	dealloc(heap, threads);
+	dealloc(heap, data);
+}
+void test_lock_free_queues() {
+	Allocator heap = get_heap_allocator();
+	
+	// Odd element size, to see it doesn't assume anything about alignment
+	typedef struct { u8 x, y, z; } Three_Bytes;
+	Three_Bytes in[20];
+	Three_Bytes out[20];
+	for (u8 i = 0; i < 20; i++) in[i] = (Three_Bytes){ i, (u8)(i*2), (u8)(i*3) };
+	
+	Spsc_Queue spsc;
+	spsc_queue_init(&spsc, sizeof(Three_Bytes), 5, heap);
+	assert(spsc.capacity == 8, "Failed: Spsc_Queue capacity should round up to 8, is %llu", spsc.capacity);
+	assert(!spsc_queue_pop(&spsc, &out[0]), "Failed: pop from empty Spsc_Queue");
+	for (u64 i = 0; i < 8; i++) assert(spsc_queue_push(&spsc, &in[i]), "Failed: Spsc_Queue push %llu", i);
+	assert(!spsc_queue_push(&spsc, &in[8]), "Failed: push to full Spsc_Queue");
+	assert(spsc_queue_get_count(&spsc) == 8, "Failed: Spsc_Queue count");
+	for (u64 i = 0; i < 5; i++) {
+		assert(spsc_queue_pop(&spsc, &out[i]) && memcmp(&out[i], &in[i], sizeof(Three_Bytes)) == 0, "Failed: Spsc_Queue pop %llu", i);
+	}
+	// Batches which wrap around the end of the buffer
+	assert(spsc_queue_push_many(&spsc, &in[8], 12) == 5, "Failed: Spsc_Queue push_many should only push what fits");
+	assert(spsc_queue_pop_many(&spsc, out, 20) == 8, "Failed: Spsc_Queue pop_many should pop everything");
+	for (u64 i = 0; i < 8; i++) {
+		assert(memcmp(&out[i], &in[i+5], sizeof(Three_Bytes)) == 0, "Failed: Spsc_Queue batch item %llu", i);
+	}
+	assert(spsc_queue_pop_many(&spsc, out, 20) == 0, "Failed: Spsc_Queue should be empty");
+	spsc_queue_deinit(&spsc);
+	
+	Mpmc_Queue mpmc;
+	mpmc_queue_init(&mpmc, sizeof(Three_Bytes), 5, heap);
+	assert(mpmc.capacity == 8, "Failed: Mpmc_Queue capacity should round up to 8, is %llu", mpmc.capacity);
+	assert(!mpmc_queue_pop(&mpmc, &out[0]), "Failed: pop from empty Mpmc_Queue");
+	for (u64 lap = 0; lap < 3; lap++) {
+		for (u64 i = 0; i < 8; i++) assert(mpmc_queue_push(&mpmc, &in[i+lap]), "Failed: Mpmc_Queue push %llu", i);
+		assert(!mpmc_queue_push(&mpmc, &in[0]), "Failed: push to full Mpmc_Queue");
+		for (u64 i = 0; i < 8; i++) {
+			assert(mpmc_queue_pop(&mpmc, &out[i]) && memcmp(&out[i], &in[i+lap], sizeof(Three_Bytes)) == 0, "Failed: Mpmc_Queue pop %llu", i);
+		}
+		assert(!mpmc_queue_pop(&mpmc, &out[0]), "Failed: Mpmc_Queue should be empty");
+	}
+	mpmc_queue_deinit(&mpmc);
+	
+	// Stress with small queues so they are full or empty a lot
+	run_queue_test(QUEUE_TEST_SPSC, 1, 1, 200000, 1,  4);
+	run_queue_test(QUEUE_TEST_SPSC, 1, 1, 200000, 13, 16);
+	run_queue_test(QUEUE_TEST_SPSC, 1, 1, 200000, 64, 1024);
+	run_queue_test(QUEUE_TEST_MPMC, 1, 1, 200000, 1,  4);
+	run_queue_test(QUEUE_TEST_MPMC, 4, 4, 100000, 1,  8);
+	run_queue_test(QUEUE_TEST_MPMC, 8, 2, 50000,  4,  64);
+	run_queue_test(QUEUE_TEST_MPMC, 2, 8, 200000, 16, 1024);
+	run_queue_test(QUEUE_TEST_MPMC, 8, 8, 50000,  1,  1024);
+}
+
+typedef struct Fiber_Test_Data {
+	u64 order[64]; // Which fiber ran, in order
+	u64 order_count;
+	u64 steps[8];
+	Job_Counter jobs_done;
+	u64 job_results[16];
+	u64 deep_sum;
+	float64 float_check;
+	u64 yield_count;
+	float64 busy_budget;
+	float64 busy_first_resume_time;
+	u64 busy_yields_past_budget;
+} Fiber_Test_Data;
+typedef struct Fiber_Test_Arg {
+	Fiber_Test_Data *data;
+	u64 index;
+} Fiber_Test_Arg;
+void fiber_test_stepping_proc(void *p) {
+	Fiber_Test_Arg *arg = (Fiber_Test_Arg*)p;
+	assert(fiber_get_current() != 0, "Failed: fiber_get_current() in a fiber");
+	for (u64 i = 0; i < 4; i++) {
+		arg->data->order[arg->data->order_count++] = arg->index;
+		arg->data->steps[arg->index] += 1;
+		fiber_yield();
+	}
+}
+void fiber_test_job_proc(void *p) {
+	u64 *result = (u64*)p;
+	*result = (u64)(result) & 0xFFFF;
+}
+void fiber_test_await_proc(void *p) {
+	Fiber_Test_Data *data = (Fiber_Test_Data*)p;
+	Job jobs[16];
+	for (u64 i = 0; i < 16; i++) jobs[i] = (Job){ fiber_test_job_proc, &data->job_results[i] };
+	job_submit(jobs, 16, &data->jobs_done);
+	fiber_await(&data->jobs_done);
+	for (u64 i = 0; i < 16; i++) {
+		assert(data->job_results[i] == ((u64)&data->job_results[i] & 0xFFFF), "Failed: fiber_await returned before job %llu was done", i);
+	}
+}
+u64 fiber_test_recurse(u64 depth) {
+	volatile u8 buffer[256];
+	buffer[0] = (u8)depth;
+	if (depth == 0) return buffer[0];
+	if (depth % 16 == 0) fiber_yield();
+	return buffer[0] + fiber_test_recurse(depth-1);
+}
+void fiber_test_deep_proc(void *p) {
+	Fiber_Test_Data *data = (Fiber_Test_Data*)p;
+	// ~40KB of stack, yielding along the way
+	data->deep_sum = fiber_test_recurse(128);
+}
+void fiber_test_float_proc(void *p) {
+	Fiber_Test_Data *data = (Fiber_Test_Data*)p;
+	float64 x = 1.0;
+	for (u64 i = 0; i < 100; i++) {
+		x = x*1.5 + 0.25;
+		fiber_yield();
+		x = x/1.5;
+	}
+	data->float_check = x;
+}
+void fiber_test_spawner_proc(void *p) {
+	Fiber_Test_Arg *args = (Fiber_Test_Arg*)p;
+	fiber_start(fiber_test_stepping_proc, &args[0], 0);
+	fiber_yield();
+	fiber_start(fiber_test_stepping_proc, &args[1], 0);
+}
+void fiber_test_busy_proc(void *p) {
+	Fiber_Test_Data *data = (Fiber_Test_Data*)p;
+	// fibers_run() started its clock before this, so measuring from here never overshoots it
+	data->busy_first_resume_time = os_get_current_time_in_seconds();
+	while (data->yield_count < 1000000000ULL) {
+		data->yield_count += 1;
+		f64 now = os_get_current_time_in_seconds();
+		if (now-data->busy_first_resume_time >= data->busy_budget) data->busy_yields_past_budget += 1;
+		fiber_yield();
+	}
+}
+void test_fibers() {
+	Fiber_Test_Data data = {0};
+	Fiber_Test_Arg args[8];
+	for (u64 i = 0; i < 8; i++) args[i] = (Fiber_Test_Arg){ &data, i };
+	
+	assert(fiber_get_current() == 0, "Failed: fiber_get_current() outside of fibers");
+	assert(fibers_run(1.0) == 0, "Failed: fibers_run() with nothing to run");
+	
+	// Round robin
+	Job_Counter counter = {0};
+	for (u64 i = 0; i < 3; i++) fiber_start(fiber_test_stepping_proc, &args[i], &counter);
+	assert(counter.pending == 3, "Failed: fiber_start() should count on the counter");
+	u64 left = fibers_run(1000.0);
+	assert(left == 0, "Failed: %llu fibers left after a big budget", left);
+	assert(job_counter_is_done(&counter), "Failed: counter not done after all fibers finished");
+	assert(data.order_count == 12, "Failed: fibers ran %llu steps, expected 12", data.order_count);
+	for (u64 i = 0; i < 12; i++) {
+		assert(data.order[i] == i%3, "Failed: fibers didn't run round robin, step %llu was fiber %llu", i, data.order[i]);
+	}
+	
+	// Fibers starting fibers, freed stacks are reused
+	memset(&data, 0, sizeof(data));
+	fiber_start(fiber_test_spawner_proc, args, &counter);
+	while (fibers_run(0.0)) {}
+	assert(data.steps[0] == 4 && data.steps[1] == 4, "Failed: fibers started from a fiber didn't run");
+	
+	// Await a job counter
+	fiber_start(fiber_test_await_proc, &data, &counter);
+	while (fibers_run(0.001)) {}
+	assert(job_counter_is_done(&data.jobs_done), "Failed: jobs not done after awaiting fiber finished");
+	
+	// Deep stack & float state across yields
+	fiber_start(fiber_test_deep_proc, &data, &counter);
+	fiber_start(fiber_test_float_proc, &data, &counter);
+	float64 x = 3.0;
+	while (fibers_run(0.0)) x += 1.0;
+	u64 expected_sum = 0;
+	for (u64 i = 0; i <= 128; i++) expected_sum += (u8)i;
+	assert(data.deep_sum == expected_sum, "Failed: deep recursion in a fiber got %llu, expected %llu", data.deep_sum, expected_sum);
+	float64 expected = 1.0;
+	for (u64 i = 0; i < 100; i++) expected = (expected*1.5 + 0.25)/1.5;
+	assert(data.float_check == expected, "Failed: floats in a fiber were clobbered by yields");
+	assert(x > 3.0, "Failed: floats on the scheduler side");
+	
+	// The budget is respected, give or take one resume. The upper bound is checked by counting
+	// resumes rather than with a time window, since this thread can be preempted at any point.
+	const f64 budget = 0.005;
+	data.busy_budget = budget;
+	fiber_start(fiber_test_busy_proc, &data, &counter);
+	f64 start = os_get_current_time_in_seconds();
+	fibers_run(budget);
+	f64 elapsed = os_get_current_time_in_seconds()-start;
+	assert(elapsed >= budget, "Failed: fibers_run(%.3f) returned after %.4f seconds", budget, elapsed);
+	assert(data.busy_yields_past_budget <= 1, "Failed: fibers_run(%.3f) kept resuming %llu times after the budget was used up", budget, data.busy_yields_past_budget);
+	data.yield_count = 1000000000ULL;
+	fibers_run(1.0);
+	assert(job_counter_is_done(&counter), "Failed: all test fibers should be done");
+}
+
+void test_frame_stats() {
+	frame_stats_reset();
+	
+	Frame_Stats_Summary empty = frame_stats_get_summary(FRAME_STATS_FRAME_TIME);
+	assert(empty.sample_count == 0 && empty.max == 0, "Failed: summary of no samples");
+	
+	// 1ms..256ms in shuffled order
+	for (u64 i = 0; i < FRAME_STATS_HISTORY_COUNT; i++) {
+		u64 ms = (i*97) % FRAME_STATS_HISTORY_COUNT + 1;
+		frame_stats_record(FRAME_STATS_FRAME_TIME, (f64)ms/1000.0);
+	}
+	Frame_Stats_Summary s = frame_stats_get_summary(FRAME_STATS_FRAME_TIME);
+	assert(s.sample_count == FRAME_STATS_HISTORY_COUNT, "Failed: expected %d samples, got %llu", FRAME_STATS_HISTORY_COUNT, s.sample_count);
+	assert(fabs(s.max-0.256) < 0.000001, "Failed: max is %f, expected 0.256", s.max);
+	assert(fabs(s.average-0.1285) < 0.000001, "Failed: average is %f, expected 0.1285", s.average);
+	assert(fabs(s.p50-0.128)/0.128 < 0.04, "Failed: p50 is %f, expected ~0.128", s.p50);
+	assert(fabs(s.p95-0.244)/0.244 < 0.04, "Failed: p95 is %f, expected ~0.244", s.p95);
+	assert(fabs(s.p99-0.254)/0.254 < 0.04, "Failed: p99 is %f, expected ~0.254", s.p99);
+	assert(s.p50 <= s.p95 && s.p95 <= s.p99 && s.p99 <= s.max, "Failed: percentiles out of order");
+	
+	// Old samples fall out of the window, histogram included
+	for (u64 i = 0; i < FRAME_STATS_HISTORY_COUNT; i++) {
+		frame_stats_record(FRAME_STATS_FRAME_TIME, 0.002);
+	}
+	s = frame_stats_get_summary(FRAME_STATS_FRAME_TIME);
+	assert(fabs(s.max-0.002) < 0.000001 && fabs(s.p99-0.002)/0.002 < 0.04, "Failed: old samples still counted, max %f p99 %f", s.max, s.p99);
+	
+	frame_stats_record(FRAME_STATS_FRAME_TIME, 0.005);
+	f32 history[4];
+	u64 count = frame_stats_get_history(FRAME_STATS_FRAME_TIME, history, 4);
+	assert(count == 4 && history[3] == 0.005f && history[2] == 0.002f, "Failed: history should end with the latest sample");
+	assert(frame_stats_get_summary(FRAME_STATS_FRAME_TIME).last == (f64)0.005f, "Failed: last sample");
+	
+	frame_stats_reset();
+}
+
+#if ENABLE_PROFILING
+#define PROFILER_TEST_SCOPE_COUNT 10000
+void profiler_test_thread_proc(Thread *t) {
+	for (u64 i = 0; i < PROFILER_TEST_SCOPE_COUNT; i++) {
+		tm_scope("Profiler test scope") {
+			volatile u64 x = i;
+			(void)x;
+		}
+	}
+}
+// Collects everything that's buffered and counts the test records, collected and dropped
+u64 profiler_test_count_records() {
+	spinlock_acquire_or_wait(&_profiler_lock);
+	_profiler_collect_records();
+	u64 count = 0;
+	for (Profile_Thread_Buffer *buffer = profile_thread_buffers; buffer; buffer = buffer->next) {
+		assert(spsc_queue_get_count(&buffer->records) == 0, "Failed: records left in a thread buffer after collecting");
+		count += buffer->dropped_count;
+	}
+	string name = STR("Profiler test scope");
+	u64 record_count = growing_array_get_valid_count(profile_records);
+	for (u64 i = 0; i < record_count; i++) {
+		Profile_Record *r = &profile_records[i];
+		if (strings_match((string){ r->name_count, r->name_data }, name)) count += 1;
+	}
+	spinlock_release(&_profiler_lock);
+	return count;
+}
+void test_profiler() {
+	tm_scope("Profiler test setup") {}
+	u64 count_before = profiler_test_count_records();
+	
+	Thread threads[3];
+	for (u64 i = 0; i < 3; i++) {
+		os_thread_init(&threads[i], profiler_test_thread_proc);
+		os_thread_start(&threads[i]);
+	}
+	
+	profiler_test_thread_proc(0);
+	for (u64 i = 0; i < 3; i++) {
+		os_thread_join(&threads[i]);
+		os_thread_destroy(&threads[i]);
+	}
+	
+	// Again on a thread that already has its buffer
+	profiler_test_thread_proc(0);
+	
+	// Nothing may be lost on the way from the thread buffers to the collected records
+	u64 count = profiler_test_count_records()-count_before;
+	u64 expected = PROFILER_TEST_SCOPE_COUNT*5;
+	assert(count == expected, "Failed: expected %llu profile records, got %llu", expected, count);
+	
+	// Threads started after others exited take over their buffers
+	u64 buffer_count = 0;
+	for (Profile_Thread_Buffer *buffer = profile_thread_buffers; buffer; buffer = buffer->next) buffer_count += 1;
+	for (u64 i = 0; i < 3; i++) {
+		os_thread_init(&threads[i], profiler_test_thread_proc);
+		os_thread_start(&threads[i]);
+		os_thread_join(&threads[i]);
+		os_thread_destroy(&threads[i]);
+	}
+	u64 buffer_count_after = 0;
+	for (Profile_Thread_Buffer *buffer = profile_thread_buffers; buffer; buffer = buffer->next) buffer_count_after += 1;
+	assert(buffer_count_after == buffer_count, "Failed: exited threads' profiler buffers were not reused (%llu buffers, was %llu)", buffer_count_after, buffer_count);
+	count = profiler_test_count_records()-count_before;
+	expected += PROFILER_TEST_SCOPE_COUNT*3;
+	assert(count == expected, "Failed: expected %llu profile records after reusing buffers, got %llu", expected, count);
+	
+	// Counters & frame marks
+	profile_last_frame_mark = 0; // So only the second mark has a frame time
+	tm_counter("Profiler test counter", 1234.5);
+	tm_frame_mark();
+	tm_frame_mark();
+	spinlock_acquire_or_wait(&_profiler_lock);
+	_profiler_collect_records();
+	Profile_Record last[4];
+	u64 found = 0;
+	for (s64 i = (s64)growing_array_get_valid_count(profile_records)-1; i >= 0 && found < 4; i--) {
+		if (profile_records[i].thread_index == profile_thread_buffer->thread_index) {
+			last[3-found] = profile_records[i];
+			found += 1;
+		}
+	}
+	assert(found == 4, "Failed: counter & frame mark records missing");
+	assert(last[0].kind == PROFILE_RECORD_COUNTER && last[0].value == 1234.5, "Failed: tm_counter record");
+	assert(last[1].kind == PROFILE_RECORD_FRAME_MARK, "Failed: tm_frame_mark record");
+	assert(last[2].kind == PROFILE_RECORD_FRAME_MARK, "Failed: tm_frame_mark record");
+	assert(last[3].kind == PROFILE_RECORD_COUNTER && last[3].value >= 0.0, "Failed: frame time counter");
+	spinlock_release(&_profiler_lock);
+	
+	// Calibrated conversion agrees with the os clock. Only with an invariant TSC, otherwise the
+	// rate changes with the clock speed (and VMs often don't report one).
+	calibrate_rdtsc_frequency();
+	u64 start = rdtsc();
+	f64 start_time = os_get_current_time_in_seconds();
+	os_sleep(20);
+	f64 elapsed = os_get_current_time_in_seconds()-start_time;
+	f64 converted = rdtsc_to_seconds(rdtsc()-start);
+	if (rdtsc_is_invariant) {
+		assert(converted > elapsed*0.95 && converted < elapsed*1.05, "Failed: %.4f seconds measured with rdtsc, %.4f by the os", converted, elapsed);
+	} else {
+		assert(converted > 0, "Failed: rdtsc_to_seconds() of a 20ms sleep gave %.4f seconds", converted);
+		log_warning("CPU doesn't report an invariant TSC, skipping the rdtsc vs os clock check (%.4f vs %.4f seconds)", converted, elapsed);
+	}
+}
+#endif // ENABLE_PROFILING
+
+void test_sampling_profiler() {
+	// Fake stack, growing down from the end: 3 frames, each [caller frame, return address]
+	u64 stack[16] = {0};
+	u64 low = (u64)stack;
+	u64 high = (u64)(stack+16);
+	stack[4]  = (u64)&stack[8];  stack[5]  = 0x1000;
+	stack[8]  = (u64)&stack[12]; stack[9]  = 0x2000;
+	stack[12] = 0;               stack[13] = 0x3000; // Outermost, no caller
+
+	u64 frames[8];
+	u64 count = walk_frame_pointers(0x500, (u64)&stack[4], low, high, frames, 8);
+	assert(count == 4, "Failed: walked %llu frames, expected 4", count);
+	assert(frames[0] == 0x500 && frames[1] == 0x1000 && frames[2] == 0x2000 && frames[3] == 0x3000, "Failed: wrong frames");
+
+	count = walk_frame_pointers(0x500, (u64)&stack[4], low, high, frames, 2);
+	assert(count == 2, "Failed: max_frames not respected");
+
+	// Garbage frame pointers stop the walk instead of being followed
+	count = walk_frame_pointers(0x500, high+64, low, high, frames, 8);
+	assert(count == 1, "Failed: followed a frame pointer outside the stack");
+	count = walk_frame_pointers(0x500, (u64)&stack[4]+3, low, high, frames, 8);
+	assert(count == 1, "Failed: followed an unaligned frame pointer");
+	stack[8] = (u64)&stack[4];
+	count = walk_frame_pointers(0x500, (u64)&stack[4], low, high, frames, 8);
+	assert(count == 3, "Failed: followed a frame pointer down the stack, got %llu frames", count);
+
+#if ENABLE_SAMPLING_PROFILER
+	// This thread was registered in oogabooga_init, so spinning should get it sampled
+	u64 samples_before = sampling_profiler_sample_count;
+	f64 start = os_get_current_time_in_seconds();
+	while (os_get_current_time_in_seconds()-start < 0.1 && sampling_profiler_sample_count == samples_before) {}
+	assert(sampling_profiler_sample_count > samples_before, "Failed: no samples of a busy thread in 100ms");
+#endif
+}
+
 #ifndef OOGABOOGA_HEADLESS
 int compare_draw_quads(const void *a, const void *b) {
     return ((Draw_Quad*)a)->z-((Draw_Quad*)b)->z;
@@ -1296,6 +2676,36 @@ void test_sort() {
     }
     
     print("Merge sort took on average %llu cycles and %.2f ms\n", cycles / num_samples, (seconds * 1000.0) / (float64)num_samples);
+    
+    dealloc(get_heap_allocator(), items);
+    
+    // Serial vs parallel on big frames. Both are stable, so they must give the exact same result.
+    u64 quad_counts[] = { 10000, 100000, 1000000 };
+    for (u64 c = 0; c < sizeof(quad_counts)/sizeof(u64); c++) {
+        item_count = quad_counts[c];
+        
+        Draw_Quad *serial = alloc(get_heap_allocator(), item_count * sizeof(Draw_Quad));
+        Draw_Quad *parallel = alloc(get_heap_allocator(), item_count * sizeof(Draw_Quad));
+        buffer = alloc(get_heap_allocator(), item_count * sizeof(Draw_Quad));
+        
+        for (u64 i = 0; i < item_count; i++) {
+            serial[i].z = get_random_int_in_range(-MAX_Z+1, MAX_Z);
+            serial[i].color.x = (float32)i; // To see that equal z keep their order
+        }
+        memcpy(parallel, serial, item_count * sizeof(Draw_Quad));
+        
+        radix_sort(serial, buffer, item_count, sizeof(Draw_Quad), offsetof(Draw_Quad, z), MAX_Z_BITS);
+        radix_sort_parallel(parallel, buffer, item_count, sizeof(Draw_Quad), offsetof(Draw_Quad, z), MAX_Z_BITS);
+        
+        for (u64 i = 1; i < item_count; i++) {
+            assert(serial[i].z > serial[i-1].z || (serial[i].z == serial[i-1].z && serial[i].color.x > serial[i-1].color.x), "Failed: radix sort is not sorted or not stable at %llu", i);
+        }
+        assert(memcmp(serial, parallel, item_count * sizeof(Draw_Quad)) == 0, "Failed: radix_sort_parallel gave a different result than radix_sort for %llu quads", item_count);
+        
+        dealloc(get_heap_allocator(), serial);
+        dealloc(get_heap_allocator(), parallel);
+        dealloc(get_heap_allocator(), buffer);
+    }
 }
 #endif /* OOGABOOGA_HEADLESS */
 
@@ -1365,16 +2775,80 @@ void test_growing_array() {
     assert(growing_array_get_valid_count(things) == 99, "Failed: growing_array_get_valid_count");
 }
 
+// Same as the growing_array example, builds an array of 10000 circles one at a time while
+// something else keeps allocating in between.
+void test_growing_array_realloc() {
+	typedef struct Circle {
+		Vector2 pos;
+		float radius;
+	} Circle;
+	
+	Allocator heap = get_heap_allocator();
+	
+	const int num_circles = 10000;
+	
+	u64 in_place_before = heap_realloc_in_place_count;
+	u64 moved_before = heap_realloc_moved_count;
+	
+	Circle *circles;
+	growing_array_init((void**)&circles, sizeof(Circle), heap);
+	
+	void *others[64];
+	for (int i = 0; i < num_circles; i++) {
+		Circle c = {v2((f32)i, (f32)i), (f32)i};
+		growing_array_add((void**)&circles, &c);
+		if (i % 256 == 0) others[i/256 % 64] = alloc_uninitialized(heap, 200);
+	}
+	for (int i = 0; i < num_circles; i++) assert(circles[i].radius == (f32)i, "Failed: growing array is corrupt at %d", i);
+	for (int i = 0; i < num_circles; i += 256) dealloc(heap, others[i/256 % 64]);
+	
+	growing_array_deinit((void**)&circles);
+	
+	assert(heap_realloc_in_place_count+heap_realloc_moved_count > in_place_before+moved_before, "Failed: growing the array didn't realloc");
+}
+
 void oogabooga_run_tests() {
 	
 	print("Testing growing array... ");
 	test_growing_array();
 	print("OK!\n");
+	
+	print("Testing growing array realloc... ");
+	test_growing_array_realloc();
+	print("OK!\n");
     
 	print("Testing allocator... ");
 	test_allocator(true);
 	print("OK!\n");
 	
+	print("Testing heap stats... ");
+	test_heap_stats();
+	print("OK!\n");
+	
+	print("Testing heap trim... ");
+	test_heap_trim();
+	print("OK!\n");
+	
+	print("Testing zero initialization... ");
+	test_zero_initialization();
+	print("OK!\n");
+	
+	print("Testing aligned allocations... ");
+	test_alloc_aligned();
+	print("OK!\n");
+	
+	print("Testing arena... ");
+	test_arena();
+	print("OK!\n");
+	
+	print("Testing pool... ");
+	test_pool();
+	print("OK!\n");
+	
+	print("Testing allocator thread caches... ");
+	test_allocator_thread_caches();
+	print("OK!\n");
+	
 	print("Testing threads... ");
 	test_threads();
 	print("OK!\n");
@@ -1411,6 +2885,44 @@ void oogabooga_run_tests() {
 	test_mutex();
 	print("OK!\n");
 
+	print("Testing lock contention... ");
+	test_lock_contention();
+	print("OK!\n");
+
+	print("Testing atomics... ");
+	test_atomics();
+	print("OK!\n");
+
+	print("Testing sync primitives... ");
+	test_sync_primitives();
+	print("OK!\n");
+
+	print("Testing job system... ");
+	test_job_system();
+	print("OK!\n");
+
+	print("Testing lock-free queues... ");
+	test_lock_free_queues();
+	print("OK!\n");
+
+	print("Testing fibers... ");
+	test_fibers();
+	print("OK!\n");
+
+	print("Testing frame stats... ");
+	test_frame_stats();
+	print("OK!\n");
+
+#if ENABLE_PROFILING
+	print("Testing profiler... ");
+	test_profiler();
+	print("OK!\n");
+#endif
+
+	print("Testing sampling profiler... ");
+	test_sampling_profiler();
+	print("OK!\n");
+
 #ifndef OOGABOOGA_HEADLESS
 	print("Testing radix sort... ");
 	test_sort();
@@ -118,7 +118,8 @@ thread_local Allocator third_party_allocator = {0};
 void *third_party_malloc(size_t size) {
 	assert(third_party_allocator.proc, "No third party allocator was set, but it was used!");
 	if (!size) return 0;
-	return alloc(third_party_allocator, size);
+	// malloc doesn't zero, so don't pay for it
+	return alloc_uninitialized(third_party_allocator, size);
 }
 void *third_party_realloc(void *p, size_t size) {
 	assert(third_party_allocator.proc, "No third party allocator was set, but it was used!");